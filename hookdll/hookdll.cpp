@@ -22,6 +22,7 @@
 #include <string.h>
 #include <windows.h>
 
+#include "../src/Capture.hpp"
 #include "../src/DirectPlay8Address.hpp"
 #include "../src/DirectPlay8Peer.hpp"
 #include "../src/Factory.hpp"
@@ -75,6 +76,7 @@ extern "C" BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvRe
 			abort();
 		}
 		
+		capture_fini();
 		log_fini();
 	}
 	
@@ -0,0 +1,131 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <assert.h>
+#include <mutex>
+#include <stdlib.h>
+
+#include "BufferPool.hpp"
+
+const size_t BufferPool::MIN_SIZE;
+const size_t BufferPool::MAX_SIZE;
+
+static_assert((BufferPool::MIN_SIZE << 4) == BufferPool::MAX_SIZE, "BufferPool::NUM_CLASSES must cover MIN_SIZE to MAX_SIZE");
+
+BufferPool::BufferPool(size_t max_free):
+	max_free(max_free) {}
+
+BufferPool::~BufferPool()
+{
+	for(int i = 0; i < NUM_CLASSES; ++i)
+	{
+		for(auto b = free_bufs[i].begin(); b != free_bufs[i].end(); ++b)
+		{
+			delete *b;
+		}
+	}
+}
+
+int BufferPool::size_class(size_t size)
+{
+	if(size > MAX_SIZE)
+	{
+		return NUM_CLASSES;
+	}
+	
+	int c = 0;
+	for(size_t c_size = MIN_SIZE; c_size < size; c_size <<= 1)
+	{
+		++c;
+	}
+	
+	return c;
+}
+
+size_t BufferPool::buffer_size(size_t size)
+{
+	int c = size_class(size);
+	return (c < NUM_CLASSES ? (MIN_SIZE << c) : size);
+}
+
+BufferPool::Buffer *BufferPool::get(size_t size)
+{
+	int c = size_class(size);
+	
+	if(c < NUM_CLASSES)
+	{
+		std::unique_lock<std::mutex> l(lock);
+		
+		if(!free_bufs[c].empty())
+		{
+			Buffer *buf = free_bufs[c].back();
+			free_bufs[c].pop_back();
+			
+			buf->refcount = 1;
+			return buf;
+		}
+	}
+	
+	return new Buffer(this, buffer_size(size));
+}
+
+void BufferPool::put(Buffer *buf)
+{
+	int c = size_class(buf->buf_size);
+	
+	if(c < NUM_CLASSES)
+	{
+		assert((MIN_SIZE << c) == buf->buf_size);
+		
+		std::unique_lock<std::mutex> l(lock);
+		
+		if(free_bufs[c].size() < max_free)
+		{
+			free_bufs[c].push_back(buf);
+			return;
+		}
+	}
+	
+	delete buf;
+}
+
+BufferPool::Buffer::Buffer(BufferPool *pool, size_t size):
+	pool(pool), buf(new unsigned char[size]), buf_size(size), refcount(1) {}
+
+BufferPool::Buffer::~Buffer()
+{
+	delete[] buf;
+}
+
+void BufferPool::Buffer::ref()
+{
+	++refcount;
+}
+
+void BufferPool::Buffer::unref()
+{
+	if(--refcount == 0)
+	{
+		pool->put(this);
+	}
+}
+
+bool BufferPool::Buffer::shared() const
+{
+	return refcount > 1;
+}
@@ -0,0 +1,107 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_BUFFERPOOL_HPP
+#define DPLITE_BUFFERPOOL_HPP
+
+#include <atomic>
+#include <mutex>
+#include <stdlib.h>
+#include <vector>
+
+#include "network.hpp"
+
+/* Pool of buffers for holding data read from the network.
+ *
+ * Buffers are allocated in power-of-two size classes from MIN_SIZE up to MAX_SIZE (which is
+ * large enough to hold any packet). Buffers given back to the pool are kept for reuse, up to
+ * max_free of each size class, so that peers only hold onto receive buffers while they are
+ * actually in use. Larger buffers can be allocated, but aren't pooled.
+ *
+ * Buffers are reference counted so that received messages can be handed to the application
+ * without copying them out of the receive buffer - each DPNMSG_RECEIVE holds a reference to
+ * the buffer its data is in until it is returned. The pool must outlive all its buffers.
+ *
+ * All methods are thread-safe.
+*/
+
+class BufferPool
+{
+	public:
+		static const size_t MIN_SIZE = 16 * 1024;
+		static const size_t MAX_SIZE = MAX_PACKET_SIZE;
+		
+		class Buffer
+		{
+			friend class BufferPool;
+			
+			private:
+				BufferPool *const pool;
+				
+				unsigned char *const buf;
+				const size_t buf_size;
+				
+				std::atomic<unsigned int> refcount;
+				
+				Buffer(BufferPool *pool, size_t size);
+				~Buffer();
+				
+			public:
+				/* No copy c'tor. */
+				Buffer(const Buffer &src) = delete;
+				
+				unsigned char *data() const { return buf; }
+				size_t size() const { return buf_size; }
+				
+				void ref();
+				void unref();
+				
+				/* Returns true if anything other than the caller holds a reference. */
+				bool shared() const;
+		};
+		
+	private:
+		static const int NUM_CLASSES = 5;
+		
+		std::mutex lock;
+		
+		std::vector<Buffer*> free_bufs[NUM_CLASSES];
+		const size_t max_free;
+		
+		static int size_class(size_t size);
+		
+		void put(Buffer *buf);
+		
+	public:
+		BufferPool(size_t max_free = 16);
+		~BufferPool();
+		
+		/* No copy c'tor. */
+		BufferPool(const BufferPool &src) = delete;
+		
+		/* Returns the capacity of the buffer which would be allocated for size bytes. */
+		static size_t buffer_size(size_t size);
+		
+		/* Takes a buffer of at least size bytes from the pool, allocating a new one if
+		 * there aren't any free ones of the right size class. The returned buffer has a
+		 * reference count of one and is returned to the pool when it reaches zero.
+		*/
+		Buffer *get(size_t size);
+};
+
+#endif /* !DPLITE_BUFFERPOOL_HPP */
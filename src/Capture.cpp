@@ -0,0 +1,297 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <winsock2.h>
+#include <algorithm>
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "Capture.hpp"
+#include "Log.hpp"
+
+std::atomic<int> capture_state(0);
+
+static std::atomic<uint32_t> next_instance(1);
+
+/* Everything below is protected by lock. */
+static std::mutex lock;
+
+static HANDLE file = INVALID_HANDLE_VALUE;
+static HANDLE mapping = NULL;
+static unsigned char *view = NULL;
+static uint64_t view_size = 0;  /* Size of the file and the mapping of it. */
+static uint64_t used = 0;       /* Bytes written to the mapping so far. */
+
+static LARGE_INTEGER qpc_start;
+static LARGE_INTEGER qpc_freq;
+
+/* Size of the capture closed by capture_fini(), so a capture started again by the same
+ * process (e.g. after DllCanUnloadNow() when COM didn't unload us) carries on from the end
+ * of it rather than overwriting it.
+*/
+static uint64_t resume_at = 0;
+
+static bool map_file(uint64_t size)
+{
+	HANDLE m = CreateFileMapping(file, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)(size), NULL);
+	if(m == NULL)
+	{
+		DWORD err = GetLastError();
+		LOG_ERROR(LOG_CAT_GENERAL, "Unable to map capture file: %s", win_strerror(err).c_str());
+		
+		return false;
+	}
+	
+	void *v = MapViewOfFile(m, FILE_MAP_WRITE, 0, 0, (SIZE_T)(size));
+	if(v == NULL)
+	{
+		DWORD err = GetLastError();
+		LOG_ERROR(LOG_CAT_GENERAL, "Unable to map capture file: %s", win_strerror(err).c_str());
+		
+		CloseHandle(m);
+		return false;
+	}
+	
+	mapping   = m;
+	view      = (unsigned char*)(v);
+	view_size = size;
+	
+	return true;
+}
+
+static void unmap_file()
+{
+	if(view != NULL)
+	{
+		UnmapViewOfFile(view);
+		view = NULL;
+	}
+	
+	if(mapping != NULL)
+	{
+		CloseHandle(mapping);
+		mapping = NULL;
+	}
+}
+
+static void close_file()
+{
+	if(file != INVALID_HANDLE_VALUE)
+	{
+		unmap_file();
+		
+		/* Trim off whatever we didn't use of the last CAPTURE_GROW_SIZE step. */
+		
+		LARGE_INTEGER end;
+		end.QuadPart = used;
+		
+		SetFilePointerEx(file, end, NULL, FILE_BEGIN);
+		SetEndOfFile(file);
+		
+		CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+	}
+	
+	view_size = 0;
+	used      = 0;
+}
+
+void capture_init()
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(capture_state != 0)
+	{
+		return;
+	}
+	
+	const char *path = getenv("DPLITE_CAPTURE");
+	if(path != NULL && *path != '\0')
+	{
+		if(resume_at != 0)
+		{
+			file = CreateFile(path, (GENERIC_READ | GENERIC_WRITE), FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			
+			LARGE_INTEGER size;
+			if(file != INVALID_HANDLE_VALUE && (!GetFileSizeEx(file, &size) || (uint64_t)(size.QuadPart) != resume_at))
+			{
+				/* Not the file we left behind any more. */
+				CloseHandle(file);
+				file = INVALID_HANDLE_VALUE;
+			}
+			
+			if(file != INVALID_HANDLE_VALUE)
+			{
+				/* Timestamps carry on from the original qpc_start. */
+				used = resume_at;
+				
+				if(map_file(resume_at + CAPTURE_GROW_SIZE))
+				{
+					LOG_INFO(LOG_CAT_GENERAL, "Resuming capture to %s", path);
+				}
+				else{
+					close_file();
+				}
+				
+				resume_at = 0;
+				
+				capture_state = (file != INVALID_HANDLE_VALUE ? 2 : 1);
+				return;
+			}
+			
+			resume_at = 0;
+		}
+		
+		file = CreateFile(path, (GENERIC_READ | GENERIC_WRITE), FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if(file == INVALID_HANDLE_VALUE)
+		{
+			DWORD err = GetLastError();
+			LOG_ERROR(LOG_CAT_GENERAL, "Unable to open capture file %s: %s", path, win_strerror(err).c_str());
+		}
+		else if(!map_file(CAPTURE_GROW_SIZE))
+		{
+			close_file();
+		}
+		else{
+			CaptureFileHeader fh;
+			memset(&fh, 0, sizeof(fh));
+			
+			memcpy(fh.magic, CAPTURE_MAGIC, sizeof(fh.magic));
+			fh.version     = CAPTURE_VERSION;
+			fh.header_size = sizeof(fh);
+			
+			FILETIME now;
+			GetSystemTimeAsFileTime(&now);
+			
+			fh.start_time = ((uint64_t)(now.dwHighDateTime) << 32) | now.dwLowDateTime;
+			
+			memcpy(view, &fh, sizeof(fh));
+			used = sizeof(fh);
+			
+			QueryPerformanceFrequency(&qpc_freq);
+			QueryPerformanceCounter(&qpc_start);
+			
+			LOG_INFO(LOG_CAT_GENERAL, "Capturing frames to %s", path);
+		}
+	}
+	
+	capture_state = (file != INVALID_HANDLE_VALUE ? 2 : 1);
+}
+
+void capture_fini()
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(file != INVALID_HANDLE_VALUE)
+	{
+		resume_at = used;
+	}
+	
+	close_file();
+	
+	/* Let the next capture_enabled() call start capturing again. */
+	capture_state = 0;
+}
+
+uint32_t capture_new_instance()
+{
+	return next_instance.fetch_add(1, std::memory_order_relaxed);
+}
+
+void capture_frame(uint32_t instance, uint32_t peer_id, CaptureDirection direction, CaptureTransport transport,
+	uint32_t remote_ip, uint16_t remote_port, const void *data, size_t size)
+{
+	std::vector< std::pair<const void*, size_t> > buffers;
+	buffers.push_back(std::make_pair(data, size));
+	
+	capture_frame(instance, peer_id, direction, transport, remote_ip, remote_port, buffers);
+}
+
+void capture_frame(uint32_t instance, uint32_t peer_id, CaptureDirection direction, CaptureTransport transport,
+	uint32_t remote_ip, uint16_t remote_port, const std::vector< std::pair<const void*, size_t> > &buffers)
+{
+	size_t size = 0;
+	for(auto b = buffers.begin(); b != buffers.end(); ++b)
+	{
+		size += b->second;
+	}
+	
+	uint64_t record_size = (sizeof(CaptureRecordHeader) + size + 7) & ~(uint64_t)(7);
+	
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(capture_state != 2)
+	{
+		return;
+	}
+	
+	if((used + record_size) > view_size)
+	{
+		/* Out of space, grow the file. New space in the file is zeroed, which takes
+		 * care of the padding after each record.
+		*/
+		
+		uint64_t new_size = view_size + std::max<uint64_t>(CAPTURE_GROW_SIZE, record_size);
+		
+		unmap_file();
+		
+		if(!map_file(new_size))
+		{
+			LOG_ERROR(LOG_CAT_GENERAL, "Stopping capture");
+			
+			close_file();
+			capture_state = 1;
+			
+			return;
+		}
+	}
+	
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	
+	uint64_t elapsed = now.QuadPart - qpc_start.QuadPart;
+	uint64_t freq    = qpc_freq.QuadPart;
+	
+	CaptureRecordHeader rh;
+	memset(&rh, 0, sizeof(rh));
+	
+	rh.length      = size;
+	rh.instance    = instance;
+	rh.time_us     = ((elapsed / freq) * 1000000) + (((elapsed % freq) * 1000000) / freq);
+	rh.peer_id     = peer_id;
+	rh.remote_ip   = remote_ip;
+	rh.remote_port = remote_port;
+	rh.direction   = direction;
+	rh.transport   = transport;
+	
+	unsigned char *at = view + used;
+	
+	memcpy(at, &rh, sizeof(rh));
+	at += sizeof(rh);
+	
+	for(auto b = buffers.begin(); b != buffers.end(); ++b)
+	{
+		memcpy(at, b->first, b->second);
+		at += b->second;
+	}
+	
+	used += record_size;
+}
@@ -0,0 +1,117 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef DPLITE_CAPTURE_HPP
+#define DPLITE_CAPTURE_HPP
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+/* Binary capture of every frame sent or received, enabled by setting the DPLITE_CAPTURE
+ * environment variable to the path of a file to write to. Captures can be decoded and
+ * replayed using the dpcapture tool.
+ *
+ * The file starts with a CaptureFileHeader followed by a CaptureRecordHeader and the frame
+ * data for each record, each record padded to a multiple of 8 bytes. The file is written
+ * through a memory mapping which grows in CAPTURE_GROW_SIZE steps and is trimmed to the
+ * data written when the capture is closed, a capture from a process which crashed may be
+ * followed by zeros, which readers should treat as the end of the file.
+ *
+ * All fields are little-endian.
+*/
+
+#define CAPTURE_MAGIC   "DPLCAP\0\0"
+#define CAPTURE_VERSION 1
+
+#define CAPTURE_GROW_SIZE (4 * 1024 * 1024)
+
+/* peer_id of frames which aren't associated with a peer (e.g. UDP datagrams). */
+#define CAPTURE_NO_PEER 0xFFFFFFFF
+
+enum CaptureDirection
+{
+	CAPTURE_DIR_IN  = 1,
+	CAPTURE_DIR_OUT = 2,
+};
+
+enum CaptureTransport
+{
+	CAPTURE_TRANSPORT_TCP = 1,
+	CAPTURE_TRANSPORT_UDP = 2,
+};
+
+struct CaptureFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;  /* sizeof(CaptureFileHeader) */
+	uint64_t start_time;   /* FILETIME (100ns intervals since 1601) the capture was started. */
+	uint64_t reserved;
+};
+
+struct CaptureRecordHeader
+{
+	uint32_t length;       /* Bytes of frame data following the header. */
+	uint32_t instance;     /* Identifies the DirectPlay8Peer instance within the process. */
+	uint64_t time_us;      /* Microseconds since CaptureFileHeader.start_time */
+	uint32_t peer_id;      /* Peer ID within the instance, CAPTURE_NO_PEER if not known. */
+	uint32_t remote_ip;    /* IPv4 address of the other end, network byte order. */
+	uint16_t remote_port;  /* Port of the other end, host byte order. */
+	uint8_t direction;     /* CaptureDirection */
+	uint8_t transport;     /* CaptureTransport */
+	uint32_t reserved;
+};
+
+static_assert(sizeof(CaptureFileHeader) == 32, "CaptureFileHeader must be 32 bytes");
+static_assert(sizeof(CaptureRecordHeader) == 32, "CaptureRecordHeader must be 32 bytes");
+
+/* 0 until capture_init() has been called, then 1 if capturing is disabled or 2 if it is
+ * enabled.
+*/
+extern std::atomic<int> capture_state;
+
+void capture_init();
+void capture_fini();
+
+inline bool capture_enabled()
+{
+	int state = capture_state.load(std::memory_order_relaxed);
+	
+	if(state == 0)
+	{
+		capture_init();
+		state = capture_state.load(std::memory_order_relaxed);
+	}
+	
+	return state == 2;
+}
+
+/* Returns a new ID for the instance field of CaptureRecordHeader. */
+uint32_t capture_new_instance();
+
+void capture_frame(uint32_t instance, uint32_t peer_id, CaptureDirection direction, CaptureTransport transport,
+	uint32_t remote_ip, uint16_t remote_port, const void *data, size_t size);
+
+void capture_frame(uint32_t instance, uint32_t peer_id, CaptureDirection direction, CaptureTransport transport,
+	uint32_t remote_ip, uint16_t remote_port, const std::vector< std::pair<const void*, size_t> > &buffers);
+
+#endif /* !DPLITE_CAPTURE_HPP */
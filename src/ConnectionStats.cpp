@@ -0,0 +1,160 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <dplay8.h>
+#include <stdint.h>
+#include <windows.h>
+
+#include "ConnectionStats.hpp"
+
+const uint64_t ConnectionStats::THROUGHPUT_PERIOD_MS;
+
+ConnectionStats::ConnectionStats(uint64_t now):
+	bytes_sent_guaranteed(0),
+	packets_sent_guaranteed(0),
+	bytes_sent_nonguaranteed(0),
+	packets_sent_nonguaranteed(0),
+	bytes_received_guaranteed(0),
+	packets_received_guaranteed(0),
+	bytes_received_nonguaranteed(0),
+	packets_received_nonguaranteed(0),
+	messages_received(0),
+	messages_transmitted(),
+	messages_timed_out(),
+	rtt_valid(false),
+	rtt_x8(0),
+	period_start(now),
+	period_start_bytes(0),
+	throughput(0),
+	peak_throughput(0) {}
+
+void ConnectionStats::packet_sent(bool guaranteed, size_t size)
+{
+	if(guaranteed)
+	{
+		bytes_sent_guaranteed += size;
+		++packets_sent_guaranteed;
+	}
+	else{
+		bytes_sent_nonguaranteed += size;
+		++packets_sent_nonguaranteed;
+	}
+}
+
+void ConnectionStats::packet_received(bool guaranteed, size_t size)
+{
+	if(guaranteed)
+	{
+		bytes_received_guaranteed += size;
+		++packets_received_guaranteed;
+	}
+	else{
+		bytes_received_nonguaranteed += size;
+		++packets_received_nonguaranteed;
+	}
+}
+
+void ConnectionStats::message_sent(SendQueue::SendPriority priority, HRESULT result)
+{
+	if(result == S_OK)
+	{
+		++(messages_transmitted[SendQueue::pri_index(priority)]);
+	}
+	else if(result == DPNERR_TIMEDOUT)
+	{
+		++(messages_timed_out[SendQueue::pri_index(priority)]);
+	}
+}
+
+void ConnectionStats::message_received()
+{
+	++messages_received;
+}
+
+void ConnectionStats::rtt_sample(DWORD sample)
+{
+	if(rtt_valid)
+	{
+		/* Each sample moves the average 1/8th of the way towards it, like TCP's SRTT.
+		 * The average is kept multiplied by 8 so it doesn't get stuck short of the
+		 * samples due to rounding.
+		*/
+		rtt_x8 = rtt_x8 - (rtt_x8 / 8) + sample;
+	}
+	else{
+		rtt_x8    = (uint64_t)(sample) * 8;
+		rtt_valid = true;
+	}
+}
+
+DWORD ConnectionStats::get_rtt() const
+{
+	return (DWORD)(rtt_x8 / 8);
+}
+
+void ConnectionStats::update(uint64_t now)
+{
+	if(now < period_start || (now - period_start) < THROUGHPUT_PERIOD_MS)
+	{
+		return;
+	}
+	
+	uint64_t bytes_sent = bytes_sent_guaranteed + bytes_sent_nonguaranteed;
+	
+	throughput = (DWORD)(((bytes_sent - period_start_bytes) * 1000) / (now - period_start));
+	
+	if(throughput > peak_throughput)
+	{
+		peak_throughput = throughput;
+	}
+	
+	period_start       = now;
+	period_start_bytes = bytes_sent;
+}
+
+void ConnectionStats::get_info(DPN_CONNECTION_INFO *info) const
+{
+	info->dwRoundTripLatencyMS = get_rtt();
+	info->dwThroughputBPS      = throughput;
+	info->dwPeakThroughputBPS  = peak_throughput;
+	
+	info->dwBytesSentGuaranteed      = (DWORD)(bytes_sent_guaranteed);
+	info->dwPacketsSentGuaranteed    = (DWORD)(packets_sent_guaranteed);
+	info->dwBytesSentNonGuaranteed   = (DWORD)(bytes_sent_nonguaranteed);
+	info->dwPacketsSentNonGuaranteed = (DWORD)(packets_sent_nonguaranteed);
+	
+	/* TCP does its own retransmissions, and lost datagrams are never noticed. */
+	info->dwBytesRetried   = 0;
+	info->dwPacketsRetried = 0;
+	info->dwBytesDropped   = 0;
+	info->dwPacketsDropped = 0;
+	
+	info->dwMessagesTransmittedHighPriority   = (DWORD)(messages_transmitted[2]);
+	info->dwMessagesTimedOutHighPriority      = (DWORD)(messages_timed_out[2]);
+	info->dwMessagesTransmittedNormalPriority = (DWORD)(messages_transmitted[1]);
+	info->dwMessagesTimedOutNormalPriority    = (DWORD)(messages_timed_out[1]);
+	info->dwMessagesTransmittedLowPriority    = (DWORD)(messages_transmitted[0]);
+	info->dwMessagesTimedOutLowPriority       = (DWORD)(messages_timed_out[0]);
+	
+	info->dwBytesReceivedGuaranteed      = (DWORD)(bytes_received_guaranteed);
+	info->dwPacketsReceivedGuaranteed    = (DWORD)(packets_received_guaranteed);
+	info->dwBytesReceivedNonGuaranteed   = (DWORD)(bytes_received_nonguaranteed);
+	info->dwPacketsReceivedNonGuaranteed = (DWORD)(packets_received_nonguaranteed);
+	
+	info->dwMessagesReceived = (DWORD)(messages_received);
+}
@@ -0,0 +1,98 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_CONNECTIONSTATS_HPP
+#define DPLITE_CONNECTIONSTATS_HPP
+
+#include <dplay8.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <windows.h>
+
+#include "SendQueue.hpp"
+
+/* Traffic and latency statistics for the connection to one peer, reported to the application
+ * by GetConnectionInfo().
+ *
+ * Packet and byte counts include everything written to or read from the connection, including
+ * internal messages and the packet headers. Message counts are only of the application's own
+ * messages. The round trip time is a moving average of samples taken by the owner (using
+ * DPLITE_MSGID_PING), and throughput is the rate data was sent at (in bytes per second) over
+ * the last complete THROUGHPUT_PERIOD_MS, which is only recalculated when update() is called.
+*/
+
+class ConnectionStats
+{
+	public:
+		static const uint64_t THROUGHPUT_PERIOD_MS = 1000;
+		
+	private:
+		uint64_t bytes_sent_guaranteed;
+		uint64_t packets_sent_guaranteed;
+		uint64_t bytes_sent_nonguaranteed;
+		uint64_t packets_sent_nonguaranteed;
+		
+		uint64_t bytes_received_guaranteed;
+		uint64_t packets_received_guaranteed;
+		uint64_t bytes_received_nonguaranteed;
+		uint64_t packets_received_nonguaranteed;
+		
+		uint64_t messages_received;
+		
+		/* Indexed by SendQueue::pri_index(). */
+		uint64_t messages_transmitted[3];
+		uint64_t messages_timed_out[3];
+		
+		bool rtt_valid;
+		uint64_t rtt_x8;
+		
+		uint64_t period_start;
+		uint64_t period_start_bytes;
+		
+		DWORD throughput;
+		DWORD peak_throughput;
+		
+	public:
+		ConnectionStats(uint64_t now);
+		
+		void packet_sent(bool guaranteed, size_t size);
+		void packet_received(bool guaranteed, size_t size);
+		
+		/* Records the completion of an application message, only successful and timed
+		 * out messages are counted.
+		*/
+		void message_sent(SendQueue::SendPriority priority, HRESULT result);
+		void message_received();
+		
+		void rtt_sample(DWORD sample);
+		
+		/* Returns the smoothed round trip time in milliseconds, or zero if no samples
+		 * have been taken yet.
+		*/
+		DWORD get_rtt() const;
+		
+		/* Calculates the throughput over the period ending now if it has run for at least
+		 * THROUGHPUT_PERIOD_MS and starts a new one.
+		*/
+		void update(uint64_t now);
+		
+		/* Fills in everything except dwSize. */
+		void get_info(DPN_CONNECTION_INFO *info) const;
+};
+
+#endif /* !DPLITE_CONNECTIONSTATS_HPP */
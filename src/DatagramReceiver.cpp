@@ -0,0 +1,161 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+#include <windows.h>
+
+#include "DatagramReceiver.hpp"
+#include "Messages.hpp"
+
+const size_t DatagramReceiver::FRAGMENT_SIZE;
+const DWORD DatagramReceiver::MAX_FRAGMENTS;
+const size_t DatagramReceiver::MAX_REASSEMBLY;
+
+DatagramReceiver::DatagramReceiver(BufferPool &pool):
+	pool(pool), seq_valid(false), seq(0) {}
+
+DatagramReceiver::~DatagramReceiver()
+{
+	for(auto ra = reassembly.begin(); ra != reassembly.end(); ++ra)
+	{
+		ra->buffer->unref();
+	}
+}
+
+bool DatagramReceiver::is_stale(DWORD channel, DWORD sequence) const
+{
+	return channel == DATAGRAM_CHANNEL_SEQUENTIAL
+		&& seq_valid
+		&& (int32_t)(sequence - seq) <= 0;
+}
+
+void DatagramReceiver::advance_seq(DWORD sequence)
+{
+	seq_valid = true;
+	seq       = sequence;
+	
+	for(auto ra = reassembly.begin(); ra != reassembly.end();)
+	{
+		if(is_stale(ra->channel, ra->sequence))
+		{
+			ra->buffer->unref();
+			ra = reassembly.erase(ra);
+		}
+		else{
+			++ra;
+		}
+	}
+}
+
+DatagramReceiver::Result DatagramReceiver::add(const Fragment &fragment, const void **message, BufferPool::Buffer **message_buffer)
+{
+	if(fragment.channel != DATAGRAM_CHANNEL_SEQUENTIAL && fragment.channel != DATAGRAM_CHANNEL_NONSEQUENTIAL)
+	{
+		return FRAGMENT_INVALID;
+	}
+	
+	size_t fragment_offset = (size_t)(fragment.fragment_index) * FRAGMENT_SIZE;
+	
+	if(fragment.fragment_count == 0 || fragment.fragment_count > MAX_FRAGMENTS
+		|| fragment.fragment_index >= fragment.fragment_count
+		|| fragment.message_size > (fragment.fragment_count * FRAGMENT_SIZE)
+		|| fragment_offset > fragment.message_size
+		|| fragment.size != std::min<size_t>(FRAGMENT_SIZE, fragment.message_size - fragment_offset))
+	{
+		return FRAGMENT_INVALID;
+	}
+	
+	if(is_stale(fragment.channel, fragment.sequence))
+	{
+		return FRAGMENT_STALE;
+	}
+	
+	if(fragment.fragment_count == 1)
+	{
+		/* Whole message is in this datagram, deliver it straight from the receive buffer. */
+		
+		if(fragment.channel == DATAGRAM_CHANNEL_SEQUENTIAL)
+		{
+			advance_seq(fragment.sequence);
+		}
+		
+		*message        = fragment.data;
+		*message_buffer = NULL;
+		
+		return MESSAGE_COMPLETE;
+	}
+	
+	auto ra = reassembly.begin();
+	while(ra != reassembly.end() && ra->message_id != fragment.message_id)
+	{
+		++ra;
+	}
+	
+	if(ra == reassembly.end())
+	{
+		if(reassembly.size() >= MAX_REASSEMBLY)
+		{
+			/* Give up on the oldest incomplete message, its remaining fragments have
+			 * probably been lost.
+			*/
+			reassembly.front().buffer->unref();
+			reassembly.pop_front();
+		}
+		
+		Reassembly new_ra;
+		new_ra.message_id         = fragment.message_id;
+		new_ra.channel            = fragment.channel;
+		new_ra.sequence           = fragment.sequence;
+		new_ra.message_size       = fragment.message_size;
+		new_ra.fragment_count     = fragment.fragment_count;
+		new_ra.fragments_received = 0;
+		new_ra.buffer             = pool.get(fragment.message_size);
+		
+		ra = reassembly.insert(reassembly.end(), new_ra);
+	}
+	else if(ra->channel != fragment.channel || ra->sequence != fragment.sequence
+		|| ra->message_size != fragment.message_size || ra->fragment_count != fragment.fragment_count)
+	{
+		return FRAGMENT_INVALID;
+	}
+	
+	memcpy(ra->buffer->data() + fragment_offset, fragment.data, fragment.size);
+	ra->fragments_received |= (1U << fragment.fragment_index);
+	
+	DWORD all_fragments = (fragment.fragment_count == 32 ? 0xFFFFFFFF : ((1U << fragment.fragment_count) - 1));
+	
+	if(ra->fragments_received != all_fragments)
+	{
+		return FRAGMENT_INCOMPLETE;
+	}
+	
+	BufferPool::Buffer *buffer = ra->buffer;
+	reassembly.erase(ra);
+	
+	if(fragment.channel == DATAGRAM_CHANNEL_SEQUENTIAL)
+	{
+		advance_seq(fragment.sequence);
+	}
+	
+	*message        = buffer->data();
+	*message_buffer = buffer;
+	
+	return MESSAGE_COMPLETE;
+}
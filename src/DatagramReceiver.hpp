@@ -0,0 +1,128 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_DATAGRAMRECEIVER_HPP
+#define DPLITE_DATAGRAMRECEIVER_HPP
+
+#include <list>
+#include <stdlib.h>
+#include <windows.h>
+
+#include "BufferPool.hpp"
+
+/* Reassembles and orders the DPLITE_MSGID_DATAGRAM messages received from one peer.
+ *
+ * Each fragment received from the peer is passed to add(), which says whether a complete
+ * message is ready to be delivered. Fragments of messages too large for one datagram are
+ * copied into a buffer from the pool until the rest arrive, up to MAX_REASSEMBLY messages
+ * at a time.
+ *
+ * Messages in DATAGRAM_CHANNEL_SEQUENTIAL are discarded (complete or not) if a later
+ * message in that channel has already been completed, so they are never delivered out of
+ * order. Messages in
+ * DATAGRAM_CHANNEL_NONSEQUENTIAL are delivered as soon as they are complete.
+ *
+ * Not thread-safe.
+*/
+
+class DatagramReceiver
+{
+	public:
+		/* Payload carried by each fragment, leaving room within MAX_DATAGRAM_SIZE for the
+		 * message header and other fields.
+		*/
+		static const size_t FRAGMENT_SIZE = MAX_DATAGRAM_SIZE - 128;
+		
+		/* Maximum number of fragments in a message. */
+		static const DWORD MAX_FRAGMENTS = 32;
+		
+		/* Maximum number of incomplete messages held at once. */
+		static const size_t MAX_REASSEMBLY = 4;
+		
+		/* The fields of a received DPLITE_MSGID_DATAGRAM. */
+		struct Fragment
+		{
+			DWORD message_id;
+			DWORD channel;
+			DWORD sequence;
+			DWORD message_size;
+			DWORD fragment_index;
+			DWORD fragment_count;
+			
+			const void *data;
+			size_t size;
+		};
+		
+		enum Result {
+			FRAGMENT_INVALID,    /* Fragment is malformed or doesn't match its message. */
+			FRAGMENT_STALE,      /* Message was overtaken by a later one and discarded. */
+			FRAGMENT_INCOMPLETE, /* Waiting for more fragments of the message. */
+			MESSAGE_COMPLETE,    /* Message is ready to be delivered. */
+		};
+		
+	private:
+		struct Reassembly
+		{
+			DWORD message_id;
+			DWORD channel;
+			DWORD sequence;
+			DWORD message_size;
+			DWORD fragment_count;
+			DWORD fragments_received; /* Bitmask of received fragment indices. */
+			
+			BufferPool::Buffer *buffer;
+		};
+		
+		BufferPool &pool;
+		
+		/* Incomplete messages, oldest first. */
+		std::list<Reassembly> reassembly;
+		
+		/* Sequence number of the last message completed in DATAGRAM_CHANNEL_SEQUENTIAL. */
+		bool seq_valid;
+		DWORD seq;
+		
+		bool is_stale(DWORD channel, DWORD sequence) const;
+		
+		/* Records the completion of a message in DATAGRAM_CHANNEL_SEQUENTIAL and
+		 * discards any incomplete messages it has made stale.
+		*/
+		void advance_seq(DWORD sequence);
+		
+	public:
+		DatagramReceiver(BufferPool &pool);
+		~DatagramReceiver();
+		
+		/* No copy c'tor. */
+		DatagramReceiver(const DatagramReceiver &src) = delete;
+		
+		/* Processes a received fragment.
+		 *
+		 * If MESSAGE_COMPLETE is returned, *message points to the message_size bytes of
+		 * the message. If the message was reassembled from more than one fragment then
+		 * *message_buffer is set to the buffer holding it, which the caller must unref()
+		 * when done with it, otherwise *message_buffer is set to NULL and *message points
+		 * into the fragment's own data.
+		*/
+		Result add(const Fragment &fragment, const void **message, BufferPool::Buffer **message_buffer);
+		
+		/* Returns the number of incomplete messages being held. */
+		size_t pending() const { return reassembly.size(); }
+};
+
+#endif /* !DPLITE_DATAGRAMRECEIVER_HPP */
@@ -31,7 +31,7 @@
 #include "Log.hpp"
 
 #define UNIMPLEMENTED(fmt, ...) \
-	log_printf("Unimplemented method: " fmt, ## __VA_ARGS__); \
+	LOG_WARN(LOG_CAT_GENERAL, "Unimplemented method: " fmt, ## __VA_ARGS__); \
 	return E_NOTIMPL;
 
 DirectPlay8Address::DirectPlay8Address(std::atomic<unsigned int> *global_refcount):
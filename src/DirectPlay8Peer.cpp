@@ -17,6 +17,7 @@
 */
 
 #include <winsock2.h>
+#include <algorithm>
 #include <assert.h>
 #include <atomic>
 #include <dplay8.h>
@@ -31,15 +32,18 @@
 #include <windows.h>
 #include <ws2tcpip.h>
 
+#include "Capture.hpp"
 #include "COMAPIException.hpp"
 #include "DirectPlay8Address.hpp"
 #include "DirectPlay8Peer.hpp"
+#include "DirectPlay8ThreadPool.hpp"
 #include "Log.hpp"
 #include "Messages.hpp"
 #include "network.hpp"
+#include "StreamFramer.hpp"
 
 #define UNIMPLEMENTED(fmt, ...) \
-	log_printf("Unimplemented: " fmt, ## __VA_ARGS__); \
+	LOG_WARN(LOG_CAT_GENERAL, "Unimplemented: " fmt, ## __VA_ARGS__); \
 	return E_NOTIMPL;
 
 #define RENEW_PEER_OR_RETURN() \
@@ -49,8 +53,38 @@
 		return; \
 	}
 
-#define THREADS_PER_POOL     4
-#define MAX_HANDLES_PER_POOL 16
+/* Maximum number of queued tasks run by each call to handle_work(). */
+#define WORK_BATCH_SIZE 32
+
+/* Maximum number of buffers passed to a single WSASend() call. */
+#define MAX_SEND_BUFS 64
+
+/* io_peer_send() stops adding messages to a WSASend() call once it has this many bytes. */
+#define MAX_SEND_BATCH (64 * 1024)
+
+/* How long DPNSEND_COALESCE messages may be held back waiting for others to send with. */
+#define COALESCE_DELAY_MS 10
+
+/* How often each peer is pinged and its throughput recalculated. */
+#define STATS_INTERVAL_MS ConnectionStats::THROUGHPUT_PERIOD_MS
+
+/* Default and minimum DPN_CAPS.dwTimeoutUntilKeepAlive. */
+#define DEFAULT_KEEPALIVE_MS 25000
+#define MIN_KEEPALIVE_MS     50
+
+/* How many times per keepalive period each peer is checked. */
+#define KEEPALIVE_CHECKS_PER_PERIOD 4
+
+/* A peer we haven't heard anything from for this many keepalive periods is assumed to have
+ * gone away and is destroyed.
+*/
+#define KEEPALIVE_DEAD_PERIODS 2
+
+/* Payload carried by each DPLITE_MSGID_DATAGRAM fragment. */
+#define DATAGRAM_FRAGMENT_SIZE DatagramReceiver::FRAGMENT_SIZE
+
+/* Non-guaranteed messages which would need more fragments than this go over TCP instead. */
+#define MAX_DATAGRAM_FRAGMENTS DatagramReceiver::MAX_FRAGMENTS
 
 /* Ephemeral port range as defined by IANA. */
 static const int AUTO_PORT_MIN = 49152;
@@ -64,8 +98,41 @@ DirectPlay8Peer::DirectPlay8Peer(std::atomic<unsigned int> *global_refcount):
 	listener_socket(-1),
 	discovery_socket(-1),
 	worker_pool(NULL),
-	udp_sq(udp_socket_event)
+	work_signalled(false),
+	udp_sq(udp_socket_event),
+	timers(GetTickCount64()),
+	timer_event_due(0),
+	coalesce_timer_armed(false),
+	stats_timer_armed(false),
+	keepalive_timer_armed(false),
+	next_datagram_id(0),
+	capture_instance(capture_new_instance()),
+	session(std::make_shared<const SessionSnapshot>())
 {
+	next_datagram_seq[DATAGRAM_CHANNEL_SEQUENTIAL]    = 0;
+	next_datagram_seq[DATAGRAM_CHANNEL_NONSEQUENTIAL] = 0;
+	
+	memset(&caps, 0, sizeof(caps));
+	
+	caps.dwSize                    = sizeof(caps);
+	caps.dwFlags                   = 0;
+	caps.dwConnectTimeout          = 200;
+	caps.dwConnectRetries          = 14;
+	caps.dwTimeoutUntilKeepAlive   = DEFAULT_KEEPALIVE_MS;
+	caps.dwMaxRecvMsgSize          = 0xFFFFFFFF;
+	caps.dwNumSendRetries          = 10;
+	caps.dwMaxSendRetryInterval    = 5000;
+	caps.dwDropThresholdRate       = 7;
+	caps.dwThrottleRate            = 25;
+	caps.dwNumHardDisconnectSends  = 3;
+	caps.dwMaxHardDisconnectPeriod = 500;
+	
+	timer_event = CreateWaitableTimer(NULL, FALSE, NULL);
+	if(timer_event == NULL)
+	{
+		throw std::runtime_error("Unable to create waitable timer");
+	}
+	
 	AddRef();
 }
 
@@ -75,6 +142,8 @@ DirectPlay8Peer::~DirectPlay8Peer()
 	{
 		Close(DPNCLOSE_IMMEDIATE);
 	}
+	
+	CloseHandle(timer_event);
 }
 
 HRESULT DirectPlay8Peer::QueryInterface(REFIID riid, void **ppvObject)
@@ -131,18 +200,19 @@ HRESULT DirectPlay8Peer::Initialize(PVOID CONST pvUserContext, CONST PFNDPNMESSA
 	WSADATA wd;
 	if(WSAStartup(MAKEWORD(2,2), &wd) != 0)
 	{
-		log_printf("WSAStartup() failed");
+		LOG_ERROR(LOG_CAT_SOCKETS, "WSAStartup() failed");
 		return DPNERR_GENERIC;
 	}
 	
 	message_handler     = pfn;
 	message_handler_ctx = pvUserContext;
 	
-	worker_pool = new HandleHandlingPool(THREADS_PER_POOL, MAX_HANDLES_PER_POOL);
+	worker_pool = DirectPlay8ThreadPool::create_reactor();
 	
 	worker_pool->add_handle(udp_socket_event,   [this]() { handle_udp_socket_event();   });
 	worker_pool->add_handle(other_socket_event, [this]() { handle_other_socket_event(); });
 	worker_pool->add_handle(work_ready,         [this]() { handle_work(); });
+	worker_pool->add_handle(timer_event,        [this]() { handle_timer_event(); });
 	
 	state = STATE_INITIALISED;
 	
@@ -247,7 +317,7 @@ HRESULT DirectPlay8Peer::CancelAsyncOperation(CONST DPNHANDLE hAsyncHandle, CONS
 				if(sqop != NULL)
 				{
 					sqop->invoke_callback(l, DPNERR_USERCANCEL);
-					delete sqop;
+					sqop->release();
 					continue;
 				}
 			}
@@ -258,7 +328,7 @@ HRESULT DirectPlay8Peer::CancelAsyncOperation(CONST DPNHANDLE hAsyncHandle, CONS
 				if(sqop != NULL)
 				{
 					sqop->invoke_callback(l, DPNERR_USERCANCEL);
-					delete sqop;
+					sqop->release();
 					continue;
 				}
 			}
@@ -269,7 +339,7 @@ HRESULT DirectPlay8Peer::CancelAsyncOperation(CONST DPNHANDLE hAsyncHandle, CONS
 				if(sqop != NULL)
 				{
 					sqop->invoke_callback(l, DPNERR_USERCANCEL);
-					delete sqop;
+					sqop->release();
 					continue;
 				}
 			}
@@ -303,16 +373,24 @@ HRESULT DirectPlay8Peer::CancelAsyncOperation(CONST DPNHANDLE hAsyncHandle, CONS
 		
 		if(dwFlags & DPNCANCEL_ALL_OPERATIONS)
 		{
+			SendQueue::SendOp *sqop;
+			
+			while((sqop = udp_sq.remove_queued()) != NULL)
+			{
+				sqop->invoke_callback(l, DPNERR_USERCANCEL);
+				sqop->release();
+			}
+			
 			for(auto p = peers.begin(); p != peers.end();)
 			{
 				Peer *peer = p->second;
 				
-				SendQueue::SendOp *sqop = peer->sq.remove_queued();
+				sqop = peer->sq.remove_queued();
 				
 				if(sqop != NULL)
 				{
 					sqop->invoke_callback(l, DPNERR_USERCANCEL);
-					delete sqop;
+					sqop->release();
 					
 					/* Restart in case peers was munged. */
 					p = peers.begin();
@@ -357,39 +435,56 @@ HRESULT DirectPlay8Peer::CancelAsyncOperation(CONST DPNHANDLE hAsyncHandle, CONS
 	}
 	else if((hAsyncHandle & AsyncHandleAllocator::TYPE_MASK) == AsyncHandleAllocator::TYPE_SEND)
 	{
-		/* Search the send queues for a queued send with the handle. */
+		/* A send is queued as a SendOp for each fragment of each target, so it can only
+		 * be cancelled if none of them have started sending yet.
+		*/
 		
-		SendQueue::SendOp *sqop = udp_sq.remove_queued_by_handle(hAsyncHandle);
 		if(udp_sq.handle_is_pending(hAsyncHandle))
 		{
-			/* Cannot cancel once message has started sending. */
 			return DPNERR_CANNOTCANCEL;
 		}
 		
-		for(auto p = peers.begin(); p != peers.end() && sqop == NULL; ++p)
+		for(auto p = peers.begin(); p != peers.end(); ++p)
 		{
-			Peer *peer = p->second;
-			
-			sqop = peer->sq.remove_queued_by_handle(hAsyncHandle);
-			if(peer->sq.handle_is_pending(hAsyncHandle))
+			if(p->second->sq.handle_is_pending(hAsyncHandle))
 			{
-				/* Cannot cancel once message has started sending. */
 				return DPNERR_CANNOTCANCEL;
 			}
 		}
 		
-		if(sqop != NULL)
+		/* Take all of them out of the queues before invoking any callbacks, since the
+		 * lock is released within them.
+		*/
+		
+		std::vector<SendQueue::SendOp*> sqops;
+		SendQueue::SendOp *sqop;
+		
+		while((sqop = udp_sq.remove_queued_by_handle(hAsyncHandle)) != NULL)
 		{
-			/* Queued send was found, make it go away. */
-			sqop->invoke_callback(l, DPNERR_USERCANCEL);
-			delete sqop;
-			
-			return S_OK;
+			sqops.push_back(sqop);
 		}
-		else{
+		
+		for(auto p = peers.begin(); p != peers.end(); ++p)
+		{
+			while((sqop = p->second->sq.remove_queued_by_handle(hAsyncHandle)) != NULL)
+			{
+				sqops.push_back(sqop);
+			}
+		}
+		
+		if(sqops.empty())
+		{
 			/* No pending send with that handle. */
 			return DPNERR_INVALIDHANDLE;
 		}
+		
+		for(auto o = sqops.begin(); o != sqops.end(); ++o)
+		{
+			(*o)->invoke_callback(l, DPNERR_USERCANCEL);
+			(*o)->release();
+		}
+		
+		return S_OK;
 	}
 	else{
 		/* Unrecognised handle type. */
@@ -453,7 +548,7 @@ HRESULT DirectPlay8Peer::Connect(CONST DPN_APPLICATION_DESC* CONST pdnAppDesc, I
 			return DPNERR_INVALIDHOSTADDRESS;
 		}
 		
-		log_printf("hostname = '%S'", hostname_value);
+		LOG_TRACE(LOG_CAT_GENERAL, "hostname = '%S'", hostname_value);
 		
 		if(host_sp == CLSID_DP8SP_TCPIP)
 		{
@@ -495,7 +590,7 @@ HRESULT DirectPlay8Peer::Connect(CONST DPN_APPLICATION_DESC* CONST pdnAppDesc, I
 			return DPNERR_INVALIDHOSTADDRESS;
 		}
 		
-		log_printf("port = %d", (int)(port_value));
+		LOG_TRACE(LOG_CAT_GENERAL, "port = %d", (int)(port_value));
 		
 		r_port = (uint16_t)(port_value);
 	}
@@ -509,13 +604,13 @@ HRESULT DirectPlay8Peer::Connect(CONST DPN_APPLICATION_DESC* CONST pdnAppDesc, I
 		struct in_addr hostname_addr;
 		if(inet_pton(AF_INET, override_ip, &hostname_addr) == 1)
 		{
-			log_printf(
+			LOG_INFO(LOG_CAT_GENERAL,
 				"DPLITE_CONNECT_IP environment variable is set, connecting to '%s' instead",
 				override_ip);
 			r_ipaddr = hostname_addr.s_addr;
 		}
 		else{
-			log_printf(
+			LOG_ERROR(LOG_CAT_GENERAL,
 				"DPLITE_CONNECT_IP environment variable contains invalid IP address: %s",
 				override_ip);
 			return DPNERR_INVALIDHOSTADDRESS;
@@ -645,21 +740,116 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 		return DPNERR_GENERIC;
 	}
 	
-	std::vector<unsigned char> payload;
+	std::vector< std::pair<const void*, size_t> > payload;
+	payload.reserve(cBufferDesc);
+	
+	size_t payload_size = 0;
 	
 	for(DWORD i = 0; i < cBufferDesc; ++i)
 	{
-		payload.reserve(payload.size() + prgBufferDesc[i].dwBufferSize);
-		payload.insert(payload.end(),
-			(const unsigned char*)(prgBufferDesc[i].pBufferData),
-			(const unsigned char*)(prgBufferDesc[i].pBufferData) + prgBufferDesc[i].dwBufferSize);
+		payload.push_back(std::make_pair((const void*)(prgBufferDesc[i].pBufferData), (size_t)(prgBufferDesc[i].dwBufferSize)));
+		payload_size += prgBufferDesc[i].dwBufferSize;
 	}
 	
-	PacketSerialiser message(DPLITE_MSGID_MESSAGE);
+	auto append_payload = [dwFlags](PacketSerialiser &ps, const std::vector< std::pair<const void*, size_t> > &buffers)
+	{
+		if(dwFlags & (DPNSEND_NOCOPY | DPNSEND_SYNC))
+		{
+			/* The application's buffers remain valid until the send completes, so the
+			 * payload is sent straight out of them rather than being copied.
+			*/
+			ps.append_data_ref(buffers);
+		}
+		else{
+			/* Copy the payload directly from the application's buffers into the message. */
+			ps.append_data(buffers);
+		}
+	};
+	
+	/* A single copy of the message is shared between the send queues of all targets. */
+	std::shared_ptr<PacketSerialiser> message;
+	std::vector< std::shared_ptr<PacketSerialiser> > datagrams;
+	
+	if(!(dwFlags & DPNSEND_GUARANTEED) && udp_socket != -1
+		&& payload_size <= (MAX_DATAGRAM_FRAGMENTS * DATAGRAM_FRAGMENT_SIZE))
+	{
+		/* Non-guaranteed messages are sent as datagrams over udp_socket, split into
+		 * fragments if necessary, so a lost packet doesn't hold up anything sent after it.
+		*/
+		
+		DWORD message_id  = next_datagram_id++;
+		DWORD channel     = (dwFlags & DPNSEND_NONSEQUENTIAL ? DATAGRAM_CHANNEL_NONSEQUENTIAL : DATAGRAM_CHANNEL_SEQUENTIAL);
+		DWORD sequence    = next_datagram_seq[channel]++;
+		DWORD n_fragments = (payload_size > 0 ? (payload_size + DATAGRAM_FRAGMENT_SIZE - 1) / DATAGRAM_FRAGMENT_SIZE : 1);
+		
+		auto b = payload.begin();
+		size_t b_off = 0;
+		
+		for(DWORD i = 0; i < n_fragments; ++i)
+		{
+			/* Gather this fragment's range of the payload from the application's buffers. */
+			
+			std::vector< std::pair<const void*, size_t> > fragment;
+			size_t f_need = std::min<size_t>(DATAGRAM_FRAGMENT_SIZE, payload_size - (i * DATAGRAM_FRAGMENT_SIZE));
+			
+			while(f_need > 0)
+			{
+				size_t take = std::min(f_need, (b->second - b_off));
+				
+				if(take > 0)
+				{
+					fragment.push_back(std::make_pair((const void*)((const unsigned char*)(b->first) + b_off), take));
+				}
+				
+				b_off  += take;
+				f_need -= take;
+				
+				if(b_off == b->second)
+				{
+					++b;
+					b_off = 0;
+				}
+			}
+			
+			std::shared_ptr<PacketSerialiser> datagram = std::make_shared<PacketSerialiser>(DPLITE_MSGID_DATAGRAM);
+			
+			datagram->append_dword(local_player_id);
+			datagram->append_dword(message_id);
+			datagram->append_dword(channel);
+			datagram->append_dword(sequence);
+			datagram->append_dword(dwFlags & (DPNSEND_COALESCE | DPNSEND_COMPLETEONPROCESS));
+			datagram->append_dword(payload_size);
+			datagram->append_dword(i);
+			datagram->append_dword(n_fragments);
+			append_payload(*datagram, fragment);
+			
+			datagrams.push_back(datagram);
+		}
+	}
+	else{
+		message = std::make_shared<PacketSerialiser>(DPLITE_MSGID_MESSAGE);
+		
+		message->append_dword(local_player_id);
+		append_payload(*message, payload);
+		message->append_dword(dwFlags & (DPNSEND_GUARANTEED | DPNSEND_NONSEQUENTIAL | DPNSEND_COALESCE | DPNSEND_COMPLETEONPROCESS));
+	}
 	
-	message.append_dword(local_player_id);
-	message.append_data(payload.data(), payload.size());
-	message.append_dword(dwFlags & (DPNSEND_GUARANTEED | DPNSEND_COALESCE | DPNSEND_COMPLETEONPROCESS));
+	/* Messages sent to ourself are delivered from a pool buffer in the same way as ones
+	 * received from the network, so ReturnBuffer() can treat them all alike.
+	*/
+	auto copy_payload = [this, &payload, payload_size]()
+	{
+		BufferPool::Buffer *payload_copy = recv_pool.get(payload_size);
+		unsigned char *p = payload_copy->data();
+		
+		for(auto b = payload.begin(); b != payload.end(); ++b)
+		{
+			memcpy(p, b->first, b->second);
+			p += b->second;
+		}
+		
+		return payload_copy;
+	};
 	
 	SendQueue::SendPriority priority = SendQueue::SEND_PRI_MEDIUM;
 	if(dwFlags & DPNSEND_PRIORITY_HIGH)
@@ -671,9 +861,78 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 		priority = SendQueue::SEND_PRI_LOW;
 	}
 	
+	/* Queues the message for sending to a peer. The callback is invoked once for each of
+	 * the sends_per_peer SendOps queued.
+	*/
+	auto queue_send = [this, &message, &datagrams, priority, dwFlags]
+		(Peer *peer, DPNHANDLE handle, const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback)
+	{
+		/* The message is counted in the peer's statistics when its last SendOp completes. */
+		
+		DPNID player_id = peer->player_id;
+		
+		std::function<void(std::unique_lock<std::mutex>&, HRESULT)> counted_callback =
+			[this, player_id, priority, callback]
+			(std::unique_lock<std::mutex> &l, HRESULT s_result)
+		{
+			Peer *peer = get_peer_by_player_id(player_id);
+			if(peer != NULL)
+			{
+				peer->stats.message_sent(priority, s_result);
+			}
+			
+			callback(l, s_result);
+		};
+		
+		LOG_TRACE(LOG_CAT_SENDQUEUE, "Queueing message for player %u (priority %u, %u datagrams)",
+			(unsigned)(player_id), (unsigned)(priority), (unsigned)(datagrams.size()));
+		
+		if(datagrams.empty())
+		{
+			/* DPNSEND_COALESCE messages may be held back for a moment in case more
+			 * messages are sent to the same peer which they can be combined with.
+			*/
+			bool hold = (dwFlags & DPNSEND_COALESCE) && !(dwFlags & DPNSEND_SYNC);
+			
+			peer->sq.send(priority, message, NULL, handle, counted_callback, hold);
+			
+			if(hold)
+			{
+				arm_coalesce_timer();
+			}
+		}
+		else{
+			struct sockaddr_in addr;
+			memset(&addr, 0, sizeof(addr));
+			
+			addr.sin_family      = AF_INET;
+			addr.sin_addr.s_addr = peer->ip;
+			addr.sin_port        = htons(peer->port);
+			
+			for(auto d = datagrams.begin(); d != datagrams.end(); ++d)
+			{
+				/* udp_sq doesn't know which peer each datagram is for, so they
+				 * are counted as sent when they are queued.
+				*/
+				peer->stats.packet_sent(false, (*d)->raw_packet_size());
+				
+				udp_sq.send(priority, *d, &addr, handle,
+					((d + 1) == datagrams.end() ? counted_callback : callback));
+			}
+		}
+	};
+	
+	unsigned int sends_per_peer = (datagrams.empty() ? 1 : datagrams.size());
+	
 	std::list<Peer*> send_to_peers;
 	bool send_to_self = false;
 	
+	/* The targets are resolved from the session snapshot, which is always current while
+	 * the lock is held, so only the peer of each target needs looking up.
+	*/
+	std::shared_ptr<const SessionSnapshot> session = get_session();
+	const std::vector<unsigned int> *target_peer_ids = NULL;
+	
 	if(dpnid == DPNID_ALL_PLAYERS_GROUP)
 	{
 		if(!(dwFlags & DPNSEND_NOLOOPBACK))
@@ -681,60 +940,61 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 			send_to_self = true;
 		}
 		
-		for(auto pi = peers.begin(); pi != peers.end(); ++pi)
-		{
-			if(pi->second->state == Peer::PS_CONNECTED)
-			{
-				send_to_peers.push_back(pi->second);
-			}
-		}
+		target_peer_ids = &(session->connected_peer_ids);
 	}
 	else{
-		Peer *target_peer;
-		Group *target_group;
+		std::map<DPNID, unsigned int>::const_iterator target_player;
+		std::map<DPNID, SessionSnapshot::GroupSnapshot>::const_iterator target_group;
 		
-		if(dpnid == local_player_id)
+		if(dpnid == session->local_player_id)
 		{
 			send_to_self = true;
 		}
-		else if((target_peer = get_peer_by_player_id(dpnid)) != NULL)
+		else if((target_player = session->player_peer_ids.find(dpnid)) != session->player_peer_ids.end())
 		{
+			Peer *target_peer = get_peer_by_peer_id(target_player->second);
+			assert(target_peer != NULL);
+			
 			send_to_peers.push_back(target_peer);
 		}
-		else if((target_group = get_group_by_id(dpnid)) != NULL)
+		else if((target_group = session->groups.find(dpnid)) != session->groups.end())
 		{
-			for(auto m = target_group->player_ids.begin(); m != target_group->player_ids.end(); ++m)
+			if(target_group->second.local_member && !(dwFlags & DPNSEND_NOLOOPBACK))
 			{
-				if(*m == local_player_id)
-				{
-					if(!(dwFlags & DPNSEND_NOLOOPBACK))
-					{
-						send_to_self = true;
-					}
-				}
-				else{
-					target_peer = get_peer_by_player_id(*m);
-					assert(target_peer != NULL);
-					
-					send_to_peers.push_back(target_peer);
-				}
+				send_to_self = true;
 			}
+			
+			target_peer_ids = &(target_group->second.peer_ids);
 		}
 		else{
 			return DPNERR_INVALIDPLAYER;
 		}
 	}
 	
+	if(target_peer_ids != NULL)
+	{
+		for(auto pi = target_peer_ids->begin(); pi != target_peer_ids->end(); ++pi)
+		{
+			Peer *target_peer = get_peer_by_peer_id(*pi);
+			assert(target_peer != NULL);
+			
+			send_to_peers.push_back(target_peer);
+		}
+	}
+	
 	if(dwFlags & DPNSEND_SYNC)
 	{
-		unsigned int pending = send_to_peers.size();
+		unsigned int pending = send_to_peers.size() * sends_per_peer;
 		std::mutex d_mutex;
 		std::condition_variable d_cv;
 		HRESULT result = S_OK;
 		
+		/* Synchronous sends only need a handle to find them again if they time out. */
+		DPNHANDLE handle = (dwTimeOut != 0 && !send_to_peers.empty() ? handle_alloc.new_send() : 0);
+		
 		for(auto pi = send_to_peers.begin(); pi != send_to_peers.end(); ++pi)
 		{
-			(*pi)->sq.send(priority, message, NULL,
+			queue_send(*pi, handle,
 				[&pending, &d_mutex, &d_cv, &result]
 				(std::unique_lock<std::mutex> &l, HRESULT s_result)
 				{
@@ -754,12 +1014,46 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 				});
 		}
 		
+		if(handle != 0)
+		{
+			schedule_send_timeout(handle, send_to_peers, dwTimeOut);
+		}
+		
+		if(IOReactor::in_callback())
+		{
+			/* We may be holding up the only worker which could send the message (or
+			 * have been called from DoWork() with no workers at all), so start sending
+			 * it from this thread rather than waiting for the socket to be serviced.
+			*/
+			
+			if(!datagrams.empty())
+			{
+				io_udp_send(l);
+			}
+			else{
+				std::vector<DPNID> player_ids;
+				for(auto pi = send_to_peers.begin(); pi != send_to_peers.end(); ++pi)
+				{
+					player_ids.push_back((*pi)->player_id);
+				}
+				
+				/* Peers may be destroyed by io_peer_send(). */
+				for(auto p = player_ids.begin(); p != player_ids.end(); ++p)
+				{
+					auto pi = player_to_peer_id.find(*p);
+					if(pi != player_to_peer_id.end())
+					{
+						io_peer_send(l, pi->second);
+					}
+				}
+			}
+		}
+		
 		if(send_to_self)
 		{
 			/* TODO: Should the processing of this block a DPNSEND_SYNC send? */
 			
-			unsigned char *payload_copy = new unsigned char[payload.size()];
-			memcpy(payload_copy, payload.data(), payload.size());
+			BufferPool::Buffer *payload_copy = copy_payload();
 			
 			DPNMSG_RECEIVE r;
 			memset(&r, 0, sizeof(r));
@@ -767,8 +1061,8 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 			r.dwSize            = sizeof(r);
 			r.dpnidSender       = local_player_id;
 			r.pvPlayerContext   = local_player_ctx;
-			r.pReceiveData      = payload_copy;
-			r.dwReceiveDataSize = payload.size();
+			r.pReceiveData      = payload_copy->data();
+			r.dwReceiveDataSize = payload_size;
 			r.hBufferHandle     = (DPNHANDLE)(payload_copy);
 			r.dwReceiveFlags    = (dwFlags & DPNSEND_GUARANTEED ? DPNRECEIVE_GUARANTEED : 0)
 			                    | (dwFlags & DPNSEND_COALESCE   ? DPNRECEIVE_COALESCED  : 0);
@@ -778,7 +1072,7 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 			HRESULT r_result = message_handler(message_handler_ctx, DPN_MSGID_RECEIVE, &r);
 			if(r_result != DPNSUCCESS_PENDING)
 			{
-				delete[] payload_copy;
+				payload_copy->unref();
 			}
 		}
 		else{
@@ -791,14 +1085,18 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 		return result;
 	}
 	else{
-		unsigned int *pending = new unsigned int(send_to_peers.size() + send_to_self);
+		unsigned int *pending = new unsigned int((send_to_peers.size() * sends_per_peer) + send_to_self);
 		HRESULT      *result  = new HRESULT(S_OK);
 		
 		DPNHANDLE handle = handle_alloc.new_send();
 		*phAsyncHandle   = handle;
 		
+		/* DPNMSG_SEND_COMPLETE reports the round trip time to the first target. */
+		DPNID rtt_player_id = (!send_to_peers.empty() ? send_to_peers.front()->player_id : 0);
+		DWORD send_start    = GetTickCount();
+		
 		auto handle_send_complete =
-			[this, pending, result, pvAsyncContext, dwFlags, prgBufferDesc, cBufferDesc, handle]
+			[this, pending, result, pvAsyncContext, dwFlags, prgBufferDesc, cBufferDesc, handle, rtt_player_id, send_start]
 			(std::unique_lock<std::mutex> &l, HRESULT s_result)
 		{
 			if(s_result != S_OK && *result == S_OK)
@@ -816,12 +1114,17 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 				sc.hAsyncOp = handle;
 				sc.pvUserContext = pvAsyncContext;
 				sc.hResultCode   = *result;
-				// sc.dwSendTime
-				// sc.dwFirstFrameRTT
+				sc.dwSendTime    = GetTickCount() - send_start;
 				// sc.dwFirstRetryCount
 				sc.dwSendCompleteFlags = (dwFlags & DPNSEND_GUARANTEED ? DPNRECEIVE_GUARANTEED : 0)
 				                       | (dwFlags & DPNSEND_COALESCE   ? DPNRECEIVE_COALESCED  : 0);
 				
+				Peer *rtt_peer = (rtt_player_id != 0 ? get_peer_by_player_id(rtt_player_id) : NULL);
+				if(rtt_peer != NULL)
+				{
+					sc.dwFirstFrameRTT = rtt_peer->stats.get_rtt();
+				}
+				
 				if(dwFlags & DPNSEND_NOCOPY)
 				{
 					sc.pBuffers     = (DPN_BUFFER_DESC*)(prgBufferDesc);
@@ -848,18 +1151,16 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 			
 			++(*pending);
 			
-			std::thread t([this, handle_send_complete]()
+			queue_work([this, handle_send_complete]()
 			{
 				std::unique_lock<std::mutex> l(lock);
 				handle_send_complete(l, S_OK);
 			});
-			
-			t.detach();
 		}
 		
 		for(auto pi = send_to_peers.begin(); pi != send_to_peers.end(); ++pi)
 		{
-			(*pi)->sq.send(priority, message, NULL, handle,
+			queue_send(*pi, handle,
 				[handle_send_complete]
 				(std::unique_lock<std::mutex> &l, HRESULT s_result)
 				{
@@ -867,12 +1168,14 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 				});
 		}
 		
+		if(dwTimeOut != 0 && !send_to_peers.empty())
+		{
+			schedule_send_timeout(handle, send_to_peers, dwTimeOut);
+		}
+		
 		if(send_to_self)
 		{
-			size_t payload_size = payload.size();
-			
-			unsigned char *payload_copy = new unsigned char[payload_size];
-			memcpy(payload_copy, payload.data(), payload_size);
+			BufferPool::Buffer *payload_copy = copy_payload();
 			
 			queue_work([this, payload_size, payload_copy, handle_send_complete, dwFlags]()
 			{
@@ -884,7 +1187,7 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 				r.dwSize            = sizeof(r);
 				r.dpnidSender       = local_player_id;
 				r.pvPlayerContext   = local_player_ctx;
-				r.pReceiveData      = payload_copy;
+				r.pReceiveData      = payload_copy->data();
 				r.dwReceiveDataSize = payload_size;
 				r.hBufferHandle     = (DPNHANDLE)(payload_copy);
 				r.dwReceiveFlags    = (dwFlags & DPNSEND_GUARANTEED ? DPNRECEIVE_GUARANTEED : 0)
@@ -896,7 +1199,7 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 				
 				if(r_result != DPNSUCCESS_PENDING)
 				{
-					delete[] payload_copy;
+					payload_copy->unref();
 				}
 				
 				handle_send_complete(l, S_OK);
@@ -909,7 +1212,85 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 
 HRESULT DirectPlay8Peer::GetSendQueueInfo(CONST DPNID dpnid, DWORD* CONST pdwNumMsgs, DWORD* CONST pdwNumBytes, CONST DWORD dwFlags)
 {
-	UNIMPLEMENTED("DirectPlay8Peer::GetSendQueueInfo");
+	std::unique_lock<std::mutex> l(lock);
+	
+	switch(state)
+	{
+		case STATE_NEW:                 return DPNERR_UNINITIALIZED;
+		case STATE_INITIALISED:         return DPNERR_NOCONNECTION;
+		case STATE_HOSTING:             break;
+		case STATE_CONNECTING_TO_HOST:  return DPNERR_NOCONNECTION;
+		case STATE_CONNECTING_TO_PEERS: return DPNERR_NOCONNECTION;
+		case STATE_CONNECT_FAILED:      return DPNERR_NOCONNECTION;
+		case STATE_CONNECTED:           break;
+		case STATE_CLOSING:             return DPNERR_NOCONNECTION;
+		case STATE_TERMINATED:          return DPNERR_NOCONNECTION;
+	}
+	
+	if(dwFlags & ~(DPNGETSENDQUEUEINFO_PRIORITY_NORMAL | DPNGETSENDQUEUEINFO_PRIORITY_HIGH | DPNGETSENDQUEUEINFO_PRIORITY_LOW))
+	{
+		return DPNERR_INVALIDFLAGS;
+	}
+	
+	/* No priority flags means all of them. */
+	DWORD priorities = (dwFlags != 0 ? dwFlags : (DPNGETSENDQUEUEINFO_PRIORITY_NORMAL | DPNGETSENDQUEUEINFO_PRIORITY_HIGH | DPNGETSENDQUEUEINFO_PRIORITY_LOW));
+	
+	size_t num_msgs = 0, num_bytes = 0;
+	
+	auto count_peer = [&num_msgs, &num_bytes, priorities](const Peer *peer)
+	{
+		if(priorities & DPNGETSENDQUEUEINFO_PRIORITY_LOW)
+		{
+			num_msgs  += peer->sq.get_queued_msgs(SendQueue::SEND_PRI_LOW);
+			num_bytes += peer->sq.get_queued_bytes(SendQueue::SEND_PRI_LOW);
+		}
+		
+		if(priorities & DPNGETSENDQUEUEINFO_PRIORITY_NORMAL)
+		{
+			num_msgs  += peer->sq.get_queued_msgs(SendQueue::SEND_PRI_MEDIUM);
+			num_bytes += peer->sq.get_queued_bytes(SendQueue::SEND_PRI_MEDIUM);
+		}
+		
+		if(priorities & DPNGETSENDQUEUEINFO_PRIORITY_HIGH)
+		{
+			num_msgs  += peer->sq.get_queued_msgs(SendQueue::SEND_PRI_HIGH);
+			num_bytes += peer->sq.get_queued_bytes(SendQueue::SEND_PRI_HIGH);
+		}
+	};
+	
+	if(dpnid == DPNID_ALL_PLAYERS_GROUP)
+	{
+		/* Total of the queues to every other player. */
+		
+		for(auto p = player_to_peer_id.begin(); p != player_to_peer_id.end(); ++p)
+		{
+			Peer *peer = get_peer_by_peer_id(p->second);
+			assert(peer != NULL);
+			
+			count_peer(peer);
+		}
+	}
+	else{
+		Peer *peer = get_peer_by_player_id(dpnid);
+		if(peer == NULL)
+		{
+			return DPNERR_INVALIDPLAYER;
+		}
+		
+		count_peer(peer);
+	}
+	
+	if(pdwNumMsgs != NULL)
+	{
+		*pdwNumMsgs = num_msgs;
+	}
+	
+	if(pdwNumBytes != NULL)
+	{
+		*pdwNumBytes = num_bytes;
+	}
+	
+	return S_OK;
 }
 
 HRESULT DirectPlay8Peer::Host(CONST DPN_APPLICATION_DESC* CONST pdnAppDesc, IDirectPlay8Address **CONST prgpDeviceInfo, CONST DWORD cDeviceInfo, CONST DPN_SECURITY_DESC* CONST pdnSecurity, CONST DPN_SECURITY_CREDENTIALS* CONST pdnCredentials, void* CONST pvPlayerContext, CONST DWORD dwFlags)
@@ -1099,9 +1480,15 @@ HRESULT DirectPlay8Peer::Host(CONST DPN_APPLICATION_DESC* CONST pdnAppDesc, IDir
 	
 	state = STATE_HOSTING;
 	
+	publish_session();
+	arm_stats_timer();
+	arm_keepalive_timer();
+	
 	/* Send DPNMSG_CREATE_PLAYER for local player. */
 	dispatch_create_player(l, local_player_id, &local_player_ctx);
 	
+	publish_session();
+	
 	return S_OK;
 }
 
@@ -1222,12 +1609,12 @@ HRESULT DirectPlay8Peer::SetApplicationDesc(CONST DPN_APPLICATION_DESC* CONST pa
 	 * from the other peers, they'll get it when they get it.
 	*/
 	
-	PacketSerialiser appdesc(DPLITE_MSGID_APPDESC);
+	std::shared_ptr<PacketSerialiser> appdesc = std::make_shared<PacketSerialiser>(DPLITE_MSGID_APPDESC);
 	
-	appdesc.append_dword(max_players);
-	appdesc.append_wstring(session_name);
-	appdesc.append_wstring(password);
-	appdesc.append_data(application_data.data(), application_data.size());
+	appdesc->append_dword(max_players);
+	appdesc->append_wstring(session_name);
+	appdesc->append_wstring(password);
+	appdesc->append_data(application_data.data(), application_data.size());
 	
 	for(auto pi = peers.begin(); pi != peers.end(); ++pi)
 	{
@@ -1274,7 +1661,7 @@ HRESULT DirectPlay8Peer::CreateGroup(CONST DPN_GROUP_INFO* CONST pdpnGroupInfo,
 	
 	if(pdpnGroupInfo->dwGroupFlags & DPNGROUP_AUTODESTRUCT)
 	{
-		log_printf("DirectPlay8Peer::CreateGroup() called with DPNGROUP_AUTODESTRUCT");
+		LOG_WARN(LOG_CAT_GROUPS, "DirectPlay8Peer::CreateGroup() called with DPNGROUP_AUTODESTRUCT");
 		return E_NOTIMPL;
 	}
 	
@@ -1346,7 +1733,7 @@ HRESULT DirectPlay8Peer::CreateGroup(CONST DPN_GROUP_INFO* CONST pdpnGroupInfo,
 	};
 	
 	auto create_the_group =
-		[this, group_name, group_data, pvGroupContext, cg_lock, pending, complete]
+		[this, group_name, group_data, pvGroupContext, cg_lock, pending, complete, dwFlags]
 		(std::unique_lock<std::mutex> &l, DPNID group_id)
 	{
 		groups.emplace(
@@ -1354,10 +1741,12 @@ HRESULT DirectPlay8Peer::CreateGroup(CONST DPN_GROUP_INFO* CONST pdpnGroupInfo,
 			std::forward_as_tuple(group_id),
 			std::forward_as_tuple(group_name, group_data.data(), group_data.size(), pvGroupContext));
 		
-		PacketSerialiser group_create(DPLITE_MSGID_GROUP_CREATE);
-		group_create.append_dword(group_id);
-		group_create.append_wstring(group_name);
-		group_create.append_data(group_data.data(), group_data.size());
+		publish_session();
+		
+		std::shared_ptr<PacketSerialiser> group_create = std::make_shared<PacketSerialiser>(DPLITE_MSGID_GROUP_CREATE);
+		group_create->append_dword(group_id);
+		group_create->append_wstring(group_name);
+		group_create->append_data(group_data.data(), group_data.size());
 		
 		std::unique_lock<std::mutex> cgl(*cg_lock);
 		
@@ -1375,7 +1764,7 @@ HRESULT DirectPlay8Peer::CreateGroup(CONST DPN_GROUP_INFO* CONST pdpnGroupInfo,
 					{
 						if(result != S_OK)
 						{
-							log_printf("Failed to send DPLITE_MSGID_GROUP_CREATE, session may be out of sync!");
+							LOG_ERROR(LOG_CAT_GROUPS, "Failed to send DPLITE_MSGID_GROUP_CREATE, session may be out of sync!");
 						}
 						
 						complete(l, S_OK);
@@ -1385,11 +1774,9 @@ HRESULT DirectPlay8Peer::CreateGroup(CONST DPN_GROUP_INFO* CONST pdpnGroupInfo,
 		
 		cgl.unlock();
 		
-		/* Raise local DPNMSG_CREATE_GROUP.
-		 * TODO: Do this in a properly managed worker thread.
-		*/
+		/* Raise local DPNMSG_CREATE_GROUP. */
 		
-		std::thread t([this, group_id, pvGroupContext, complete]()
+		run_or_queue_work(l, (dwFlags & DPNCREATEGROUP_SYNC), [this, group_id, pvGroupContext, complete]()
 		{
 			std::unique_lock<std::mutex> l(lock);
 			
@@ -1410,12 +1797,12 @@ HRESULT DirectPlay8Peer::CreateGroup(CONST DPN_GROUP_INFO* CONST pdpnGroupInfo,
 			if(group != NULL)
 			{
 				group->ctx = cg.pvGroupContext;
+				
+				publish_session();
 			}
 			
 			complete(l, S_OK);
 		});
-		
-		t.detach();
 	};
 	
 	if(local_player_id == host_player_id)
@@ -1525,8 +1912,8 @@ HRESULT DirectPlay8Peer::DestroyGroup(CONST DPNID idGroup, PVOID CONST pvAsyncCo
 	
 	/* Send DPLITE_MSGID_GROUP_DESTROY to each PS_CONNECTED peer. */
 	
-	PacketSerialiser group_destroy(DPLITE_MSGID_GROUP_DESTROY);
-	group_destroy.append_dword(idGroup);
+	std::shared_ptr<PacketSerialiser> group_destroy = std::make_shared<PacketSerialiser>(DPLITE_MSGID_GROUP_DESTROY);
+	group_destroy->append_dword(idGroup);
 	
 	int *pending = new int(1);
 	std::condition_variable cv;
@@ -1573,7 +1960,7 @@ HRESULT DirectPlay8Peer::DestroyGroup(CONST DPNID idGroup, PVOID CONST pvAsyncCo
 				{
 					if(result != S_OK)
 					{
-						log_printf("Failed to send DPLITE_MSGID_GROUP_DESTROY, session may be out of sync!");
+						LOG_ERROR(LOG_CAT_GROUPS, "Failed to send DPLITE_MSGID_GROUP_DESTROY, session may be out of sync!");
 					}
 					
 					complete(l);
@@ -1581,11 +1968,9 @@ HRESULT DirectPlay8Peer::DestroyGroup(CONST DPNID idGroup, PVOID CONST pvAsyncCo
 		}
 	}
 	
-	/* Raise local DPNMSG_DESTROY_GROUP and then destroy the group.
-	 * TODO: Do this in a properly managed worker thread.
-	*/
+	/* Raise local DPNMSG_DESTROY_GROUP and then destroy the group. */
 	
-	std::thread t([this, idGroup, complete]()
+	run_or_queue_work(l, (dwFlags & DPNDESTROYGROUP_SYNC), [this, idGroup, complete]()
 	{
 		std::unique_lock<std::mutex> l(lock);
 		
@@ -1605,13 +1990,13 @@ HRESULT DirectPlay8Peer::DestroyGroup(CONST DPNID idGroup, PVOID CONST pvAsyncCo
 			l.lock();
 			
 			groups.erase(idGroup);
+			
+			publish_session();
 		}
 		
 		complete(l);
 	});
 	
-	t.detach();
-	
 	if(dwFlags & DPNDESTROYGROUP_SYNC)
 	{
 		cv.wait(l, [&pending]() { return (*pending == 0); });
@@ -1707,10 +2092,10 @@ HRESULT DirectPlay8Peer::AddPlayerToGroup(CONST DPNID idGroup, CONST DPNID idCli
 	{
 		/* Adding ourself to the group. Notify everyone else in the session. */
 		
-		PacketSerialiser group_joined(DPLITE_MSGID_GROUP_JOINED);
-		group_joined.append_dword(idGroup);
-		group_joined.append_wstring(group->name);
-		group_joined.append_data(group->data.data(), group->data.size());
+		std::shared_ptr<PacketSerialiser> group_joined = std::make_shared<PacketSerialiser>(DPLITE_MSGID_GROUP_JOINED);
+		group_joined->append_dword(idGroup);
+		group_joined->append_wstring(group->name);
+		group_joined->append_data(group->data.data(), group->data.size());
 		
 		for(auto p = peers.begin(); p != peers.end(); ++p)
 		{
@@ -1725,7 +2110,7 @@ HRESULT DirectPlay8Peer::AddPlayerToGroup(CONST DPNID idGroup, CONST DPNID idCli
 					{
 						if(result != S_OK)
 						{
-							log_printf("Failed to send DPLITE_MSGID_GROUP_JOINED, session may be out of sync!");
+							LOG_ERROR(LOG_CAT_GROUPS, "Failed to send DPLITE_MSGID_GROUP_JOINED, session may be out of sync!");
 						}
 						
 						complete(l, S_OK);
@@ -1737,8 +2122,10 @@ HRESULT DirectPlay8Peer::AddPlayerToGroup(CONST DPNID idGroup, CONST DPNID idCli
 		
 		group->player_ids.insert(local_player_id);
 		
+		publish_session();
+		
 		void *group_ctx = group->ctx;
-		std::thread t([this, idGroup, group_ctx, complete]()
+		run_or_queue_work(l, (dwFlags & DPNADDPLAYERTOGROUP_SYNC), [this, idGroup, group_ctx, complete]()
 		{
 			DPNMSG_ADD_PLAYER_TO_GROUP ap;
 			memset(&ap, 0, sizeof(ap));
@@ -1754,8 +2141,6 @@ HRESULT DirectPlay8Peer::AddPlayerToGroup(CONST DPNID idGroup, CONST DPNID idCli
 			std::unique_lock<std::mutex> l(lock);
 			complete(l, S_OK);
 		});
-		
-		t.detach();
 	}
 	else{
 		Peer *peer = get_peer_by_player_id(idClient);
@@ -1891,8 +2276,8 @@ HRESULT DirectPlay8Peer::RemovePlayerFromGroup(CONST DPNID idGroup, CONST DPNID
 	{
 		/* Removing ourself from the group. Notify everyone else in the session. */
 		
-		PacketSerialiser group_left(DPLITE_MSGID_GROUP_LEFT);
-		group_left.append_dword(idGroup);
+		std::shared_ptr<PacketSerialiser> group_left = std::make_shared<PacketSerialiser>(DPLITE_MSGID_GROUP_LEFT);
+		group_left->append_dword(idGroup);
 		
 		for(auto p = peers.begin(); p != peers.end(); ++p)
 		{
@@ -1907,7 +2292,7 @@ HRESULT DirectPlay8Peer::RemovePlayerFromGroup(CONST DPNID idGroup, CONST DPNID
 					{
 						if(result != S_OK)
 						{
-							log_printf("Failed to send DPLITE_MSGID_GROUP_LEFT, session may be out of sync!");
+							LOG_ERROR(LOG_CAT_GROUPS, "Failed to send DPLITE_MSGID_GROUP_LEFT, session may be out of sync!");
 						}
 						
 						complete(l, S_OK);
@@ -1919,8 +2304,10 @@ HRESULT DirectPlay8Peer::RemovePlayerFromGroup(CONST DPNID idGroup, CONST DPNID
 		
 		group->player_ids.erase(local_player_id);
 		
+		publish_session();
+		
 		void *group_ctx = group->ctx;
-		std::thread t([this, idGroup, group_ctx, complete]()
+		run_or_queue_work(l, (dwFlags & DPNREMOVEPLAYERFROMGROUP_SYNC), [this, idGroup, group_ctx, complete]()
 		{
 			DPNMSG_REMOVE_PLAYER_FROM_GROUP rp;
 			memset(&rp, 0, sizeof(rp));
@@ -1936,8 +2323,6 @@ HRESULT DirectPlay8Peer::RemovePlayerFromGroup(CONST DPNID idGroup, CONST DPNID
 			std::unique_lock<std::mutex> l(lock);
 			complete(l, S_OK);
 		});
-		
-		t.detach();
 	}
 	else{
 		Peer *peer = get_peer_by_player_id(idClient);
@@ -2076,7 +2461,7 @@ HRESULT DirectPlay8Peer::GetGroupInfo(CONST DPNID dpnid, DPN_GROUP_INFO* CONST p
 
 HRESULT DirectPlay8Peer::EnumPlayersAndGroups(DPNID* CONST prgdpnid, DWORD* CONST pcdpnid, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	/* Only reads the session snapshot, so doesn't need the lock. */
 	
 	switch(state)
 	{
@@ -2091,26 +2476,19 @@ HRESULT DirectPlay8Peer::EnumPlayersAndGroups(DPNID* CONST prgdpnid, DWORD* CONS
 		case STATE_TERMINATED:          return DPNERR_CONNECTIONLOST;
 	}
 	
+	std::shared_ptr<const SessionSnapshot> session = get_session();
+	
 	DWORD num_results = 0;
 	
 	if(dwFlags & DPNENUM_PLAYERS)
 	{
 		++num_results; /* For local peer. */
-		
-		for(auto p = peers.begin(); p != peers.end(); ++p)
-		{
-			Peer *peer = p->second;
-			
-			if(peer->state == Peer::PS_CONNECTED)
-			{
-				++num_results;
-			}
-		}
+		num_results += session->connected_players.size();
 	}
 	
 	if(dwFlags & DPNENUM_GROUPS)
 	{
-		num_results += groups.size();
+		num_results += session->groups.size();
 	}
 	
 	if(*pcdpnid < num_results)
@@ -2123,22 +2501,17 @@ HRESULT DirectPlay8Peer::EnumPlayersAndGroups(DPNID* CONST prgdpnid, DWORD* CONS
 	
 	if(dwFlags & DPNENUM_PLAYERS)
 	{
-		prgdpnid[next_idx++] = local_player_id;
+		prgdpnid[next_idx++] = session->local_player_id;
 		
-		for(auto p = peers.begin(); p != peers.end(); ++p)
+		for(auto p = session->connected_players.begin(); p != session->connected_players.end(); ++p)
 		{
-			Peer *peer = p->second;
-			
-			if(peer->state == Peer::PS_CONNECTED)
-			{
-				prgdpnid[next_idx++] = peer->player_id;
-			}
+			prgdpnid[next_idx++] = *p;
 		}
 	}
 	
 	if(dwFlags & DPNENUM_GROUPS)
 	{
-		for(auto g = groups.begin(); g != groups.end(); ++g)
+		for(auto g = session->groups.begin(); g != session->groups.end(); ++g)
 		{
 			DPNID group_id = g->first;
 			prgdpnid[next_idx++] = group_id;
@@ -2153,7 +2526,7 @@ HRESULT DirectPlay8Peer::EnumPlayersAndGroups(DPNID* CONST prgdpnid, DWORD* CONS
 
 HRESULT DirectPlay8Peer::EnumGroupMembers(CONST DPNID dpnid, DPNID* CONST prgdpnid, DWORD* CONST pcdpnid, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	/* Only reads the session snapshot, so doesn't need the lock. */
 	
 	switch(state)
 	{
@@ -2168,13 +2541,15 @@ HRESULT DirectPlay8Peer::EnumGroupMembers(CONST DPNID dpnid, DPNID* CONST prgdpn
 		case STATE_TERMINATED:          return DPNERR_CONNECTIONLOST;
 	}
 	
-	auto g = groups.find(dpnid);
-	if(g == groups.end())
+	std::shared_ptr<const SessionSnapshot> session = get_session();
+	
+	auto g = session->groups.find(dpnid);
+	if(g == session->groups.end())
 	{
 		return DPNERR_INVALIDGROUP;
 	}
 	
-	Group &group = g->second;
+	const SessionSnapshot::GroupSnapshot &group = g->second;
 	
 	if(*pcdpnid < group.player_ids.size())
 	{
@@ -2615,16 +2990,39 @@ HRESULT DirectPlay8Peer::Close(CONST DWORD dwFlags)
 	 * STATE_CLOSING and we have no open sockets.
 	*/
 	l.unlock();
-	delete worker_pool;
+	DirectPlay8ThreadPool::destroy_reactor(worker_pool);
+	
+	/* Run anything left in the work queue now there are no workers to do it, so nobody is
+	 * left waiting for a completion.
+	*/
+	
+	WorkTask work;
+	while(work_queue.pop(work))
+	{
+		work();
+	}
+	
+	work_signalled = false;
+	
 	l.lock();
 	worker_pool = NULL;
 	
+	CancelWaitableTimer(timer_event);
+	timer_event_due = 0;
+	
+	timers.clear();
+	coalesce_timer_armed = false;
+	stats_timer_armed    = false;
+	keepalive_timer_armed = false;
+	
 	destroyed_groups.clear();
 	
 	WSACleanup();
 	
 	state = STATE_NEW;
 	
+	publish_session();
+	
 	return S_OK;
 }
 
@@ -2741,8 +3139,8 @@ HRESULT DirectPlay8Peer::DestroyPeer(CONST DPNID dpnidClient, CONST void* CONST
 	/* dpnidClient must be present in player_to_peer_id for the above to have succeeded. */
 	unsigned int peer_id = player_to_peer_id[dpnidClient];
 	
-	PacketSerialiser destroy_peer_base(DPLITE_MSGID_DESTROY_PEER);
-	destroy_peer_base.append_dword(peer->player_id);
+	std::shared_ptr<PacketSerialiser> destroy_peer_base = std::make_shared<PacketSerialiser>(DPLITE_MSGID_DESTROY_PEER);
+	destroy_peer_base->append_dword(peer->player_id);
 	
 	PacketSerialiser destroy_peer_full(DPLITE_MSGID_DESTROY_PEER);
 	destroy_peer_full.append_dword(peer->player_id);
@@ -2774,15 +3172,15 @@ HRESULT DirectPlay8Peer::DestroyPeer(CONST DPNID dpnidClient, CONST void* CONST
 
 HRESULT DirectPlay8Peer::ReturnBuffer(CONST DPNHANDLE hBufferHandle, CONST DWORD dwFlags)
 {
-	unsigned char *buffer = (unsigned char*)(hBufferHandle);
-	delete[] buffer;
+	BufferPool::Buffer *buffer = (BufferPool::Buffer*)(hBufferHandle);
+	buffer->unref();
 	
 	return S_OK;
 }
 
 HRESULT DirectPlay8Peer::GetPlayerContext(CONST DPNID dpnid,PVOID* CONST ppvPlayerContext, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	/* Only reads the session snapshot, so doesn't need the lock. */
 	
 	switch(state)
 	{
@@ -2795,16 +3193,18 @@ HRESULT DirectPlay8Peer::GetPlayerContext(CONST DPNID dpnid,PVOID* CONST ppvPlay
 		case STATE_CONNECTED:           break;
 	}
 	
-	if(dpnid == local_player_id)
+	std::shared_ptr<const SessionSnapshot> session = get_session();
+	
+	if(dpnid == session->local_player_id)
 	{
-		*ppvPlayerContext = local_player_ctx;
+		*ppvPlayerContext = session->local_player_ctx;
 		return S_OK;
 	}
 	
-	Peer *peer = get_peer_by_player_id(dpnid);
-	if(peer != NULL)
+	auto p = session->players.find(dpnid);
+	if(p != session->players.end())
 	{
-		*ppvPlayerContext = peer->player_ctx;
+		*ppvPlayerContext = p->second;
 		return S_OK;
 	}
 	
@@ -2813,7 +3213,7 @@ HRESULT DirectPlay8Peer::GetPlayerContext(CONST DPNID dpnid,PVOID* CONST ppvPlay
 
 HRESULT DirectPlay8Peer::GetGroupContext(CONST DPNID dpnid,PVOID* CONST ppvGroupContext, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	/* Only reads the session snapshot, so doesn't need the lock. */
 	
 	switch(state)
 	{
@@ -2828,10 +3228,12 @@ HRESULT DirectPlay8Peer::GetGroupContext(CONST DPNID dpnid,PVOID* CONST ppvGroup
 		case STATE_TERMINATED:          return DPNERR_CONNECTIONLOST;
 	}
 	
-	Group *group = get_group_by_id(dpnid);
-	if(group != NULL)
+	std::shared_ptr<const SessionSnapshot> session = get_session();
+	
+	auto g = session->groups.find(dpnid);
+	if(g != session->groups.end())
 	{
-		*ppvGroupContext = group->ctx;
+		*ppvGroupContext = g->second.ctx;
 		return S_OK;
 	}
 	else{
@@ -2848,33 +3250,18 @@ HRESULT DirectPlay8Peer::GetCaps(DPN_CAPS* CONST pdpCaps, CONST DWORD dwFlags)
 		return DPNERR_UNINITIALIZED;
 	}
 	
-	l.unlock();
-	
 	if(pdpCaps->dwSize == sizeof(DPN_CAPS))
 	{
-		pdpCaps->dwFlags                   = 0;
-		pdpCaps->dwConnectTimeout          = 200;
-		pdpCaps->dwConnectRetries          = 14;
-		pdpCaps->dwTimeoutUntilKeepAlive   = 25000;
+		pdpCaps->dwFlags                   = caps.dwFlags;
+		pdpCaps->dwConnectTimeout          = caps.dwConnectTimeout;
+		pdpCaps->dwConnectRetries          = caps.dwConnectRetries;
+		pdpCaps->dwTimeoutUntilKeepAlive   = caps.dwTimeoutUntilKeepAlive;
 		
 		return S_OK;
 	}
 	else if(pdpCaps->dwSize == sizeof(DPN_CAPS_EX))
 	{
-		DPN_CAPS_EX *pdpCapsEx = (DPN_CAPS_EX*)(pdpCaps);
-		
-		pdpCapsEx->dwFlags                   = 0;
-		pdpCapsEx->dwConnectTimeout          = 200;
-		pdpCapsEx->dwConnectRetries          = 14;
-		pdpCapsEx->dwTimeoutUntilKeepAlive   = 25000;
-		pdpCapsEx->dwMaxRecvMsgSize          = 0xFFFFFFFF;
-		pdpCapsEx->dwNumSendRetries          = 10;
-		pdpCapsEx->dwMaxSendRetryInterval    = 5000;
-		pdpCapsEx->dwDropThresholdRate       = 7;
-		pdpCapsEx->dwThrottleRate            = 25;
-		pdpCapsEx->dwNumHardDisconnectSends  = 3;
-		pdpCapsEx->dwMaxHardDisconnectPeriod = 500;
-		
+		*(DPN_CAPS_EX*)(pdpCaps) = caps;
 		return S_OK;
 	}
 	else{
@@ -2891,20 +3278,44 @@ HRESULT DirectPlay8Peer::SetCaps(CONST DPN_CAPS* CONST pdpCaps, CONST DWORD dwFl
 		return DPNERR_UNINITIALIZED;
 	}
 	
-	l.unlock();
-	
-	if(pdpCaps->dwSize == sizeof(DPN_CAPS) || pdpCaps->dwSize == sizeof(DPN_CAPS_EX))
+	if(pdpCaps->dwSize == sizeof(DPN_CAPS_EX))
 	{
-		/* Our protocol doesn't have all the tunables the official DirectPlay does... so
-		 * just say everything was accepted.
-		 *
-		 * TODO: Store new values for future GetSPCaps() calls?
-		*/
-		return S_OK;
+		caps = *(const DPN_CAPS_EX*)(pdpCaps);
+	}
+	else if(pdpCaps->dwSize == sizeof(DPN_CAPS))
+	{
+		caps.dwFlags                 = pdpCaps->dwFlags;
+		caps.dwConnectTimeout        = pdpCaps->dwConnectTimeout;
+		caps.dwConnectRetries        = pdpCaps->dwConnectRetries;
+		caps.dwTimeoutUntilKeepAlive = pdpCaps->dwTimeoutUntilKeepAlive;
 	}
 	else{
 		return DPNERR_INVALIDPARAM;
 	}
+	
+	caps.dwSize = sizeof(caps);
+	
+	if(caps.dwTimeoutUntilKeepAlive < MIN_KEEPALIVE_MS)
+	{
+		caps.dwTimeoutUntilKeepAlive = MIN_KEEPALIVE_MS;
+	}
+	
+	/* Our protocol doesn't have all the tunables the official DirectPlay does, the rest
+	 * are only stored for future GetCaps() calls.
+	 *
+	 * If the keepalive timer is running, restart it so the new period takes effect now
+	 * rather than after the old one.
+	*/
+	
+	if(keepalive_timer_armed)
+	{
+		timers.cancel(keepalive_timer);
+		keepalive_timer_armed = false;
+		
+		arm_keepalive_timer();
+	}
+	
+	return S_OK;
 }
 
 HRESULT DirectPlay8Peer::SetSPCaps(CONST GUID* CONST pguidSP, CONST DPN_SP_CAPS* CONST pdpspCaps, CONST DWORD dwFlags )
@@ -2934,8 +3345,21 @@ HRESULT DirectPlay8Peer::SetSPCaps(CONST GUID* CONST pguidSP, CONST DPN_SP_CAPS*
 	 * member is for legacy support. Microsoft DirectX 9.0 applications should use the
 	 * IDirectPlay8ThreadPool::SetThreadCount method to set the number of threads. The other
 	 * members of the DPN_SP_CAPS structure are get-only or ignored.
+	 *
+	 * Older applications can't know about DoWork(), so a dwNumThreads of zero is ignored
+	 * rather than stopping all the threads.
 	*/
 	
+	if(pdpspCaps->dwNumThreads != 0 && pdpspCaps->dwNumThreads != DirectPlay8ThreadPool::get_thread_count())
+	{
+		if(IOReactor::in_callback())
+		{
+			return DPNERR_NOTALLOWED;
+		}
+		
+		DirectPlay8ThreadPool::set_thread_count(pdpspCaps->dwNumThreads);
+	}
+	
 	return S_OK;
 }
 
@@ -2967,7 +3391,7 @@ HRESULT DirectPlay8Peer::GetSPCaps(CONST GUID* CONST pguidSP, DPN_SP_CAPS* CONST
 	                   | DPNSPCAPS_SUPPORTSALLADAPTERS
 	                   | DPNSPCAPS_SUPPORTSTHREADPOOL;
 	
-	pdpspCaps->dwNumThreads               = 3;
+	pdpspCaps->dwNumThreads               = DirectPlay8ThreadPool::get_thread_count();
 	pdpspCaps->dwDefaultEnumCount         = DEFAULT_ENUM_COUNT;
 	pdpspCaps->dwDefaultEnumRetryInterval = DEFAULT_ENUM_INTERVAL;
 	pdpspCaps->dwDefaultEnumTimeout       = DEFAULT_ENUM_TIMEOUT;
@@ -2980,7 +3404,42 @@ HRESULT DirectPlay8Peer::GetSPCaps(CONST GUID* CONST pguidSP, DPN_SP_CAPS* CONST
 
 HRESULT DirectPlay8Peer::GetConnectionInfo(CONST DPNID dpnid, DPN_CONNECTION_INFO* CONST pdpConnectionInfo, CONST DWORD dwFlags)
 {
-	UNIMPLEMENTED("DirectPlay8Peer::GetConnectionInfo");
+	std::unique_lock<std::mutex> l(lock);
+	
+	switch(state)
+	{
+		case STATE_NEW:                 return DPNERR_UNINITIALIZED;
+		case STATE_INITIALISED:         return DPNERR_NOCONNECTION;
+		case STATE_HOSTING:             break;
+		case STATE_CONNECTING_TO_HOST:  return DPNERR_NOCONNECTION;
+		case STATE_CONNECTING_TO_PEERS: return DPNERR_NOCONNECTION;
+		case STATE_CONNECT_FAILED:      return DPNERR_NOCONNECTION;
+		case STATE_CONNECTED:           break;
+		case STATE_CLOSING:             return DPNERR_NOCONNECTION;
+		case STATE_TERMINATED:          return DPNERR_NOCONNECTION;
+	}
+	
+	if(dwFlags != 0)
+	{
+		return DPNERR_INVALIDFLAGS;
+	}
+	
+	if(pdpConnectionInfo == NULL || pdpConnectionInfo->dwSize != sizeof(DPN_CONNECTION_INFO))
+	{
+		return DPNERR_INVALIDPARAM;
+	}
+	
+	/* There is no connection to the local player or to groups. */
+	
+	Peer *peer = get_peer_by_player_id(dpnid);
+	if(peer == NULL)
+	{
+		return DPNERR_INVALIDPLAYER;
+	}
+	
+	peer->stats.get_info(pdpConnectionInfo);
+	
+	return S_OK;
 }
 
 HRESULT DirectPlay8Peer::RegisterLobby(CONST DPNHANDLE dpnHandle, struct IDirectPlay8LobbiedApplication* CONST pIDP8LobbiedApplication, CONST DWORD dwFlags)
@@ -3019,8 +3478,8 @@ HRESULT DirectPlay8Peer::TerminateSession(void* CONST pvTerminateData, CONST DWO
 	 * be rather horrible.
 	*/
 	
-	PacketSerialiser terminate_session(DPLITE_MSGID_TERMINATE_SESSION);
-	terminate_session.append_data(pvTerminateData, dwTerminateDataSize);
+	std::shared_ptr<PacketSerialiser> terminate_session = std::make_shared<PacketSerialiser>(DPLITE_MSGID_TERMINATE_SESSION);
+	terminate_session->append_data(pvTerminateData, dwTerminateDataSize);
 	
 	std::list< std::pair<DPNID, void*> > closing_peers;
 	std::list<unsigned int> destroy_peers;
@@ -3035,6 +3494,8 @@ HRESULT DirectPlay8Peer::TerminateSession(void* CONST pvTerminateData, CONST DWO
 			peer->sq.send(SendQueue::SEND_PRI_HIGH, terminate_session, NULL, [](std::unique_lock<std::mutex> &l, HRESULT result){});
 			peer->state = Peer::PS_CLOSING;
 			
+			publish_session();
+			
 			closing_peers.push_back(std::make_pair(peer->player_id, peer->player_ctx));
 		}
 		else if(peer->state == Peer::PS_CLOSING)
@@ -3123,6 +3584,71 @@ DirectPlay8Peer::Group *DirectPlay8Peer::get_group_by_id(DPNID group_id)
 	}
 }
 
+/* Builds a new SessionSnapshot from the current state of the session and publishes it for
+ * lock-free readers. Must be called with the lock held after changing the players or
+ * groups in the session, or their contexts.
+*/
+void DirectPlay8Peer::publish_session()
+{
+	std::shared_ptr<SessionSnapshot> snapshot = std::make_shared<SessionSnapshot>();
+	
+	snapshot->local_player_id  = local_player_id;
+	snapshot->local_player_ctx = local_player_ctx;
+	
+	for(auto p = player_to_peer_id.begin(); p != player_to_peer_id.end(); ++p)
+	{
+		Peer *peer = get_peer_by_peer_id(p->second);
+		if(peer != NULL)
+		{
+			snapshot->players[p->first]         = peer->player_ctx;
+			snapshot->player_peer_ids[p->first] = p->second;
+		}
+	}
+	
+	for(auto p = peers.begin(); p != peers.end(); ++p)
+	{
+		Peer *peer = p->second;
+		
+		if(peer->state == Peer::PS_CONNECTED)
+		{
+			snapshot->connected_players.push_back(peer->player_id);
+			snapshot->connected_peer_ids.push_back(p->first);
+		}
+	}
+	
+	for(auto g = groups.begin(); g != groups.end(); ++g)
+	{
+		SessionSnapshot::GroupSnapshot &gs = snapshot->groups[g->first];
+		
+		gs.ctx = g->second.ctx;
+		gs.player_ids.assign(g->second.player_ids.begin(), g->second.player_ids.end());
+		gs.local_member = false;
+		
+		for(auto m = g->second.player_ids.begin(); m != g->second.player_ids.end(); ++m)
+		{
+			if(*m == local_player_id)
+			{
+				gs.local_member = true;
+			}
+			else{
+				/* Members whose peer has already gone can't be sent to. */
+				auto pp = snapshot->player_peer_ids.find(*m);
+				if(pp != snapshot->player_peer_ids.end())
+				{
+					gs.peer_ids.push_back(pp->second);
+				}
+			}
+		}
+	}
+	
+	std::atomic_store(&session, std::shared_ptr<const SessionSnapshot>(snapshot));
+}
+
+std::shared_ptr<const DirectPlay8Peer::SessionSnapshot> DirectPlay8Peer::get_session() const
+{
+	return std::atomic_load(&session);
+}
+
 void DirectPlay8Peer::handle_udp_socket_event()
 {
 	std::unique_lock<std::mutex> l(lock);
@@ -3135,20 +3661,31 @@ void DirectPlay8Peer::handle_udp_socket_event()
 	struct sockaddr_in from_addr;
 	int fa_len = sizeof(from_addr);
 	
-	unsigned char recv_buf[MAX_PACKET_SIZE];
+	/* Datagrams are received into a pool buffer so that messages in them can be passed to
+	 * the application without copying, like those received over TCP. Nothing we accept
+	 * on this socket is anywhere near as large as a buffer from the pool.
+	*/
+	BufferPool::Buffer *recv_buf = recv_pool.get(BufferPool::MIN_SIZE);
 	
-	int r = recvfrom(udp_socket, (char*)(recv_buf), sizeof(recv_buf), 0, (struct sockaddr*)(&from_addr), &fa_len);
+	int r = recvfrom(udp_socket, (char*)(recv_buf->data()), recv_buf->size(), 0, (struct sockaddr*)(&from_addr), &fa_len);
 	if(r > 0)
 	{
+		if(capture_enabled())
+		{
+			capture_frame(capture_instance, CAPTURE_NO_PEER, CAPTURE_DIR_IN, CAPTURE_TRANSPORT_UDP,
+				from_addr.sin_addr.s_addr, ntohs(from_addr.sin_port), recv_buf->data(), r);
+		}
+		
 		/* Process message */
 		std::unique_ptr<PacketDeserialiser> pd;
 		
 		try {
-			pd.reset(new PacketDeserialiser(recv_buf, r));
+			pd.reset(new PacketDeserialiser(recv_buf->data(), r));
 		}
 		catch(const PacketDeserialiser::Error &)
 		{
 			/* Malformed packet received */
+			recv_buf->unref();
 			return;
 		}
 		
@@ -3160,12 +3697,18 @@ void DirectPlay8Peer::handle_udp_socket_event()
 				break;
 			}
 			
+			case DPLITE_MSGID_DATAGRAM:
+			{
+				handle_datagram(l, *pd, r, &from_addr, recv_buf);
+				break;
+			}
+			
 			default:
 			{
 				char s_ip[16];
 				inet_ntop(AF_INET, &(from_addr.sin_addr), s_ip, sizeof(s_ip));
 				
-				log_printf(
+				LOG_WARN(LOG_CAT_DISPATCH,
 					"Unexpected message type %u received on udp_socket from %s",
 					(unsigned)(pd->packet_type()), s_ip);
 				
@@ -3174,7 +3717,12 @@ void DirectPlay8Peer::handle_udp_socket_event()
 		}
 	}
 	
-	io_udp_send(l);
+	recv_buf->unref();
+	
+	if(udp_socket != -1)
+	{
+		io_udp_send(l);
+	}
 }
 
 void DirectPlay8Peer::handle_other_socket_event()
@@ -3215,7 +3763,7 @@ void DirectPlay8Peer::handle_other_socket_event()
 					char s_ip[16];
 					inet_ntop(AF_INET, &(from_addr.sin_addr), s_ip, sizeof(s_ip));
 					
-					log_printf(
+					LOG_WARN(LOG_CAT_ENUM,
 						"Unexpected message type %u received on discovery_socket from %s",
 						(unsigned)(pd->packet_type()), s_ip);
 					
@@ -3227,126 +3775,440 @@ void DirectPlay8Peer::handle_other_socket_event()
 	peer_accept(l);
 }
 
-void DirectPlay8Peer::queue_work(const std::function<void()> &work)
+void DirectPlay8Peer::queue_work(WorkTask &&work)
+{
+	work_queue.push(std::move(work));
+	
+	if(!work_signalled.exchange(true))
+	{
+		SetEvent(work_ready);
+	}
+}
+
+/* Runs work in the calling thread (releasing the lock while it does) if run_now is set,
+ * otherwise queues it for a worker. DPN*_SYNC calls which raise local messages run them
+ * now, since they are going to block until they have been delivered anyway and may have
+ * been called from within handle_work() by the only thread which could deliver them.
+*/
+void DirectPlay8Peer::run_or_queue_work(std::unique_lock<std::mutex> &l, bool run_now, WorkTask &&work)
 {
-	work_queue.push(work);
-	SetEvent(work_ready);
+	if(run_now)
+	{
+		l.unlock();
+		work();
+		l.lock();
+	}
+	else{
+		queue_work(std::move(work));
+	}
 }
 
 void DirectPlay8Peer::handle_work()
 {
-	std::unique_lock<std::mutex> l(lock);
+	/* Clear work_signalled before looking at the queue, so anything queued after this point
+	 * will signal work_ready again rather than possibly being missed.
+	*/
+	work_signalled = false;
 	
-	if(!work_queue.empty())
+	WorkTask work;
+	
+	for(unsigned int i = 0; i < WORK_BATCH_SIZE; ++i)
 	{
-		std::function<void()> work = work_queue.front();
-		work_queue.pop();
-		
-		if(!work_queue.empty())
+		if(!work_queue.pop(work))
 		{
-			/* Wake up another thread, in case we are heavily loaded and the pool isn't
-			 * keeping up with the events from queue_work()
-			*/
-			SetEvent(work_ready);
+			return;
 		}
 		
-		l.unlock();
-		
 		work();
 	}
+	
+	if(!work_queue.empty())
+	{
+		/* Still more to do, but give other handles a turn first. */
+		work_signalled = true;
+		SetEvent(work_ready);
+	}
 }
 
-void DirectPlay8Peer::io_peer_triggered(unsigned int peer_id)
+/* Schedules a callback to be run with the lock held at the given GetTickCount64() time.
+ * Must be called with the lock held.
+*/
+TimerWheel::TimerID DirectPlay8Peer::schedule_timer(uint64_t when, const TimerWheel::Callback &callback)
 {
-	std::unique_lock<std::mutex> l(lock);
+	TimerWheel::TimerID id = timers.schedule(when, callback);
+	update_timer_event();
 	
-	Peer *peer = get_peer_by_peer_id(peer_id);
-	if(peer == NULL)
+	return id;
+}
+
+/* Sets timer_event for the next time the timer wheel needs advancing, if that is earlier
+ * than it is already set for.
+*/
+void DirectPlay8Peer::update_timer_event()
+{
+	uint64_t next;
+	if(!timers.next_expiry(&next) || (timer_event_due != 0 && timer_event_due <= next))
 	{
-		/* The peer has gone away since this event was raised. Discard. */
 		return;
 	}
 	
-	if(peer->state == Peer::PS_CONNECTING_HOST)
-	{
-		assert(state == STATE_CONNECTING_TO_HOST);
-		io_peer_connected(l, peer_id);
-	}
-	else if(peer->state == Peer::PS_CONNECTING_PEER)
+	uint64_t now = GetTickCount64();
+	uint64_t wait_ms = (next > now ? next - now : 1);
+	
+	/* Negative due time is relative, in 100ns intervals. */
+	LARGE_INTEGER due;
+	due.QuadPart = -((LONGLONG)(wait_ms) * 10000);
+	
+	if(SetWaitableTimer(timer_event, &due, 0, NULL, NULL, FALSE))
 	{
-		assert(state == STATE_CONNECTING_TO_PEERS);
-		io_peer_connected(l, peer_id);
+		timer_event_due = next;
 	}
 	else{
-		io_peer_send(l, peer_id);
-		io_peer_recv(l, peer_id);
+		DWORD err = GetLastError();
+		LOG_ERROR(LOG_CAT_GENERAL, "SetWaitableTimer: %s", win_strerror(err).c_str());
 	}
 }
 
-void DirectPlay8Peer::io_udp_send(std::unique_lock<std::mutex> &l)
+void DirectPlay8Peer::handle_timer_event()
 {
-	SendQueue::SendOp *sqop;
+	std::unique_lock<std::mutex> l(lock);
 	
-	while(udp_socket != -1 && (sqop = udp_sq.get_pending()) != NULL)
+	timer_event_due = 0;
+	
+	std::vector<TimerWheel::Callback> expired = timers.advance(GetTickCount64());
+	
+	for(auto t = expired.begin(); t != expired.end(); ++t)
 	{
-		std::pair<const void*, size_t>            data = sqop->get_data();
-		std::pair<const struct sockaddr*, size_t> addr = sqop->get_dest_addr();
+		(*t)(l);
+	}
+	
+	update_timer_event();
+}
+
+/* Schedules the failure of any SendOps with the given handle which are still queued to any
+ * of the given peers (or in udp_sq) once timeout milliseconds have passed. SendOps which have
+ * started sending are left to finish.
+*/
+void DirectPlay8Peer::schedule_send_timeout(DPNHANDLE handle, const std::list<Peer*> &targets, DWORD timeout)
+{
+	std::vector<DPNID> player_ids;
+	player_ids.reserve(targets.size());
+	
+	for(auto t = targets.begin(); t != targets.end(); ++t)
+	{
+		player_ids.push_back((*t)->player_id);
+	}
+	
+	schedule_timer(GetTickCount64() + timeout, [this, handle, player_ids](std::unique_lock<std::mutex> &l)
+	{
+		SendQueue::SendOp *sqop;
 		
-		int s = sendto(udp_socket, (const char*)(data.first), data.second, 0, addr.first, addr.second);
-		if(s == -1)
+		while((sqop = udp_sq.remove_queued_by_handle(handle)) != NULL)
 		{
-			DWORD err = WSAGetLastError();
+			sqop->invoke_callback(l, DPNERR_TIMEDOUT);
+			sqop->release();
+		}
+		
+		for(auto p = player_ids.begin(); p != player_ids.end(); ++p)
+		{
+			/* The peer may go away while we are in a callback. */
 			
-			if(err == WSAEWOULDBLOCK)
+			Peer *peer;
+			while((peer = get_peer_by_player_id(*p)) != NULL && (sqop = peer->sq.remove_queued_by_handle(handle)) != NULL)
 			{
-				/* Socket send buffer is full. */
-				return;
-			}
-			else{
-				/* TODO: LOG ME */
+				sqop->invoke_callback(l, DPNERR_TIMEDOUT);
+				sqop->release();
 			}
 		}
-		
-		udp_sq.pop_pending(sqop);
-		
-		/* Wake up another worker to continue dealing with this socket in case we wind up
-		 * blocking for a long time in application code within the callback.
-		*/
-		SetEvent(udp_socket_event);
-		
-		/* TODO: More specific error codes */
-		sqop->invoke_callback(l, (s < 0 ? DPNERR_GENERIC : S_OK));
-		
-		delete sqop;
-	}
+	});
 }
 
-void DirectPlay8Peer::io_peer_connected(std::unique_lock<std::mutex> &l, unsigned int peer_id)
+/* Schedules a flush of held messages after COALESCE_DELAY_MS, unless one is already
+ * pending. Must be called with the lock held.
+*/
+void DirectPlay8Peer::arm_coalesce_timer()
 {
-	Peer *peer = get_peer_by_peer_id(peer_id);
-	assert(peer != NULL);
+	if(coalesce_timer_armed)
+	{
+		return;
+	}
 	
-	int error;
-	int esize = sizeof(error);
+	coalesce_timer_armed = true;
 	
-	if(getsockopt(peer->sock, SOL_SOCKET, SO_ERROR, (char*)(&error), &esize) != 0)
+	schedule_timer(GetTickCount64() + COALESCE_DELAY_MS, [this](std::unique_lock<std::mutex> &l)
 	{
-		log_printf("getsockopt(level = SOL_SOCKET, optname = SO_ERROR) failed");
-		connect_fail(l, DPNERR_GENERIC, NULL, 0);
+		coalesce_timer_armed = false;
+		
+		for(auto p = peers.begin(); p != peers.end(); ++p)
+		{
+			p->second->sq.flush();
+		}
+	});
+}
+
+/* Pings every connected peer and updates their throughput every STATS_INTERVAL_MS for as long
+ * as we are in a session.
+*/
+void DirectPlay8Peer::arm_stats_timer()
+{
+	if(stats_timer_armed)
+	{
+		return;
 	}
 	
-	if(error == 0)
+	stats_timer_armed = true;
+	
+	schedule_timer(GetTickCount64() + STATS_INTERVAL_MS, [this](std::unique_lock<std::mutex> &l)
 	{
-		/* TCP connection established. */
+		stats_timer_armed = false;
 		
-		log_printf("peer_id %u TCP connection established", peer_id);
-		
-		if(peer->state == Peer::PS_CONNECTING_HOST)
+		if(state != STATE_HOSTING && state != STATE_CONNECTED)
 		{
-			PacketSerialiser connect_host(DPLITE_MSGID_CONNECT_HOST);
-			
-			if(instance_guid != GUID_NULL)
-			{
+			return;
+		}
+		
+		uint64_t now = GetTickCount64();
+		
+		PacketSerialiser ping(DPLITE_MSGID_PING);
+		ping.append_dword(GetTickCount());
+		
+		std::shared_ptr<const PacketSerialiser> ping_p = std::make_shared<const PacketSerialiser>(std::move(ping));
+		
+		for(auto p = peers.begin(); p != peers.end(); ++p)
+		{
+			Peer *peer = p->second;
+			
+			peer->stats.update(now);
+			
+			if(peer->state == Peer::PS_CONNECTED)
+			{
+				peer->sq.send(SendQueue::SEND_PRI_HIGH, ping_p, NULL,
+					[](std::unique_lock<std::mutex> &l, HRESULT result) {});
+			}
+		}
+		
+		arm_stats_timer();
+	});
+}
+
+/* Checks every connected peer KEEPALIVE_CHECKS_PER_PERIOD times per keepalive period for as
+ * long as we are in a session. Any peer we haven't heard from for KEEPALIVE_DEAD_PERIODS
+ * periods is destroyed.
+ *
+ * The pings sent by arm_stats_timer() normally keep the connection alive on their own, since
+ * their replies are what we hear from an otherwise idle peer. A period shorter than
+ * STATS_INTERVAL_MS would outrun them though, so a DPLITE_MSGID_PING is also sent early to
+ * any peer we haven't sent anything to for a whole period.
+*/
+void DirectPlay8Peer::arm_keepalive_timer()
+{
+	if(keepalive_timer_armed)
+	{
+		return;
+	}
+	
+	keepalive_timer_armed = true;
+	
+	DWORD interval = caps.dwTimeoutUntilKeepAlive / KEEPALIVE_CHECKS_PER_PERIOD;
+	
+	keepalive_timer = schedule_timer(GetTickCount64() + interval, [this](std::unique_lock<std::mutex> &l)
+	{
+		keepalive_timer_armed = false;
+		
+		if(state != STATE_HOSTING && state != STATE_CONNECTED)
+		{
+			return;
+		}
+		
+		uint64_t now     = GetTickCount64();
+		uint64_t period  = caps.dwTimeoutUntilKeepAlive;
+		uint64_t dead_at = period * KEEPALIVE_DEAD_PERIODS;
+		
+		std::vector<unsigned int> dead_peers;
+		
+		for(auto p = peers.begin(); p != peers.end(); ++p)
+		{
+			Peer *peer = p->second;
+			
+			if(peer->state != Peer::PS_CONNECTED)
+			{
+				continue;
+			}
+			
+			if((now - peer->last_recv_time) >= dead_at)
+			{
+				dead_peers.push_back(p->first);
+			}
+			else if((now - peer->last_send_time) >= period)
+			{
+				/* Count the ping as sent now, so we don't queue up more of them if the
+				 * socket is backed up.
+				*/
+				peer->last_send_time = now;
+				
+				PacketSerialiser ping(DPLITE_MSGID_PING);
+				ping.append_dword(GetTickCount());
+				
+				peer->sq.send(SendQueue::SEND_PRI_HIGH, ping, NULL,
+					[](std::unique_lock<std::mutex> &l, HRESULT result) {});
+			}
+		}
+		
+		for(auto d = dead_peers.begin(); d != dead_peers.end(); ++d)
+		{
+			if(get_peer_by_peer_id(*d) == NULL)
+			{
+				/* Destroyed along with an earlier one. */
+				continue;
+			}
+			
+			LOG_WARN(LOG_CAT_SOCKETS, "Nothing received from peer %u for %u ms, dropping connection",
+				*d, (unsigned)(dead_at));
+			
+			peer_destroy(l, *d, DPNERR_CONNECTIONLOST, DPNDESTROYPLAYERREASON_CONNECTIONLOST);
+		}
+		
+		if(state == STATE_HOSTING || state == STATE_CONNECTED)
+		{
+			arm_keepalive_timer();
+		}
+	});
+}
+
+void DirectPlay8Peer::io_peer_triggered(unsigned int peer_id)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Peer *peer = get_peer_by_peer_id(peer_id);
+	if(peer == NULL)
+	{
+		/* The peer has gone away since this event was raised. Discard. */
+		return;
+	}
+	
+	if(peer->state == Peer::PS_CONNECTING_HOST)
+	{
+		assert(state == STATE_CONNECTING_TO_HOST);
+		io_peer_connected(l, peer_id);
+	}
+	else if(peer->state == Peer::PS_CONNECTING_PEER)
+	{
+		assert(state == STATE_CONNECTING_TO_PEERS);
+		io_peer_connected(l, peer_id);
+	}
+	else{
+		io_peer_send(l, peer_id);
+		io_peer_recv(l, peer_id);
+	}
+}
+
+void DirectPlay8Peer::io_udp_send(std::unique_lock<std::mutex> &l)
+{
+	SendQueue::SendOp *sqop;
+	
+	while(udp_socket != -1 && (sqop = udp_sq.get_pending()) != NULL)
+	{
+		WSABUF bufs[MAX_SEND_BUFS];
+		size_t n_bufs = sqop->get_pending_data(bufs, MAX_SEND_BUFS);
+		
+		size_t gathered = 0;
+		for(size_t i = 0; i < n_bufs; ++i)
+		{
+			gathered += bufs[i].len;
+		}
+		
+		/* Datagrams can't be sent in pieces, so if the message is made up of more
+		 * buffers than a single WSASendTo() call can take (e.g. a DPNSEND_NOCOPY send
+		 * with lots of DPN_BUFFER_DESCs) it has to be copied into one first.
+		*/
+		
+		std::vector<unsigned char> flat;
+		
+		if(gathered != sqop->get_pending_size())
+		{
+			const std::vector< std::pair<const void*, size_t> > &segments = sqop->get_segments();
+			
+			flat.reserve(sqop->get_data_size());
+			
+			for(auto seg = segments.begin(); seg != segments.end(); ++seg)
+			{
+				flat.insert(flat.end(), (const unsigned char*)(seg->first), (const unsigned char*)(seg->first) + seg->second);
+			}
+			
+			assert(flat.size() == sqop->get_pending_size());
+			
+			bufs[0].buf = (char*)(flat.data());
+			bufs[0].len = flat.size();
+			n_bufs = 1;
+		}
+		
+		std::pair<const struct sockaddr*, size_t> addr = sqop->get_dest_addr();
+		
+		DWORD sent;
+		int s = WSASendTo(udp_socket, bufs, n_bufs, &sent, 0, addr.first, addr.second, NULL, NULL);
+		if(s == SOCKET_ERROR)
+		{
+			DWORD err = WSAGetLastError();
+			
+			if(err == WSAEWOULDBLOCK)
+			{
+				/* Socket send buffer is full. */
+				return;
+			}
+			else{
+				/* TODO: LOG ME */
+			}
+		}
+		else if(capture_enabled())
+		{
+			/* udp_sq doesn't know which peer each datagram is for. */
+			
+			const struct sockaddr_in *to_addr = (const struct sockaddr_in*)(addr.first);
+			
+			capture_frame(capture_instance, CAPTURE_NO_PEER, CAPTURE_DIR_OUT, CAPTURE_TRANSPORT_UDP,
+				to_addr->sin_addr.s_addr, ntohs(to_addr->sin_port), sqop->get_segments());
+		}
+		
+		udp_sq.pop_pending(sqop);
+		
+		/* Wake up another worker to continue dealing with this socket in case we wind up
+		 * blocking for a long time in application code within the callback.
+		*/
+		SetEvent(udp_socket_event);
+		
+		/* TODO: More specific error codes */
+		sqop->invoke_callback(l, (s < 0 ? DPNERR_GENERIC : S_OK));
+		
+		sqop->release();
+	}
+}
+
+void DirectPlay8Peer::io_peer_connected(std::unique_lock<std::mutex> &l, unsigned int peer_id)
+{
+	Peer *peer = get_peer_by_peer_id(peer_id);
+	assert(peer != NULL);
+	
+	int error;
+	int esize = sizeof(error);
+	
+	if(getsockopt(peer->sock, SOL_SOCKET, SO_ERROR, (char*)(&error), &esize) != 0)
+	{
+		LOG_ERROR(LOG_CAT_SOCKETS, "getsockopt(level = SOL_SOCKET, optname = SO_ERROR) failed");
+		connect_fail(l, DPNERR_GENERIC, NULL, 0);
+	}
+	
+	if(error == 0)
+	{
+		/* TCP connection established. */
+		
+		LOG_INFO(LOG_CAT_SOCKETS, "peer_id %u TCP connection established", peer_id);
+		
+		if(peer->state == Peer::PS_CONNECTING_HOST)
+		{
+			PacketSerialiser connect_host(DPLITE_MSGID_CONNECT_HOST);
+			
+			if(instance_guid != GUID_NULL)
+			{
 				connect_host.append_guid(instance_guid);
 			}
 			else{
@@ -3404,7 +4266,7 @@ void DirectPlay8Peer::io_peer_connected(std::unique_lock<std::mutex> &l, unsigne
 	else{
 		/* TCP connection failed. */
 		
-		log_printf("peer_id %u TCP connection failed: %s", peer_id, win_strerror(error).c_str());
+		LOG_WARN(LOG_CAT_SOCKETS, "peer_id %u TCP connection failed: %s", peer_id, win_strerror(error).c_str());
 		
 		if(peer->state == Peer::PS_CONNECTING_HOST)
 		{
@@ -3419,55 +4281,159 @@ void DirectPlay8Peer::io_peer_connected(std::unique_lock<std::mutex> &l, unsigne
 
 void DirectPlay8Peer::io_peer_send(std::unique_lock<std::mutex> &l, unsigned int peer_id)
 {
-	Peer *peer;
+	Peer *peer = get_peer_by_peer_id(peer_id);
 	SendQueue::SendOp *sqop;
 	
-	while((peer = get_peer_by_peer_id(peer_id)) != NULL)
+	if(peer == NULL)
+	{
+		return;
+	}
+	
+	if(peer->send_busy)
+	{
+		/* Another thread is already sending to this peer, it will pick up anything
+		 * which has been queued since it started.
+		*/
+		peer->send_again = true;
+		return;
+	}
+	
+	peer->send_busy = true;
+	
+	/* Stop if peer_destroy() has started, it is waiting for us to finish. */
+	while((peer = get_peer_by_peer_id(peer_id)) != NULL && !peer->dying)
 	{
 		if((sqop = peer->sq.get_pending()) != NULL)
 		{
-			std::pair<const void*, size_t> d = sqop->get_pending_data();
+			/* Gather as many queued messages as we can into one call, in the order
+			 * the queue gives them to us. The payloads are gathered from the
+			 * application's buffers if they weren't copied when the messages were
+			 * queued.
+			*/
 			
-			int s = send(peer->sock, (const char*)(d.first), d.second, 0);
+			WSABUF bufs[MAX_SEND_BUFS];
+			size_t n_bufs = 0;
+			size_t batch_size = 0;
 			
-			if(s < 0)
+			/* Every SendOp has at least one buffer, so there can't be more of
+			 * them than MAX_SEND_BUFS.
+			*/
+			SendQueue::SendOp *sqops[MAX_SEND_BUFS];
+			size_t n_sqops = 0;
+			
+			while(1)
 			{
-				DWORD err = WSAGetLastError();
+				sqops[n_sqops++] = sqop;
+				
+				n_bufs     += sqop->get_pending_data(bufs + n_bufs, MAX_SEND_BUFS - n_bufs);
+				batch_size += sqop->get_pending_size();
 				
+				if(n_bufs == MAX_SEND_BUFS || batch_size >= MAX_SEND_BATCH
+					|| (sqop = peer->sq.get_next_pending(sqop)) == NULL)
+				{
+					break;
+				}
+			}
+			
+			/* The lock is released for the duration of the call so that sending to
+			 * other peers isn't held up behind it. Nothing else can touch the pending
+			 * SendOps at the head of the queue, and peer_destroy() waits for io_busy
+			 * to drop before closing the socket.
+			*/
+			
+			int sock = peer->sock;
+			++(peer->io_busy);
+			
+			peer->send_again = false;
+			
+			l.unlock();
+			
+			DWORD s;
+			int sr = WSASend(sock, bufs, n_bufs, &s, 0, NULL, NULL);
+			DWORD err = WSAGetLastError();
+			
+			l.lock();
+			
+			if(--(peer->io_busy) == 0)
+			{
+				peer_io_done.notify_all();
+			}
+			
+			if(sr != 0)
+			{
 				if(err == WSAEWOULDBLOCK)
 				{
+					if(peer->send_again)
+					{
+						/* Space may have become available since the call failed
+						 * and its FD_WRITE was consumed by a thread we turned away.
+						*/
+						continue;
+					}
+					
 					/* Send buffer full. Try again later. */
 					break;
 				}
 				else{
 					/* Write error. */
 					
-					log_printf("Write error on peer %u: %s", peer_id, win_strerror(err).c_str());
-					log_printf("Closing connection");
+					LOG_WARN(LOG_CAT_SOCKETS, "Write error on peer %u: %s", peer_id, win_strerror(err).c_str());
+					LOG_WARN(LOG_CAT_SOCKETS, "Closing connection");
 					
 					peer_destroy(l, peer_id, DPNERR_CONNECTIONLOST, DPNDESTROYPLAYERREASON_CONNECTIONLOST);
 					return;
 				}
 			}
 			
-			sqop->inc_sent_data(s);
+			LOG_TRACE(LOG_CAT_SOCKETS, "Wrote %u bytes from %u messages to peer %u",
+				(unsigned)(s), (unsigned)(n_sqops), peer_id);
+			
+			/* Pop every message which was sent completely, the first one which wasn't
+			 * (if any) stays at the head of the queue for the next call.
+			*/
+			
+			size_t n_done = 0;
 			
-			if(s == d.second)
+			for(auto o = sqops; o != sqops + n_sqops && s > 0; ++o)
 			{
-				peer->sq.pop_pending(sqop);
+				size_t o_sent = std::min<size_t>(s, (*o)->get_pending_size());
 				
+				(*o)->inc_sent_data(o_sent);
+				s -= o_sent;
+				
+				if((*o)->get_pending_size() == 0)
+				{
+					if(capture_enabled())
+					{
+						capture_frame(capture_instance, peer_id, CAPTURE_DIR_OUT, CAPTURE_TRANSPORT_TCP,
+							peer->ip, peer->port, (*o)->get_segments());
+					}
+					
+					peer->stats.packet_sent(true, (*o)->get_data_size());
+					peer->last_send_time = GetTickCount64();
+					
+					peer->sq.pop_pending(*o);
+					++n_done;
+				}
+			}
+			
+			if(n_done > 0)
+			{
 				if(peer->sq.get_pending() != NULL)
 				{
-					/* There is another message in the send queue.
+					/* There are more messages in the send queue.
 					 *
-					 * Wake another worker to dispatch it in case we have to
+					 * Wake another worker to dispatch them in case we have to
 					 * block within the application for a while.
 					*/
 					SetEvent(peer->event);
 				}
 				
-				sqop->invoke_callback(l, S_OK);
-				delete sqop;
+				for(size_t i = 0; i < n_done; ++i)
+				{
+					sqops[i]->invoke_callback(l, S_OK);
+					sqops[i]->release();
+				}
 			}
 		}
 		else{
@@ -3483,9 +4449,9 @@ void DirectPlay8Peer::io_peer_send(std::unique_lock<std::mutex> &l, unsigned int
 				if(shutdown(peer->sock, SD_SEND) != 0)
 				{
 					DWORD err = WSAGetLastError();
-					log_printf(
+					LOG_WARN(LOG_CAT_SOCKETS,
 						"shutdown(SD_SEND) on peer %u failed: %s",
-						peer_id, win_strerror(err));
+						peer_id, win_strerror(err).c_str());
 					
 					peer_destroy(l, peer_id, DPNERR_CONNECTIONLOST, DPNDESTROYPLAYERREASON_CONNECTIONLOST);
 					return;
@@ -3497,6 +4463,11 @@ void DirectPlay8Peer::io_peer_send(std::unique_lock<std::mutex> &l, unsigned int
 			break;
 		}
 	}
+	
+	if(peer != NULL)
+	{
+		peer->send_busy = false;
+	}
 }
 
 void DirectPlay8Peer::io_peer_recv(std::unique_lock<std::mutex> &l, unsigned int peer_id)
@@ -3504,40 +4475,75 @@ void DirectPlay8Peer::io_peer_recv(std::unique_lock<std::mutex> &l, unsigned int
 	Peer *peer;
 	
 	bool rb_claimed = false;
+	bool events_disabled = false;
 	
-	while((peer = get_peer_by_peer_id(peer_id)) != NULL)
+	/* Stop if peer_destroy() has started, it is waiting for us to finish. */
+	while((peer = get_peer_by_peer_id(peer_id)) != NULL && !peer->dying)
 	{
-		if(!rb_claimed && peer->recv_busy)
+		if(!rb_claimed)
 		{
-			/* Another thread is already processing data from this socket.
-			 *
-			 * Only one thread at a time is allowed to handle reads, even when the
-			 * other thread is in the application callback, so that the order of
-			 * messages is preserved.
-			*/
-			return;
+			if(peer->recv_busy)
+			{
+				/* Another thread is already processing data from this socket.
+				 *
+				 * Only one thread at a time is allowed to handle reads, even when the
+				 * other thread is in the application callback, so that the order of
+				 * messages is preserved.
+				*/
+				peer->recv_again = true;
+				return;
+			}
+			
+			peer->recv_busy = true;
+			rb_claimed      = true;
 		}
 		
-		int r = recv(peer->sock, (char*)(peer->recv_buf) + peer->recv_buf_cur, sizeof(peer->recv_buf) - peer->recv_buf_cur, 0);
+		std::pair<unsigned char*, size_t> space = peer->recv_framer.write_space();
+		
+		/* Read without holding the lock, the receive buffer belongs to us while we
+		 * have recv_busy and peer_destroy() waits for io_busy to drop.
+		*/
+		
+		int sock = peer->sock;
+		++(peer->io_busy);
+		
+		peer->recv_again = false;
+		
+		l.unlock();
+		
+		int r = recv(sock, (char*)(space.first), space.second, 0);
 		DWORD err = WSAGetLastError();
 		
+		l.lock();
+		
+		if(--(peer->io_busy) == 0)
+		{
+			peer_io_done.notify_all();
+		}
+		
 		if(r < 0 && err == WSAEWOULDBLOCK)
 		{
+			if(peer->recv_again)
+			{
+				/* Data may have arrived since the call failed and its FD_READ was
+				 * consumed by a thread we turned away.
+				*/
+				continue;
+			}
+			
 			/* Nothing to read. */
 			break;
 		}
 		
-		if(!rb_claimed)
+		if(!events_disabled)
 		{
-			/* No other thread is processing data from this peer, we shall
-			 * claim the throne and temporarily disable FD_READ events from it
-			 * to avoid other workers spinning against the recv_busy lock.
+			/* There is data to process from this peer, temporarily disable FD_READ
+			 * events from it to avoid other workers spinning against the recv_busy
+			 * lock.
 			*/
 			
-			peer->recv_busy = true;
-			rb_claimed      = true;
-			
 			peer->disable_events(FD_READ | FD_CLOSE);
+			events_disabled = true;
 		}
 		
 		if(r == 0)
@@ -3553,8 +4559,8 @@ void DirectPlay8Peer::io_peer_recv(std::unique_lock<std::mutex> &l, unsigned int
 		{
 			/* Read error. */
 			
-			log_printf("Read error on peer %u: %s", peer_id, win_strerror(err).c_str());
-			log_printf("Closing connection");
+			LOG_WARN(LOG_CAT_SOCKETS, "Read error on peer %u: %s", peer_id, win_strerror(err).c_str());
+			LOG_WARN(LOG_CAT_SOCKETS, "Closing connection");
 			
 			peer_destroy(l, peer_id, DPNERR_CONNECTIONLOST, DPNDESTROYPLAYERREASON_CONNECTIONLOST);
 			return;
@@ -3569,189 +4575,223 @@ void DirectPlay8Peer::io_peer_recv(std::unique_lock<std::mutex> &l, unsigned int
 			continue;
 		}
 		
-		peer->recv_buf_cur += r;
+		peer->recv_framer.commit(r);
+		
+		const unsigned char *frame;
+		size_t frame_size;
+		StreamFramer::FrameStatus fs;
+		
+		while((fs = peer->recv_framer.next_frame(&frame, &frame_size)) == StreamFramer::FRAME_READY)
+		{
+			if(capture_enabled())
+			{
+				capture_frame(capture_instance, peer_id, CAPTURE_DIR_IN, CAPTURE_TRANSPORT_TCP,
+					peer->ip, peer->port, frame, frame_size);
+			}
+			
+			/* Process message */
+			std::unique_ptr<PacketDeserialiser> pd;
+			
+			try {
+				pd.reset(new PacketDeserialiser(frame, frame_size));
+			}
+			catch(const PacketDeserialiser::Error &e)
+			{
+				/* Malformed packet received - TCP stream invalid! */
+				
+				LOG_WARN(LOG_CAT_DISPATCH,
+					"Received malformed packet (%s) from peer %u, dropping connection",
+					e.what(), peer_id);
+				
+				peer_destroy(l, peer_id, DPNERR_CONNECTIONLOST, DPNDESTROYPLAYERREASON_CONNECTIONLOST);
+				return;
+			}
+			
+			peer->stats.packet_received(true, frame_size);
+			peer->last_recv_time = GetTickCount64();
+			
+			dispatch_packet(l, peer_id, *pd, peer->recv_framer.frame_buffer());
+			
+			RENEW_PEER_OR_RETURN();
+			
+			/* Message at the front of the buffer has been dealt with. */
+			peer->recv_framer.pop_frame();
+		}
+		
+		if(fs == StreamFramer::FRAME_OVERSIZE)
+		{
+			/* Malformed packet received - TCP stream invalid! */
+			
+			LOG_WARN(LOG_CAT_DISPATCH,
+				"Received over-size packet from peer %u, dropping connection",
+				peer_id);
+			
+			peer_destroy(l, peer_id, DPNERR_CONNECTIONLOST, DPNDESTROYPLAYERREASON_CONNECTIONLOST);
+			return;
+		}
+	}
+	
+	if(peer != NULL && rb_claimed)
+	{
+		if(events_disabled)
+		{
+			peer->enable_events(FD_READ | FD_CLOSE);
+		}
+		
+		peer->recv_busy = false;
+	}
+	
+	if(peer != NULL && !peer->recv_busy)
+	{
+		/* Don't hold onto the receive buffer while the peer is idle. */
+		peer->recv_framer.release();
+	}
+}
+
+void DirectPlay8Peer::dispatch_packet(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd, BufferPool::Buffer *buffer)
+{
+	LOG_TRACE(LOG_CAT_DISPATCH, "Received message type %u (%u fields) from peer %u",
+		(unsigned)(pd.packet_type()), (unsigned)(pd.num_fields()), peer_id);
+	
+	switch(pd.packet_type())
+	{
+		case DPLITE_MSGID_CONNECT_HOST:
+		{
+			handle_host_connect_request(l, peer_id, pd);
+			break;
+		}
+		
+		case DPLITE_MSGID_CONNECT_HOST_OK:
+		{
+			handle_host_connect_ok(l, peer_id, pd);
+			break;
+		}
+		
+		case DPLITE_MSGID_CONNECT_HOST_FAIL:
+		{
+			handle_host_connect_fail(l, peer_id, pd);
+			break;
+		}
+		
+		case DPLITE_MSGID_MESSAGE:
+		{
+			handle_message(l, pd, buffer);
+			break;
+		}
+		
+		case DPLITE_MSGID_PLAYERINFO:
+		{
+			handle_playerinfo(l, peer_id, pd);
+			break;
+		}
+		
+		case DPLITE_MSGID_ACK:
+		{
+			handle_ack(l, peer_id, pd);
+			break;
+		}
+		
+		case DPLITE_MSGID_APPDESC:
+		{
+			handle_appdesc(l, peer_id, pd);
+			break;
+		}
+		
+		case DPLITE_MSGID_CONNECT_PEER:
+		{
+			handle_connect_peer(l, peer_id, pd);
+			break;
+		}
+		
+		case DPLITE_MSGID_CONNECT_PEER_OK:
+		{
+			handle_connect_peer_ok(l, peer_id, pd);
+			break;
+		}
+		
+		case DPLITE_MSGID_CONNECT_PEER_FAIL:
+		{
+			handle_connect_peer_fail(l, peer_id, pd);
+			break;
+		}
+		
+		case DPLITE_MSGID_DESTROY_PEER:
+		{
+			handle_destroy_peer(l, peer_id, pd);
+			break;
+		}
+		
+		case DPLITE_MSGID_TERMINATE_SESSION:
+		{
+			handle_terminate_session(l, peer_id, pd);
+			break;
+		}
+		
+		case DPLITE_MSGID_GROUP_ALLOCATE:
+		{
+			handle_group_allocate(l, peer_id, pd);
+			break;
+		}
+		
+		case DPLITE_MSGID_GROUP_CREATE:
+		{
+			handle_group_create(l, peer_id, pd);
+			break;
+		}
+		
+		case DPLITE_MSGID_GROUP_DESTROY:
+		{
+			handle_group_destroy(l, peer_id, pd);
+			break;
+		}
+		
+		case DPLITE_MSGID_GROUP_JOIN:
+		{
+			handle_group_join(l, peer_id, pd);
+			break;
+		}
+		
+		case DPLITE_MSGID_GROUP_JOINED:
+		{
+			handle_group_joined(l, peer_id, pd);
+			break;
+		}
+		
+		case DPLITE_MSGID_GROUP_LEAVE:
+		{
+			handle_group_leave(l, peer_id, pd);
+			break;
+		}
+		
+		case DPLITE_MSGID_GROUP_LEFT:
+		{
+			handle_group_left(l, peer_id, pd);
+			break;
+		}
+		
+		case DPLITE_MSGID_COALESCED:
+		{
+			handle_coalesced(l, peer_id, pd, buffer);
+			break;
+		}
+		
+		case DPLITE_MSGID_PING:
+		{
+			handle_ping(l, peer_id, pd);
+			break;
+		}
 		
-		while(peer->recv_buf_cur >= sizeof(TLVChunk))
+		case DPLITE_MSGID_PONG:
 		{
-			TLVChunk *header = (TLVChunk*)(peer->recv_buf);
-			size_t full_packet_size = sizeof(TLVChunk) + header->value_length;
-			
-			if(full_packet_size > MAX_PACKET_SIZE)
-			{
-				/* Malformed packet received - TCP stream invalid! */
-				
-				log_printf(
-					"Received over-size packet from peer %u, dropping connection",
-					peer_id);
-				
-				peer_destroy(l, peer_id, DPNERR_CONNECTIONLOST, DPNDESTROYPLAYERREASON_CONNECTIONLOST);
-				return;
-			}
-			
-			if(peer->recv_buf_cur >= full_packet_size)
-			{
-				/* Process message */
-				std::unique_ptr<PacketDeserialiser> pd;
-				
-				try {
-					pd.reset(new PacketDeserialiser(peer->recv_buf, full_packet_size));
-				}
-				catch(const PacketDeserialiser::Error &e)
-				{
-					/* Malformed packet received - TCP stream invalid! */
-					
-					log_printf(
-						"Received malformed packet (%s) from peer %u, dropping connection",
-						e.what(), peer_id);
-					
-					peer_destroy(l, peer_id, DPNERR_CONNECTIONLOST, DPNDESTROYPLAYERREASON_CONNECTIONLOST);
-					return;
-				}
-				
-				switch(pd->packet_type())
-				{
-					case DPLITE_MSGID_CONNECT_HOST:
-					{
-						handle_host_connect_request(l, peer_id, *pd);
-						break;
-					}
-					
-					case DPLITE_MSGID_CONNECT_HOST_OK:
-					{
-						handle_host_connect_ok(l, peer_id, *pd);
-						break;
-					}
-					
-					case DPLITE_MSGID_CONNECT_HOST_FAIL:
-					{
-						handle_host_connect_fail(l, peer_id, *pd);
-						break;
-					}
-					
-					case DPLITE_MSGID_MESSAGE:
-					{
-						handle_message(l, *pd);
-						break;
-					}
-					
-					case DPLITE_MSGID_PLAYERINFO:
-					{
-						handle_playerinfo(l, peer_id, *pd);
-						break;
-					}
-					
-					case DPLITE_MSGID_ACK:
-					{
-						handle_ack(l, peer_id, *pd);
-						break;
-					}
-					
-					case DPLITE_MSGID_APPDESC:
-					{
-						handle_appdesc(l, peer_id, *pd);
-						break;
-					}
-					
-					case DPLITE_MSGID_CONNECT_PEER:
-					{
-						handle_connect_peer(l, peer_id, *pd);
-						break;
-					}
-					
-					case DPLITE_MSGID_CONNECT_PEER_OK:
-					{
-						handle_connect_peer_ok(l, peer_id, *pd);
-						break;
-					}
-					
-					case DPLITE_MSGID_CONNECT_PEER_FAIL:
-					{
-						handle_connect_peer_fail(l, peer_id, *pd);
-						break;
-					}
-					
-					case DPLITE_MSGID_DESTROY_PEER:
-					{
-						handle_destroy_peer(l, peer_id, *pd);
-						break;
-					}
-					
-					case DPLITE_MSGID_TERMINATE_SESSION:
-					{
-						handle_terminate_session(l, peer_id, *pd);
-						break;
-					}
-					
-					case DPLITE_MSGID_GROUP_ALLOCATE:
-					{
-						handle_group_allocate(l, peer_id, *pd);
-						break;
-					}
-					
-					case DPLITE_MSGID_GROUP_CREATE:
-					{
-						handle_group_create(l, peer_id, *pd);
-						break;
-					}
-					
-					case DPLITE_MSGID_GROUP_DESTROY:
-					{
-						handle_group_destroy(l, peer_id, *pd);
-						break;
-					}
-					
-					case DPLITE_MSGID_GROUP_JOIN:
-					{
-						handle_group_join(l, peer_id, *pd);
-						break;
-					}
-					
-					case DPLITE_MSGID_GROUP_JOINED:
-					{
-						handle_group_joined(l, peer_id, *pd);
-						break;
-					}
-					
-					case DPLITE_MSGID_GROUP_LEAVE:
-					{
-						handle_group_leave(l, peer_id, *pd);
-						break;
-					}
-					
-					case DPLITE_MSGID_GROUP_LEFT:
-					{
-						handle_group_left(l, peer_id, *pd);
-						break;
-					}
-					
-					default:
-						log_printf(
-							"Unexpected message type %u received from peer %u",
-							(unsigned)(pd->packet_type()), peer_id);
-						break;
-				}
-				
-				RENEW_PEER_OR_RETURN();
-				
-				/* Message at the front of the buffer has been dealt with, shift any
-				 * remaining data beyond it to the front and truncate it.
-				*/
-				
-				memmove(peer->recv_buf, peer->recv_buf + full_packet_size,
-					peer->recv_buf_cur - full_packet_size);
-				peer->recv_buf_cur -= full_packet_size;
-			}
-			else{
-				/* Haven't read the full message yet. */
-				break;
-			}
+			handle_pong(l, peer_id, pd);
+			break;
 		}
-	}
-	
-	if(peer != NULL && rb_claimed)
-	{
-		peer->enable_events(FD_READ | FD_CLOSE);
-		peer->recv_busy = false;
+		
+		default:
+			LOG_WARN(LOG_CAT_DISPATCH,
+				"Unexpected message type %u received from peer %u",
+				(unsigned)(pd.packet_type()), peer_id);
+			break;
 	}
 }
 
@@ -3776,7 +4816,7 @@ void DirectPlay8Peer::peer_accept(std::unique_lock<std::mutex> &l)
 		}
 		else{
 			/* Hopefully this is temporary and doesn't go into a tight loop... */
-			log_printf("Incoming connection failed: %s", win_strerror(err).c_str());
+			LOG_WARN(LOG_CAT_SOCKETS, "Incoming connection failed: %s", win_strerror(err).c_str());
 			return;
 		}
 	}
@@ -3788,7 +4828,7 @@ void DirectPlay8Peer::peer_accept(std::unique_lock<std::mutex> &l)
 	if(setsockopt(newfd, SOL_SOCKET, SO_LINGER, (char*)(&li), sizeof(li)) != 0)
 	{
 		DWORD err = WSAGetLastError();
-		log_printf("Failed to set SO_LINGER parameters on accepted connection: %s", win_strerror(err).c_str());
+		LOG_ERROR(LOG_CAT_SOCKETS, "Failed to set SO_LINGER parameters on accepted connection: %s", win_strerror(err).c_str());
 		
 		/* Not fatal, since this probably won't matter in production. */
 	}
@@ -3797,8 +4837,8 @@ void DirectPlay8Peer::peer_accept(std::unique_lock<std::mutex> &l)
 	if(ioctlsocket(newfd, FIONBIO, &non_blocking) != 0)
 	{
 		DWORD err = WSAGetLastError();
-		log_printf("Failed to set accepted connection to non-blocking mode: %s", win_strerror(err).c_str());
-		log_printf("Closing connection");
+		LOG_ERROR(LOG_CAT_SOCKETS, "Failed to set accepted connection to non-blocking mode: %s", win_strerror(err).c_str());
+		LOG_WARN(LOG_CAT_SOCKETS, "Closing connection");
 		
 		closesocket(newfd);
 		return;
@@ -3819,15 +4859,15 @@ void DirectPlay8Peer::peer_accept(std::unique_lock<std::mutex> &l)
 	if(setsockopt(newfd, SOL_SOCKET, SO_LINGER, (char*)(&no_linger), sizeof(no_linger)) != 0)
 	{
 		DWORD err = WSAGetLastError();
-		log_printf("Failed to set SO_LINGER on accepted connection: %s", win_strerror(err).c_str());
+		LOG_ERROR(LOG_CAT_SOCKETS, "Failed to set SO_LINGER on accepted connection: %s", win_strerror(err).c_str());
 	}
 	
 	unsigned int peer_id = next_peer_id++;
-	Peer *peer = new Peer(Peer::PS_ACCEPTED, newfd, addr.sin_addr.s_addr, ntohs(addr.sin_port));
+	Peer *peer = new Peer(Peer::PS_ACCEPTED, newfd, addr.sin_addr.s_addr, ntohs(addr.sin_port), recv_pool);
 	
 	if(!peer->enable_events(FD_READ | FD_WRITE | FD_CLOSE))
 	{
-		log_printf("WSAEventSelect() failed, dropping peer");
+		LOG_ERROR(LOG_CAT_SOCKETS, "WSAEventSelect() failed, dropping peer");
 		
 		closesocket(peer->sock);
 		delete peer;
@@ -3849,7 +4889,7 @@ bool DirectPlay8Peer::peer_connect(Peer::PeerState initial_state, uint32_t remot
 	}
 	
 	unsigned int peer_id = next_peer_id++;
-	Peer *peer = new Peer(initial_state, p_sock, remote_ip, remote_port);
+	Peer *peer = new Peer(initial_state, p_sock, remote_ip, remote_port, recv_pool);
 	
 	peer->player_id = player_id;
 	
@@ -3869,7 +4909,7 @@ bool DirectPlay8Peer::peer_connect(Peer::PeerState initial_state, uint32_t remot
 	char s_ip[16];
 	inet_ntop(AF_INET, &(r_addr.sin_addr), s_ip, sizeof(s_ip));
 	
-	log_printf("Initiating connection to %s:%d as peer_id %u", s_ip, (int)(remote_port), peer_id);
+	LOG_INFO(LOG_CAT_SOCKETS, "Initiating connection to %s:%d as peer_id %u", s_ip, (int)(remote_port), peer_id);
 	
 	if(connect(peer->sock, (struct sockaddr*)(&r_addr), sizeof(r_addr)) != -1 || WSAGetLastError() != WSAEWOULDBLOCK)
 	{
@@ -3891,16 +4931,35 @@ void DirectPlay8Peer::peer_destroy(std::unique_lock<std::mutex> &l, unsigned int
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
 	
-	/* Cancel any outstanding sends and notify the callbacks. */
+	/* Stop any more socket calls being made for this peer without holding the lock and
+	 * wait for any which are in progress to return, they may still be using its socket
+	 * and buffers.
+	*/
+	
+	peer->dying = true;
+	
+	while(peer->io_busy > 0)
+	{
+		peer_io_done.wait(l);
+		RENEW_PEER_OR_RETURN();
+	}
+	
+	/* Cancel any outstanding sends and notify the callbacks. Held messages are released
+	 * first so they are cancelled too.
+	*/
+	
+	peer->sq.flush();
 	
 	for(SendQueue::SendOp *sqop; (sqop = peer->sq.get_pending()) != NULL;)
 	{
 		peer->sq.pop_pending(sqop);
 		
 		sqop->invoke_callback(l, outstanding_op_result);
-		delete sqop;
+		sqop->release();
 		
 		RENEW_PEER_OR_RETURN();
+		
+		peer->sq.flush();
 	}
 	
 	/* Fail any outstanding acks and notify the callbacks. */
@@ -3928,10 +4987,14 @@ void DirectPlay8Peer::peer_destroy(std::unique_lock<std::mutex> &l, unsigned int
 		
 		peer->state = Peer::PS_CLOSING;
 		
+		publish_session();
+		
 		dispatch_destroy_player(l, peer->player_id, peer->player_ctx, destroy_player_reason);
 		
 		player_to_peer_id.erase(killed_player_id);
 		
+		publish_session();
+		
 		if(state == STATE_CONNECTED && killed_player_id == host_player_id)
 		{
 			/* The connection to the host has been lost. We need to raise a
@@ -3980,6 +5043,16 @@ void DirectPlay8Peer::peer_destroy(std::unique_lock<std::mutex> &l, unsigned int
 		RENEW_PEER_OR_RETURN();
 	}
 	
+	/* The lock was released while running callbacks above, make sure nothing got into a
+	 * socket call in the meantime.
+	*/
+	
+	while(peer->io_busy > 0)
+	{
+		peer_io_done.wait(l);
+		RENEW_PEER_OR_RETURN();
+	}
+	
 	worker_pool->remove_handle(peer->event);
 	
 	closesocket(peer->sock);
@@ -3987,6 +5060,8 @@ void DirectPlay8Peer::peer_destroy(std::unique_lock<std::mutex> &l, unsigned int
 	peers.erase(peer_id);
 	delete peer;
 	
+	publish_session();
+	
 	peer_destroyed.notify_all();
 }
 
@@ -4013,9 +5088,13 @@ void DirectPlay8Peer::peer_shutdown(std::unique_lock<std::mutex> &l, unsigned in
 		peer->state = Peer::PS_CLOSING;
 		SetEvent(peer->event);
 		
+		publish_session();
+		
 		dispatch_destroy_player(l, peer->player_id, peer->player_ctx, destroy_player_reason);
 		
 		player_to_peer_id.erase(peer_id);
+		
+		publish_session();
 	}
 	else if(peer->state == Peer::PS_CLOSING)
 	{
@@ -4073,6 +5152,8 @@ void DirectPlay8Peer::group_destroy_all(std::unique_lock<std::mutex> &l, DWORD d
 		}
 		
 		groups.erase(group_id);
+		
+		publish_session();
 	}
 }
 
@@ -4104,6 +5185,9 @@ void DirectPlay8Peer::handle_host_enum_request(std::unique_lock<std::mutex> &l,
 		return;
 	}
 	
+	LOG_TRACE(LOG_CAT_ENUM, "Received DPLITE_MSGID_HOST_ENUM_REQUEST from port %u",
+		(unsigned)(ntohs(from_addr->sin_port)));
+	
 	if(!pd.is_null(0))
 	{
 		GUID r_application_guid = pd.get_guid(0);
@@ -4219,7 +5303,7 @@ void DirectPlay8Peer::handle_host_connect_request(std::unique_lock<std::mutex> &
 	
 	if(peer->state != Peer::PS_ACCEPTED)
 	{
-		log_printf("Received unexpected DPLITE_MSGID_CONNECT_HOST from peer %u, in state %u",
+		LOG_WARN(LOG_CAT_DISPATCH, "Received unexpected DPLITE_MSGID_CONNECT_HOST from peer %u, in state %u",
 			peer_id, (unsigned)(peer->state));
 		return;
 	}
@@ -4350,6 +5434,8 @@ void DirectPlay8Peer::handle_host_connect_request(std::unique_lock<std::mutex> &
 		
 		peer->state = Peer::PS_CONNECTED;
 		
+		publish_session();
+		
 		/* Send DPLITE_MSGID_GROUP_DESTROY for each destroyed group. */
 		
 		for(auto di = destroyed_groups.begin(); di != destroyed_groups.end(); ++di)
@@ -4453,6 +5539,8 @@ void DirectPlay8Peer::handle_host_connect_request(std::unique_lock<std::mutex> &
 		RENEW_PEER_OR_RETURN();
 		
 		peer->player_ctx = cp.pvPlayerContext;
+		
+		publish_session();
 	}
 	else{
 		/* Connection rejected by application. */
@@ -4482,7 +5570,7 @@ void DirectPlay8Peer::handle_host_connect_ok(std::unique_lock<std::mutex> &l, un
 	
 	if(peer->state != Peer::PS_REQUESTING_HOST)
 	{
-		log_printf("Received unexpected DPLITE_MSGID_CONNECT_HOST_OK from peer %u, in state %u",
+		LOG_WARN(LOG_CAT_DISPATCH, "Received unexpected DPLITE_MSGID_CONNECT_HOST_OK from peer %u, in state %u",
 			peer_id, (unsigned)(peer->state));
 		return;
 	}
@@ -4498,6 +5586,8 @@ void DirectPlay8Peer::handle_host_connect_ok(std::unique_lock<std::mutex> &l, un
 	
 	local_player_id = pd.get_dword(2);
 	
+	publish_session();
+	
 	DWORD n_other_peers = pd.get_dword(3);
 	
 	for(DWORD n = 0; n < n_other_peers; ++n)
@@ -4557,6 +5647,8 @@ void DirectPlay8Peer::handle_host_connect_ok(std::unique_lock<std::mutex> &l, un
 	
 	peer->state = Peer::PS_CONNECTED;
 	
+	publish_session();
+	
 	state = STATE_CONNECTING_TO_PEERS;
 	
 	{
@@ -4572,6 +5664,8 @@ void DirectPlay8Peer::handle_host_connect_ok(std::unique_lock<std::mutex> &l, un
 		l.lock();
 		
 		local_player_ctx = cp.pvPlayerContext;
+		
+		publish_session();
 	}
 	
 	{
@@ -4589,6 +5683,8 @@ void DirectPlay8Peer::handle_host_connect_ok(std::unique_lock<std::mutex> &l, un
 		RENEW_PEER_OR_RETURN();
 		
 		peer->player_ctx = cp.pvPlayerContext;
+		
+		publish_session();
 	}
 	
 	for(auto g = peer_groups.begin(); g != peer_groups.end(); ++g)
@@ -4616,6 +5712,8 @@ void DirectPlay8Peer::handle_host_connect_ok(std::unique_lock<std::mutex> &l, un
 		
 		group->player_ids.insert(peer->player_id);
 		
+		publish_session();
+		
 		DPNMSG_ADD_PLAYER_TO_GROUP ap;
 		memset(&ap, 0, sizeof(ap));
 		
@@ -4655,7 +5753,7 @@ void DirectPlay8Peer::handle_host_connect_fail(std::unique_lock<std::mutex> &l,
 	
 	if(peer->state != Peer::PS_REQUESTING_HOST)
 	{
-		log_printf("Received unexpected DPLITE_MSGID_CONNECT_HOST_FAIL from peer %u, in state %u",
+		LOG_WARN(LOG_CAT_DISPATCH, "Received unexpected DPLITE_MSGID_CONNECT_HOST_FAIL from peer %u, in state %u",
 			peer_id, (unsigned)(peer->state));
 		return;
 	}
@@ -4682,7 +5780,7 @@ void DirectPlay8Peer::handle_host_connect_fail(std::unique_lock<std::mutex> &l,
 	}
 	catch(const PacketDeserialiser::Error &e)
 	{
-		log_printf("Received invalid DPLITE_MSGID_CONNECT_HOST_FAIL from peer %u: %s",
+		LOG_WARN(LOG_CAT_DISPATCH, "Received invalid DPLITE_MSGID_CONNECT_HOST_FAIL from peer %u: %s",
 			peer_id, e.what());
 	}
 	
@@ -4696,7 +5794,7 @@ void DirectPlay8Peer::handle_connect_peer(std::unique_lock<std::mutex> &l, unsig
 	
 	if(peer->state != Peer::PS_ACCEPTED)
 	{
-		log_printf("Received unexpected DPLITE_MSGID_CONNECT_PEER from peer %u, in state %u",
+		LOG_WARN(LOG_CAT_DISPATCH, "Received unexpected DPLITE_MSGID_CONNECT_PEER from peer %u, in state %u",
 			peer_id, (unsigned)(peer->state));
 		return;
 	}
@@ -4752,7 +5850,7 @@ void DirectPlay8Peer::handle_connect_peer(std::unique_lock<std::mutex> &l, unsig
 	
 	if(player_to_peer_id.find(peer->player_id) != player_to_peer_id.end())
 	{
-		log_printf("Rejected DPLITE_MSGID_CONNECT_PEER with already-known Player ID %u", (unsigned)(peer->player_id));
+		LOG_WARN(LOG_CAT_DISPATCH, "Rejected DPLITE_MSGID_CONNECT_PEER with already-known Player ID %u", (unsigned)(peer->player_id));
 		
 		send_fail(DPNERR_ALREADYCONNECTED);
 		return;
@@ -4762,6 +5860,8 @@ void DirectPlay8Peer::handle_connect_peer(std::unique_lock<std::mutex> &l, unsig
 	
 	peer->state = Peer::PS_CONNECTED;
 	
+	publish_session();
+	
 	/* Send DPLITE_MSGID_GROUP_DESTROY for each destroyed group. */
 	
 	for(auto di = destroyed_groups.begin(); di != destroyed_groups.end(); ++di)
@@ -4834,6 +5934,8 @@ void DirectPlay8Peer::handle_connect_peer(std::unique_lock<std::mutex> &l, unsig
 	RENEW_PEER_OR_RETURN();
 	
 	peer->player_ctx = cp.pvPlayerContext;
+	
+	publish_session();
 }
 
 void DirectPlay8Peer::handle_connect_peer_ok(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
@@ -4843,7 +5945,7 @@ void DirectPlay8Peer::handle_connect_peer_ok(std::unique_lock<std::mutex> &l, un
 	
 	if(peer->state != Peer::PS_REQUESTING_PEER)
 	{
-		log_printf("Received unexpected DPLITE_MSGID_CONNECT_PEER_OK from peer %u, in state %u",
+		LOG_WARN(LOG_CAT_DISPATCH, "Received unexpected DPLITE_MSGID_CONNECT_PEER_OK from peer %u, in state %u",
 			peer_id, (unsigned)(peer->state));
 		return;
 	}
@@ -4874,6 +5976,8 @@ void DirectPlay8Peer::handle_connect_peer_ok(std::unique_lock<std::mutex> &l, un
 	/* player_id initialised in handling of DPLITE_MSGID_CONNECT_HOST_OK. */
 	player_to_peer_id[peer->player_id] = peer_id;
 	
+	publish_session();
+	
 	{
 		DPNMSG_CREATE_PLAYER cp;
 		memset(&cp, 0, sizeof(cp));
@@ -4889,6 +5993,8 @@ void DirectPlay8Peer::handle_connect_peer_ok(std::unique_lock<std::mutex> &l, un
 		RENEW_PEER_OR_RETURN();
 		
 		peer->player_ctx = cp.pvPlayerContext;
+		
+		publish_session();
 	}
 	
 	for(auto g = peer_groups.begin(); g != peer_groups.end(); ++g)
@@ -4916,6 +6022,8 @@ void DirectPlay8Peer::handle_connect_peer_ok(std::unique_lock<std::mutex> &l, un
 		
 		group->player_ids.insert(peer->player_id);
 		
+		publish_session();
+		
 		DPNMSG_ADD_PLAYER_TO_GROUP ap;
 		memset(&ap, 0, sizeof(ap));
 		
@@ -4942,7 +6050,7 @@ void DirectPlay8Peer::handle_connect_peer_fail(std::unique_lock<std::mutex> &l,
 	
 	if(peer->state != Peer::PS_REQUESTING_PEER)
 	{
-		log_printf("Received unexpected DPLITE_MSGID_CONNECT_PEER_FAIL from peer %u, in state %u",
+		LOG_WARN(LOG_CAT_DISPATCH, "Received unexpected DPLITE_MSGID_CONNECT_PEER_FAIL from peer %u, in state %u",
 			peer_id, (unsigned)(peer->state));
 		return;
 	}
@@ -4956,55 +6064,105 @@ void DirectPlay8Peer::handle_connect_peer_fail(std::unique_lock<std::mutex> &l,
 	}
 	catch(const PacketDeserialiser::Error &e)
 	{
-		log_printf("Received invalid DPLITE_MSGID_CONNECT_PEER_FAIL from peer %u: %s",
+		LOG_WARN(LOG_CAT_DISPATCH, "Received invalid DPLITE_MSGID_CONNECT_PEER_FAIL from peer %u: %s",
 			peer_id, e.what());
 	}
 	
 	connect_fail(l, DPNERR_PLAYERNOTREACHABLE, NULL, 0);
 }
 
-void DirectPlay8Peer::handle_message(std::unique_lock<std::mutex> &l, const PacketDeserialiser &pd)
+void DirectPlay8Peer::handle_message(std::unique_lock<std::mutex> &l, const PacketDeserialiser &pd, BufferPool::Buffer *buffer)
 {
 	try {
 		DWORD from_player_id = pd.get_dword(0);
 		std::pair<const void*, size_t> payload = pd.get_data(1);
 		DWORD flags = pd.get_dword(2);
 		
+		/* Messages arrive over TCP in the order they were sent, even DPNSEND_NONSEQUENTIAL
+		 * ones - those are only sent this way when they are also DPNSEND_GUARANTEED.
+		*/
+		
+		dispatch_receive(l, from_player_id, payload.first, payload.second,
+			(flags & DPNSEND_GUARANTEED ? DPNRECEIVE_GUARANTEED : 0), buffer);
+	}
+	catch(const PacketDeserialiser::Error &e)
+	{
+		LOG_WARN(LOG_CAT_DISPATCH, "Received invalid DPLITE_MSGID_MESSAGE: %s", e.what());
+	}
+}
+
+void DirectPlay8Peer::handle_datagram(std::unique_lock<std::mutex> &l, const PacketDeserialiser &pd, size_t datagram_size, const struct sockaddr_in *from_addr, BufferPool::Buffer *buffer)
+{
+	try {
+		DWORD from_player_id = pd.get_dword(0);
+		
+		DatagramReceiver::Fragment fragment;
+		fragment.message_id     = pd.get_dword(1);
+		fragment.channel        = pd.get_dword(2);
+		fragment.sequence       = pd.get_dword(3);
+		fragment.message_size   = pd.get_dword(5);
+		fragment.fragment_index = pd.get_dword(6);
+		fragment.fragment_count = pd.get_dword(7);
+		
+		std::pair<const void*, size_t> data = pd.get_data(8);
+		fragment.data = data.first;
+		fragment.size = data.second;
+		
 		Peer *peer = get_peer_by_player_id(from_player_id);
-		if(peer == NULL)
+		
+		if(peer == NULL || peer->state != Peer::PS_CONNECTED
+			|| peer->ip != from_addr->sin_addr.s_addr || peer->port != ntohs(from_addr->sin_port))
 		{
+			/* Only accept datagrams from the address of the player they claim to be from. */
+			
+			char s_ip[16];
+			inet_ntop(AF_INET, &(from_addr->sin_addr), s_ip, sizeof(s_ip));
+			
+			LOG_WARN(LOG_CAT_DISPATCH, "Discarding DPLITE_MSGID_DATAGRAM for player %u from unexpected address %s:%u",
+				(unsigned)(from_player_id), s_ip, (unsigned)(ntohs(from_addr->sin_port)));
+			
 			return;
 		}
 		
-		unsigned char *payload_copy = new unsigned char[payload.second];
-		memcpy(payload_copy, payload.first, payload.second);
+		peer->stats.packet_received(false, datagram_size);
+		peer->last_recv_time = GetTickCount64();
 		
-		DPNMSG_RECEIVE r;
-		memset(&r, 0, sizeof(r));
+		const void *message;
+		BufferPool::Buffer *message_buffer;
 		
-		static_assert(sizeof(DPNHANDLE) >= sizeof(unsigned char*),
-			"DPNHANDLE must be large enough to take a pointer");
-		
-		r.dwSize            = sizeof(r);
-		r.dpnidSender       = from_player_id;
-		r.pvPlayerContext   = peer->player_ctx;
-		r.pReceiveData      = payload_copy;
-		r.dwReceiveDataSize = payload.second;
-		r.hBufferHandle     = (DPNHANDLE)(payload_copy);
-		// r.dwReceiveFlags
-		
-		l.unlock();
-		HRESULT r_result = message_handler(message_handler_ctx, DPN_MSGID_RECEIVE, &r);
-		l.lock();
-		
-		if(r_result != DPNSUCCESS_PENDING)
+		switch(peer->datagrams.add(fragment, &message, &message_buffer))
 		{
-			delete[] payload_copy;
+			case DatagramReceiver::FRAGMENT_INVALID:
+				LOG_WARN(LOG_CAT_DISPATCH, "Received invalid DPLITE_MSGID_DATAGRAM: Bad fragment %u/%u (%u bytes) of %u byte message %u in channel %u",
+					(unsigned)(fragment.fragment_index), (unsigned)(fragment.fragment_count), (unsigned)(fragment.size),
+					(unsigned)(fragment.message_size), (unsigned)(fragment.message_id), (unsigned)(fragment.channel));
+				break;
+				
+			case DatagramReceiver::FRAGMENT_STALE:
+				LOG_TRACE(LOG_CAT_DISPATCH, "Discarding stale DPLITE_MSGID_DATAGRAM %u from player %u",
+					(unsigned)(fragment.message_id), (unsigned)(from_player_id));
+				break;
+				
+			case DatagramReceiver::FRAGMENT_INCOMPLETE:
+				break;
+				
+			case DatagramReceiver::MESSAGE_COMPLETE:
+			{
+				dispatch_receive(l, from_player_id, message, fragment.message_size, 0,
+					(message_buffer != NULL ? message_buffer : buffer));
+				
+				if(message_buffer != NULL)
+				{
+					message_buffer->unref();
+				}
+				
+				break;
+			}
 		}
 	}
 	catch(const PacketDeserialiser::Error &e)
 	{
-		log_printf("Received invalid DPLITE_MSGID_MESSAGE: %s", e.what());
+		LOG_WARN(LOG_CAT_DISPATCH, "Received invalid DPLITE_MSGID_DATAGRAM: %s", e.what());
 	}
 }
 
@@ -5021,14 +6179,14 @@ void DirectPlay8Peer::handle_playerinfo(std::unique_lock<std::mutex> &l, unsigne
 		
 		if(peer->state != Peer::PS_CONNECTED)
 		{
-			log_printf("Received unexpected DPLITE_MSGID_PLAYERINFO from peer %u, in state %u",
+			LOG_WARN(LOG_CAT_DISPATCH, "Received unexpected DPLITE_MSGID_PLAYERINFO from peer %u, in state %u",
 				peer_id, (unsigned)(peer->state));
 			return;
 		}
 		
 		if(player_id != peer->player_id)
 		{
-			log_printf("Received unexpected DPLITE_MSGID_PLAYERINFO from peer %u for player %u",
+			LOG_WARN(LOG_CAT_DISPATCH, "Received unexpected DPLITE_MSGID_PLAYERINFO from peer %u for player %u",
 				peer_id, (unsigned)(player_id));
 			return;
 		}
@@ -5065,7 +6223,7 @@ void DirectPlay8Peer::handle_playerinfo(std::unique_lock<std::mutex> &l, unsigne
 	}
 	catch(const PacketDeserialiser::Error &e)
 	{
-		log_printf("Received invalid DPLITE_MSGID_PLAYERINFO from peer %u: %s",
+		LOG_WARN(LOG_CAT_DISPATCH, "Received invalid DPLITE_MSGID_PLAYERINFO from peer %u: %s",
 			peer_id, e.what());
 	}
 }
@@ -5083,7 +6241,7 @@ void DirectPlay8Peer::handle_ack(std::unique_lock<std::mutex> &l, unsigned int p
 		auto ai = peer->pending_acks.find(ack_id);
 		if(ai == peer->pending_acks.end())
 		{
-			log_printf("Received DPLITE_MSGID_CONNECT_HOST_FAIL with unknown ID %u from peer %u: %s",
+			LOG_WARN(LOG_CAT_DISPATCH, "Received DPLITE_MSGID_CONNECT_HOST_FAIL with unknown ID %u from peer %u: %s",
 				(unsigned)(ack_id), peer_id);
 			return;
 		}
@@ -5095,7 +6253,7 @@ void DirectPlay8Peer::handle_ack(std::unique_lock<std::mutex> &l, unsigned int p
 	}
 	catch(const PacketDeserialiser::Error &e)
 	{
-		log_printf("Received invalid DPLITE_MSGID_ACK from peer %u: %s",
+		LOG_WARN(LOG_CAT_DISPATCH, "Received invalid DPLITE_MSGID_ACK from peer %u: %s",
 			peer_id, e.what());
 	}
 }
@@ -5113,7 +6271,7 @@ void DirectPlay8Peer::handle_appdesc(std::unique_lock<std::mutex> &l, unsigned i
 		
 		if(peer->state != Peer::PS_CONNECTED)
 		{
-			log_printf("Received unexpected DPLITE_MSGID_APPDESC from peer %u, in state %u",
+			LOG_WARN(LOG_CAT_DISPATCH, "Received unexpected DPLITE_MSGID_APPDESC from peer %u, in state %u",
 				peer_id, (unsigned)(peer->state));
 			return;
 		}
@@ -5124,7 +6282,7 @@ void DirectPlay8Peer::handle_appdesc(std::unique_lock<std::mutex> &l, unsigned i
 		
 		if(peer->player_id != host_player_id)
 		{
-			log_printf("Received unexpected DPLITE_MSGID_CONNECT_HOST_FAIL from non-host peer %u",
+			LOG_WARN(LOG_CAT_DISPATCH, "Received unexpected DPLITE_MSGID_CONNECT_HOST_FAIL from non-host peer %u",
 				peer_id);
 			return;
 		}
@@ -5149,7 +6307,7 @@ void DirectPlay8Peer::handle_appdesc(std::unique_lock<std::mutex> &l, unsigned i
 	}
 	catch(const PacketDeserialiser::Error &e)
 	{
-		log_printf("Received invalid DPLITE_MSGID_APPDESC from peer %u: %s",
+		LOG_WARN(LOG_CAT_DISPATCH, "Received invalid DPLITE_MSGID_APPDESC from peer %u: %s",
 			peer_id, e.what());
 	}
 }
@@ -5164,7 +6322,7 @@ void DirectPlay8Peer::handle_destroy_peer(std::unique_lock<std::mutex> &l, unsig
 		
 		if(peer->state != Peer::PS_CONNECTED)
 		{
-			log_printf("Received unexpected DPLITE_MSGID_DESTROY_PEER from peer %u, in state %u",
+			LOG_WARN(LOG_CAT_DISPATCH, "Received unexpected DPLITE_MSGID_DESTROY_PEER from peer %u, in state %u",
 				peer_id, (unsigned)(peer->state));
 			return;
 		}
@@ -5175,7 +6333,7 @@ void DirectPlay8Peer::handle_destroy_peer(std::unique_lock<std::mutex> &l, unsig
 		
 		if(peer->player_id != host_player_id && peer->player_id != destroy_player_id)
 		{
-			log_printf("Received unexpected DPLITE_MSGID_DESTROY_PEER from non-host peer %u",
+			LOG_WARN(LOG_CAT_DISPATCH, "Received unexpected DPLITE_MSGID_DESTROY_PEER from non-host peer %u",
 				peer_id);
 			return;
 		}
@@ -5241,7 +6399,7 @@ void DirectPlay8Peer::handle_destroy_peer(std::unique_lock<std::mutex> &l, unsig
 	}
 	catch(const PacketDeserialiser::Error &e)
 	{
-		log_printf("Received invalid DPLITE_MSGID_DESTROY_PEER from peer %u: %s",
+		LOG_WARN(LOG_CAT_DISPATCH, "Received invalid DPLITE_MSGID_DESTROY_PEER from peer %u: %s",
 			peer_id, e.what());
 	}
 }
@@ -5256,7 +6414,7 @@ void DirectPlay8Peer::handle_terminate_session(std::unique_lock<std::mutex> &l,
 		
 		if(peer->state != Peer::PS_CONNECTED)
 		{
-			log_printf("Received unexpected DPLITE_MSGID_TERMINATE_SESSION from peer %u, in state %u",
+			LOG_WARN(LOG_CAT_DISPATCH, "Received unexpected DPLITE_MSGID_TERMINATE_SESSION from peer %u, in state %u",
 				peer_id, (unsigned)(peer->state));
 			return;
 		}
@@ -5267,7 +6425,7 @@ void DirectPlay8Peer::handle_terminate_session(std::unique_lock<std::mutex> &l,
 		
 		if(peer->player_id != host_player_id)
 		{
-			log_printf("Received unexpected DPLITE_MSGID_TERMINATE_SESSION from non-host peer %u",
+			LOG_WARN(LOG_CAT_DISPATCH, "Received unexpected DPLITE_MSGID_TERMINATE_SESSION from non-host peer %u",
 				peer_id);
 			return;
 		}
@@ -5294,7 +6452,7 @@ void DirectPlay8Peer::handle_terminate_session(std::unique_lock<std::mutex> &l,
 	}
 	catch(const PacketDeserialiser::Error &e)
 	{
-		log_printf("Received invalid DPLITE_MSGID_TERMINATE_SESSION from peer %u: %s",
+		LOG_WARN(LOG_CAT_DISPATCH, "Received invalid DPLITE_MSGID_TERMINATE_SESSION from peer %u: %s",
 			peer_id, e.what());
 	}
 }
@@ -5309,7 +6467,7 @@ void DirectPlay8Peer::handle_group_allocate(std::unique_lock<std::mutex> &l, uns
 		
 		if(peer->state != Peer::PS_CONNECTED)
 		{
-			log_printf("Received unexpected DPLITE_MSGID_GROUP_ALLOCATE from peer %u, in state %u",
+			LOG_WARN(LOG_CAT_GROUPS, "Received unexpected DPLITE_MSGID_GROUP_ALLOCATE from peer %u, in state %u",
 				peer_id, (unsigned)(peer->state));
 			return;
 		}
@@ -5320,7 +6478,7 @@ void DirectPlay8Peer::handle_group_allocate(std::unique_lock<std::mutex> &l, uns
 	}
 	catch(const PacketDeserialiser::Error &e)
 	{
-		log_printf("Received invalid DPLITE_MSGID_GROUP_ALLOCATE from peer %u: %s",
+		LOG_WARN(LOG_CAT_GROUPS, "Received invalid DPLITE_MSGID_GROUP_ALLOCATE from peer %u: %s",
 			peer_id, e.what());
 	}
 }
@@ -5339,7 +6497,7 @@ void DirectPlay8Peer::handle_group_create(std::unique_lock<std::mutex> &l, unsig
 			&& peer->state != Peer::PS_REQUESTING_HOST
 			&& peer->state != Peer::PS_REQUESTING_PEER)
 		{
-			log_printf("Received unexpected DPLITE_MSGID_GROUP_CREATE from peer %u, in state %u",
+			LOG_WARN(LOG_CAT_GROUPS, "Received unexpected DPLITE_MSGID_GROUP_CREATE from peer %u, in state %u",
 				peer_id, (unsigned)(peer->state));
 			return;
 		}
@@ -5361,6 +6519,8 @@ void DirectPlay8Peer::handle_group_create(std::unique_lock<std::mutex> &l, unsig
 				std::forward_as_tuple(group_id),
 				std::forward_as_tuple(group_name, group_data.first, group_data.second));
 		
+		publish_session();
+		
 		/* Raise DPNMSG_CREATE_GROUP for the new group. */
 		
 		DPNMSG_CREATE_GROUP cg;
@@ -5380,11 +6540,13 @@ void DirectPlay8Peer::handle_group_create(std::unique_lock<std::mutex> &l, unsig
 		if(group != NULL)
 		{
 			group->ctx = cg.pvGroupContext;
+			
+			publish_session();
 		}
 	}
 	catch(const PacketDeserialiser::Error &e)
 	{
-		log_printf("Received invalid DPLITE_MSGID_TERMINATE_SESSION from peer %u: %s",
+		LOG_WARN(LOG_CAT_DISPATCH, "Received invalid DPLITE_MSGID_TERMINATE_SESSION from peer %u: %s",
 			peer_id, e.what());
 	}
 }
@@ -5401,7 +6563,7 @@ void DirectPlay8Peer::handle_group_destroy(std::unique_lock<std::mutex> &l, unsi
 			&& peer->state != Peer::PS_REQUESTING_HOST
 			&& peer->state != Peer::PS_REQUESTING_PEER)
 		{
-			log_printf("Received unexpected DPLITE_MSGID_GROUP_DESTROY from peer %u, in state %u",
+			LOG_WARN(LOG_CAT_GROUPS, "Received unexpected DPLITE_MSGID_GROUP_DESTROY from peer %u, in state %u",
 				peer_id, (unsigned)(peer->state));
 			return;
 		}
@@ -5430,11 +6592,13 @@ void DirectPlay8Peer::handle_group_destroy(std::unique_lock<std::mutex> &l, unsi
 			l.lock();
 			
 			groups.erase(group_id);
+			
+			publish_session();
 		}
 	}
 	catch(const PacketDeserialiser::Error &e)
 	{
-		log_printf("Received invalid DPLITE_MSGID_GROUP_DESTROY from peer %u: %s",
+		LOG_WARN(LOG_CAT_GROUPS, "Received invalid DPLITE_MSGID_GROUP_DESTROY from peer %u: %s",
 			peer_id, e.what());
 	}
 }
@@ -5452,7 +6616,7 @@ void DirectPlay8Peer::handle_group_join(std::unique_lock<std::mutex> &l, unsigne
 		
 		if(peer->state != Peer::PS_CONNECTED)
 		{
-			log_printf("Received unexpected DPLITE_MSGID_GROUP_JOIN from peer %u, in state %u",
+			LOG_WARN(LOG_CAT_GROUPS, "Received unexpected DPLITE_MSGID_GROUP_JOIN from peer %u, in state %u",
 				peer_id, (unsigned)(peer->state));
 			return;
 		}
@@ -5474,6 +6638,8 @@ void DirectPlay8Peer::handle_group_join(std::unique_lock<std::mutex> &l, unsigne
 				std::forward_as_tuple(group_id),
 				std::forward_as_tuple(group_name, group_data.first, group_data.second));
 			
+			publish_session();
+			
 			/* Raise DPNMSG_CREATE_GROUP for the new group. */
 			
 			DPNMSG_CREATE_GROUP cg;
@@ -5498,6 +6664,8 @@ void DirectPlay8Peer::handle_group_join(std::unique_lock<std::mutex> &l, unsigne
 			}
 			
 			group->ctx = cg.pvGroupContext;
+			
+			publish_session();
 		}
 		
 		if(group->player_ids.find(local_player_id) != group->player_ids.end())
@@ -5507,10 +6675,10 @@ void DirectPlay8Peer::handle_group_join(std::unique_lock<std::mutex> &l, unsigne
 			return;
 		}
 		
-		PacketSerialiser group_joined(DPLITE_MSGID_GROUP_JOINED);
-		group_joined.append_dword(group_id);
-		group_joined.append_wstring(group->name);
-		group_joined.append_data(group->data.data(), group->data.size());
+		std::shared_ptr<PacketSerialiser> group_joined = std::make_shared<PacketSerialiser>(DPLITE_MSGID_GROUP_JOINED);
+		group_joined->append_dword(group_id);
+		group_joined->append_wstring(group->name);
+		group_joined->append_data(group->data.data(), group->data.size());
 		
 		for(auto p = peers.begin(); p != peers.end(); ++p)
 		{
@@ -5532,6 +6700,8 @@ void DirectPlay8Peer::handle_group_join(std::unique_lock<std::mutex> &l, unsigne
 		
 		group->player_ids.insert(local_player_id);
 		
+		publish_session();
+		
 		DPNMSG_ADD_PLAYER_TO_GROUP ap;
 		memset(&ap, 0, sizeof(ap));
 		
@@ -5547,7 +6717,7 @@ void DirectPlay8Peer::handle_group_join(std::unique_lock<std::mutex> &l, unsigne
 	}
 	catch(const PacketDeserialiser::Error &e)
 	{
-		log_printf("Received invalid DPLITE_MSGID_GROUP_JOIN from peer %u: %s",
+		LOG_WARN(LOG_CAT_GROUPS, "Received invalid DPLITE_MSGID_GROUP_JOIN from peer %u: %s",
 			peer_id, e.what());
 	}
 }
@@ -5564,7 +6734,7 @@ void DirectPlay8Peer::handle_group_joined(std::unique_lock<std::mutex> &l, unsig
 		
 		if(peer->state != Peer::PS_CONNECTED)
 		{
-			log_printf("Received unexpected DPLITE_MSGID_GROUP_JOINED from peer %u, in state %u",
+			LOG_WARN(LOG_CAT_GROUPS, "Received unexpected DPLITE_MSGID_GROUP_JOINED from peer %u, in state %u",
 				peer_id, (unsigned)(peer->state));
 			return;
 		}
@@ -5585,6 +6755,8 @@ void DirectPlay8Peer::handle_group_joined(std::unique_lock<std::mutex> &l, unsig
 				std::forward_as_tuple(group_id),
 				std::forward_as_tuple(group_name, group_data.first, group_data.second));
 			
+			publish_session();
+			
 			/* Raise DPNMSG_CREATE_GROUP for the new group. */
 			
 			DPNMSG_CREATE_GROUP cg;
@@ -5608,18 +6780,25 @@ void DirectPlay8Peer::handle_group_joined(std::unique_lock<std::mutex> &l, unsig
 			}
 			
 			group->ctx = cg.pvGroupContext;
+			
+			publish_session();
 		}
 		
 		if(group->player_ids.find(peer->player_id) != group->player_ids.end())
 		{
 			/* Already in group. */
-			log_printf("Received DPLITE_MSGID_GROUP_JOINED from peer %u for group %u, but it is already in group",
+			LOG_WARN(LOG_CAT_GROUPS, "Received DPLITE_MSGID_GROUP_JOINED from peer %u for group %u, but it is already in group",
 				peer_id, (unsigned)(group_id));
 			return;
 		}
 		
 		group->player_ids.insert(peer->player_id);
 		
+		LOG_TRACE(LOG_CAT_GROUPS, "Player %u joined group %u",
+			(unsigned)(peer->player_id), (unsigned)(group_id));
+		
+		publish_session();
+		
 		DPNMSG_ADD_PLAYER_TO_GROUP ap;
 		memset(&ap, 0, sizeof(ap));
 		
@@ -5635,7 +6814,7 @@ void DirectPlay8Peer::handle_group_joined(std::unique_lock<std::mutex> &l, unsig
 	}
 	catch(const PacketDeserialiser::Error &e)
 	{
-		log_printf("Received invalid DPLITE_MSGID_GROUP_JOINED from peer %u: %s",
+		LOG_WARN(LOG_CAT_GROUPS, "Received invalid DPLITE_MSGID_GROUP_JOINED from peer %u: %s",
 			peer_id, e.what());
 	}
 }
@@ -5651,7 +6830,7 @@ void DirectPlay8Peer::handle_group_leave(std::unique_lock<std::mutex> &l, unsign
 		
 		if(peer->state != Peer::PS_CONNECTED)
 		{
-			log_printf("Received unexpected DPLITE_MSGID_GROUP_LEAVE from peer %u, in state %u",
+			LOG_WARN(LOG_CAT_GROUPS, "Received unexpected DPLITE_MSGID_GROUP_LEAVE from peer %u, in state %u",
 				peer_id, (unsigned)(peer->state));
 			return;
 		}
@@ -5677,8 +6856,8 @@ void DirectPlay8Peer::handle_group_leave(std::unique_lock<std::mutex> &l, unsign
 			return;
 		}
 		
-		PacketSerialiser group_left(DPLITE_MSGID_GROUP_LEFT);
-		group_left.append_dword(group_id);
+		std::shared_ptr<PacketSerialiser> group_left = std::make_shared<PacketSerialiser>(DPLITE_MSGID_GROUP_LEFT);
+		group_left->append_dword(group_id);
 		
 		for(auto p = peers.begin(); p != peers.end(); ++p)
 		{
@@ -5700,6 +6879,8 @@ void DirectPlay8Peer::handle_group_leave(std::unique_lock<std::mutex> &l, unsign
 		
 		group->player_ids.erase(local_player_id);
 		
+		publish_session();
+		
 		DPNMSG_REMOVE_PLAYER_FROM_GROUP rp;
 		memset(&rp, 0, sizeof(rp));
 		
@@ -5715,7 +6896,7 @@ void DirectPlay8Peer::handle_group_leave(std::unique_lock<std::mutex> &l, unsign
 	}
 	catch(const PacketDeserialiser::Error &e)
 	{
-		log_printf("Received invalid DPLITE_MSGID_GROUP_LEAVE from peer %u: %s",
+		LOG_WARN(LOG_CAT_GROUPS, "Received invalid DPLITE_MSGID_GROUP_LEAVE from peer %u: %s",
 			peer_id, e.what());
 	}
 }
@@ -5730,7 +6911,7 @@ void DirectPlay8Peer::handle_group_left(std::unique_lock<std::mutex> &l, unsigne
 		
 		if(peer->state != Peer::PS_CONNECTED)
 		{
-			log_printf("Received unexpected DPLITE_MSGID_GROUP_LEFT from peer %u, in state %u",
+			LOG_WARN(LOG_CAT_GROUPS, "Received unexpected DPLITE_MSGID_GROUP_LEFT from peer %u, in state %u",
 				peer_id, (unsigned)(peer->state));
 			return;
 		}
@@ -5751,13 +6932,18 @@ void DirectPlay8Peer::handle_group_left(std::unique_lock<std::mutex> &l, unsigne
 		if(group->player_ids.find(peer->player_id) == group->player_ids.end())
 		{
 			/* Already in group. */
-			log_printf("Received DPLITE_MSGID_GROUP_LEFT from peer %u for group %u, but it isn't in group",
+			LOG_WARN(LOG_CAT_GROUPS, "Received DPLITE_MSGID_GROUP_LEFT from peer %u for group %u, but it isn't in group",
 				peer_id, (unsigned)(group_id));
 			return;
 		}
 		
 		group->player_ids.erase(peer->player_id);
 		
+		LOG_TRACE(LOG_CAT_GROUPS, "Player %u left group %u",
+			(unsigned)(peer->player_id), (unsigned)(group_id));
+		
+		publish_session();
+		
 		DPNMSG_REMOVE_PLAYER_FROM_GROUP rp;
 		memset(&rp, 0, sizeof(rp));
 		
@@ -5773,7 +6959,87 @@ void DirectPlay8Peer::handle_group_left(std::unique_lock<std::mutex> &l, unsigne
 	}
 	catch(const PacketDeserialiser::Error &e)
 	{
-		log_printf("Received invalid DPLITE_MSGID_GROUP_LEFT from peer %u: %s",
+		LOG_WARN(LOG_CAT_GROUPS, "Received invalid DPLITE_MSGID_GROUP_LEFT from peer %u: %s",
+			peer_id, e.what());
+	}
+}
+
+void DirectPlay8Peer::handle_coalesced(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd, BufferPool::Buffer *buffer)
+{
+	/* Each field is a whole packet which was batched up by the sender's SendQueue, they
+	 * are dispatched in order as if they had been read from the stream one at a time.
+	*/
+	
+	for(size_t i = 0; i < pd.num_fields(); ++i)
+	{
+		std::unique_ptr<PacketDeserialiser> inner;
+		
+		try {
+			std::pair<const void*, size_t> packet = pd.get_data(i);
+			inner.reset(new PacketDeserialiser(packet.first, packet.second));
+			
+			if(inner->packet_type() == DPLITE_MSGID_COALESCED)
+			{
+				throw PacketDeserialiser::Error::Malformed("Nested DPLITE_MSGID_COALESCED");
+			}
+		}
+		catch(const PacketDeserialiser::Error &e)
+		{
+			/* We have no way of knowing which messages in the batch were lost. */
+			
+			LOG_WARN(LOG_CAT_DISPATCH,
+				"Received invalid DPLITE_MSGID_COALESCED (%s) from peer %u, dropping connection",
+				e.what(), peer_id);
+			
+			peer_destroy(l, peer_id, DPNERR_CONNECTIONLOST, DPNDESTROYPLAYERREASON_CONNECTIONLOST);
+			return;
+		}
+		
+		dispatch_packet(l, peer_id, *inner, buffer);
+		
+		if(get_peer_by_peer_id(peer_id) == NULL)
+		{
+			/* Peer was destroyed while handling the message. */
+			return;
+		}
+	}
+}
+
+void DirectPlay8Peer::handle_ping(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+{
+	Peer *peer = get_peer_by_peer_id(peer_id);
+	assert(peer != NULL);
+	
+	try {
+		DWORD timestamp = pd.get_dword(0);
+		
+		PacketSerialiser pong(DPLITE_MSGID_PONG);
+		pong.append_dword(timestamp);
+		
+		peer->sq.send(SendQueue::SEND_PRI_HIGH, pong, NULL,
+			[](std::unique_lock<std::mutex> &l, HRESULT result) {});
+	}
+	catch(const PacketDeserialiser::Error &e)
+	{
+		LOG_WARN(LOG_CAT_DISPATCH, "Received invalid DPLITE_MSGID_PING from peer %u: %s",
+			peer_id, e.what());
+	}
+}
+
+void DirectPlay8Peer::handle_pong(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+{
+	Peer *peer = get_peer_by_peer_id(peer_id);
+	assert(peer != NULL);
+	
+	try {
+		DWORD timestamp = pd.get_dword(0);
+		
+		/* Unsigned subtraction copes with GetTickCount() wrapping. */
+		peer->stats.rtt_sample(GetTickCount() - timestamp);
+	}
+	catch(const PacketDeserialiser::Error &e)
+	{
+		LOG_WARN(LOG_CAT_DISPATCH, "Received invalid DPLITE_MSGID_PONG from peer %u: %s",
 			peer_id, e.what());
 	}
 }
@@ -5815,6 +7081,9 @@ void DirectPlay8Peer::connect_check(std::unique_lock<std::mutex> &l)
 	
 	state = STATE_CONNECTED;
 	
+	arm_stats_timer();
+	arm_keepalive_timer();
+	
 	DPNMSG_CONNECT_COMPLETE cc;
 	memset(&cc, 0, sizeof(cc));
 	
@@ -5894,6 +7163,46 @@ HRESULT DirectPlay8Peer::dispatch_message(std::unique_lock<std::mutex> &l, DWORD
 	return result;
 }
 
+/* Raises a DPNMSG_RECEIVE for a message held in a pool buffer. The application is given a
+ * reference to the buffer, which will be released when it returns unless it returns
+ * DPNSUCCESS_PENDING, in which case it is released by ReturnBuffer().
+*/
+HRESULT DirectPlay8Peer::dispatch_receive(std::unique_lock<std::mutex> &l, DPNID dpnidSender, const void *data, size_t data_size, DWORD dwReceiveFlags, BufferPool::Buffer *buffer)
+{
+	Peer *peer = get_peer_by_player_id(dpnidSender);
+	if(peer == NULL)
+	{
+		return S_OK;
+	}
+	
+	peer->stats.message_received();
+	
+	buffer->ref();
+	
+	DPNMSG_RECEIVE r;
+	memset(&r, 0, sizeof(r));
+	
+	static_assert(sizeof(DPNHANDLE) >= sizeof(BufferPool::Buffer*),
+		"DPNHANDLE must be large enough to take a pointer");
+	
+	r.dwSize            = sizeof(r);
+	r.dpnidSender       = dpnidSender;
+	r.pvPlayerContext   = peer->player_ctx;
+	r.pReceiveData      = (BYTE*)(data);
+	r.dwReceiveDataSize = data_size;
+	r.hBufferHandle     = (DPNHANDLE)(buffer);
+	r.dwReceiveFlags    = dwReceiveFlags;
+	
+	HRESULT r_result = dispatch_message(l, DPN_MSGID_RECEIVE, &r);
+	
+	if(r_result != DPNSUCCESS_PENDING)
+	{
+		buffer->unref();
+	}
+	
+	return r_result;
+}
+
 HRESULT DirectPlay8Peer::dispatch_create_player(std::unique_lock<std::mutex> &l, DPNID dpnidPlayer, void **ppvPlayerContext)
 {
 	DPNMSG_CREATE_PLAYER cp;
@@ -5922,6 +7231,8 @@ HRESULT DirectPlay8Peer::dispatch_destroy_player(std::unique_lock<std::mutex> &l
 		{
 			group->player_ids.erase(dpnidPlayer);
 			
+			publish_session();
+			
 			DPNMSG_REMOVE_PLAYER_FROM_GROUP rp;
 			memset(&rp, 0, sizeof(rp));
 			
@@ -5965,16 +7276,18 @@ HRESULT DirectPlay8Peer::dispatch_destroy_group(std::unique_lock<std::mutex> &l,
 	return dispatch_message(l, DPN_MSGID_DESTROY_GROUP, &dg);
 }
 
-DirectPlay8Peer::Peer::Peer(enum PeerState state, int sock, uint32_t ip, uint16_t port):
-	state(state), sock(sock), ip(ip), port(port), recv_busy(false), recv_buf_cur(0), events(0), sq(event), send_open(true), next_ack_id(1)
+DirectPlay8Peer::Peer::Peer(enum PeerState state, int sock, uint32_t ip, uint16_t port, BufferPool &recv_pool):
+	state(state), sock(sock), ip(ip), port(port), recv_busy(false), recv_framer(recv_pool), send_busy(false), recv_again(false), send_again(false), io_busy(0), dying(false), events(0), sq(event, true), send_open(true), stats(GetTickCount64()), last_recv_time(GetTickCount64()), last_send_time(GetTickCount64()), next_ack_id(1), datagrams(recv_pool)
 {}
 
+DirectPlay8Peer::Peer::~Peer() {}
+
 bool DirectPlay8Peer::Peer::enable_events(long events)
 {
 	if(WSAEventSelect(sock, event, (this->events | events)) != 0)
 	{
 		DWORD err = WSAGetLastError();
-		log_printf("WSAEventSelect() error: ", win_strerror(err).c_str());
+		LOG_ERROR(LOG_CAT_SOCKETS, "WSAEventSelect() error: %s", win_strerror(err).c_str());
 		
 		return false;
 	}
@@ -5989,7 +7302,7 @@ bool DirectPlay8Peer::Peer::disable_events(long events)
 	if(WSAEventSelect(sock, event, (this->events & ~events)) != 0)
 	{
 		DWORD err = WSAGetLastError();
-		log_printf("WSAEventSelect() error: ", win_strerror(err).c_str());
+		LOG_ERROR(LOG_CAT_SOCKETS, "WSAEventSelect() error: %s", win_strerror(err).c_str());
 		
 		return false;
 	}
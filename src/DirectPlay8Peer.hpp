@@ -21,21 +21,31 @@
 
 #include <winsock2.h>
 #include <atomic>
+#include <condition_variable>
 #include <dplay8.h>
+#include <list>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <objbase.h>
-#include <queue>
+#include <set>
 #include <stdint.h>
+#include <vector>
 #include <windows.h>
 
 #include "AsyncHandleAllocator.hpp"
+#include "BufferPool.hpp"
+#include "ConnectionStats.hpp"
+#include "DatagramReceiver.hpp"
 #include "EventObject.hpp"
-#include "HandleHandlingPool.hpp"
 #include "HostEnumerator.hpp"
+#include "IOReactor.hpp"
 #include "network.hpp"
 #include "packet.hpp"
 #include "SendQueue.hpp"
+#include "StreamFramer.hpp"
+#include "TimerWheel.hpp"
+#include "WorkQueue.hpp"
 
 class DirectPlay8Peer: public IDirectPlay8Peer
 {
@@ -58,7 +68,10 @@ class DirectPlay8Peer: public IDirectPlay8Peer
 			STATE_TERMINATED,
 		};
 		
-		State state;
+		/* Atomic so methods which only read the session snapshot can check it without
+		 * taking the lock. Only changed while holding the lock.
+		*/
+		std::atomic<State> state;
 		
 		AsyncHandleAllocator handle_alloc;
 		
@@ -86,13 +99,56 @@ class DirectPlay8Peer: public IDirectPlay8Peer
 		EventObject udp_socket_event;
 		EventObject other_socket_event;
 		
-		HandleHandlingPool *worker_pool;
+		IOReactor *worker_pool;
 		
-		std::queue< std::function<void()> > work_queue;
+		/* Tasks queued by queue_work(). work_signalled is set when work_ready has been
+		 * signalled and handle_work() hasn't started draining the queue since, so we only
+		 * signal it once however many tasks are queued in the meantime.
+		*/
+		WorkQueue work_queue;
+		std::atomic<bool> work_signalled;
 		EventObject work_ready;
 		
 		SendQueue udp_sq;
 		
+		/* Timers for periodic and deferred jobs (send timeouts, coalescing flushes).
+		 * timer_event is a waitable timer set for the next time the wheel needs
+		 * advancing, timer_event_due is that time or zero if it isn't set.
+		*/
+		TimerWheel timers;
+		HANDLE timer_event;
+		uint64_t timer_event_due;
+		
+		/* Set while a flush of held DPNSEND_COALESCE messages is scheduled. */
+		bool coalesce_timer_armed;
+		
+		/* Set while the periodic ping and throughput update of every peer is scheduled. */
+		bool stats_timer_armed;
+		
+		/* Set while the periodic keepalive check of every peer is scheduled. */
+		bool keepalive_timer_armed;
+		TimerWheel::TimerID keepalive_timer;
+		
+		/* Values set by SetCaps(), returned by GetCaps(). */
+		DPN_CAPS_EX caps;
+		
+		/* Receive buffers for all peers. DPNMSG_RECEIVE messages hold a reference to the
+		 * buffer their data is in, which is released by ReturnBuffer() if the application
+		 * returned DPNSUCCESS_PENDING.
+		*/
+		BufferPool recv_pool;
+		
+		/* Message ID for the next DPLITE_MSGID_DATAGRAM message we send. */
+		DWORD next_datagram_id;
+		
+		/* Identifies frames from this instance in DPLITE_CAPTURE captures. */
+		uint32_t capture_instance;
+		
+		/* Next sequence number in each DPLITE_MSGID_DATAGRAM channel, indexed by
+		 * DATAGRAM_CHANNEL_SEQUENTIAL and DATAGRAM_CHANNEL_NONSEQUENTIAL.
+		*/
+		DWORD next_datagram_seq[2];
+		
 		struct Peer
 		{
 			enum PeerState {
@@ -145,9 +201,36 @@ class DirectPlay8Peer: public IDirectPlay8Peer
 			std::wstring player_name;
 			std::vector<unsigned char> player_data;
 			
+			/* Receive buffer, taken from recv_pool when data is read from the socket
+			 * and given back once everything in it has been processed. Grows as needed
+			 * to hold the message being read.
+			*/
 			bool recv_busy;
-			unsigned char recv_buf[MAX_PACKET_SIZE];
-			size_t recv_buf_cur;
+			StreamFramer recv_framer;
+			
+			/* Set while a thread is sending from sq, so only one writes to the socket
+			 * at a time.
+			*/
+			bool send_busy;
+			
+			/* Set when a thread is turned away by recv_busy/send_busy. The busy thread
+			 * clears it before each socket call and tries again rather than stopping on
+			 * WSAEWOULDBLOCK if it was set in the meantime, since the event which
+			 * turned the other thread away may have been for data or buffer space which
+			 * arrived after the call.
+			*/
+			bool recv_again;
+			bool send_again;
+			
+			/* Number of threads in a socket call for this peer which was made without
+			 * holding the lock. The peer mustn't be destroyed until it reaches zero.
+			*/
+			unsigned int io_busy;
+			
+			/* Set once peer_destroy() has started on the peer, no new socket calls may
+			 * be made for it without holding the lock after this.
+			*/
+			bool dying;
 			
 			EventObject event;
 			long events;
@@ -155,6 +238,14 @@ class DirectPlay8Peer: public IDirectPlay8Peer
 			SendQueue sq;
 			bool send_open;
 			
+			ConnectionStats stats;
+			
+			/* GetTickCount64() when we last read anything from or finished writing
+			 * anything to the peer, used for keepalives and detecting dead peers.
+			*/
+			uint64_t last_recv_time;
+			uint64_t last_send_time;
+			
 			/* Some messages require confirmation of success/failure from the other
 			 * peer. Each of these is assigned a rolling (per peer) ID, the callback
 			 * associated to which is called when we get a DPLITE_MSGID_ACK.
@@ -162,7 +253,11 @@ class DirectPlay8Peer: public IDirectPlay8Peer
 			DWORD next_ack_id;
 			std::map< DWORD, std::function<void(std::unique_lock<std::mutex>&, HRESULT, const void*, size_t)> > pending_acks;
 			
-			Peer(enum PeerState state, int sock, uint32_t ip, uint16_t port);
+			/* DPLITE_MSGID_DATAGRAM messages being received from the peer. */
+			DatagramReceiver datagrams;
+			
+			Peer(enum PeerState state, int sock, uint32_t ip, uint16_t port, BufferPool &recv_pool);
+			~Peer();
 			
 			bool enable_events(long events);
 			bool disable_events(long events);
@@ -186,6 +281,7 @@ class DirectPlay8Peer: public IDirectPlay8Peer
 		unsigned int next_peer_id;
 		std::map<unsigned int, Peer*> peers;
 		std::condition_variable peer_destroyed;
+		std::condition_variable peer_io_done;
 		
 		std::map<DPNID, unsigned int> player_to_peer_id;
 		
@@ -203,6 +299,48 @@ class DirectPlay8Peer: public IDirectPlay8Peer
 		std::map<DPNID, Group> groups;
 		std::set<DPNID> destroyed_groups;
 		
+		/* Immutable copy of the players and groups in the session, for methods which
+		 * only look them up. A new snapshot is built and published by publish_session()
+		 * whenever players, groups or their contexts change; readers take a reference to
+		 * the current one without locking and old ones are freed when the last reader
+		 * drops its reference.
+		*/
+		struct SessionSnapshot
+		{
+			DPNID local_player_id;
+			void *local_player_ctx;
+			
+			/* Player ID => context of each remote player which can be looked up. */
+			std::map<DPNID, void*> players;
+			
+			/* Player ID => peer ID of each remote player which can be sent to. */
+			std::map<DPNID, unsigned int> player_peer_ids;
+			
+			/* Remote players which are fully connected, in the order they are
+			 * enumerated, and the peer ID of each one.
+			*/
+			std::vector<DPNID> connected_players;
+			std::vector<unsigned int> connected_peer_ids;
+			
+			struct GroupSnapshot
+			{
+				void *ctx;
+				std::vector<DPNID> player_ids;
+				
+				/* Peer IDs of the remote members, so sending to the group doesn't
+				 * need to look each member up.
+				*/
+				std::vector<unsigned int> peer_ids;
+				bool local_member;
+			};
+			
+			std::map<DPNID, GroupSnapshot> groups;
+			
+			SessionSnapshot(): local_player_id(0), local_player_ctx(NULL) {}
+		};
+		
+		std::shared_ptr<const SessionSnapshot> session;
+		
 		/* Serialises access to everything.
 		 *
 		 * All methods and event handlers hold this lock while executing. They will
@@ -225,17 +363,31 @@ class DirectPlay8Peer: public IDirectPlay8Peer
 		Peer *get_peer_by_player_id(DPNID player_id);
 		Group *get_group_by_id(DPNID group_id);
 		
+		void publish_session();
+		std::shared_ptr<const SessionSnapshot> get_session() const;
+		
 		void handle_udp_socket_event();
 		void io_udp_send(std::unique_lock<std::mutex> &l);
 		void handle_other_socket_event();
 		
-		void queue_work(const std::function<void()> &work);
+		void queue_work(WorkTask &&work);
+		void run_or_queue_work(std::unique_lock<std::mutex> &l, bool run_now, WorkTask &&work);
 		void handle_work();
 		
+		TimerWheel::TimerID schedule_timer(uint64_t when, const TimerWheel::Callback &callback);
+		void update_timer_event();
+		void handle_timer_event();
+		
+		void schedule_send_timeout(DPNHANDLE handle, const std::list<Peer*> &targets, DWORD timeout);
+		void arm_coalesce_timer();
+		void arm_stats_timer();
+		void arm_keepalive_timer();
+		
 		void io_peer_triggered(unsigned int peer_id);
 		void io_peer_connected(std::unique_lock<std::mutex> &l, unsigned int peer_id);
 		void io_peer_send(std::unique_lock<std::mutex> &l, unsigned int peer_id);
 		void io_peer_recv(std::unique_lock<std::mutex> &l, unsigned int peer_id);
+		void dispatch_packet(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd, BufferPool::Buffer *buffer);
 		
 		void peer_accept(std::unique_lock<std::mutex> &l);
 		bool peer_connect(Peer::PeerState initial_state, uint32_t remote_ip, uint16_t remote_port, DPNID player_id = 0);
@@ -255,7 +407,8 @@ class DirectPlay8Peer: public IDirectPlay8Peer
 		void handle_connect_peer(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
 		void handle_connect_peer_ok(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
 		void handle_connect_peer_fail(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
-		void handle_message(std::unique_lock<std::mutex> &l, const PacketDeserialiser &pd);
+		void handle_message(std::unique_lock<std::mutex> &l, const PacketDeserialiser &pd, BufferPool::Buffer *buffer);
+		void handle_datagram(std::unique_lock<std::mutex> &l, const PacketDeserialiser &pd, size_t datagram_size, const struct sockaddr_in *from_addr, BufferPool::Buffer *buffer);
 		void handle_playerinfo(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
 		void handle_ack(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
 		void handle_appdesc(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
@@ -268,11 +421,15 @@ class DirectPlay8Peer: public IDirectPlay8Peer
 		void handle_group_joined(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
 		void handle_group_leave(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
 		void handle_group_left(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_coalesced(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd, BufferPool::Buffer *buffer);
+		void handle_ping(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_pong(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
 		
 		void connect_check(std::unique_lock<std::mutex> &l);
 		void connect_fail(std::unique_lock<std::mutex> &l, HRESULT hResultCode, const void *pvApplicationReplyData, DWORD dwApplicationReplyDataSize);
 		
 		HRESULT dispatch_message(std::unique_lock<std::mutex> &l, DWORD dwMessageType, PVOID pvMessage);
+		HRESULT dispatch_receive(std::unique_lock<std::mutex> &l, DPNID dpnidSender, const void *data, size_t data_size, DWORD dwReceiveFlags, BufferPool::Buffer *buffer);
 		HRESULT dispatch_create_player(std::unique_lock<std::mutex> &l, DPNID dpnidPlayer, void **ppvPlayerContext);
 		HRESULT dispatch_destroy_player(std::unique_lock<std::mutex> &l, DPNID dpnidPlayer, void *pvPlayerContext, DWORD dwReason);
 		HRESULT dispatch_destroy_group(std::unique_lock<std::mutex> &l, DPNID dpnidGroup, void *pvGroupContext, DWORD dwReason);
@@ -0,0 +1,400 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <atomic>
+#include <condition_variable>
+#include <dplay8.h>
+#include <list>
+#include <mutex>
+#include <objbase.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+#include <windows.h>
+
+#include "DirectPlay8ThreadPool.hpp"
+#include "IOReactor.hpp"
+#include "Log.hpp"
+
+/* Passed as dwProcessorNum to refer to all processors. */
+#define ALL_PROCESSORS ((DWORD)(-1))
+
+/* The thread count and set of reactors are shared by the whole process, like the real
+ * DirectPlay thread pool.
+ *
+ * The initial thread count can be overridden by setting the DPLITE_THREADS environment
+ * variable, and the workers can be restricted to a set of processors by setting
+ * DPLITE_AFFINITY to a mask of them, e.g. "0x0C" for the third and fourth.
+ *
+ * pool_lock protects the variables below. A reactor's busy count is non-zero while a
+ * DoWork() or set_thread_count() call is using it without pool_lock held, and
+ * destroy_reactor() waits on pool_cv for it to reach zero. set_lock serialises calls to
+ * set_thread_count().
+*/
+
+struct PoolReactor
+{
+	IOReactor *reactor;
+	unsigned int busy;
+	
+	PoolReactor(IOReactor *reactor): reactor(reactor), busy(0) {}
+};
+
+static std::mutex pool_lock;
+static std::condition_variable pool_cv;
+static bool pool_initialised = false;
+static DWORD pool_threads;
+static uint64_t pool_affinity;
+static std::list<PoolReactor> pool_reactors;
+
+static std::mutex set_lock;
+
+/* Reads the environment overrides the first time the pool is used. Must be called with
+ * pool_lock held.
+*/
+static void pool_init()
+{
+	if(pool_initialised)
+	{
+		return;
+	}
+	
+	pool_threads  = DirectPlay8ThreadPool::DEFAULT_THREADS;
+	pool_affinity = 0;
+	
+	const char *threads = getenv("DPLITE_THREADS");
+	if(threads != NULL && *threads != '\0')
+	{
+		pool_threads = strtoul(threads, NULL, 0);
+	}
+	
+	const char *affinity = getenv("DPLITE_AFFINITY");
+	if(affinity != NULL && *affinity != '\0')
+	{
+		pool_affinity = strtoull(affinity, NULL, 0);
+	}
+	
+	pool_initialised = true;
+}
+
+/* Increments the busy count of every registered reactor and returns them. */
+static std::vector<PoolReactor*> pin_reactors()
+{
+	std::vector<PoolReactor*> pinned;
+	
+	for(auto r = pool_reactors.begin(); r != pool_reactors.end(); ++r)
+	{
+		++(r->busy);
+		pinned.push_back(&(*r));
+	}
+	
+	return pinned;
+}
+
+static void unpin_reactors(const std::vector<PoolReactor*> &pinned)
+{
+	for(auto r = pinned.begin(); r != pinned.end(); ++r)
+	{
+		--((*r)->busy);
+	}
+	
+	pool_cv.notify_all();
+}
+
+IOReactor *DirectPlay8ThreadPool::create_reactor()
+{
+	std::unique_lock<std::mutex> l(pool_lock);
+	pool_init();
+	
+	IOReactor *reactor = new IOReactor(pool_threads, pool_affinity);
+	pool_reactors.push_back(PoolReactor(reactor));
+	
+	return reactor;
+}
+
+void DirectPlay8ThreadPool::destroy_reactor(IOReactor *reactor)
+{
+	std::unique_lock<std::mutex> l(pool_lock);
+	
+	for(auto r = pool_reactors.begin(); r != pool_reactors.end(); ++r)
+	{
+		if(r->reactor == reactor)
+		{
+			pool_cv.wait(l, [&r]() { return r->busy == 0; });
+			pool_reactors.erase(r);
+			
+			break;
+		}
+	}
+	
+	l.unlock();
+	
+	delete reactor;
+}
+
+DWORD DirectPlay8ThreadPool::get_thread_count()
+{
+	std::unique_lock<std::mutex> l(pool_lock);
+	pool_init();
+	
+	return pool_threads;
+}
+
+void DirectPlay8ThreadPool::set_thread_count(DWORD threads)
+{
+	std::unique_lock<std::mutex> sl(set_lock);
+	std::unique_lock<std::mutex> pl(pool_lock);
+	pool_init();
+	
+	pool_threads = threads;
+	
+	/* Don't hold pool_lock while the workers are replaced, a callback in one of the old
+	 * workers might be creating or destroying a peer.
+	*/
+	
+	std::vector<PoolReactor*> pinned = pin_reactors();
+	pl.unlock();
+	
+	for(auto r = pinned.begin(); r != pinned.end(); ++r)
+	{
+		(*r)->reactor->set_threads(threads);
+	}
+	
+	pl.lock();
+	unpin_reactors(pinned);
+}
+
+DirectPlay8ThreadPool::DirectPlay8ThreadPool(std::atomic<unsigned int> *global_refcount):
+	global_refcount(global_refcount),
+	local_refcount(0),
+	initialised(false),
+	message_handler(NULL),
+	message_handler_ctx(NULL)
+{
+	AddRef();
+}
+
+DirectPlay8ThreadPool::~DirectPlay8ThreadPool() {}
+
+HRESULT DirectPlay8ThreadPool::QueryInterface(REFIID riid, void **ppvObject)
+{
+	if(riid == IID_IDirectPlay8ThreadPool || riid == IID_IUnknown)
+	{
+		*((IUnknown**)(ppvObject)) = this;
+		AddRef();
+		
+		return S_OK;
+	}
+	else{
+		return E_NOINTERFACE;
+	}
+}
+
+ULONG DirectPlay8ThreadPool::AddRef(void)
+{
+	if(global_refcount != NULL)
+	{
+		++(*global_refcount);
+	}
+	
+	return ++local_refcount;
+}
+
+ULONG DirectPlay8ThreadPool::Release(void)
+{
+	std::atomic<unsigned int> *global_refcount = this->global_refcount;
+	
+	ULONG rc = --local_refcount;
+	if(rc == 0)
+	{
+		delete this;
+	}
+	
+	if(global_refcount != NULL)
+	{
+		--(*global_refcount);
+	}
+	
+	return rc;
+}
+
+HRESULT DirectPlay8ThreadPool::Initialize(PVOID CONST pvUserContext, CONST PFNDPNMESSAGEHANDLER pfn, CONST DWORD dwFlags)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(initialised)
+	{
+		return DPNERR_ALREADYINITIALIZED;
+	}
+	
+	if(pfn == NULL)
+	{
+		return DPNERR_INVALIDPARAM;
+	}
+	
+	/* We never create or destroy threads while an application is watching, so the
+	 * DPN_MSGID_CREATE_THREAD and DPN_MSGID_DESTROY_THREAD messages are never raised.
+	*/
+	
+	message_handler     = pfn;
+	message_handler_ctx = pvUserContext;
+	
+	initialised = true;
+	
+	return S_OK;
+}
+
+HRESULT DirectPlay8ThreadPool::Close(CONST DWORD dwFlags)
+{
+	if(IOReactor::in_callback())
+	{
+		return DPNERR_NOTALLOWED;
+	}
+	
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(!initialised)
+	{
+		return DPNERR_UNINITIALIZED;
+	}
+	
+	initialised = false;
+	
+	return S_OK;
+}
+
+HRESULT DirectPlay8ThreadPool::GetThreadCount(CONST DWORD dwProcessorNum, DWORD* CONST pdwNumThreads, CONST DWORD dwFlags)
+{
+	{
+		std::unique_lock<std::mutex> l(lock);
+		
+		if(!initialised)
+		{
+			return DPNERR_UNINITIALIZED;
+		}
+	}
+	
+	if(dwProcessorNum != ALL_PROCESSORS)
+	{
+		LOG_WARN(LOG_CAT_GENERAL, "DirectPlay8ThreadPool::GetThreadCount: Per-processor thread counts are not supported");
+		return DPNERR_UNSUPPORTED;
+	}
+	
+	*pdwNumThreads = get_thread_count();
+	
+	return S_OK;
+}
+
+HRESULT DirectPlay8ThreadPool::SetThreadCount(CONST DWORD dwProcessorNum, CONST DWORD dwNumThreads, CONST DWORD dwFlags)
+{
+	if(IOReactor::in_callback())
+	{
+		return DPNERR_NOTALLOWED;
+	}
+	
+	{
+		std::unique_lock<std::mutex> l(lock);
+		
+		if(!initialised)
+		{
+			return DPNERR_UNINITIALIZED;
+		}
+	}
+	
+	if(dwProcessorNum != ALL_PROCESSORS)
+	{
+		LOG_WARN(LOG_CAT_GENERAL, "DirectPlay8ThreadPool::SetThreadCount: Per-processor thread counts are not supported");
+		return DPNERR_UNSUPPORTED;
+	}
+	
+	set_thread_count(dwNumThreads);
+	
+	return S_OK;
+}
+
+HRESULT DirectPlay8ThreadPool::DoWork(CONST DWORD dwAllowedTimeSlice, CONST DWORD dwFlags)
+{
+	if(IOReactor::in_callback())
+	{
+		return DPNERR_NOTALLOWED;
+	}
+	
+	{
+		std::unique_lock<std::mutex> l(lock);
+		
+		if(!initialised)
+		{
+			return DPNERR_UNINITIALIZED;
+		}
+	}
+	
+	std::unique_lock<std::mutex> pl(pool_lock);
+	pool_init();
+	
+	if(pool_threads != 0)
+	{
+		return DPNERR_NOTALLOWED;
+	}
+	
+	std::vector<PoolReactor*> pinned = pin_reactors();
+	pl.unlock();
+	
+	/* Process events until none are ready or we run out of time. A time slice of zero
+	 * processes a single event, INFINITE runs until there is nothing left.
+	*/
+	
+	ULONGLONG deadline = GetTickCount64() + dwAllowedTimeSlice;
+	HRESULT result = S_OK;
+	
+	while(1)
+	{
+		bool did_work = false;
+		bool expired  = false;
+		
+		for(auto r = pinned.begin(); r != pinned.end() && !expired; ++r)
+		{
+			while((*r)->reactor->poll(0))
+			{
+				did_work = true;
+				
+				if(dwAllowedTimeSlice != INFINITE && GetTickCount64() >= deadline)
+				{
+					expired = true;
+					break;
+				}
+			}
+		}
+		
+		if(!did_work)
+		{
+			break;
+		}
+		
+		if(expired)
+		{
+			result = DPNSUCCESS_PENDING;
+			break;
+		}
+	}
+	
+	pl.lock();
+	unpin_reactors(pinned);
+	
+	return result;
+}
@@ -0,0 +1,91 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_DIRECTPLAY8THREADPOOL_HPP
+#define DPLITE_DIRECTPLAY8THREADPOOL_HPP
+
+#include <winsock2.h>
+#include <atomic>
+#include <dplay8.h>
+#include <mutex>
+#include <objbase.h>
+
+#include "IOReactor.hpp"
+
+/* The IDirectPlay8ThreadPool interface controls the number of threads which service network
+ * I/O and raise message callbacks for every DirectPlay8Peer in the process.
+ *
+ * Each peer has its own IOReactor, created by create_reactor(), and the thread count set
+ * here is applied to all of them. With a thread count of zero nothing happens in the
+ * background and the application must call DoWork() regularly to process network events,
+ * in which case all callbacks are raised from within DoWork().
+*/
+
+class DirectPlay8ThreadPool: public IDirectPlay8ThreadPool
+{
+	private:
+		std::atomic<unsigned int> * const global_refcount;
+		ULONG local_refcount;
+		
+		std::mutex lock;
+		
+		bool initialised;
+		
+		PFNDPNMESSAGEHANDLER message_handler;
+		PVOID message_handler_ctx;
+		
+	public:
+		/* Number of threads used before SetThreadCount() is called, unless overridden by
+		 * the DPLITE_THREADS environment variable.
+		*/
+		static const DWORD DEFAULT_THREADS = 4;
+		
+		static DWORD get_thread_count();
+		
+		/* Changes the number of threads running in every IOReactor. Must not be called
+		 * from within an IOReactor callback.
+		*/
+		static void set_thread_count(DWORD threads);
+		
+		/* Creates an IOReactor running the current number of threads and registers it so
+		 * that SetThreadCount() and DoWork() apply to it.
+		*/
+		static IOReactor *create_reactor();
+		
+		/* Unregisters and destroys an IOReactor from create_reactor(), waiting for any
+		 * DoWork() calls which are servicing it.
+		*/
+		static void destroy_reactor(IOReactor *reactor);
+		
+		DirectPlay8ThreadPool(std::atomic<unsigned int> *global_refcount);
+		virtual ~DirectPlay8ThreadPool();
+		
+		/* IUnknown */
+		virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject) override;
+		virtual ULONG STDMETHODCALLTYPE AddRef() override;
+		virtual ULONG STDMETHODCALLTYPE Release() override;
+		
+		/* IDirectPlay8ThreadPool */
+		virtual HRESULT STDMETHODCALLTYPE Initialize(PVOID CONST pvUserContext, CONST PFNDPNMESSAGEHANDLER pfn, CONST DWORD dwFlags) override;
+		virtual HRESULT STDMETHODCALLTYPE Close(CONST DWORD dwFlags) override;
+		virtual HRESULT STDMETHODCALLTYPE GetThreadCount(CONST DWORD dwProcessorNum, DWORD* CONST pdwNumThreads, CONST DWORD dwFlags) override;
+		virtual HRESULT STDMETHODCALLTYPE SetThreadCount(CONST DWORD dwProcessorNum, CONST DWORD dwNumThreads, CONST DWORD dwFlags) override;
+		virtual HRESULT STDMETHODCALLTYPE DoWork(CONST DWORD dwAllowedTimeSlice, CONST DWORD dwFlags) override;
+};
+
+#endif /* !DPLITE_DIRECTPLAY8THREADPOOL_HPP */
@@ -24,6 +24,7 @@
 #include "COMAPIException.hpp"
 #include "DirectPlay8Address.hpp"
 #include "HostEnumerator.hpp"
+#include "Log.hpp"
 #include "Messages.hpp"
 #include "packet.hpp"
 
@@ -235,6 +236,8 @@ void HostEnumerator::main()
 			sendto(sock, (const char*)(raw.first), raw.second, 0,
 				(struct sockaddr*)(&send_addr), sizeof(send_addr));
 			
+			LOG_TRACE(LOG_CAT_ENUM, "Sent DPLITE_MSGID_HOST_ENUM_REQUEST");
+			
 			next_tx_at = now + tx_interval;
 			--tx_remain;
 			
@@ -296,6 +299,8 @@ void HostEnumerator::handle_packet(const void *data, size_t size, struct sockadd
 		return;
 	}
 	
+	LOG_TRACE(LOG_CAT_ENUM, "Received DPLITE_MSGID_HOST_ENUM_RESPONSE (%u bytes)", (unsigned)(size));
+	
 	DPN_APPLICATION_DESC app_desc;
 	memset(&app_desc, 0, sizeof(app_desc));
 	std::wstring app_desc_pwszSessionName;
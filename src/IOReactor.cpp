@@ -0,0 +1,444 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+#include <exception>
+#include <stdexcept>
+
+#include "IOReactor.hpp"
+
+#ifdef _WIN32
+#include "log.hpp"
+#endif
+
+/* Depth of IOReactor callbacks executing in this thread. */
+static thread_local unsigned int callback_depth = 0;
+
+IOReactor::IOReactor(size_t threads, uint64_t affinity):
+	next_id(1),
+	affinity(affinity)
+{
+#ifdef _WIN32
+	/* The concurrency value is left at the number of processors, since the number of
+	 * workers can change later.
+	*/
+	iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+	if(iocp == NULL)
+	{
+		throw std::runtime_error("Unable to create I/O completion port");
+	}
+#else
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(epoll_fd == -1)
+	{
+		throw std::runtime_error("Unable to create epoll instance");
+	}
+	
+	stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(stop_fd == -1)
+	{
+		close(epoll_fd);
+		throw std::runtime_error("Unable to create eventfd");
+	}
+	
+	/* stop_fd is level triggered and only read once the workers have exited, so when
+	 * stop_workers() writes to it every worker will see it. ID zero is never given to a
+	 * registration.
+	*/
+	
+	struct epoll_event event;
+	event.events   = EPOLLIN;
+	event.data.u64 = 0;
+	
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &event) != 0)
+	{
+		close(stop_fd);
+		close(epoll_fd);
+		throw std::runtime_error("Unable to add eventfd to epoll instance");
+	}
+#endif
+	
+	try {
+		start_workers(threads);
+	}
+	catch(const std::exception &e)
+	{
+#ifdef _WIN32
+		CloseHandle(iocp);
+#else
+		close(stop_fd);
+		close(epoll_fd);
+#endif
+		
+		throw;
+	}
+}
+
+IOReactor::~IOReactor()
+{
+	/* Remove any remaining handles first, so nothing is dispatched after we start stopping
+	 * the workers.
+	*/
+	
+	std::vector<Handle> handles;
+	
+	{
+		std::unique_lock<std::mutex> l(lock);
+		
+		for(auto h = handle_ids.begin(); h != handle_ids.end(); ++h)
+		{
+			handles.push_back(h->first);
+		}
+	}
+	
+	for(auto h = handles.begin(); h != handles.end(); ++h)
+	{
+		remove_handle(*h);
+	}
+	
+	stop_workers();
+	
+#ifdef _WIN32
+	CloseHandle(iocp);
+#else
+	close(stop_fd);
+	close(epoll_fd);
+#endif
+}
+
+void IOReactor::add_handle(Handle handle, const std::function<void()> &callback)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(handle_ids.find(handle) != handle_ids.end())
+	{
+		throw std::invalid_argument("Handle is already registered");
+	}
+	
+	/* Skip zero and any IDs still in use if we ever wrap around. */
+	
+	uintptr_t id;
+	do {
+		id = next_id++;
+	} while(id == 0 || registrations.find(id) != registrations.end());
+	
+	std::shared_ptr<Registration> reg = std::make_shared<Registration>(id, handle, callback);
+	
+	registrations.insert(std::make_pair(id, reg));
+	handle_ids.insert(std::make_pair(handle, id));
+	
+#ifdef _WIN32
+	reg->reactor = this;
+	
+	if(!arm(reg.get()))
+	{
+		handle_ids.erase(handle);
+		registrations.erase(id);
+		
+		throw std::runtime_error("Unable to register wait");
+	}
+#else
+	struct epoll_event event;
+	event.events   = EPOLLIN | EPOLLET;
+	event.data.u64 = id;
+	
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handle, &event) != 0)
+	{
+		handle_ids.erase(handle);
+		registrations.erase(id);
+		
+		throw std::runtime_error("Unable to add descriptor to epoll instance");
+	}
+#endif
+}
+
+void IOReactor::remove_handle(Handle handle)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	auto h = handle_ids.find(handle);
+	if(h == handle_ids.end())
+	{
+		return;
+	}
+	
+	auto r = registrations.find(h->second);
+	std::shared_ptr<Registration> reg = r->second;
+	
+	registrations.erase(r);
+	handle_ids.erase(h);
+	
+#ifdef _WIN32
+	HANDLE wait = reg->wait;
+	reg->wait = NULL;
+	
+	l.unlock();
+	
+	if(wait != NULL)
+	{
+		/* Block until the wait callback has returned if it is running, since it still
+		 * references reg. A completion it already posted is ignored by dispatch() now that
+		 * the ID has gone.
+		*/
+		UnregisterWaitEx(wait, INVALID_HANDLE_VALUE);
+	}
+#else
+	/* Fails if the descriptor has already been closed, which removes it anyway. */
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, handle, NULL);
+#endif
+}
+
+void IOReactor::set_threads(size_t threads)
+{
+	stop_workers();
+	start_workers(threads);
+}
+
+void IOReactor::set_affinity(uint64_t affinity)
+{
+	this->affinity = affinity;
+	
+	for(auto w = workers.begin(); w != workers.end(); ++w)
+	{
+		apply_affinity(*w);
+	}
+}
+
+bool IOReactor::poll(int timeout_ms)
+{
+	return wait_and_dispatch(timeout_ms) > 0;
+}
+
+bool IOReactor::in_callback()
+{
+	return callback_depth > 0;
+}
+
+void IOReactor::worker_main()
+{
+	while(wait_and_dispatch(-1) >= 0) {}
+}
+
+/* Waits for a handle to become ready and dispatches it. Returns 1 if a callback was invoked,
+ * 0 if nothing was ready within the timeout, or -1 if the calling worker should exit.
+*/
+int IOReactor::wait_and_dispatch(int timeout_ms)
+{
+#ifdef _WIN32
+	DWORD bytes;
+	ULONG_PTR key;
+	OVERLAPPED *overlapped;
+	
+	if(!GetQueuedCompletionStatus(iocp, &bytes, &key, &overlapped, (timeout_ms < 0 ? INFINITE : (DWORD)(timeout_ms))))
+	{
+		if(overlapped == NULL && GetLastError() == WAIT_TIMEOUT)
+		{
+			return 0;
+		}
+		
+		/* Only fails without dequeuing anything if the port is broken. */
+		LOG_ERROR(LOG_CAT_SOCKETS, "GetQueuedCompletionStatus: %s", win_strerror(GetLastError()).c_str());
+		return -1;
+	}
+	
+	if(key == 0)
+	{
+		/* Posted by stop_workers(). If poll() picked it up, put it back for a worker. */
+		if(timeout_ms >= 0)
+		{
+			PostQueuedCompletionStatus(iocp, 0, 0, NULL);
+			return 0;
+		}
+		
+		return -1;
+	}
+	
+	dispatch(key);
+#else
+	struct epoll_event event;
+	
+	int n = epoll_wait(epoll_fd, &event, 1, timeout_ms);
+	if(n < 0)
+	{
+		return (errno == EINTR ? 0 : -1);
+	}
+	else if(n == 0)
+	{
+		return 0;
+	}
+	
+	if(event.data.u64 == 0)
+	{
+		/* stop_fd has been written to by stop_workers(). */
+		return (timeout_ms >= 0 ? 0 : -1);
+	}
+	
+	dispatch(event.data.u64);
+#endif
+	
+	return 1;
+}
+
+void IOReactor::dispatch(uintptr_t id)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	auto r = registrations.find(id);
+	if(r == registrations.end())
+	{
+		/* Removed since it became ready. */
+		return;
+	}
+	
+	/* Take a reference so the callback functor can't disappear from under itself if the
+	 * handle is removed while it is executing.
+	*/
+	std::shared_ptr<Registration> reg = r->second;
+	
+	l.unlock();
+	
+	++callback_depth;
+	reg->callback();
+	--callback_depth;
+}
+
+void IOReactor::start_workers(size_t threads)
+{
+	try {
+		for(size_t i = 0; i < threads; ++i)
+		{
+			workers.push_back(std::thread(&IOReactor::worker_main, this));
+			apply_affinity(workers.back());
+		}
+	}
+	catch(const std::exception &e)
+	{
+		stop_workers();
+		throw;
+	}
+}
+
+void IOReactor::stop_workers()
+{
+	if(workers.empty())
+	{
+		return;
+	}
+	
+#ifdef _WIN32
+	for(size_t i = 0; i < workers.size(); ++i)
+	{
+		PostQueuedCompletionStatus(iocp, 0, 0, NULL);
+	}
+#else
+	uint64_t one = 1;
+	write(stop_fd, &one, sizeof(one));
+#endif
+	
+	for(auto w = workers.begin(); w != workers.end(); ++w)
+	{
+		w->join();
+	}
+	
+	workers.clear();
+	
+#ifndef _WIN32
+	/* Reset stop_fd so any new workers don't exit straight away. */
+	uint64_t value;
+	read(stop_fd, &value, sizeof(value));
+#endif
+}
+
+/* Restricts a worker to the processors in affinity, if any. Failure isn't fatal, the worker
+ * just runs wherever the scheduler puts it.
+*/
+void IOReactor::apply_affinity(std::thread &thread)
+{
+	if(affinity == 0)
+	{
+		return;
+	}
+	
+#ifdef _WIN32
+	if(SetThreadAffinityMask(thread.native_handle(), (DWORD_PTR)(affinity)) == 0)
+	{
+		LOG_WARN(LOG_CAT_GENERAL, "SetThreadAffinityMask: %s", win_strerror(GetLastError()).c_str());
+	}
+#else
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	
+	for(unsigned int i = 0; i < 64 && i < CPU_SETSIZE; ++i)
+	{
+		if(affinity & ((uint64_t)(1) << i))
+		{
+			CPU_SET(i, &cpus);
+		}
+	}
+	
+	pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+#endif
+}
+
+#ifdef _WIN32
+/* Registers the thread pool wait for a registration, which fires every time the handle is
+ * signalled until it is unregistered. Must be called with lock held.
+*/
+bool IOReactor::arm(Registration *reg)
+{
+	if(!RegisterWaitForSingleObject(&(reg->wait), reg->handle, &wait_callback, reg, INFINITE, WT_EXECUTEINWAITTHREAD))
+	{
+		reg->wait = NULL;
+		return false;
+	}
+	
+	return true;
+}
+
+VOID CALLBACK IOReactor::wait_callback(PVOID context, BOOLEAN timed_out)
+{
+	Registration *reg = (Registration*)(context);
+	
+	/* remove_handle() may release reg as soon as we return, so don't touch it after
+	 * posting the completion.
+	*/
+	HANDLE iocp  = reg->reactor->iocp;
+	ULONG_PTR id = reg->id;
+	
+	PostQueuedCompletionStatus(iocp, 0, id, NULL);
+}
+#endif
+
+IOReactor::Registration::Registration(uintptr_t id, Handle handle, const std::function<void()> &callback):
+	id(id), handle(handle), callback(callback)
+#ifdef _WIN32
+	, reactor(NULL), wait(NULL)
+#endif
+	{}
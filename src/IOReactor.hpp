@@ -0,0 +1,154 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_IOREACTOR_HPP
+#define DPLITE_IOREACTOR_HPP
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <windows.h>
+#endif
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/* This class runs a fixed number of worker threads which invoke callback functors when the
+ * handles registered with it become ready, without needing more threads as more handles are
+ * added.
+ *
+ * On Windows, handles are auto reset event objects. Each one is watched by a thread pool
+ * wait (RegisterWaitForSingleObject()) which posts a completion packet to an I/O completion
+ * port each time it is signalled, and the workers service the completion port.
+ *
+ * Elsewhere, handles are file descriptors which are watched for becoming readable using
+ * edge triggered epoll, which behaves like an auto reset event. This backend exists so the
+ * reactor can be tested on Linux.
+ *
+ * Handles may be added or removed at any point without disturbing any other handles.
+ *
+ * Each time a handle is signalled its callback is invoked once, even if it is already
+ * running in another worker, so a callback which waits for something to happen on its own
+ * handle (e.g. a blocking send from within a receive callback) doesn't deadlock. Callbacks
+ * must be safe to run concurrently and should not block, as that ties up one of the workers.
+ *
+ * A callback which is running when its handle is removed will run to completion, and the
+ * destructor must not be called from within a callback.
+ *
+ * The reactor may have zero worker threads, in which case nothing is dispatched until some
+ * thread calls poll().
+*/
+
+class IOReactor
+{
+	public:
+#ifdef _WIN32
+		typedef HANDLE Handle;
+#else
+		typedef int Handle;
+#endif
+		
+	private:
+		struct Registration
+		{
+			const uintptr_t id;
+			const Handle handle;
+			const std::function<void()> callback;
+			
+#ifdef _WIN32
+			IOReactor *reactor;
+			
+			/* Thread pool wait object, NULL once unregistered. */
+			HANDLE wait;
+#endif
+			
+			Registration(uintptr_t id, Handle handle, const std::function<void()> &callback);
+		};
+		
+		/* lock protects registrations, handle_ids and next_id. Registrations are looked up
+		 * by ID rather than the handle so that a handle which is removed and re-added
+		 * while a completion is still queued for it can't be mistaken for the new one.
+		*/
+		
+		std::mutex lock;
+		
+		std::unordered_map< uintptr_t, std::shared_ptr<Registration> > registrations;
+		std::unordered_map<Handle, uintptr_t> handle_ids;
+		uintptr_t next_id;
+		
+#ifdef _WIN32
+		HANDLE iocp;
+		
+		bool arm(Registration *reg);
+		static VOID CALLBACK wait_callback(PVOID context, BOOLEAN timed_out);
+#else
+		int epoll_fd;
+		int stop_fd;
+#endif
+		
+		std::vector<std::thread> workers;
+		uint64_t affinity;
+		
+		void worker_main();
+		int wait_and_dispatch(int timeout_ms);
+		void dispatch(uintptr_t id);
+		void start_workers(size_t threads);
+		void stop_workers();
+		void apply_affinity(std::thread &thread);
+		
+	public:
+		/* affinity is a mask of processors the workers may run on, zero for any. */
+		IOReactor(size_t threads, uint64_t affinity = 0);
+		~IOReactor();
+		
+		/* No copy c'tor. */
+		IOReactor(const IOReactor &src) = delete;
+		
+		void add_handle(Handle handle, const std::function<void()> &callback);
+		void remove_handle(Handle handle);
+		
+		size_t get_threads() const { return workers.size(); }
+		
+		/* Changes the number of worker threads. Handles remain registered, and anything which
+		 * becomes ready while the workers are being replaced is dispatched once they are
+		 * running. Must not be called from within a callback.
+		*/
+		void set_threads(size_t threads);
+		
+		uint64_t get_affinity() const { return affinity; }
+		
+		/* Changes the processors the workers may run on, zero for any. Must not be called
+		 * concurrently with set_threads().
+		*/
+		void set_affinity(uint64_t affinity);
+		
+		/* Waits up to timeout_ms milliseconds (forever if negative) for a handle to become
+		 * ready and invokes its callback in the calling thread. Returns true if a callback
+		 * was invoked.
+		*/
+		bool poll(int timeout_ms);
+		
+		/* Returns true if the calling thread is executing a callback from any IOReactor. */
+		static bool in_callback();
+};
+
+#endif /* !DPLITE_IOREACTOR_HPP */
@@ -17,18 +17,278 @@
 */
 
 #include <winsock2.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <limits.h>
 #include <mutex>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <vector>
 #include <windows.h>
 
 #include "Log.hpp"
 
+/* Each thread which logs anything formats its lines into its own LogRing, which is drained
+ * by a background writer thread. The owning thread is the only writer of a ring's head and
+ * the writer thread the only writer of its tail, so adding a line needs no locking and no
+ * system calls.
+ *
+ * Lines are numbered from a global counter so the writer can put lines from different
+ * threads back in order before writing them out.
+*/
+
+#define RING_SIZE 256         /* Lines per thread, must be a power of two. */
+#define LINE_SIZE 256         /* Bytes stored inline per line, longer lines go on the heap. */
+#define WRITE_INTERVAL_MS 50  /* How often the writer thread wakes up if not woken early. */
+
+struct LogLine
+{
+	uint64_t seq;
+	size_t length;
+	char *long_text;  /* Heap allocated text if the line didn't fit in text, otherwise NULL. */
+	char text[LINE_SIZE];
+};
+
+struct LogRing
+{
+	LogLine lines[RING_SIZE];
+	
+	/* Kept on separate cache lines so the owning thread and writer don't contend. */
+	alignas(64) std::atomic<size_t> head;
+	alignas(64) std::atomic<size_t> tail;
+	
+	/* Lines discarded because the ring was full. */
+	std::atomic<unsigned> dropped;
+	
+	/* Set when the owning thread exits, the ring is freed once drained. */
+	std::atomic<bool> orphaned;
+	
+	DWORD thread_id;
+	
+	LogRing(DWORD thread_id):
+		head(0), tail(0), dropped(0), orphaned(false), thread_id(thread_id)
+	{
+		for(size_t i = 0; i < RING_SIZE; ++i)
+		{
+			lines[i].long_text = NULL;
+		}
+	}
+};
+
+/* Marks the calling thread's ring as orphaned when the thread exits. */
+struct LogRingOwner
+{
+	LogRing *ring;
+	
+	LogRingOwner(): ring(NULL) {}
+	
+	~LogRingOwner()
+	{
+		if(ring != NULL)
+		{
+			ring->orphaned.store(true, std::memory_order_release);
+		}
+	}
+};
+
+/* State shared with the writer thread. This is never destroyed, since the writer may still
+ * be running while static objects are destroyed at exit.
+*/
+struct WriterState
+{
+	/* Rings of every thread which has logged. */
+	std::mutex rings_lock;
+	std::vector<LogRing*> rings;
+	
+	std::mutex lock;
+	std::condition_variable cv;
+	bool stop;
+	bool stopped;
+	
+	WriterState(): stop(false), stopped(false) {}
+};
+
+std::atomic<int> log_category_levels[LOG_CAT_COUNT] = {
+	{ INT_MAX }, { INT_MAX }, { INT_MAX }, { INT_MAX }, { INT_MAX }, { INT_MAX },
+};
+
+static const char *const CATEGORY_NAMES[LOG_CAT_COUNT] = {
+	"general",
+	"sockets",
+	"sendqueue",
+	"dispatch",
+	"groups",
+	"enum",
+};
+
+static const char *const LEVEL_NAMES[] = {
+	"error",
+	"warn",
+	"info",
+	"trace",
+};
+
 static std::mutex lock;
-static bool initialised = false;
+static std::atomic<bool> initialised(false);
+static std::atomic<bool> trace_enabled(false);
 static FILE *log_fh = NULL;
-static bool trace_enabled = false;
+
+static std::atomic<uint64_t> next_seq(0);
+
+static thread_local LogRingOwner ring_owner;
+
+static WriterState *writer_state()
+{
+	static WriterState *ws = new WriterState();
+	return ws;
+}
+
+static LogRing *get_ring()
+{
+	if(ring_owner.ring == NULL)
+	{
+		LogRing *ring = new LogRing(GetCurrentThreadId());
+		
+		WriterState *ws = writer_state();
+		
+		std::unique_lock<std::mutex> l(ws->rings_lock);
+		ws->rings.push_back(ring);
+		
+		ring_owner.ring = ring;
+	}
+	
+	return ring_owner.ring;
+}
+
+/* Writes out every line currently in the rings, oldest first. Only called by the writer
+ * thread, or by log_fini() once it has stopped.
+*/
+static void drain()
+{
+	WriterState *ws = writer_state();
+	std::vector<LogRing*> &rings = ws->rings;
+	
+	struct Pending
+	{
+		uint64_t seq;
+		const char *text;
+		size_t length;
+	};
+	
+	static std::vector<Pending> batch;
+	
+	std::unique_lock<std::mutex> l(ws->rings_lock);
+	
+	std::vector<size_t> heads(rings.size());
+	unsigned dropped = 0;
+	
+	for(size_t r = 0; r < rings.size(); ++r)
+	{
+		LogRing *ring = rings[r];
+		
+		heads[r] = ring->head.load(std::memory_order_acquire);
+		dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+		
+		for(size_t i = ring->tail.load(std::memory_order_relaxed); i != heads[r]; ++i)
+		{
+			LogLine &line = ring->lines[i & (RING_SIZE - 1)];
+			
+			Pending p = { line.seq, (line.long_text != NULL ? line.long_text : line.text), line.length };
+			batch.push_back(p);
+		}
+	}
+	
+	std::sort(batch.begin(), batch.end(),
+		[](const Pending &a, const Pending &b) { return a.seq < b.seq; });
+	
+	for(auto p = batch.begin(); p != batch.end(); ++p)
+	{
+		fwrite(p->text, 1, p->length, log_fh);
+	}
+	
+	if(dropped > 0)
+	{
+		fprintf(log_fh, "[%u log messages dropped]\n", dropped);
+	}
+	
+	fflush(log_fh);
+	
+	batch.clear();
+	
+	/* Give the written lines back to their threads and free the rings of any threads
+	 * which have exited.
+	*/
+	
+	size_t w = 0;
+	
+	for(size_t r = 0; r < rings.size(); ++r)
+	{
+		LogRing *ring = rings[r];
+		
+		for(size_t i = ring->tail.load(std::memory_order_relaxed); i != heads[r]; ++i)
+		{
+			LogLine &line = ring->lines[i & (RING_SIZE - 1)];
+			
+			free(line.long_text);
+			line.long_text = NULL;
+		}
+		
+		ring->tail.store(heads[r], std::memory_order_release);
+		
+		if(ring->orphaned.load(std::memory_order_acquire) && ring->head.load(std::memory_order_acquire) == heads[r])
+		{
+			delete ring;
+		}
+		else{
+			rings[w++] = ring;
+		}
+	}
+	
+	rings.resize(w);
+}
+
+static void writer_loop()
+{
+	WriterState *ws = writer_state();
+	
+	std::unique_lock<std::mutex> l(ws->lock);
+	
+	while(!ws->stop)
+	{
+		ws->cv.wait_for(l, std::chrono::milliseconds(WRITE_INTERVAL_MS));
+		
+		l.unlock();
+		drain();
+		l.lock();
+	}
+	
+	/* log_fini() may be waiting inside DllMain(), where joining this thread would deadlock
+	 * on the loader lock, so we tell it we're finished instead.
+	*/
+	ws->stopped = true;
+	ws->cv.notify_all();
+}
+
+/* The writer thread holds a reference to the module it is running from (passed as module)
+ * so the module can't be unloaded until the thread has completely finished executing its
+ * code, which it releases on the way out using FreeLibraryAndExitThread().
+*/
+static DWORD WINAPI writer_main(LPVOID module)
+{
+	writer_loop();
+	
+	if(module != NULL)
+	{
+		FreeLibraryAndExitThread((HMODULE)(module), 0);
+	}
+	
+	return 0;
+}
 
 static void _log_init()
 {
@@ -43,27 +303,143 @@ static void _log_init()
 		log_fh = fopen(log_name, "a");
 		if(log_fh != NULL)
 		{
-			setbuf(log_fh, NULL);
+			setvbuf(log_fh, NULL, _IOFBF, 65536);
+		}
+	}
+	
+	if(log_fh != NULL)
+	{
+		WriterState *ws = writer_state();
+		
+		ws->stop    = false;
+		ws->stopped = false;
+		
+		HMODULE module;
+		if(!GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCTSTR)(&writer_main), &module))
+		{
+			module = NULL;
+		}
+		
+		HANDLE thread = CreateThread(NULL, 0, &writer_main, module, 0, NULL);
+		if(thread != NULL)
+		{
+			CloseHandle(thread);
+		}
+		else{
+			/* No writer, so log to nothing rather than filling up the rings. */
+			
+			if(module != NULL)
+			{
+				FreeLibrary(module);
+			}
+			
+			fclose(log_fh);
+			log_fh = NULL;
+		}
+	}
+	
+	/* DPLITE_LOG_LEVEL sets the level for every category, DPLITE_TRACE may then be set to
+	 * a non-zero number to enable tracing of every category, or a comma separated list of
+	 * category names to trace, e.g. "sockets,sendqueue".
+	*/
+	
+	int level = LOG_LVL_INFO;
+	
+	const char *level_name = getenv("DPLITE_LOG_LEVEL");
+	if(level_name != NULL)
+	{
+		for(int i = 0; i <= LOG_LVL_TRACE; ++i)
+		{
+			if(strcmp(level_name, LEVEL_NAMES[i]) == 0)
+			{
+				level = i;
+			}
 		}
 	}
 	
 	const char *t = getenv("DPLITE_TRACE");
-	trace_enabled = (t && atoi(t) != 0);
+	bool trace_all = (t && atoi(t) != 0);
+	
+	trace_enabled = false;
+	
+	for(int c = 0; c < LOG_CAT_COUNT; ++c)
+	{
+		bool trace_c = trace_all;
+		
+		for(const char *n = t; n != NULL && *n != '\0' && !trace_c;)
+		{
+			size_t n_len = strcspn(n, ",");
+			
+			if(n_len == strlen(CATEGORY_NAMES[c]) && strncmp(n, CATEGORY_NAMES[c], n_len) == 0)
+			{
+				trace_c = true;
+			}
+			
+			n += n_len;
+			n += (*n == ',');
+		}
+		
+		if(trace_c)
+		{
+			trace_enabled = true;
+		}
+		
+		int c_level = -1;
+		if(log_fh != NULL)
+		{
+			c_level = trace_c ? LOG_LVL_TRACE : level;
+		}
+		
+		log_category_levels[c].store(c_level, std::memory_order_relaxed);
+	}
 	
-	initialised = true;
+	initialised.store(true, std::memory_order_release);
 }
 
 static void _log_fini()
 {
-	initialised = false;
+	if(!initialised)
+	{
+		return;
+	}
+	
+	for(int c = 0; c < LOG_CAT_COUNT; ++c)
+	{
+		log_category_levels[c].store(-1, std::memory_order_relaxed);
+	}
 	
 	trace_enabled = false;
 	
 	if(log_fh != NULL)
 	{
+		WriterState *ws = writer_state();
+		
+		std::unique_lock<std::mutex> wl(ws->lock);
+		
+		ws->stop = true;
+		ws->cv.notify_all();
+		
+		while(!ws->stopped)
+		{
+			ws->cv.wait(wl);
+		}
+		
+		wl.unlock();
+		
+		/* Anything logged while the writer was stopping. */
+		drain();
+		
 		fclose(log_fh);
 		log_fh = NULL;
 	}
+	
+	initialised = false;
+	
+	/* Let the next message logged initialise us again. */
+	for(int c = 0; c < LOG_CAT_COUNT; ++c)
+	{
+		log_category_levels[c].store(INT_MAX, std::memory_order_relaxed);
+	}
 }
 
 void log_init()
@@ -80,31 +456,105 @@ void log_fini()
 
 bool log_trace_enabled()
 {
-	std::unique_lock<std::mutex> l(lock);
-	_log_init();
+	if(!initialised.load(std::memory_order_acquire))
+	{
+		log_init();
+	}
 	
-	return trace_enabled;
+	return trace_enabled.load(std::memory_order_relaxed);
 }
 
-void log_printf(const char *fmt, ...)
+static void log_vprintf_at(LogCategory category, LogLevel level, const char *fmt, va_list argv)
 {
-	std::unique_lock<std::mutex> l(lock);
-	_log_init();
+	if(!initialised.load(std::memory_order_acquire))
+	{
+		log_init();
+	}
 	
-	if(log_fh != NULL)
+	if(!log_enabled(category, level))
+	{
+		return;
+	}
+	
+	LogRing *ring = get_ring();
+	
+	size_t head = ring->head.load(std::memory_order_relaxed);
+	size_t tail = ring->tail.load(std::memory_order_acquire);
+	
+	if((head - tail) == RING_SIZE)
+	{
+		ring->dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	
+	LogLine &line = ring->lines[head & (RING_SIZE - 1)];
+	
+	line.seq = next_seq.fetch_add(1, std::memory_order_relaxed);
+	
+	int prefix_len = snprintf(line.text, LINE_SIZE, "[thread=%u time=%u %s %s] ",
+		(unsigned)(ring->thread_id), (unsigned)(GetTickCount()),
+		CATEGORY_NAMES[category], LEVEL_NAMES[level]);
+	
+	va_list argv2;
+	va_copy(argv2, argv);
+	int msg_len = vsnprintf(line.text + prefix_len, LINE_SIZE - prefix_len, fmt, argv2);
+	va_end(argv2);
+	
+	if(msg_len < 0)
 	{
-		fprintf(log_fh, "[thread=%u time=%u] ",
-			(unsigned)(GetCurrentThreadId()), (unsigned)(GetTickCount()));
+		msg_len = 0;
+	}
+	
+	line.length = prefix_len + msg_len + 1;
+	
+	if(line.length < LINE_SIZE)
+	{
+		line.text[line.length - 1] = '\n';
+	}
+	else{
+		/* Too long to fit, format it again into a big enough heap buffer. */
 		
-		va_list argv;
-		va_start(argv, fmt);
-		vfprintf(log_fh, fmt, argv);
-		va_end(argv);
+		line.long_text = (char*)(malloc(line.length + 1));
 		
-		fprintf(log_fh, "\n");
+		if(line.long_text != NULL)
+		{
+			memcpy(line.long_text, line.text, prefix_len);
+			
+			vsnprintf(line.long_text + prefix_len, msg_len + 1, fmt, argv);
+			
+			line.long_text[line.length - 1] = '\n';
+		}
+		else{
+			line.length = LINE_SIZE;
+			line.text[LINE_SIZE - 1] = '\n';
+		}
+	}
+	
+	ring->head.store(head + 1, std::memory_order_release);
+	
+	if((head + 1 - tail) == (RING_SIZE / 2))
+	{
+		/* Ring is filling up, don't wait for the writer to wake up by itself. */
+		writer_state()->cv.notify_one();
 	}
 }
 
+void log_printf(const char *fmt, ...)
+{
+	va_list argv;
+	va_start(argv, fmt);
+	log_vprintf_at(LOG_CAT_GENERAL, LOG_LVL_INFO, fmt, argv);
+	va_end(argv);
+}
+
+void log_printf_at(LogCategory category, LogLevel level, const char *fmt, ...)
+{
+	va_list argv;
+	va_start(argv, fmt);
+	log_vprintf_at(category, level, fmt, argv);
+	va_end(argv);
+}
+
 /* Convert a windows error number to an error message */
 std::string win_strerror(DWORD errnum)
 {
@@ -19,13 +19,74 @@
 #ifndef DPLITE_LOG_HPP
 #define DPLITE_LOG_HPP
 
+#include <atomic>
+#include <limits.h>
 #include <string>
 
+/* Log levels, from least to most verbose. */
+enum LogLevel
+{
+	LOG_LVL_ERROR = 0,
+	LOG_LVL_WARN,
+	LOG_LVL_INFO,
+	LOG_LVL_TRACE,
+};
+
+/* Subsystems which can have their logging turned up or down independently. */
+enum LogCategory
+{
+	LOG_CAT_GENERAL = 0,
+	LOG_CAT_SOCKETS,
+	LOG_CAT_SENDQUEUE,
+	LOG_CAT_DISPATCH,
+	LOG_CAT_GROUPS,
+	LOG_CAT_ENUM,
+	
+	LOG_CAT_COUNT
+};
+
+/* Most verbose level enabled for each category, -1 if it is disabled entirely.
+ *
+ * Everything starts out enabled so that the first message logged initialises the logging
+ * system, which then sets the real levels from the environment.
+*/
+extern std::atomic<int> log_category_levels[LOG_CAT_COUNT];
+
+inline bool log_enabled(LogCategory category, LogLevel level)
+{
+	return (int)(level) <= log_category_levels[category].load(std::memory_order_relaxed);
+}
+
 void log_init();
 void log_fini();
 bool log_trace_enabled();
 
 void log_printf(const char *fmt, ...);
+void log_printf_at(LogCategory category, LogLevel level, const char *fmt, ...);
+
+/* Leveled logging macros. The arguments are only evaluated if the category is enabled at
+ * the given level.
+ *
+ * Building with DPLITE_NO_TRACE defined compiles LOG_TRACE() out entirely.
+*/
+
+#define LOG_AT(category, level, ...) \
+	do { \
+		if(log_enabled(category, level)) \
+		{ \
+			log_printf_at(category, level, __VA_ARGS__); \
+		} \
+	} while(0)
+
+#define LOG_ERROR(category, ...) LOG_AT(category, LOG_LVL_ERROR, __VA_ARGS__)
+#define LOG_WARN(category, ...)  LOG_AT(category, LOG_LVL_WARN,  __VA_ARGS__)
+#define LOG_INFO(category, ...)  LOG_AT(category, LOG_LVL_INFO,  __VA_ARGS__)
+
+#ifdef DPLITE_NO_TRACE
+#define LOG_TRACE(category, ...) do {} while(0)
+#else
+#define LOG_TRACE(category, ...) LOG_AT(category, LOG_LVL_TRACE, __VA_ARGS__)
+#endif
 
 std::string win_strerror(DWORD errnum);
 
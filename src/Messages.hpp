@@ -288,4 +288,68 @@
  * DWORD   - Group ID
 */
 
+#define DPLITE_MSGID_DATAGRAM 22
+
+/* DPLITE_MSGID_DATAGRAM
+ * Message sent using the SendTo() method without DPNSEND_GUARANTEED.
+ *
+ * This is sent to the UDP socket of the receiving peer rather than over the TCP connection,
+ * and is only accepted if it was sent from the address of the peer whose player ID it
+ * carries.
+ *
+ * Messages too large to fit in a single datagram are split into fragments of
+ * DATAGRAM_FRAGMENT_SIZE bytes (the last may be shorter), each sent in a separate datagram
+ * with the same message ID. The receiver delivers the message once all fragments have
+ * arrived. Incomplete messages may be discarded at any time.
+ *
+ * Messages sent with DPNSEND_NONSEQUENTIAL go in DATAGRAM_CHANNEL_NONSEQUENTIAL and are
+ * delivered as soon as they arrive. Everything else goes in DATAGRAM_CHANNEL_SEQUENTIAL,
+ * where the receiver discards any message older than one it has already delivered from
+ * the same sender. Sequence numbers are allocated by the sender for each channel, one
+ * message may be sent to many players so they aren't contiguous for any one receiver.
+ *
+ * DWORD - Player ID
+ * DWORD - Message ID, allocated sequentially by the sender
+ * DWORD - Channel
+ * DWORD - Sequence number within channel
+ * DWORD - Flags (DPNSEND_COALESCE, DPNSEND_COMPLETEONPROCESS)
+ * DWORD - Total message size
+ * DWORD - Fragment index
+ * DWORD - Fragment count
+ * DATA  - Fragment payload
+*/
+
+#define DATAGRAM_CHANNEL_SEQUENTIAL    0
+#define DATAGRAM_CHANNEL_NONSEQUENTIAL 1
+
+#define DPLITE_MSGID_COALESCED 24
+
+/* DPLITE_MSGID_COALESCED
+ * Several small packets sent over a TCP connection together.
+ *
+ * The receiver processes each packet in order, as if it had arrived alone. Coalesced packets
+ * are never nested.
+ *
+ * DATA - Serialised packet
+ * ...
+*/
+
+#define DPLITE_MSGID_PING 25
+
+/* DPLITE_MSGID_PING
+ * Sent periodically over the TCP connection to each connected peer to measure the round trip
+ * time, and to keep the connection alive. The receiver responds immediately with a
+ * DPLITE_MSGID_PONG carrying the same timestamp.
+ *
+ * DWORD - Sender's timestamp (GetTickCount())
+*/
+
+#define DPLITE_MSGID_PONG 26
+
+/* DPLITE_MSGID_PONG
+ * Response to a DPLITE_MSGID_PING.
+ *
+ * DWORD - Timestamp from the DPLITE_MSGID_PING
+*/
+
 #endif /* !DPLITE_MESSAGES_HPP */
@@ -17,78 +17,480 @@
 */
 
 #include <assert.h>
+#include <string.h>
 #include <winsock2.h>
 #include <windows.h>
 
+#include "Messages.hpp"
 #include "SendQueue.hpp"
 
-void SendQueue::send(SendPriority priority, const PacketSerialiser &ps,
+const size_t SendQueue::POOL_MAX_FREE;
+const size_t SendQueue::POOL_MAX_FREE_PACKETS;
+const size_t SendQueue::INDEX_MIN_BUCKETS;
+
+SendQueue::SendQueue(HANDLE signal_on_queue, bool coalesce):
+	queues(),
+	app_queues(),
+	pending(),
+	index(INDEX_MIN_BUCKETS),
+	index_count(0),
+	queued_msgs(),
+	queued_bytes(),
+	held_bytes(),
+	signal_on_queue(signal_on_queue),
+	coalesce(coalesce),
+	pool(new Pool()) {}
+
+SendQueue::~SendQueue()
+{
+	/* Anything still in the queue goes straight back to the allocator. SendOps which
+	 * have been popped or removed are left to their owners, the pool is freed along
+	 * with the last of them.
+	*/
+	
+	auto destroy = [this](SendOp *op)
+	{
+		for(SendOp *bop = op->batch; bop != NULL;)
+		{
+			SendOp *next = bop->q_link.next;
+			
+			delete bop;
+			--(pool->n_live);
+			
+			bop = next;
+		}
+		
+		delete op;
+		--(pool->n_live);
+	};
+	
+	for(int i = 0; i < 3; ++i)
+	{
+		while(queues[i].head != NULL)
+		{
+			SendOp *op = queues[i].head;
+			list_remove(queues[i], op, &SendOp::q_link);
+			
+			destroy(op);
+		}
+	}
+	
+	while(pending.head != NULL)
+	{
+		SendOp *op = pending.head;
+		list_remove(pending, op, &SendOp::q_link);
+		
+		destroy(op);
+	}
+	
+	while(pool->free_ops != NULL)
+	{
+		SendOp *op = pool->free_ops;
+		pool->free_ops = op->q_link.next;
+		
+		delete op;
+	}
+	
+	pool->n_free = 0;
+	
+	if(pool->n_live == 0)
+	{
+		delete pool;
+	}
+	else{
+		pool->orphaned = true;
+	}
+}
+
+void SendQueue::send(SendPriority priority, PacketSerialiser ps,
 	const struct sockaddr_in *dest_addr,
 	const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback)
 {
-	send(priority, ps, dest_addr, 0, callback);
+	send(priority, std::move(ps), dest_addr, 0, callback);
 }
 
-void SendQueue::send(SendPriority priority, const PacketSerialiser &ps,
+void SendQueue::send(SendPriority priority, PacketSerialiser ps,
 	const struct sockaddr_in *dest_addr, DPNHANDLE async_handle,
 	const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback)
 {
-	std::pair<const void*, size_t> data = ps.raw_packet();
+	send(priority, std::make_shared<const PacketSerialiser>(std::move(ps)), dest_addr, async_handle, callback);
+}
+
+void SendQueue::send(SendPriority priority, const std::shared_ptr<const PacketSerialiser> &ps,
+	const struct sockaddr_in *dest_addr,
+	const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback)
+{
+	send(priority, ps, dest_addr, 0, callback);
+}
+
+void SendQueue::send(SendPriority priority, const std::shared_ptr<const PacketSerialiser> &ps,
+	const struct sockaddr_in *dest_addr, DPNHANDLE async_handle,
+	const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback, bool hold)
+{
+	SendOp *op = pool->get();
 	
-	SendOp *op = new SendOp(
-		data.first, data.second,
+	op->init(ps,
 		(const struct sockaddr*)(dest_addr), (dest_addr != NULL ? sizeof(*dest_addr) : 0),
 		async_handle,
 		callback);
 	
-	switch(priority)
+	op->priority = priority;
+	op->state    = SendOp::OP_QUEUED;
+	
+	int pi = pri_index(priority);
+	
+	++(queued_msgs[pi]);
+	queued_bytes[pi] += op->get_data_size();
+	
+	list_push_back(queues[pi], op, &SendOp::q_link);
+	
+	if(async_handle != 0)
 	{
-		case SEND_PRI_LOW:
-			low_queue.push_back(op);
-			break;
-			
-		case SEND_PRI_MEDIUM:
-			medium_queue.push_back(op);
-			break;
-			
-		case SEND_PRI_HIGH:
-			high_queue.push_back(op);
-			break;
+		list_push_back(app_queues[pi], op, &SendOp::app_link);
+		index_add(op);
 	}
 	
+	/* Held SendOps are always at the back of their queue. */
+	
+	if(coalesce && hold && op->get_data_size() <= COALESCE_MAX_PACKET)
+	{
+		op->held = true;
+		held_bytes[pi] += op->get_data_size();
+		
+		if(held_bytes[pi] < COALESCE_MAX_SIZE)
+		{
+			return;
+		}
+		
+		/* Enough has been held to fill a packet, release it. */
+	}
+	
+	/* Anything being held in this queue has to go first. */
+	release_held(pi);
+	
 	SetEvent(signal_on_queue);
 }
 
-SendQueue::SendOp *SendQueue::get_pending()
+bool SendQueue::flush()
 {
-	if(current != NULL)
+	bool released = false;
+	
+	for(int i = 0; i < 3; ++i)
 	{
-		return current;
+		released = release_held(i) || released;
 	}
 	
-	if(!high_queue.empty())
+	if(released)
 	{
-		current = high_queue.front();
-		high_queue.pop_front();
+		SetEvent(signal_on_queue);
 	}
-	else if(!medium_queue.empty())
+	
+	return released;
+}
+
+/* Clears the held flag on any SendOps at the back of a queue (other than a SendOp which was
+ * just queued after them), returns true if there were any.
+*/
+bool SendQueue::release_held(int pi)
+{
+	if(held_bytes[pi] == 0)
 	{
-		current = medium_queue.front();
-		medium_queue.pop_front();
+		return false;
 	}
-	else if(!low_queue.empty())
+	
+	for(SendOp *op = queues[pi].tail; held_bytes[pi] > 0; op = op->q_link.prev)
 	{
-		current = low_queue.front();
-		low_queue.pop_front();
+		assert(op != NULL);
+		
+		if(op->held)
+		{
+			op->held = false;
+			held_bytes[pi] -= op->get_data_size();
+		}
 	}
 	
-	return current;
+	return true;
+}
+
+SendQueue::SendOp *SendQueue::get_pending()
+{
+	if(pending.head != NULL)
+	{
+		return pending.head;
+	}
+	
+	return take_next();
+}
+
+SendQueue::SendOp *SendQueue::get_next_pending(SendQueue::SendOp *op)
+{
+	assert(op->state == SendOp::OP_PENDING);
+	
+	if(op->q_link.next != NULL)
+	{
+		return op->q_link.next;
+	}
+	
+	return take_next();
 }
 
 void SendQueue::pop_pending(SendQueue::SendOp *op)
 {
-	assert(op == current);
-	current = NULL;
+	assert(pending.head != NULL && op == pending.head);
+	
+	list_remove(pending, op, &SendOp::q_link);
+	op->state = SendOp::OP_RELEASED;
+	
+	if(op->batch == NULL)
+	{
+		uncount(op);
+		index_remove(op);
+	}
+	else{
+		for(SendOp *bop = op->batch; bop != NULL; bop = bop->q_link.next)
+		{
+			uncount(bop);
+			index_remove(bop);
+			
+			bop->state = SendOp::OP_RELEASED;
+		}
+	}
+}
+
+void SendQueue::uncount(const SendOp *op)
+{
+	int pi = pri_index(op->priority);
+	
+	assert(queued_msgs[pi] > 0);
+	assert(queued_bytes[pi] >= op->get_data_size());
+	
+	--(queued_msgs[pi]);
+	queued_bytes[pi] -= op->get_data_size();
+}
+
+int SendQueue::pri_index(SendPriority priority)
+{
+	switch(priority)
+	{
+		case SEND_PRI_LOW:    return 0;
+		case SEND_PRI_MEDIUM: return 1;
+		case SEND_PRI_HIGH:   return 2;
+		
+		default:
+			/* Unreachable. */
+			abort();
+	}
+}
+
+void SendQueue::list_push_back(OpList &list, SendOp *op, Link SendOp::*link)
+{
+	(op->*link).prev = list.tail;
+	(op->*link).next = NULL;
+	
+	if(list.tail != NULL)
+	{
+		(list.tail->*link).next = op;
+	}
+	else{
+		list.head = op;
+	}
+	
+	list.tail = op;
+}
+
+void SendQueue::list_remove(OpList &list, SendOp *op, Link SendOp::*link)
+{
+	Link &ol = op->*link;
+	
+	if(ol.prev != NULL)
+	{
+		(ol.prev->*link).next = ol.next;
+	}
+	else{
+		assert(list.head == op);
+		list.head = ol.next;
+	}
+	
+	if(ol.next != NULL)
+	{
+		(ol.next->*link).prev = ol.prev;
+	}
+	else{
+		assert(list.tail == op);
+		list.tail = ol.prev;
+	}
+	
+	ol.prev = NULL;
+	ol.next = NULL;
+}
+
+/* Handles are allocated sequentially, so the low bits are enough to spread them over the
+ * buckets.
+*/
+SendQueue::OpList &SendQueue::index_bucket(DPNHANDLE async_handle)
+{
+	return index[(size_t)(async_handle) & (index.size() - 1)];
+}
+
+void SendQueue::index_add(SendOp *op)
+{
+	assert(op->async_handle != 0);
+	
+	if(index_count >= index.size())
+	{
+		/* Double the number of buckets. Only happens when the queue grows beyond any
+		 * size it has been before.
+		*/
+		
+		std::vector<OpList> old_index(index.size() * 2);
+		old_index.swap(index);
+		
+		for(auto b = old_index.begin(); b != old_index.end(); ++b)
+		{
+			while(b->head != NULL)
+			{
+				SendOp *bop = b->head;
+				
+				list_remove(*b, bop, &SendOp::index_link);
+				list_push_back(index_bucket(bop->async_handle), bop, &SendOp::index_link);
+			}
+		}
+	}
+	
+	list_push_back(index_bucket(op->async_handle), op, &SendOp::index_link);
+	++index_count;
+}
+
+void SendQueue::index_remove(SendOp *op)
+{
+	if(op->async_handle != 0)
+	{
+		list_remove(index_bucket(op->async_handle), op, &SendOp::index_link);
+		--index_count;
+	}
+}
+
+/* Moves the next SendOp to be sent from the highest priority queue with one ready onto the
+ * end of the pending list and returns it, or returns NULL if there isn't one.
+*/
+SendQueue::SendOp *SendQueue::take_next()
+{
+	for(int i = 2; i >= 0; --i)
+	{
+		if(queues[i].head != NULL && !queues[i].head->held)
+		{
+			SendOp *op = make_batch(i);
+			
+			op->state = SendOp::OP_PENDING;
+			list_push_back(pending, op, &SendOp::q_link);
+			
+			return op;
+		}
+	}
+	
+	return NULL;
+}
+
+/* Takes the SendOp from the front of a queue, along with any small ones following it if
+ * coalescing is enabled. Multiple SendOps are combined into a new one which sends them all
+ * in a DPLITE_MSGID_COALESCED packet and completes each of them when it completes.
+*/
+SendQueue::SendOp *SendQueue::make_batch(int pi)
+{
+	SendOp *first = NULL, *last = NULL;
+	size_t batch_size = 0;
+	
+	while(queues[pi].head != NULL)
+	{
+		SendOp *op = queues[pi].head;
+		
+		if(first != NULL
+			&& (!coalesce
+				|| first->get_data_size() > COALESCE_MAX_PACKET
+				|| op->get_data_size() > COALESCE_MAX_PACKET
+				|| (batch_size + op->get_data_size()) > COALESCE_MAX_SIZE))
+		{
+			break;
+		}
+		
+		list_remove(queues[pi], op, &SendOp::q_link);
+		
+		if(op->async_handle != 0)
+		{
+			list_remove(app_queues[pi], op, &SendOp::app_link);
+		}
+		
+		if(op->held)
+		{
+			/* Held SendOps following the first may join it. */
+			
+			op->held = false;
+			held_bytes[pi] -= op->get_data_size();
+		}
+		
+		op->state = SendOp::OP_PENDING;
+		
+		if(last != NULL)
+		{
+			last->q_link.next = op;
+			op->q_link.prev   = last;
+		}
+		else{
+			first = op;
+		}
+		
+		last = op;
+		batch_size += op->get_data_size();
+	}
+	
+	if(first == last)
+	{
+		return first;
+	}
+	
+	/* The packets are small, so they are copied into the batch rather than referenced to
+	 * keep it in a single buffer.
+	*/
+	
+	SendOp *batch_op = pool->get();
+	
+	batch_op->batch_packet = pool->get_packet(DPLITE_MSGID_COALESCED);
+	
+	for(SendOp *op = first; op != NULL; op = op->q_link.next)
+	{
+		batch_op->batch_packet->append_data(op->segments);
+	}
+	
+	batch_op->init(batch_op->batch_packet, NULL, 0, 0, nullptr);
+	
+	batch_op->batch    = first;
+	batch_op->priority = first->priority;
+	
+	return batch_op;
+}
+
+/* Takes a queued SendOp out of the queue and hands it to the caller. */
+SendQueue::SendOp *SendQueue::remove_op(SendOp *op)
+{
+	assert(op->state == SendOp::OP_QUEUED);
+	assert(op->async_handle != 0);
+	
+	int pi = pri_index(op->priority);
+	
+	list_remove(queues[pi], op, &SendOp::q_link);
+	list_remove(app_queues[pi], op, &SendOp::app_link);
+	index_remove(op);
+	
+	if(op->held)
+	{
+		op->held = false;
+		held_bytes[pi] -= op->get_data_size();
+	}
+	
+	uncount(op);
+	op->state = SendOp::OP_RELEASED;
+	
+	return op;
 }
 
 /* NOTE: The remove_queued() family of methods will ONLY return SendOps which
@@ -98,19 +500,11 @@ void SendQueue::pop_pending(SendQueue::SendOp *op)
 
 SendQueue::SendOp *SendQueue::remove_queued()
 {
-	std::list<SendOp*> *queues[] = { &high_queue, &medium_queue, &low_queue };
-	
-	for(int i = 0; i < 3; ++i)
+	for(int i = 2; i >= 0; --i)
 	{
-		for(auto it = queues[i]->begin(); it != queues[i]->end(); ++it)
+		if(app_queues[i].head != NULL)
 		{
-			SendOp *op = *it;
-			
-			if(op->async_handle != 0)
-			{
-				queues[i]->erase(it);
-				return op;
-			}
+			return remove_op(app_queues[i].head);
 		}
 	}
 	
@@ -119,19 +513,16 @@ SendQueue::SendOp *SendQueue::remove_queued()
 
 SendQueue::SendOp *SendQueue::remove_queued_by_handle(DPNHANDLE async_handle)
 {
-	std::list<SendOp*> *queues[] = { &low_queue, &medium_queue, &high_queue };
+	if(async_handle == 0)
+	{
+		return NULL;
+	}
 	
-	for(int i = 0; i < 3; ++i)
+	for(SendOp *op = index_bucket(async_handle).head; op != NULL; op = op->index_link.next)
 	{
-		for(auto it = queues[i]->begin(); it != queues[i]->end(); ++it)
+		if(op->async_handle == async_handle && op->state == SendOp::OP_QUEUED)
 		{
-			SendOp *op = *it;
-			
-			if(op->async_handle != 0 && op->async_handle == async_handle)
-			{
-				queues[i]->erase(it);
-				return op;
-			}
+			return remove_op(op);
 		}
 	}
 	
@@ -140,65 +531,195 @@ SendQueue::SendOp *SendQueue::remove_queued_by_handle(DPNHANDLE async_handle)
 
 SendQueue::SendOp *SendQueue::remove_queued_by_priority(SendPriority priority)
 {
-	std::list<SendOp*> *queue;
+	OpList &queue = app_queues[pri_index(priority)];
 	
-	switch(priority)
+	if(queue.head != NULL)
 	{
-		case SEND_PRI_LOW:
-			queue = &low_queue;
-			break;
-			
-		case SEND_PRI_MEDIUM:
-			queue = &medium_queue;
-			break;
-			
-		case SEND_PRI_HIGH:
-			queue = &high_queue;
-			break;
+		return remove_op(queue.head);
+	}
+	
+	return NULL;
+}
 
-		default:
-			/* Unreachable. */
-			abort();
+bool SendQueue::handle_is_pending(DPNHANDLE async_handle)
+{
+	if(async_handle == 0)
+	{
+		return false;
+	}
+	
+	for(SendOp *op = index_bucket(async_handle).head; op != NULL; op = op->index_link.next)
+	{
+		if(op->async_handle == async_handle && op->state == SendOp::OP_PENDING)
+		{
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+SendQueue::SendOp *SendQueue::Pool::get()
+{
+	SendOp *op;
+	
+	if(free_ops != NULL)
+	{
+		op = free_ops;
+		free_ops = op->q_link.next;
+		
+		op->q_link.next = NULL;
+		--n_free;
+	}
+	else{
+		op = new SendOp(this);
 	}
 	
-	for(auto it = queue->begin(); it != queue->end(); ++it)
+	++n_live;
+	
+	return op;
+}
+
+void SendQueue::Pool::put(SendOp *op)
+{
+	assert(n_live > 0);
+	--n_live;
+	
+	if(orphaned)
 	{
-		SendOp *op = *it;
+		delete op;
 		
-		if(op->async_handle != 0)
+		if(n_live == 0)
 		{
-			queue->erase(it);
-			return op;
+			delete this;
 		}
 	}
+	else if(n_free < POOL_MAX_FREE)
+	{
+		op->q_link.prev = NULL;
+		op->q_link.next = free_ops;
+		free_ops = op;
+		
+		++n_free;
+	}
+	else{
+		delete op;
+	}
+}
+
+/* Returns an empty packet of the given type, reusing one from a previous batch if there is
+ * one available.
+*/
+std::shared_ptr<PacketSerialiser> SendQueue::Pool::get_packet(uint32_t type)
+{
+	if(free_packets.empty())
+	{
+		return std::make_shared<PacketSerialiser>(type);
+	}
 	
-	return NULL;
+	std::shared_ptr<PacketSerialiser> packet = std::move(free_packets.back());
+	free_packets.pop_back();
+	
+	packet->reset(type);
+	
+	return packet;
 }
 
-bool SendQueue::handle_is_pending(DPNHANDLE async_handle)
+void SendQueue::Pool::put_packet(std::shared_ptr<PacketSerialiser> &&packet)
 {
-	return (current != NULL && current->async_handle == async_handle);
+	if(!orphaned && packet.use_count() == 1 && free_packets.size() < POOL_MAX_FREE_PACKETS)
+	{
+		free_packets.push_back(std::move(packet));
+	}
+	
+	packet.reset();
 }
 
-SendQueue::SendOp::SendOp(const void *data, size_t data_size,
+SendQueue::SendOp::SendOp(Pool *pool):
+	pool(pool),
+	state(OP_FREE),
+	q_link(),
+	app_link(),
+	index_link(),
+	data_size(0),
+	sent_data(0),
+	sent_segment(0),
+	sent_segment_offset(0),
+	dest_addr_size(0),
+	batch(NULL),
+	priority(SEND_PRI_LOW),
+	async_handle(0),
+	held(false) {}
+
+void SendQueue::SendOp::init(const std::shared_ptr<const PacketSerialiser> &packet,
 	const struct sockaddr *dest_addr, size_t dest_addr_size,
 	DPNHANDLE async_handle,
-	const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback):
-	
-	data((const unsigned char*)(data), (const unsigned char*)(data) + data_size),
-	sent_data(0),
-	async_handle(async_handle),
-	callback(callback)
+	const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback)
 {
+	assert(state == OP_FREE);
 	assert((size_t)(dest_addr_size) <= sizeof(this->dest_addr));
 	
-	memcpy(&(this->dest_addr), dest_addr, dest_addr_size);
+	this->packet = packet;
+	
+	packet->raw_packet_v(segments);
+	data_size = packet->raw_packet_size();
+	
+	sent_data           = 0;
+	sent_segment        = 0;
+	sent_segment_offset = 0;
+	
+	if(dest_addr_size > 0)
+	{
+		memcpy(&(this->dest_addr), dest_addr, dest_addr_size);
+	}
+	
 	this->dest_addr_size = dest_addr_size;
+	
+	this->callback     = callback;
+	this->async_handle = async_handle;
+	
+	held = false;
+}
+
+void SendQueue::SendOp::release()
+{
+	assert(state == OP_RELEASED);
+	
+	/* Members of a batch are released along with it. */
+	
+	for(SendOp *bop = batch; bop != NULL;)
+	{
+		SendOp *next = bop->q_link.next;
+		bop->release();
+		
+		bop = next;
+	}
+	
+	batch = NULL;
+	
+	packet.reset();
+	
+	if(batch_packet)
+	{
+		pool->put_packet(std::move(batch_packet));
+	}
+	
+	callback = nullptr;
+	segments.clear();
+	
+	state = OP_FREE;
+	
+	pool->put(this);
 }
 
 std::pair<const void*, size_t> SendQueue::SendOp::get_data() const
 {
-	return std::make_pair<const void*, size_t>(data.data(), data.size());
+	return packet->raw_packet();
+}
+
+size_t SendQueue::SendOp::get_data_size() const
+{
+	return data_size;
 }
 
 std::pair<const struct sockaddr*, size_t> SendQueue::SendOp::get_dest_addr() const
@@ -209,15 +730,58 @@ std::pair<const struct sockaddr*, size_t> SendQueue::SendOp::get_dest_addr() con
 void SendQueue::SendOp::inc_sent_data(size_t sent)
 {
 	sent_data += sent;
-	assert(sent_data <= data.size());
+	assert(sent_data <= data_size);
+	
+	while(sent > 0)
+	{
+		size_t seg_remain = segments[sent_segment].second - sent_segment_offset;
+		
+		if(sent >= seg_remain)
+		{
+			sent -= seg_remain;
+			
+			++sent_segment;
+			sent_segment_offset = 0;
+		}
+		else{
+			sent_segment_offset += sent;
+			sent = 0;
+		}
+	}
+}
+
+size_t SendQueue::SendOp::get_pending_data(WSABUF *bufs, size_t max_bufs) const
+{
+	size_t n_bufs = 0;
+	
+	for(size_t i = sent_segment; i < segments.size() && n_bufs < max_bufs; ++i)
+	{
+		size_t skip = (i == sent_segment ? sent_segment_offset : 0);
+		
+		bufs[n_bufs].buf = (char*)(segments[i].first) + skip;
+		bufs[n_bufs].len = segments[i].second - skip;
+		
+		++n_bufs;
+	}
+	
+	return n_bufs;
 }
 
-std::pair<const void*, size_t> SendQueue::SendOp::get_pending_data() const
+size_t SendQueue::SendOp::get_pending_size() const
 {
-	return std::make_pair<const void*, size_t>(data.data() + sent_data, data.size() - sent_data);
+	return data_size - sent_data;
 }
 
 void SendQueue::SendOp::invoke_callback(std::unique_lock<std::mutex> &l, HRESULT result) const
 {
-	callback(l, result);
+	if(batch != NULL)
+	{
+		for(SendOp *bop = batch; bop != NULL; bop = bop->q_link.next)
+		{
+			bop->callback(l, result);
+		}
+	}
+	else{
+		callback(l, result);
+	}
 }
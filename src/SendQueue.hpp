@@ -23,9 +23,8 @@
 
 #include <functional>
 #include <dplay8.h>
-#include <list>
+#include <memory>
 #include <mutex>
-#include <set>
 #include <stdlib.h>
 #include <utility>
 #include <vector>
@@ -33,69 +32,296 @@
 
 #include "packet.hpp"
 
+/* Queue of packets waiting to be written to a socket, in order of priority.
+ *
+ * A SendQueue created with coalescing enabled (used for TCP connections) may combine
+ * consecutive small packets of the same priority into a single DPLITE_MSGID_COALESCED packet
+ * when get_pending() is called, so a burst of small messages goes out in one send() call
+ * with one frame header. Packets queued with hold set aren't returned by get_pending()
+ * until flush() is called, a packet without hold is queued after them or the held packets
+ * reach COALESCE_MAX_SIZE, giving later packets a chance to join them.
+ *
+ * SendOps are taken from a pool belonging to the queue and linked into the queues through
+ * pointers within the SendOp itself, and any which have an async_handle are also linked into
+ * a hash index by handle, so queueing, cancelling and looking up SendOps doesn't touch the
+ * allocator once the pool has grown to the number of SendOps in use. SendOps returned from
+ * the queue belong to the caller until it calls release() on them, which may be after the
+ * SendQueue has been destroyed.
+ *
+ * Not thread-safe, the owner must serialise access to the queue and its SendOps.
+*/
+
 class SendQueue
 {
 	public:
+		/* Largest packet which may be coalesced with others. */
+		static const size_t COALESCE_MAX_PACKET = 256;
+		
+		/* Largest amount of packet data combined into one DPLITE_MSGID_COALESCED packet. */
+		static const size_t COALESCE_MAX_SIZE = 1400;
+		
+		/* Number of released SendOps kept by the pool for reuse. */
+		static const size_t POOL_MAX_FREE = 256;
+		
 		enum SendPriority {
 			SEND_PRI_LOW = 1,
 			SEND_PRI_MEDIUM = 2,
 			SEND_PRI_HIGH = 4,
 		};
 		
+		class SendOp;
+		
+	private:
+		struct Pool;
+		
+		struct Link
+		{
+			SendOp *prev;
+			SendOp *next;
+		};
+		
+		struct OpList
+		{
+			SendOp *head;
+			SendOp *tail;
+		};
+		
+	public:
 		class SendOp
 		{
+			friend class SendQueue;
+			friend struct SendQueue::Pool;
+			
 			private:
-				std::vector<unsigned char> data;
+				enum State {
+					OP_FREE,
+					OP_QUEUED,   /* In a priority queue, may be removed. */
+					OP_PENDING,  /* Taken by get_pending(), or part of a batch which was. */
+					OP_RELEASED, /* Popped or removed, owned by the caller. */
+				};
+				
+				Pool *const pool;
+				State state;
+				
+				/* Links into the priority queue or pending list (or the pool's free
+				 * list, or the batch it is part of).
+				*/
+				Link q_link;
+				
+				/* Links into app_queues and the handle index. Only used by SendOps
+				 * with an async_handle.
+				*/
+				Link app_link;
+				Link index_link;
+				
+				/* The packet is shared between every SendOp created from the same
+				 * message, each one only tracks how much of it has been sent.
+				*/
+				std::shared_ptr<const PacketSerialiser> packet;
+				
+				/* The buffers making up the packet, any referenced data is sent directly
+				 * from the buffers provided by the application.
+				*/
+				std::vector< std::pair<const void*, size_t> > segments;
+				size_t data_size;
+				
 				size_t sent_data;
+				size_t sent_segment;
+				size_t sent_segment_offset;
 				
 				struct sockaddr_storage dest_addr;
 				size_t dest_addr_size;
 				
 				std::function<void(std::unique_lock<std::mutex>&, HRESULT)> callback;
 				
-			public:
-				const DPNHANDLE async_handle;
+				/* The first of the SendOps combined into this one (linked through
+				 * their q_link) if it is a DPLITE_MSGID_COALESCED packet.
+				*/
+				SendOp *batch;
+				
+				/* Packet built by the queue for a batch, kept with the SendOp so it
+				 * can be reused by later batches.
+				*/
+				std::shared_ptr<PacketSerialiser> batch_packet;
+				
+				SendPriority priority;
+				DPNHANDLE async_handle;
+				
+				SendOp(Pool *pool);
+				~SendOp() {}
 				
-				SendOp(
-					const void *data, size_t data_size,
+				void init(
+					const std::shared_ptr<const PacketSerialiser> &packet,
 					const struct sockaddr *dest_addr, size_t dest_addr_size,
 					DPNHANDLE async_handle,
 					const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback);
 				
+			public:
+				/* Set if the SendOp is being held back for coalescing. */
+				bool held;
+				
+				/* No copy c'tor. */
+				SendOp(const SendOp &src) = delete;
+				
+				/* Returns the SendOp to its queue's pool. The SendOp must have been
+				 * popped or removed from the queue.
+				*/
+				void release();
+				
+				DPNHANDLE get_async_handle() const { return async_handle; }
+				
+				/* Returns the packet as a single buffer. Only valid when the packet
+				 * doesn't contain any referenced data.
+				*/
 				std::pair<const void*, size_t> get_data() const;
+				size_t get_data_size() const;
+				
+				/* Returns the buffers making up the whole packet. */
+				const std::vector< std::pair<const void*, size_t> > &get_segments() const { return segments; }
+				
 				std::pair<const struct sockaddr*, size_t> get_dest_addr() const;
 				
 				void inc_sent_data(size_t sent);
-				std::pair<const void*, size_t> get_pending_data() const;
 				
+				/* Fills in up to max_bufs WSABUF structures describing the data which
+				 * hasn't been sent yet, returns the number of buffers filled in.
+				*/
+				size_t get_pending_data(WSABUF *bufs, size_t max_bufs) const;
+				size_t get_pending_size() const;
+				
+				/* Invokes the callback, or the callback of each SendOp in the batch. */
 				void invoke_callback(std::unique_lock<std::mutex> &l, HRESULT result) const;
 		};
 		
 	private:
-		std::list<SendOp*> low_queue;
-		std::list<SendOp*> medium_queue;
-		std::list<SendOp*> high_queue;
+		/* Number of released batch packets kept by the pool for reuse. */
+		static const size_t POOL_MAX_FREE_PACKETS = 4;
+		
+		/* Released SendOps waiting to be reused. The pool is freed when both the queue
+		 * and every SendOp taken from it are gone.
+		*/
+		struct Pool
+		{
+			SendOp *free_ops;
+			size_t n_free;
+			
+			/* Number of SendOps which aren't on the free list. */
+			size_t n_live;
+			
+			bool orphaned;
+			
+			/* Packets from released batches. */
+			std::vector< std::shared_ptr<PacketSerialiser> > free_packets;
+			
+			Pool(): free_ops(NULL), n_free(0), n_live(0), orphaned(false)
+			{
+				free_packets.reserve(POOL_MAX_FREE_PACKETS);
+			}
+			
+			SendOp *get();
+			void put(SendOp *op);
+			
+			std::shared_ptr<PacketSerialiser> get_packet(uint32_t type);
+			void put_packet(std::shared_ptr<PacketSerialiser> &&packet);
+		};
+		
+		/* Initial number of buckets in the handle index, doubled whenever there are more
+		 * SendOps in the index than buckets.
+		*/
+		static const size_t INDEX_MIN_BUCKETS = 64;
+		
+		/* Every SendOp which hasn't been taken yet, in the order it will be sent (indexed
+		 * by pri_index()).
+		*/
+		OpList queues[3];
+		
+		/* The SendOps in queues which have an async_handle, in the same order. */
+		OpList app_queues[3];
 		
-		SendOp *current;
+		/* SendOps which have been taken from the queues by get_pending() or
+		 * get_next_pending() and not popped yet, in the order they are being sent.
+		*/
+		OpList pending;
+		
+		/* Every queued or pending SendOp with an async_handle (including those within
+		 * a batch), hashed by handle.
+		*/
+		std::vector<OpList> index;
+		size_t index_count;
+		
+		/* Number of messages and bytes at each priority (indexed by pri_index()) which
+		 * have been queued and not popped or removed yet.
+		*/
+		size_t queued_msgs[3];
+		size_t queued_bytes[3];
+		
+		/* Size of the held SendOps at the back of each queue. */
+		size_t held_bytes[3];
 		
 		HANDLE signal_on_queue;
 		
+		const bool coalesce;
+		
+		Pool *pool;
+		
+		static void list_push_back(OpList &list, SendOp *op, Link SendOp::*link);
+		static void list_remove(OpList &list, SendOp *op, Link SendOp::*link);
+		
+		OpList &index_bucket(DPNHANDLE async_handle);
+		void index_add(SendOp *op);
+		void index_remove(SendOp *op);
+		
+		bool release_held(int pi);
+		SendOp *make_batch(int pi);
+		SendOp *take_next();
+		SendOp *remove_op(SendOp *op);
+		void uncount(const SendOp *op);
+		
 	public:
-		SendQueue(HANDLE signal_on_queue): current(NULL), signal_on_queue(signal_on_queue) {}
+		/* Maps a SendPriority to an index from 0 (low) to 2 (high). */
+		static int pri_index(SendPriority priority);
+		
+		SendQueue(HANDLE signal_on_queue, bool coalesce = false);
+		~SendQueue();
 		
 		/* No copy c'tor. */
 		SendQueue(const SendQueue &src) = delete;
 		
-		void send(SendPriority priority, const PacketSerialiser &ps, const struct sockaddr_in *dest_addr, const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback);
-		void send(SendPriority priority, const PacketSerialiser &ps, const struct sockaddr_in *dest_addr, DPNHANDLE async_handle, const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback);
+		/* The packet is taken by value, callers may std::move() a PacketSerialiser they
+		 * don't need any more into the queue to avoid copying it.
+		*/
+		void send(SendPriority priority, PacketSerialiser ps, const struct sockaddr_in *dest_addr, const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback);
+		void send(SendPriority priority, PacketSerialiser ps, const struct sockaddr_in *dest_addr, DPNHANDLE async_handle, const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback);
+		
+		/* Queues a packet which may also be queued for sending elsewhere, the packet must
+		 * not be modified once it has been passed to send().
+		*/
+		void send(SendPriority priority, const std::shared_ptr<const PacketSerialiser> &ps, const struct sockaddr_in *dest_addr, const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback);
+		void send(SendPriority priority, const std::shared_ptr<const PacketSerialiser> &ps, const struct sockaddr_in *dest_addr, DPNHANDLE async_handle, const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback, bool hold = false);
+		
+		/* Releases any held SendOps, returns true if there were any. */
+		bool flush();
 		
 		SendOp *get_pending();
+		
+		/* Returns the SendOp to be sent after op (which must be pending), so that several
+		 * can be written in one call. Once taken, a SendOp can no longer be removed by
+		 * the remove_queued() methods and must be popped in order by pop_pending().
+		*/
+		SendOp *get_next_pending(SendOp *op);
+		
 		void pop_pending(SendOp *op);
 		
 		SendOp *remove_queued();
 		SendOp *remove_queued_by_handle(DPNHANDLE async_handle);
 		SendOp *remove_queued_by_priority(SendPriority priority);
 		bool handle_is_pending(DPNHANDLE async_handle);
+		
+		/* Returns the number of messages or bytes of packet data waiting to be sent at the
+		 * given priority, including any partially sent.
+		*/
+		size_t get_queued_msgs(SendPriority priority) const { return queued_msgs[pri_index(priority)]; }
+		size_t get_queued_bytes(SendPriority priority) const { return queued_bytes[pri_index(priority)]; }
 };
 
 #endif /* !DPLITE_SENDQUEUE_HPP */
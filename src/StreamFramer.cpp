@@ -0,0 +1,165 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utility>
+
+#include "network.hpp"
+#include "packet.hpp"
+#include "StreamFramer.hpp"
+
+StreamFramer::StreamFramer(BufferPool &pool):
+	pool(pool), buf(NULL), read_pos(0), write_pos(0), frame_size(0) {}
+
+StreamFramer::~StreamFramer()
+{
+	if(buf != NULL)
+	{
+		buf->unref();
+	}
+}
+
+/* Moves any pending data to the start of a buffer of at least min_size bytes. A new buffer
+ * is used if the current one is too small, or is still referenced by packets which have
+ * been handed out.
+*/
+void StreamFramer::resize(size_t min_size)
+{
+	size_t pending = write_pos - read_pos;
+	
+	if(buf != NULL && buf->size() >= min_size && !buf->shared())
+	{
+		memmove(buf->data(), buf->data() + read_pos, pending);
+	}
+	else{
+		BufferPool::Buffer *new_buf = pool.get(min_size);
+		
+		if(buf != NULL)
+		{
+			memcpy(new_buf->data(), buf->data() + read_pos, pending);
+			buf->unref();
+		}
+		
+		buf = new_buf;
+	}
+	
+	read_pos  = 0;
+	write_pos = pending;
+}
+
+std::pair<unsigned char*, size_t> StreamFramer::write_space()
+{
+	if(buf == NULL)
+	{
+		resize(BufferPool::MIN_SIZE);
+	}
+	else if(write_pos == buf->size())
+	{
+		/* A partial packet has reached the end of the buffer, move it to the start of
+		 * the buffer, or a larger one if we know it won't fit.
+		*/
+		resize(frame_size > 0 ? frame_size : (write_pos - read_pos) + 1);
+	}
+	
+	return std::make_pair(buf->data() + write_pos, buf->size() - write_pos);
+}
+
+void StreamFramer::commit(size_t size)
+{
+	assert(size <= (buf->size() - write_pos));
+	write_pos += size;
+}
+
+StreamFramer::FrameStatus StreamFramer::next_frame(const unsigned char **frame, size_t *size)
+{
+	size_t pending = write_pos - read_pos;
+	
+	if(frame_size == 0)
+	{
+		if(pending < sizeof(TLVChunk))
+		{
+			return FRAME_PARTIAL;
+		}
+		
+		const TLVChunk *header = (const TLVChunk*)(buf->data() + read_pos);
+		
+		if(header->value_length > (MAX_PACKET_SIZE - sizeof(TLVChunk)))
+		{
+			return FRAME_OVERSIZE;
+		}
+		
+		frame_size = sizeof(TLVChunk) + header->value_length;
+	}
+	
+	if(pending < frame_size)
+	{
+		return FRAME_PARTIAL;
+	}
+	
+	*frame = buf->data() + read_pos;
+	*size  = frame_size;
+	
+	return FRAME_READY;
+}
+
+void StreamFramer::pop_frame()
+{
+	assert(frame_size > 0 && (write_pos - read_pos) >= frame_size);
+	
+	read_pos  += frame_size;
+	frame_size = 0;
+	
+	if(read_pos == write_pos)
+	{
+		if(buf->shared())
+		{
+			/* Packets in the buffer are still in use, start again with a new one. */
+			buf->unref();
+			buf = NULL;
+		}
+		
+		/* Buffer is empty, start again from the beginning. */
+		read_pos  = 0;
+		write_pos = 0;
+	}
+}
+
+BufferPool::Buffer *StreamFramer::frame_buffer() const
+{
+	assert(frame_size > 0);
+	return buf;
+}
+
+size_t StreamFramer::pending() const
+{
+	return write_pos - read_pos;
+}
+
+void StreamFramer::release()
+{
+	if(buf != NULL && read_pos == write_pos)
+	{
+		buf->unref();
+		
+		buf       = NULL;
+		read_pos  = 0;
+		write_pos = 0;
+	}
+}
@@ -0,0 +1,91 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_STREAMFRAMER_HPP
+#define DPLITE_STREAMFRAMER_HPP
+
+#include <stdlib.h>
+#include <utility>
+
+#include "BufferPool.hpp"
+
+/* Splits a stream of bytes read from a TCP socket into packets.
+ *
+ * Data is read into a buffer taken from a BufferPool and each packet is returned in place
+ * from a read cursor, rather than shifting the rest of the buffer down after each one. The
+ * buffer is only compacted when a partially received packet reaches the end of it, and is
+ * grown when a packet won't fit.
+ *
+ * Usage:
+ *
+ * 1) Call write_space() and read up to the returned number of bytes into the buffer.
+ * 2) Call commit() with the number of bytes read.
+ * 3) Call next_frame() to get each complete packet, calling pop_frame() once each one has
+ *    been processed.
+ *
+ * The pointer returned by next_frame() remains valid until pop_frame() is called, unless a
+ * reference to frame_buffer() is taken, in which case the framer won't reuse the part of the
+ * buffer holding the packet until the reference is released.
+*/
+
+class StreamFramer
+{
+	public:
+		enum FrameStatus {
+			FRAME_READY,    /* A complete packet is available. */
+			FRAME_PARTIAL,  /* Need to read more data. */
+			FRAME_OVERSIZE, /* Next packet is larger than MAX_PACKET_SIZE, stream is invalid. */
+		};
+		
+	private:
+		BufferPool &pool;
+		
+		BufferPool::Buffer *buf;
+		
+		size_t read_pos;  /* Offset of the first unprocessed byte. */
+		size_t write_pos; /* Offset of the end of the buffered data. */
+		
+		/* Size of the packet at read_pos, zero if not known yet. */
+		size_t frame_size;
+		
+		void resize(size_t min_size);
+		
+	public:
+		StreamFramer(BufferPool &pool);
+		~StreamFramer();
+		
+		/* No copy c'tor. */
+		StreamFramer(const StreamFramer &src) = delete;
+		
+		std::pair<unsigned char*, size_t> write_space();
+		void commit(size_t size);
+		
+		FrameStatus next_frame(const unsigned char **frame, size_t *size);
+		void pop_frame();
+		
+		/* Returns the buffer holding the packet returned by next_frame(). */
+		BufferPool::Buffer *frame_buffer() const;
+		
+		/* Returns the number of buffered bytes not yet popped. */
+		size_t pending() const;
+		
+		/* Gives the buffer back to the pool if there is no pending data in it. */
+		void release();
+};
+
+#endif /* !DPLITE_STREAMFRAMER_HPP */
@@ -0,0 +1,214 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <assert.h>
+#include <iterator>
+
+#include "TimerWheel.hpp"
+
+TimerWheel::TimerWheel(uint64_t now):
+	next_id(1),
+	now_tick(now / TICK_MS) {}
+	
+TimerWheel::TimerID TimerWheel::schedule(uint64_t when, const Callback &callback)
+{
+	/* Round up so the timer never fires early, and don't put it in the tick which has
+	 * already been processed.
+	*/
+	uint64_t expires = (when + TICK_MS - 1) / TICK_MS;
+	if(expires <= now_tick)
+	{
+		expires = now_tick + 1;
+	}
+	
+	Slot pending;
+	pending.push_back(Timer{ next_id++, expires, callback });
+	
+	Slot::iterator timer = pending.begin();
+	timers[timer->id] = TimerRef{ &pending, timer };
+	
+	place(&pending, timer);
+	
+	return timer->id;
+}
+
+bool TimerWheel::cancel(TimerID id)
+{
+	auto t = timers.find(id);
+	if(t == timers.end())
+	{
+		return false;
+	}
+	
+	t->second.slot->erase(t->second.timer);
+	timers.erase(t);
+	
+	return true;
+}
+
+void TimerWheel::clear()
+{
+	for(unsigned int level = 0; level < LEVELS; ++level)
+	{
+		for(unsigned int slot = 0; slot < SLOTS; ++slot)
+		{
+			wheel[level][slot].clear();
+		}
+	}
+	
+	timers.clear();
+}
+
+std::vector<TimerWheel::Callback> TimerWheel::advance(uint64_t now)
+{
+	std::vector<Callback> expired;
+	
+	uint64_t target_tick = now / TICK_MS;
+	
+	for(bool first = true; now_tick < target_tick; first = false)
+	{
+		if(first || (now_tick & (SLOTS - 1)) == 0)
+		{
+			/* Skip over any ticks before the next one with a slot to deal with. Only
+			 * checked once per revolution of the first level so long idle periods are
+			 * cheap without scanning the wheel every tick.
+			*/
+			
+			uint64_t next;
+			if(!next_expiry(&next) || (next / TICK_MS) > target_tick)
+			{
+				now_tick = target_tick;
+				break;
+			}
+			
+			now_tick = (next / TICK_MS) - 1;
+		}
+		
+		++now_tick;
+		
+		/* Move any timers from the higher level slots which begin at this tick down, a
+		 * level's slot can only begin when the level below has wrapped around.
+		*/
+		for(unsigned int level = 1; level < LEVELS; ++level)
+		{
+			if((now_tick & (((uint64_t)(1) << (SLOT_BITS * level)) - 1)) != 0)
+			{
+				break;
+			}
+			
+			cascade(level);
+		}
+		
+		Slot &slot = wheel[0][now_tick & (SLOTS - 1)];
+		
+		while(!slot.empty())
+		{
+			assert(slot.front().expires == now_tick);
+			
+			expired.push_back(std::move(slot.front().callback));
+			
+			timers.erase(slot.front().id);
+			slot.pop_front();
+		}
+	}
+	
+	return expired;
+}
+
+bool TimerWheel::next_expiry(uint64_t *when) const
+{
+	if(timers.empty())
+	{
+		return false;
+	}
+	
+	bool found = false;
+	uint64_t next_tick = 0;
+	
+	for(unsigned int level = 0; level < LEVELS; ++level)
+	{
+		uint64_t base = now_tick >> (SLOT_BITS * level);
+		
+		for(uint64_t i = 1; i <= SLOTS; ++i)
+		{
+			if(!wheel[level][(base + i) & (SLOTS - 1)].empty())
+			{
+				/* A slot is dealt with at the first tick it spans. */
+				uint64_t slot_tick = (base + i) << (SLOT_BITS * level);
+				
+				if(!found || slot_tick < next_tick)
+				{
+					next_tick = slot_tick;
+					found = true;
+				}
+				
+				break;
+			}
+		}
+	}
+	
+	assert(found);
+	
+	*when = next_tick * TICK_MS;
+	return true;
+}
+
+/* Moves a timer from the from list into the wheel slot for its expiry time relative to the
+ * current tick.
+*/
+void TimerWheel::place(Slot *from, Slot::iterator timer)
+{
+	uint64_t delta = (timer->expires > now_tick ? timer->expires - now_tick : 0);
+	
+	unsigned int level = 0;
+	while(level < (LEVELS - 1) && delta >= ((uint64_t)(1) << (SLOT_BITS * (level + 1))))
+	{
+		++level;
+	}
+	
+	uint64_t slot_tick = timer->expires;
+	
+	if(level == (LEVELS - 1) && delta >= ((uint64_t)(1) << (SLOT_BITS * LEVELS)))
+	{
+		/* Too far out for the wheel, park it in the last slot of the top level and it
+		 * will be placed again when that is cascaded.
+		*/
+		slot_tick = now_tick + ((uint64_t)(SLOTS) << (SLOT_BITS * level));
+	}
+	
+	Slot *to = &(wheel[level][(slot_tick >> (SLOT_BITS * level)) & (SLOTS - 1)]);
+	
+	to->splice(to->end(), *from, timer);
+	timers[timer->id].slot = to;
+}
+
+void TimerWheel::cascade(unsigned int level)
+{
+	Slot moving;
+	moving.splice(moving.end(), wheel[level][(now_tick >> (SLOT_BITS * level)) & (SLOTS - 1)]);
+	
+	for(auto t = moving.begin(); t != moving.end();)
+	{
+		auto next = std::next(t);
+		
+		place(&moving, t);
+		
+		t = next;
+	}
+}
@@ -0,0 +1,116 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_TIMERWHEEL_HPP
+#define DPLITE_TIMERWHEEL_HPP
+
+#include <functional>
+#include <list>
+#include <mutex>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+/* Hierarchical timing wheel for scheduling callbacks at some point in the future.
+ *
+ * Time is divided into ticks of TICK_MS milliseconds. Timers due within SLOTS ticks go into
+ * a slot of the first level, each tick of which is checked as time advances. Timers further
+ * out go into a slot of a higher level, each spanning SLOTS times as many ticks as a slot of
+ * the level below, and are cascaded down into the level below when time reaches their slot,
+ * so adding, cancelling and expiring a timer are all O(1) however many are scheduled.
+ *
+ * The object doesn't read the clock or run anything by itself - the caller passes the
+ * current time to advance() and runs the callbacks it returns, and uses next_expiry() to
+ * decide when to call it again. Times are in milliseconds, from any monotonic clock such as
+ * GetTickCount64(). Timers may fire up to TICK_MS late, never early.
+ *
+ * Not thread-safe, the caller must serialise access.
+*/
+
+class TimerWheel
+{
+	public:
+		typedef uint64_t TimerID;
+		typedef std::function<void(std::unique_lock<std::mutex>&)> Callback;
+		
+		static const uint64_t TICK_MS = 10;
+		
+		static const unsigned int SLOT_BITS = 6;
+		static const unsigned int SLOTS     = 1 << SLOT_BITS;
+		static const unsigned int LEVELS    = 4;
+		
+	private:
+		struct Timer
+		{
+			TimerID id;
+			uint64_t expires;  /* In ticks. */
+			Callback callback;
+		};
+		
+		typedef std::list<Timer> Slot;
+		
+		Slot wheel[LEVELS][SLOTS];
+		
+		struct TimerRef
+		{
+			Slot *slot;
+			Slot::iterator timer;
+		};
+		
+		std::unordered_map<TimerID, TimerRef> timers;
+		
+		TimerID next_id;
+		
+		/* The last tick which has been processed. */
+		uint64_t now_tick;
+		
+		void place(Slot *from, Slot::iterator timer);
+		void cascade(unsigned int level);
+		
+	public:
+		TimerWheel(uint64_t now);
+		
+		/* No copy c'tor. */
+		TimerWheel(const TimerWheel &src) = delete;
+		
+		/* Schedules callback to be returned by the first call to advance() at or after the
+		 * given time. Returns an ID which may be passed to cancel().
+		*/
+		TimerID schedule(uint64_t when, const Callback &callback);
+		
+		/* Removes a timer which hasn't fired yet. Returns false if there is no such timer. */
+		bool cancel(TimerID id);
+		
+		/* Removes all timers. */
+		void clear();
+		
+		/* Moves time forward, returning the callbacks of any timers which have expired in
+		 * the order they expired.
+		*/
+		std::vector<Callback> advance(uint64_t now);
+		
+		/* Returns the time at which advance() next needs to be called, which may be
+		 * earlier than any timer is due if timers need cascading from a higher level.
+		 * Returns false if there are no timers.
+		*/
+		bool next_expiry(uint64_t *when) const;
+		
+		size_t size() const { return timers.size(); }
+};
+
+#endif /* !DPLITE_TIMERWHEEL_HPP */
@@ -0,0 +1,170 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdexcept>
+#include <stdint.h>
+
+#include "WorkQueue.hpp"
+
+WorkQueue::WorkQueue(size_t capacity):
+	cells(new Cell[capacity]),
+	mask(capacity - 1),
+	enqueue_pos(0),
+	dequeue_pos(0),
+	overflow_size(0)
+{
+	if(capacity < 2 || (capacity & (capacity - 1)) != 0)
+	{
+		delete[] cells;
+		throw std::invalid_argument("capacity must be a power of two");
+	}
+	
+	for(size_t i = 0; i < capacity; ++i)
+	{
+		cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+}
+
+WorkQueue::~WorkQueue()
+{
+	delete[] cells;
+}
+
+void WorkQueue::push(WorkTask &&task)
+{
+	/* Once anything has gone into the overflow list, keep using it until consumers have
+	 * emptied it so that tasks don't overtake the ones in there.
+	*/
+	
+	if(overflow_size.load(std::memory_order_acquire) == 0 && try_push(task))
+	{
+		return;
+	}
+	
+	std::unique_lock<std::mutex> l(overflow_lock);
+	
+	overflow.push_back(std::move(task));
+	overflow_size.fetch_add(1, std::memory_order_release);
+}
+
+bool WorkQueue::pop(WorkTask &task)
+{
+	if(try_pop(task))
+	{
+		return true;
+	}
+	
+	if(overflow_size.load(std::memory_order_acquire) == 0)
+	{
+		return false;
+	}
+	
+	std::unique_lock<std::mutex> l(overflow_lock);
+	
+	if(overflow.empty())
+	{
+		return false;
+	}
+	
+	task = std::move(overflow.front());
+	overflow.pop_front();
+	
+	overflow_size.fetch_sub(1, std::memory_order_release);
+	
+	return true;
+}
+
+bool WorkQueue::empty() const
+{
+	return enqueue_pos.load(std::memory_order_relaxed) == dequeue_pos.load(std::memory_order_relaxed)
+		&& overflow_size.load(std::memory_order_relaxed) == 0;
+}
+
+bool WorkQueue::try_push(WorkTask &task)
+{
+	Cell *cell;
+	size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+	
+	while(1)
+	{
+		cell = &(cells[pos & mask]);
+		
+		size_t seq = cell->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)(seq) - (intptr_t)(pos);
+		
+		if(diff == 0)
+		{
+			/* Cell is free on this lap, try to claim it. */
+			if(enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if(diff < 0)
+		{
+			/* Cell still holds a task from the previous lap, the ring is full. */
+			return false;
+		}
+		else{
+			/* Another producer claimed the cell first. */
+			pos = enqueue_pos.load(std::memory_order_relaxed);
+		}
+	}
+	
+	cell->task = std::move(task);
+	cell->sequence.store(pos + 1, std::memory_order_release);
+	
+	return true;
+}
+
+bool WorkQueue::try_pop(WorkTask &task)
+{
+	Cell *cell;
+	size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+	
+	while(1)
+	{
+		cell = &(cells[pos & mask]);
+		
+		size_t seq = cell->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)(seq) - (intptr_t)(pos + 1);
+		
+		if(diff == 0)
+		{
+			/* Cell has been filled on this lap, try to claim it. */
+			if(dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if(diff < 0)
+		{
+			/* Cell hasn't been filled yet, the ring is empty. */
+			return false;
+		}
+		else{
+			/* Another consumer claimed the cell first. */
+			pos = dequeue_pos.load(std::memory_order_relaxed);
+		}
+	}
+	
+	task = std::move(cell->task);
+	cell->sequence.store(pos + mask + 1, std::memory_order_release);
+	
+	return true;
+}
@@ -0,0 +1,222 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_WORKQUEUE_HPP
+#define DPLITE_WORKQUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/* A move-only void() functor, like std::function but able to hold move-only callables.
+ *
+ * Callables of up to INLINE_SIZE bytes are stored within the object itself, larger ones (or
+ * ones which might throw when moved) are allocated on the heap.
+*/
+
+class WorkTask
+{
+	public:
+		static const size_t INLINE_SIZE = 96;
+		
+	private:
+		struct Ops
+		{
+			void (*invoke)(void *storage);
+			void (*move)(void *dst, void *src);
+			void (*destroy)(void *storage);
+			bool is_inline;
+		};
+		
+		template<typename F> struct InlineOps
+		{
+			static void invoke(void *storage) { (*(F*)(storage))(); }
+			
+			static void move(void *dst, void *src)
+			{
+				new (dst) F(std::move(*(F*)(src)));
+				((F*)(src))->~F();
+			}
+			
+			static void destroy(void *storage) { ((F*)(storage))->~F(); }
+			
+			static const Ops ops;
+		};
+		
+		template<typename F> struct HeapOps
+		{
+			static void invoke(void *storage) { (**(F**)(storage))(); }
+			static void move(void *dst, void *src) { *(F**)(dst) = *(F**)(src); }
+			static void destroy(void *storage) { delete *(F**)(storage); }
+			
+			static const Ops ops;
+		};
+		
+		alignas(std::max_align_t) unsigned char storage[INLINE_SIZE];
+		const Ops *ops;
+		
+		template<typename T, typename F> void init(F &&f, std::true_type is_inline)
+		{
+			new (storage) T(std::forward<F>(f));
+			ops = &(InlineOps<T>::ops);
+		}
+		
+		template<typename T, typename F> void init(F &&f, std::false_type is_inline)
+		{
+			*(T**)(storage) = new T(std::forward<F>(f));
+			ops = &(HeapOps<T>::ops);
+		}
+		
+		void reset()
+		{
+			if(ops != NULL)
+			{
+				ops->destroy(storage);
+				ops = NULL;
+			}
+		}
+		
+	public:
+		WorkTask(): ops(NULL) {}
+		
+		template<typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, WorkTask>::value>::type>
+			WorkTask(F &&f)
+		{
+			typedef typename std::decay<F>::type T;
+			
+			init<T>(std::forward<F>(f), std::integral_constant<bool,
+				(sizeof(T) <= INLINE_SIZE
+					&& alignof(T) <= alignof(std::max_align_t)
+					&& std::is_nothrow_move_constructible<T>::value)>());
+		}
+		
+		WorkTask(WorkTask &&src): ops(src.ops)
+		{
+			if(ops != NULL)
+			{
+				ops->move(storage, src.storage);
+				src.ops = NULL;
+			}
+		}
+		
+		WorkTask &operator=(WorkTask &&src)
+		{
+			if(&src != this)
+			{
+				reset();
+				
+				if(src.ops != NULL)
+				{
+					src.ops->move(storage, src.storage);
+					ops = src.ops;
+					src.ops = NULL;
+				}
+			}
+			
+			return *this;
+		}
+		
+		/* No copy c'tor. */
+		WorkTask(const WorkTask&) = delete;
+		WorkTask &operator=(const WorkTask&) = delete;
+		
+		~WorkTask() { reset(); }
+		
+		void operator()() { ops->invoke(storage); }
+		
+		explicit operator bool() const { return ops != NULL; }
+		
+		/* Returns true if the callable is stored without a heap allocation. */
+		bool is_inline() const { return ops != NULL && ops->is_inline; }
+};
+
+template<typename F> const WorkTask::Ops WorkTask::InlineOps<F>::ops = {
+	&WorkTask::InlineOps<F>::invoke,
+	&WorkTask::InlineOps<F>::move,
+	&WorkTask::InlineOps<F>::destroy,
+	true,
+};
+
+template<typename F> const WorkTask::Ops WorkTask::HeapOps<F>::ops = {
+	&WorkTask::HeapOps<F>::invoke,
+	&WorkTask::HeapOps<F>::move,
+	&WorkTask::HeapOps<F>::destroy,
+	false,
+};
+
+/* Multi-producer, multi-consumer FIFO queue of WorkTasks.
+ *
+ * Tasks are held in a fixed-size ring buffer of cells, each with a sequence number which says
+ * whether it is ready to be written or read on a given lap of the ring, so push() and pop()
+ * only need a compare-and-swap on the write or read position and never block each other
+ * (Dmitry Vyukov's bounded MPMC queue).
+ *
+ * If the ring fills up, further tasks go into a mutex protected overflow list until it has
+ * been drained, so push() never fails. Tasks pushed concurrently by different threads may be
+ * popped in either order.
+*/
+
+class WorkQueue
+{
+	private:
+		struct Cell
+		{
+			std::atomic<size_t> sequence;
+			WorkTask task;
+		};
+		
+		Cell *const cells;
+		const size_t mask;
+		
+		/* Kept on separate cache lines so producers and consumers don't contend. */
+		alignas(64) std::atomic<size_t> enqueue_pos;
+		alignas(64) std::atomic<size_t> dequeue_pos;
+		
+		alignas(64) std::atomic<size_t> overflow_size;
+		std::mutex overflow_lock;
+		std::deque<WorkTask> overflow;
+		
+		bool try_push(WorkTask &task);
+		bool try_pop(WorkTask &task);
+		
+	public:
+		static const size_t DEFAULT_CAPACITY = 1024;
+		
+		/* capacity must be a power of two. */
+		WorkQueue(size_t capacity = DEFAULT_CAPACITY);
+		~WorkQueue();
+		
+		/* No copy c'tor. */
+		WorkQueue(const WorkQueue&) = delete;
+		
+		void push(WorkTask &&task);
+		
+		/* Moves the oldest task into task and returns true, or returns false if the queue
+		 * is empty.
+		*/
+		bool pop(WorkTask &task);
+		
+		/* Only a hint when other threads are using the queue. */
+		bool empty() const;
+};
+
+#endif /* !DPLITE_WORKQUEUE_HPP */
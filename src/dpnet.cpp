@@ -23,9 +23,12 @@
 #include <olectl.h>
 #include <windows.h>
 
+#include "Capture.hpp"
 #include "DirectPlay8Address.hpp"
 #include "DirectPlay8Peer.hpp"
+#include "DirectPlay8ThreadPool.hpp"
 #include "Factory.hpp"
+#include "Log.hpp"
 
 struct DllClass
 {
@@ -36,8 +39,9 @@ struct DllClass
 };
 
 DllClass DLL_CLASSES[] = {
-	{ CLSID_DirectPlay8Address, "DirectPlay8Address Object", &Factory<DirectPlay8Address, IID_IDirectPlay8Address>::CreateFactoryInstance },
-	{ CLSID_DirectPlay8Peer,    "DirectPlay8Peer Object",    &Factory<DirectPlay8Peer,    IID_IDirectPlay8Peer   >::CreateFactoryInstance },
+	{ CLSID_DirectPlay8Address,    "DirectPlay8Address Object",    &Factory<DirectPlay8Address,    IID_IDirectPlay8Address   >::CreateFactoryInstance },
+	{ CLSID_DirectPlay8Peer,       "DirectPlay8Peer Object",       &Factory<DirectPlay8Peer,       IID_IDirectPlay8Peer      >::CreateFactoryInstance },
+	{ CLSID_DirectPlay8ThreadPool, "DirectPlay8ThreadPool Object", &Factory<DirectPlay8ThreadPool, IID_IDirectPlay8ThreadPool>::CreateFactoryInstance },
 };
 
 size_t NUM_DLL_CLASSES = sizeof(DLL_CLASSES) / sizeof(*DLL_CLASSES);
@@ -51,13 +55,32 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
 	{
 		global_refcount = 0;
 	}
+	else if(fdwReason == DLL_PROCESS_DETACH && lpvReserved == NULL)
+	{
+		capture_fini();
+		log_fini();
+	}
 	
 	return TRUE;
 }
 
 HRESULT CALLBACK DllCanUnloadNow()
 {
-	return (global_refcount == 0 ? S_OK : S_FALSE);
+	if(global_refcount == 0)
+	{
+		/* The log writer thread holds a reference to the DLL, so it has to be stopped
+		 * before COM frees us, or we would never actually be unloaded. The capture is
+		 * closed too so it is trimmed and unmapped; if we aren't unloaded after all,
+		 * the next frame captured carries on from the end of it.
+		*/
+		capture_fini();
+		log_fini();
+		
+		return S_OK;
+	}
+	else{
+		return S_FALSE;
+	}
 }
 
 HRESULT CALLBACK DllGetClassObject(REFCLSID rclsid, REFIID riid, LPVOID *ppv)
@@ -49,6 +49,14 @@ int create_udp_socket(uint32_t ipaddr, uint16_t port)
 		return -1;
 	}
 	
+	int rcvbuf = UDP_RECV_BUFFER_SIZE;
+	if(setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char*)(&rcvbuf), sizeof(rcvbuf)) == -1)
+	{
+		/* Not fatal, we just might drop more datagrams under load. */
+		DWORD err = WSAGetLastError();
+		LOG_ERROR(LOG_CAT_SOCKETS, "Failed to set SO_RCVBUF on UDP socket: %s", win_strerror(err).c_str());
+	}
+	
 	struct sockaddr_in addr;
 	addr.sin_family      = AF_INET;
 	addr.sin_addr.s_addr = ipaddr;
@@ -217,7 +225,7 @@ std::list<SystemNetworkInterface> get_network_interfaces()
 			buf.resize(size);
 		}
 		else{
-			log_printf("GetAdaptersAddresses: %s", win_strerror(err).c_str());
+			LOG_ERROR(LOG_CAT_SOCKETS, "GetAdaptersAddresses: %s", win_strerror(err).c_str());
 			return std::list<SystemNetworkInterface>();
 		}
 	}
@@ -239,7 +247,7 @@ std::list<SystemNetworkInterface> get_network_interfaces()
 		{
 			if(uc->Address.iSockaddrLength > sizeof(struct sockaddr_storage))
 			{
-				log_printf("Ignoring oversize address (family = %u, size = %u)",
+				LOG_WARN(LOG_CAT_SOCKETS, "Ignoring oversize address (family = %u, size = %u)",
 					(unsigned)(uc->Address.lpSockaddr->sa_family),
 					(unsigned)(uc->Address.iSockaddrLength));
 				continue;
@@ -29,6 +29,16 @@
 #define LISTEN_QUEUE_SIZE 16
 #define MAX_PACKET_SIZE   (256 * 1024)
 
+/* Largest datagram we send over udp_socket, chosen to fit within a typical path MTU so
+ * datagrams aren't fragmented by IP.
+*/
+#define MAX_DATAGRAM_SIZE 1400
+
+/* Requested receive buffer size for UDP sockets, large enough to absorb a burst of
+ * datagrams from many peers while the workers are busy.
+*/
+#define UDP_RECV_BUFFER_SIZE (1024 * 1024)
+
 struct SystemNetworkInterface {
 	std::wstring friendly_name;
 	
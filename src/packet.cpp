@@ -16,6 +16,7 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string>
@@ -24,17 +25,19 @@
 
 #include "packet.hpp"
 
-const uint32_t FIELD_TYPE_NULL    = 0;
-const uint32_t FIELD_TYPE_DWORD   = 1;
-const uint32_t FIELD_TYPE_DATA    = 2;
-const uint32_t FIELD_TYPE_WSTRING = 3;
-const uint32_t FIELD_TYPE_GUID    = 4;
-
 PacketSerialiser::PacketSerialiser(uint32_t type)
 {
 	/* Avoid reallocations during packet construction unless we get given a lot of data. */
 	sbuf.reserve(4096);
 	
+	reset(type);
+}
+
+void PacketSerialiser::reset(uint32_t type)
+{
+	sbuf.clear();
+	refs.clear();
+	
 	TLVChunk header;
 	header.type = type;
 	header.value_length = 0;
@@ -44,9 +47,50 @@ PacketSerialiser::PacketSerialiser(uint32_t type)
 
 std::pair<const void*, size_t> PacketSerialiser::raw_packet() const
 {
+	assert(refs.empty());
 	return std::make_pair<const void*, size_t>(sbuf.data(), sbuf.size());
 }
 
+std::vector< std::pair<const void*, size_t> > PacketSerialiser::raw_packet_v() const
+{
+	std::vector< std::pair<const void*, size_t> > v;
+	raw_packet_v(v);
+	
+	return v;
+}
+
+void PacketSerialiser::raw_packet_v(std::vector< std::pair<const void*, size_t> > &v) const
+{
+	v.clear();
+	v.reserve((refs.size() * 2) + 1);
+	
+	size_t sbuf_at = 0;
+	
+	for(auto r = refs.begin(); r != refs.end(); ++r)
+	{
+		if(r->offset > sbuf_at)
+		{
+			v.push_back(std::make_pair((const void*)(sbuf.data() + sbuf_at), (r->offset - sbuf_at)));
+			sbuf_at = r->offset;
+		}
+		
+		if(r->size > 0)
+		{
+			v.push_back(std::make_pair(r->data, r->size));
+		}
+	}
+	
+	if(sbuf.size() > sbuf_at)
+	{
+		v.push_back(std::make_pair((const void*)(sbuf.data() + sbuf_at), (sbuf.size() - sbuf_at)));
+	}
+}
+
+size_t PacketSerialiser::raw_packet_size() const
+{
+	return sizeof(TLVChunk) + ((const TLVChunk*)(sbuf.data()))->value_length;
+}
+
 void PacketSerialiser::append_null()
 {
 	TLVChunk header;
@@ -82,6 +126,56 @@ void PacketSerialiser::append_data(const void *data, size_t size)
 	((TLVChunk*)(sbuf.data()))->value_length += sizeof(header) + size;
 }
 
+void PacketSerialiser::append_data(const std::vector< std::pair<const void*, size_t> > &buffers)
+{
+	size_t size = 0;
+	for(auto b = buffers.begin(); b != buffers.end(); ++b)
+	{
+		size += b->second;
+	}
+	
+	TLVChunk header;
+	header.type = FIELD_TYPE_DATA;
+	header.value_length = size;
+	
+	sbuf.reserve(sbuf.size() + sizeof(header) + size);
+	sbuf.insert(sbuf.end(), (unsigned char*)(&header), (unsigned char*)(&header + 1));
+	
+	for(auto b = buffers.begin(); b != buffers.end(); ++b)
+	{
+		sbuf.insert(sbuf.end(), (const unsigned char*)(b->first), (const unsigned char*)(b->first) + b->second);
+	}
+	
+	((TLVChunk*)(sbuf.data()))->value_length += sizeof(header) + size;
+}
+
+void PacketSerialiser::append_data_ref(const std::vector< std::pair<const void*, size_t> > &buffers)
+{
+	size_t size = 0;
+	for(auto b = buffers.begin(); b != buffers.end(); ++b)
+	{
+		size += b->second;
+	}
+	
+	TLVChunk header;
+	header.type = FIELD_TYPE_DATA;
+	header.value_length = size;
+	
+	sbuf.insert(sbuf.end(), (unsigned char*)(&header), (unsigned char*)(&header + 1));
+	
+	for(auto b = buffers.begin(); b != buffers.end(); ++b)
+	{
+		DataRef ref;
+		ref.offset = sbuf.size();
+		ref.data   = b->first;
+		ref.size   = b->second;
+		
+		refs.push_back(ref);
+	}
+	
+	((TLVChunk*)(sbuf.data()))->value_length += sizeof(header) + size;
+}
+
 void PacketSerialiser::append_wstring(const std::wstring &string)
 {
 	size_t string_bytes = string.length() * sizeof(wchar_t);
@@ -230,3 +324,23 @@ GUID PacketDeserialiser::get_guid(size_t index) const
 	
 	return *(GUID*)(fields[index]->value);
 }
+
+uint32_t PacketDeserialiser::field_type(size_t index) const
+{
+	if(fields.size() <= index)
+	{
+		throw Error::MissingField();
+	}
+	
+	return fields[index]->type;
+}
+
+std::pair<const void*,size_t> PacketDeserialiser::get_raw(size_t index) const
+{
+	if(fields.size() <= index)
+	{
+		throw Error::MissingField();
+	}
+	
+	return std::make_pair((const void*)(fields[index]->value), (size_t)(fields[index]->value_length));
+}
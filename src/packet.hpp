@@ -27,6 +27,12 @@
 #include <vector>
 #include <windows.h>
 
+const uint32_t FIELD_TYPE_NULL    = 0;
+const uint32_t FIELD_TYPE_DWORD   = 1;
+const uint32_t FIELD_TYPE_DATA    = 2;
+const uint32_t FIELD_TYPE_WSTRING = 3;
+const uint32_t FIELD_TYPE_GUID    = 4;
+
 struct TLVChunk
 {
 	uint32_t type;
@@ -39,16 +45,51 @@ struct TLVChunk
 class PacketSerialiser
 {
 	private:
+		/* Data appended using append_data_ref() is not copied into sbuf, instead we keep a
+		 * pointer to it which is spliced into the packet after the first offset bytes of
+		 * sbuf when the packet is sent.
+		*/
+		struct DataRef
+		{
+			size_t offset;
+			const void *data;
+			size_t size;
+		};
+		
 		std::vector<unsigned char> sbuf;
+		std::vector<DataRef> refs;
 		
 	public:
 		PacketSerialiser(uint32_t type);
 		
+		/* Empties the packet and sets a new type, keeping any memory already allocated
+		 * for its data.
+		*/
+		void reset(uint32_t type);
+		
+		/* Returns the serialised packet as a single contiguous buffer.
+		 * Only valid for packets which don't contain any referenced data.
+		*/
 		std::pair<const void*, size_t> raw_packet() const;
 		
+		/* Returns the serialised packet as a list of buffers to be sent in order. */
+		std::vector< std::pair<const void*, size_t> > raw_packet_v() const;
+		
+		/* Replaces the contents of v with the list of buffers, reusing its storage. */
+		void raw_packet_v(std::vector< std::pair<const void*, size_t> > &v) const;
+		
+		size_t raw_packet_size() const;
+		
 		void append_null();
 		void append_dword(DWORD value);
 		void append_data(const void *data, size_t size);
+		void append_data(const std::vector< std::pair<const void*, size_t> > &buffers);
+		
+		/* Appends a DATA field made up of one or more buffers without copying them. The
+		 * buffers must remain valid until the packet (and any copies of it) have been sent.
+		*/
+		void append_data_ref(const std::vector< std::pair<const void*, size_t> > &buffers);
+		
 		void append_wstring(const std::wstring &string);
 		void append_guid(const GUID &guid);
 };
@@ -82,6 +123,12 @@ class PacketDeserialiser
 		std::pair<const void*,size_t> get_data(size_t index) const;
 		std::wstring get_wstring(size_t index) const;
 		GUID get_guid(size_t index) const;
+		
+		/* Returns the FIELD_TYPE_XXX of a field. */
+		uint32_t field_type(size_t index) const;
+		
+		/* Returns the raw value of a field of any type. */
+		std::pair<const void*,size_t> get_raw(size_t index) const;
 };
 
 class PacketDeserialiser::Error::Incomplete: public Error
@@ -0,0 +1,107 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <gtest/gtest.h>
+
+#include "../src/BufferPool.hpp"
+
+TEST(BufferPool, BufferSize)
+{
+	EXPECT_EQ(BufferPool::buffer_size(1),                       BufferPool::MIN_SIZE);
+	EXPECT_EQ(BufferPool::buffer_size(BufferPool::MIN_SIZE),     BufferPool::MIN_SIZE);
+	EXPECT_EQ(BufferPool::buffer_size(BufferPool::MIN_SIZE + 1), BufferPool::MIN_SIZE * 2);
+	EXPECT_EQ(BufferPool::buffer_size(BufferPool::MAX_SIZE - 1), BufferPool::MAX_SIZE);
+	EXPECT_EQ(BufferPool::buffer_size(BufferPool::MAX_SIZE),     BufferPool::MAX_SIZE);
+}
+
+TEST(BufferPool, ReuseSameClass)
+{
+	BufferPool pool;
+	
+	BufferPool::Buffer *b1 = pool.get(100);
+	EXPECT_EQ(b1->size(), BufferPool::MIN_SIZE);
+	b1->unref();
+	
+	/* Buffers of a different size class shouldn't be reused. */
+	BufferPool::Buffer *b2 = pool.get(BufferPool::MAX_SIZE);
+	EXPECT_NE(b2, b1);
+	EXPECT_EQ(b2->size(), BufferPool::MAX_SIZE);
+	
+	BufferPool::Buffer *b3 = pool.get(BufferPool::MIN_SIZE);
+	EXPECT_EQ(b3, b1);
+	
+	b2->unref();
+	b3->unref();
+}
+
+TEST(BufferPool, MaxFree)
+{
+	BufferPool pool(1);
+	
+	BufferPool::Buffer *b1 = pool.get(100);
+	BufferPool::Buffer *b2 = pool.get(100);
+	
+	/* Only one buffer should be kept, the other is freed. */
+	b1->unref();
+	b2->unref();
+	
+	BufferPool::Buffer *b3 = pool.get(100);
+	BufferPool::Buffer *b4 = pool.get(100);
+	
+	EXPECT_EQ(b3, b1);
+	EXPECT_NE(b4, b1);
+	
+	b3->unref();
+	b4->unref();
+}
+
+TEST(BufferPool, Refcount)
+{
+	BufferPool pool;
+	
+	BufferPool::Buffer *b1 = pool.get(100);
+	EXPECT_FALSE(b1->shared());
+	
+	b1->ref();
+	EXPECT_TRUE(b1->shared());
+	
+	/* Buffer shouldn't go back to the pool while it is still referenced. */
+	b1->unref();
+	EXPECT_FALSE(b1->shared());
+	
+	BufferPool::Buffer *b2 = pool.get(100);
+	EXPECT_NE(b2, b1);
+	
+	b1->unref();
+	
+	BufferPool::Buffer *b3 = pool.get(100);
+	EXPECT_EQ(b3, b1);
+	
+	b2->unref();
+	b3->unref();
+}
+
+TEST(BufferPool, Oversize)
+{
+	BufferPool pool;
+	
+	BufferPool::Buffer *b1 = pool.get(BufferPool::MAX_SIZE + 1);
+	EXPECT_EQ(b1->size(), BufferPool::MAX_SIZE + 1);
+	
+	b1->unref();
+}
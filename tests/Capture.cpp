@@ -0,0 +1,238 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+#include <windows.h>
+
+#include "../src/Capture.hpp"
+
+#define CAPTURE_FILE "dplite-capture-test.cap"
+
+static std::vector<unsigned char> read_file(const char *path)
+{
+	std::vector<unsigned char> data;
+	
+	FILE *fh = fopen(path, "rb");
+	if(fh == NULL)
+	{
+		return data;
+	}
+	
+	int c;
+	while((c = fgetc(fh)) != EOF)
+	{
+		data.push_back(c);
+	}
+	
+	fclose(fh);
+	
+	return data;
+}
+
+class CaptureTest: public ::testing::Test
+{
+	protected:
+		virtual void SetUp() override
+		{
+			capture_fini();
+			remove(CAPTURE_FILE);
+			
+			_putenv_s("DPLITE_CAPTURE", CAPTURE_FILE);
+		}
+		
+		virtual void TearDown() override
+		{
+			capture_fini();
+			
+			_putenv_s("DPLITE_CAPTURE", "");
+			remove(CAPTURE_FILE);
+		}
+};
+
+TEST_F(CaptureTest, Disabled)
+{
+	_putenv_s("DPLITE_CAPTURE", "");
+	
+	EXPECT_FALSE(capture_enabled());
+	
+	capture_frame(1, 2, CAPTURE_DIR_IN, CAPTURE_TRANSPORT_TCP, 0, 0, "hello", 5);
+	capture_fini();
+	
+	FILE *fh = fopen(CAPTURE_FILE, "rb");
+	EXPECT_EQ(fh, (FILE*)(NULL));
+	
+	if(fh != NULL)
+	{
+		fclose(fh);
+	}
+}
+
+TEST_F(CaptureTest, Records)
+{
+	ASSERT_TRUE(capture_enabled());
+	
+	uint32_t instance = capture_new_instance();
+	EXPECT_NE(capture_new_instance(), instance);
+	
+	capture_frame(instance, 2, CAPTURE_DIR_IN, CAPTURE_TRANSPORT_TCP, 0x0100007F, 6073, "hello", 5);
+	
+	std::vector< std::pair<const void*, size_t> > buffers;
+	buffers.push_back(std::make_pair("abc", 3));
+	buffers.push_back(std::make_pair("", 0));
+	buffers.push_back(std::make_pair("defgh", 5));
+	
+	capture_frame(instance, CAPTURE_NO_PEER, CAPTURE_DIR_OUT, CAPTURE_TRANSPORT_UDP, 0x0200007F, 6074, buffers);
+	
+	capture_fini();
+	
+	std::vector<unsigned char> data = read_file(CAPTURE_FILE);
+	
+	/* File is trimmed to the header and two records, each padded to 8 bytes. */
+	ASSERT_EQ(data.size(), (sizeof(CaptureFileHeader) + sizeof(CaptureRecordHeader) + 8 + sizeof(CaptureRecordHeader) + 8));
+	
+	const CaptureFileHeader *fh = (const CaptureFileHeader*)(data.data());
+	
+	EXPECT_EQ(memcmp(fh->magic, CAPTURE_MAGIC, sizeof(fh->magic)), 0);
+	EXPECT_EQ(fh->version, (uint32_t)(CAPTURE_VERSION));
+	EXPECT_EQ(fh->header_size, (uint32_t)(sizeof(CaptureFileHeader)));
+	EXPECT_NE(fh->start_time, (uint64_t)(0));
+	
+	const unsigned char *at = data.data() + sizeof(CaptureFileHeader);
+	const CaptureRecordHeader *r1 = (const CaptureRecordHeader*)(at);
+	
+	EXPECT_EQ(r1->length,      (uint32_t)(5));
+	EXPECT_EQ(r1->instance,    instance);
+	EXPECT_EQ(r1->peer_id,     (uint32_t)(2));
+	EXPECT_EQ(r1->remote_ip,   (uint32_t)(0x0100007F));
+	EXPECT_EQ(r1->remote_port, (uint16_t)(6073));
+	EXPECT_EQ(r1->direction,   (uint8_t)(CAPTURE_DIR_IN));
+	EXPECT_EQ(r1->transport,   (uint8_t)(CAPTURE_TRANSPORT_TCP));
+	EXPECT_EQ(memcmp(at + sizeof(CaptureRecordHeader), "hello\0\0\0", 8), 0);
+	
+	at += sizeof(CaptureRecordHeader) + 8;
+	const CaptureRecordHeader *r2 = (const CaptureRecordHeader*)(at);
+	
+	EXPECT_EQ(r2->length,      (uint32_t)(8));
+	EXPECT_EQ(r2->instance,    instance);
+	EXPECT_EQ(r2->peer_id,     (uint32_t)(CAPTURE_NO_PEER));
+	EXPECT_EQ(r2->remote_ip,   (uint32_t)(0x0200007F));
+	EXPECT_EQ(r2->remote_port, (uint16_t)(6074));
+	EXPECT_EQ(r2->direction,   (uint8_t)(CAPTURE_DIR_OUT));
+	EXPECT_EQ(r2->transport,   (uint8_t)(CAPTURE_TRANSPORT_UDP));
+	EXPECT_GE(r2->time_us,     r1->time_us);
+	EXPECT_EQ(memcmp(at + sizeof(CaptureRecordHeader), "abcdefgh", 8), 0);
+}
+
+TEST_F(CaptureTest, Resume)
+{
+	/* Capturing again after capture_fini() (e.g. when dpnet.dll wasn't unloaded after
+	 * DllCanUnloadNow()) carries on from the end of the existing capture.
+	*/
+	
+	ASSERT_TRUE(capture_enabled());
+	capture_frame(1, 1, CAPTURE_DIR_IN, CAPTURE_TRANSPORT_TCP, 0, 0, "first", 5);
+	capture_fini();
+	
+	ASSERT_EQ(read_file(CAPTURE_FILE).size(), (sizeof(CaptureFileHeader) + sizeof(CaptureRecordHeader) + 8));
+	
+	ASSERT_TRUE(capture_enabled());
+	capture_frame(1, 2, CAPTURE_DIR_OUT, CAPTURE_TRANSPORT_TCP, 0, 0, "second", 6);
+	capture_fini();
+	
+	std::vector<unsigned char> data = read_file(CAPTURE_FILE);
+	ASSERT_EQ(data.size(), (sizeof(CaptureFileHeader) + sizeof(CaptureRecordHeader) + 8 + sizeof(CaptureRecordHeader) + 8));
+	
+	const unsigned char *at = data.data() + sizeof(CaptureFileHeader);
+	const CaptureRecordHeader *r1 = (const CaptureRecordHeader*)(at);
+	
+	EXPECT_EQ(r1->peer_id, (uint32_t)(1));
+	EXPECT_EQ(memcmp(at + sizeof(CaptureRecordHeader), "first\0\0\0", 8), 0);
+	
+	at += sizeof(CaptureRecordHeader) + 8;
+	const CaptureRecordHeader *r2 = (const CaptureRecordHeader*)(at);
+	
+	EXPECT_EQ(r2->peer_id, (uint32_t)(2));
+	EXPECT_GE(r2->time_us, r1->time_us);
+	EXPECT_EQ(memcmp(at + sizeof(CaptureRecordHeader), "second\0\0", 8), 0);
+	
+	/* A capture file which has been replaced since is started over. */
+	
+	remove(CAPTURE_FILE);
+	
+	ASSERT_TRUE(capture_enabled());
+	capture_frame(1, 3, CAPTURE_DIR_IN, CAPTURE_TRANSPORT_TCP, 0, 0, "third", 5);
+	capture_fini();
+	
+	data = read_file(CAPTURE_FILE);
+	ASSERT_EQ(data.size(), (sizeof(CaptureFileHeader) + sizeof(CaptureRecordHeader) + 8));
+	EXPECT_EQ(memcmp(data.data(), CAPTURE_MAGIC, 8), 0);
+	EXPECT_EQ(((const CaptureRecordHeader*)(data.data() + sizeof(CaptureFileHeader)))->peer_id, (uint32_t)(3));
+}
+
+TEST_F(CaptureTest, Grow)
+{
+	/* Write enough to need the mapping to grow a couple of times, including a single
+	 * record larger than CAPTURE_GROW_SIZE.
+	*/
+	
+	ASSERT_TRUE(capture_enabled());
+	
+	std::vector<unsigned char> small(1000, 0xAA);
+	std::vector<unsigned char> big(CAPTURE_GROW_SIZE + 1, 0xBB);
+	
+	const int N_SMALL = 5000;
+	
+	for(int i = 0; i < N_SMALL; ++i)
+	{
+		capture_frame(1, i, CAPTURE_DIR_IN, CAPTURE_TRANSPORT_TCP, 0, 0, small.data(), small.size());
+	}
+	
+	capture_frame(1, N_SMALL, CAPTURE_DIR_OUT, CAPTURE_TRANSPORT_TCP, 0, 0, big.data(), big.size());
+	
+	capture_fini();
+	
+	std::vector<unsigned char> data = read_file(CAPTURE_FILE);
+	
+	size_t small_record = sizeof(CaptureRecordHeader) + 1000;
+	size_t big_record   = (sizeof(CaptureRecordHeader) + CAPTURE_GROW_SIZE + 1 + 7) & ~(size_t)(7);
+	
+	ASSERT_EQ(data.size(), sizeof(CaptureFileHeader) + (N_SMALL * small_record) + big_record);
+	
+	const unsigned char *at = data.data() + sizeof(CaptureFileHeader);
+	
+	for(int i = 0; i < N_SMALL; ++i, at += small_record)
+	{
+		const CaptureRecordHeader *r = (const CaptureRecordHeader*)(at);
+		
+		ASSERT_EQ(r->length, (uint32_t)(1000)) << "Record " << i;
+		ASSERT_EQ(r->peer_id, (uint32_t)(i)) << "Record " << i;
+		ASSERT_EQ(at[sizeof(CaptureRecordHeader) + 999], 0xAA) << "Record " << i;
+	}
+	
+	const CaptureRecordHeader *r = (const CaptureRecordHeader*)(at);
+	
+	EXPECT_EQ(r->length, (uint32_t)(CAPTURE_GROW_SIZE + 1));
+	EXPECT_EQ(r->direction, (uint8_t)(CAPTURE_DIR_OUT));
+	EXPECT_EQ(at[sizeof(CaptureRecordHeader) + CAPTURE_GROW_SIZE], 0xBB);
+}
@@ -0,0 +1,164 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <gtest/gtest.h>
+#include <string.h>
+
+#include "../src/ConnectionStats.hpp"
+
+static DPN_CONNECTION_INFO get_info(const ConnectionStats &stats)
+{
+	DPN_CONNECTION_INFO info;
+	memset(&info, 0xFF, sizeof(info));
+	
+	info.dwSize = sizeof(info);
+	stats.get_info(&info);
+	
+	return info;
+}
+
+TEST(ConnectionStats, Initial)
+{
+	ConnectionStats stats(1000);
+	DPN_CONNECTION_INFO info = get_info(stats);
+	
+	EXPECT_EQ(info.dwSize, sizeof(info));
+	
+	EXPECT_EQ(info.dwRoundTripLatencyMS,               0U);
+	EXPECT_EQ(info.dwThroughputBPS,                    0U);
+	EXPECT_EQ(info.dwPeakThroughputBPS,                0U);
+	EXPECT_EQ(info.dwBytesSentGuaranteed,              0U);
+	EXPECT_EQ(info.dwPacketsSentGuaranteed,            0U);
+	EXPECT_EQ(info.dwBytesSentNonGuaranteed,           0U);
+	EXPECT_EQ(info.dwPacketsSentNonGuaranteed,         0U);
+	EXPECT_EQ(info.dwBytesRetried,                     0U);
+	EXPECT_EQ(info.dwPacketsRetried,                   0U);
+	EXPECT_EQ(info.dwBytesDropped,                     0U);
+	EXPECT_EQ(info.dwPacketsDropped,                   0U);
+	EXPECT_EQ(info.dwMessagesTransmittedHighPriority,  0U);
+	EXPECT_EQ(info.dwMessagesTimedOutHighPriority,     0U);
+	EXPECT_EQ(info.dwMessagesTransmittedNormalPriority,0U);
+	EXPECT_EQ(info.dwMessagesTimedOutNormalPriority,   0U);
+	EXPECT_EQ(info.dwMessagesTransmittedLowPriority,   0U);
+	EXPECT_EQ(info.dwMessagesTimedOutLowPriority,      0U);
+	EXPECT_EQ(info.dwBytesReceivedGuaranteed,          0U);
+	EXPECT_EQ(info.dwPacketsReceivedGuaranteed,        0U);
+	EXPECT_EQ(info.dwBytesReceivedNonGuaranteed,       0U);
+	EXPECT_EQ(info.dwPacketsReceivedNonGuaranteed,     0U);
+	EXPECT_EQ(info.dwMessagesReceived,                 0U);
+}
+
+TEST(ConnectionStats, Counters)
+{
+	ConnectionStats stats(1000);
+	
+	stats.packet_sent(true,  100);
+	stats.packet_sent(true,  50);
+	stats.packet_sent(false, 20);
+	
+	stats.packet_received(true,  10);
+	stats.packet_received(false, 30);
+	stats.packet_received(false, 40);
+	
+	stats.message_received();
+	
+	stats.message_sent(SendQueue::SEND_PRI_HIGH,   S_OK);
+	stats.message_sent(SendQueue::SEND_PRI_MEDIUM, S_OK);
+	stats.message_sent(SendQueue::SEND_PRI_MEDIUM, S_OK);
+	stats.message_sent(SendQueue::SEND_PRI_MEDIUM, DPNERR_TIMEDOUT);
+	stats.message_sent(SendQueue::SEND_PRI_LOW,    DPNERR_TIMEDOUT);
+	
+	/* Other failures aren't counted. */
+	stats.message_sent(SendQueue::SEND_PRI_LOW, DPNERR_USERCANCEL);
+	
+	DPN_CONNECTION_INFO info = get_info(stats);
+	
+	EXPECT_EQ(info.dwBytesSentGuaranteed,      150U);
+	EXPECT_EQ(info.dwPacketsSentGuaranteed,    2U);
+	EXPECT_EQ(info.dwBytesSentNonGuaranteed,   20U);
+	EXPECT_EQ(info.dwPacketsSentNonGuaranteed, 1U);
+	
+	EXPECT_EQ(info.dwBytesReceivedGuaranteed,      10U);
+	EXPECT_EQ(info.dwPacketsReceivedGuaranteed,    1U);
+	EXPECT_EQ(info.dwBytesReceivedNonGuaranteed,   70U);
+	EXPECT_EQ(info.dwPacketsReceivedNonGuaranteed, 2U);
+	
+	EXPECT_EQ(info.dwMessagesReceived, 1U);
+	
+	EXPECT_EQ(info.dwMessagesTransmittedHighPriority,   1U);
+	EXPECT_EQ(info.dwMessagesTimedOutHighPriority,      0U);
+	EXPECT_EQ(info.dwMessagesTransmittedNormalPriority, 2U);
+	EXPECT_EQ(info.dwMessagesTimedOutNormalPriority,    1U);
+	EXPECT_EQ(info.dwMessagesTransmittedLowPriority,    0U);
+	EXPECT_EQ(info.dwMessagesTimedOutLowPriority,       1U);
+}
+
+TEST(ConnectionStats, RTT)
+{
+	ConnectionStats stats(1000);
+	
+	EXPECT_EQ(stats.get_rtt(), 0U);
+	
+	/* The first sample is taken as-is... */
+	
+	stats.rtt_sample(100);
+	EXPECT_EQ(stats.get_rtt(), 100U);
+	
+	/* ...later ones are averaged in. */
+	
+	stats.rtt_sample(180);
+	EXPECT_EQ(stats.get_rtt(), 110U);
+	
+	for(int i = 0; i < 100; ++i)
+	{
+		stats.rtt_sample(20);
+	}
+	
+	EXPECT_EQ(stats.get_rtt(), 20U);
+	EXPECT_EQ(get_info(stats).dwRoundTripLatencyMS, 20U);
+}
+
+TEST(ConnectionStats, Throughput)
+{
+	ConnectionStats stats(1000);
+	
+	stats.packet_sent(true,  3000);
+	stats.packet_sent(false, 1000);
+	
+	/* Not recalculated until a whole period has passed. */
+	
+	stats.update(1000 + ConnectionStats::THROUGHPUT_PERIOD_MS - 1);
+	EXPECT_EQ(get_info(stats).dwThroughputBPS, 0U);
+	
+	stats.update(1000 + (ConnectionStats::THROUGHPUT_PERIOD_MS * 2));
+	EXPECT_EQ(get_info(stats).dwThroughputBPS,     (DWORD)(4000 * 1000 / (ConnectionStats::THROUGHPUT_PERIOD_MS * 2)));
+	EXPECT_EQ(get_info(stats).dwPeakThroughputBPS, (DWORD)(4000 * 1000 / (ConnectionStats::THROUGHPUT_PERIOD_MS * 2)));
+	
+	/* Slower period, peak is kept. */
+	
+	stats.packet_sent(true, 500);
+	
+	stats.update(1000 + (ConnectionStats::THROUGHPUT_PERIOD_MS * 3));
+	EXPECT_EQ(get_info(stats).dwThroughputBPS,     (DWORD)(500 * 1000 / ConnectionStats::THROUGHPUT_PERIOD_MS));
+	EXPECT_EQ(get_info(stats).dwPeakThroughputBPS, (DWORD)(4000 * 1000 / (ConnectionStats::THROUGHPUT_PERIOD_MS * 2)));
+	
+	/* Idle period. */
+	
+	stats.update(1000 + (ConnectionStats::THROUGHPUT_PERIOD_MS * 4));
+	EXPECT_EQ(get_info(stats).dwThroughputBPS, 0U);
+}
@@ -0,0 +1,339 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+#include "../src/DatagramReceiver.hpp"
+#include "../src/Messages.hpp"
+
+class DatagramReceiverTest: public ::testing::Test
+{
+	protected:
+		BufferPool pool;
+		DatagramReceiver dr;
+		
+		DatagramReceiverTest(): dr(pool) {}
+		
+		/* Returns the given fragment of a message made up of message_size bytes of
+		 * ('A' + message_id).
+		*/
+		DatagramReceiver::Fragment fragment(DWORD message_id, DWORD channel, DWORD sequence, DWORD message_size, DWORD fragment_index)
+		{
+			static std::vector<unsigned char> data;
+			data.assign(DatagramReceiver::FRAGMENT_SIZE * DatagramReceiver::MAX_FRAGMENTS, 'A' + message_id);
+			
+			DWORD fragment_count = (message_size > 0 ? (message_size + DatagramReceiver::FRAGMENT_SIZE - 1) / DatagramReceiver::FRAGMENT_SIZE : 1);
+			size_t offset = fragment_index * DatagramReceiver::FRAGMENT_SIZE;
+			
+			DatagramReceiver::Fragment f;
+			f.message_id     = message_id;
+			f.channel        = channel;
+			f.sequence       = sequence;
+			f.message_size   = message_size;
+			f.fragment_index = fragment_index;
+			f.fragment_count = fragment_count;
+			f.data           = data.data() + offset;
+			f.size           = std::min<size_t>(DatagramReceiver::FRAGMENT_SIZE, message_size - offset);
+			
+			return f;
+		}
+		
+		/* Adds a fragment, returning the message if it completes one, or a description
+		 * of the result otherwise.
+		*/
+		std::string add(const DatagramReceiver::Fragment &f)
+		{
+			const void *message;
+			BufferPool::Buffer *message_buffer;
+			
+			switch(dr.add(f, &message, &message_buffer))
+			{
+				case DatagramReceiver::FRAGMENT_INVALID:    return "INVALID";
+				case DatagramReceiver::FRAGMENT_STALE:      return "STALE";
+				case DatagramReceiver::FRAGMENT_INCOMPLETE: return "INCOMPLETE";
+				
+				case DatagramReceiver::MESSAGE_COMPLETE:
+				{
+					if(f.fragment_count == 1)
+					{
+						EXPECT_EQ(message, f.data);
+						EXPECT_EQ(message_buffer, (BufferPool::Buffer*)(NULL));
+					}
+					else{
+						EXPECT_NE(message_buffer, (BufferPool::Buffer*)(NULL));
+						
+						if(message_buffer != NULL)
+						{
+							EXPECT_EQ(message, message_buffer->data());
+						}
+					}
+					
+					std::string s((const char*)(message), f.message_size);
+					
+					if(message_buffer != NULL)
+					{
+						message_buffer->unref();
+					}
+					
+					return s;
+				}
+			}
+			
+			return "???";
+		}
+};
+
+#define SEQ    DATAGRAM_CHANNEL_SEQUENTIAL
+#define NONSEQ DATAGRAM_CHANNEL_NONSEQUENTIAL
+
+#define FS DatagramReceiver::FRAGMENT_SIZE
+
+TEST_F(DatagramReceiverTest, SingleFragment)
+{
+	EXPECT_EQ(add(fragment(0, SEQ, 0, 10, 0)), std::string(10, 'A'));
+	EXPECT_EQ(add(fragment(1, SEQ, 1, FS, 0)), std::string(FS, 'B'));
+	EXPECT_EQ(add(fragment(2, SEQ, 2, 0,  0)), std::string());
+	
+	EXPECT_EQ(dr.pending(), 0U);
+}
+
+TEST_F(DatagramReceiverTest, Reassemble)
+{
+	EXPECT_EQ(add(fragment(0, SEQ, 0, (FS * 2) + 10, 0)), "INCOMPLETE");
+	EXPECT_EQ(add(fragment(0, SEQ, 0, (FS * 2) + 10, 1)), "INCOMPLETE");
+	EXPECT_EQ(dr.pending(), 1U);
+	
+	EXPECT_EQ(add(fragment(0, SEQ, 0, (FS * 2) + 10, 2)), std::string((FS * 2) + 10, 'A'));
+	EXPECT_EQ(dr.pending(), 0U);
+}
+
+TEST_F(DatagramReceiverTest, ReassembleOutOfOrder)
+{
+	EXPECT_EQ(add(fragment(0, SEQ, 0, FS * 3, 2)), "INCOMPLETE");
+	EXPECT_EQ(add(fragment(0, SEQ, 0, FS * 3, 0)), "INCOMPLETE");
+	
+	/* Duplicate fragments don't complete the message early. */
+	EXPECT_EQ(add(fragment(0, SEQ, 0, FS * 3, 2)), "INCOMPLETE");
+	
+	EXPECT_EQ(add(fragment(0, SEQ, 0, FS * 3, 1)), std::string(FS * 3, 'A'));
+}
+
+TEST_F(DatagramReceiverTest, ReassembleInterleaved)
+{
+	EXPECT_EQ(add(fragment(0, NONSEQ, 0, FS * 2, 0)), "INCOMPLETE");
+	EXPECT_EQ(add(fragment(1, NONSEQ, 1, FS * 2, 1)), "INCOMPLETE");
+	EXPECT_EQ(dr.pending(), 2U);
+	
+	EXPECT_EQ(add(fragment(1, NONSEQ, 1, FS * 2, 0)), std::string(FS * 2, 'B'));
+	EXPECT_EQ(add(fragment(0, NONSEQ, 0, FS * 2, 1)), std::string(FS * 2, 'A'));
+}
+
+TEST_F(DatagramReceiverTest, MaxFragments)
+{
+	DWORD size = FS * DatagramReceiver::MAX_FRAGMENTS;
+	
+	for(DWORD i = 0; i < (DatagramReceiver::MAX_FRAGMENTS - 1); ++i)
+	{
+		EXPECT_EQ(add(fragment(0, SEQ, 0, size, i)), "INCOMPLETE");
+	}
+	
+	EXPECT_EQ(add(fragment(0, SEQ, 0, size, DatagramReceiver::MAX_FRAGMENTS - 1)), std::string(size, 'A'));
+}
+
+TEST_F(DatagramReceiverTest, MaxReassembly)
+{
+	/* Starting more than MAX_REASSEMBLY messages discards the oldest. */
+	
+	for(DWORD i = 0; i <= DatagramReceiver::MAX_REASSEMBLY; ++i)
+	{
+		EXPECT_EQ(add(fragment(i, NONSEQ, i, FS * 2, 0)), "INCOMPLETE");
+	}
+	
+	EXPECT_EQ(dr.pending(), DatagramReceiver::MAX_REASSEMBLY);
+	
+	/* The second fragment of the discarded message starts it again. */
+	EXPECT_EQ(add(fragment(0, NONSEQ, 0, FS * 2, 1)), "INCOMPLETE");
+	
+	/* ...and discards the next oldest. */
+	EXPECT_EQ(add(fragment(1, NONSEQ, 1, FS * 2, 1)), "INCOMPLETE");
+	
+	EXPECT_EQ(add(fragment(3, NONSEQ, 3, FS * 2, 1)), std::string(FS * 2, 'D'));
+	EXPECT_EQ(dr.pending(), DatagramReceiver::MAX_REASSEMBLY - 1);
+}
+
+TEST_F(DatagramReceiverTest, Invalid)
+{
+	DatagramReceiver::Fragment f;
+	
+	/* Unknown channel. */
+	f = fragment(0, 2, 0, 10, 0);
+	EXPECT_EQ(add(f), "INVALID");
+	
+	/* No fragments. */
+	f = fragment(0, SEQ, 0, 10, 0);
+	f.fragment_count = 0;
+	EXPECT_EQ(add(f), "INVALID");
+	
+	/* Too many fragments. */
+	f = fragment(0, SEQ, 0, 10, 0);
+	f.fragment_count = DatagramReceiver::MAX_FRAGMENTS + 1;
+	EXPECT_EQ(add(f), "INVALID");
+	
+	/* Fragment index out of range. */
+	f = fragment(0, SEQ, 0, FS * 2, 1);
+	f.fragment_index = 2;
+	EXPECT_EQ(add(f), "INVALID");
+	
+	/* Message larger than its fragments can carry. */
+	f = fragment(0, SEQ, 0, FS * 2, 0);
+	f.fragment_count = 1;
+	EXPECT_EQ(add(f), "INVALID");
+	
+	/* Fragment shorter than it should be. */
+	f = fragment(0, SEQ, 0, FS * 2, 0);
+	f.size -= 1;
+	EXPECT_EQ(add(f), "INVALID");
+	
+	/* Last fragment longer than the rest of the message. */
+	f = fragment(0, SEQ, 0, FS + 10, 1);
+	f.size += 1;
+	EXPECT_EQ(add(f), "INVALID");
+	
+	EXPECT_EQ(dr.pending(), 0U);
+}
+
+TEST_F(DatagramReceiverTest, InvalidMismatch)
+{
+	/* Fragments which don't agree with earlier ones about the size of their message are
+	 * rejected without disturbing it.
+	*/
+	
+	EXPECT_EQ(add(fragment(0, SEQ, 0, FS * 3, 0)), "INCOMPLETE");
+	EXPECT_EQ(add(fragment(0, SEQ, 0, FS * 2, 1)), "INVALID");
+	EXPECT_EQ(add(fragment(0, SEQ, 0, FS * 3, 1)), "INCOMPLETE");
+	EXPECT_EQ(add(fragment(0, SEQ, 0, FS * 3, 2)), std::string(FS * 3, 'A'));
+}
+
+TEST_F(DatagramReceiverTest, DestroyIncomplete)
+{
+	/* Buffers of incomplete messages are released when the receiver is destroyed (the
+	 * pool would otherwise be destroyed with buffers outstanding under ASan).
+	*/
+	
+	DatagramReceiver dr2(pool);
+	
+	const void *message;
+	BufferPool::Buffer *message_buffer;
+	
+	EXPECT_EQ(dr2.add(fragment(0, SEQ, 0, FS * 2, 0), &message, &message_buffer), DatagramReceiver::FRAGMENT_INCOMPLETE);
+	EXPECT_EQ(dr2.pending(), 1U);
+}
+
+TEST_F(DatagramReceiverTest, SequentialDropsStale)
+{
+	EXPECT_EQ(add(fragment(0, SEQ, 5, 10, 0)), std::string(10, 'A'));
+	
+	/* Older and repeated sequence numbers are dropped... */
+	EXPECT_EQ(add(fragment(1, SEQ, 3, 10, 0)), "STALE");
+	EXPECT_EQ(add(fragment(2, SEQ, 5, 10, 0)), "STALE");
+	
+	/* ...newer ones aren't, even if there is a gap. */
+	EXPECT_EQ(add(fragment(3, SEQ, 9, 10, 0)), std::string(10, 'D'));
+	EXPECT_EQ(add(fragment(4, SEQ, 6, 10, 0)), "STALE");
+	EXPECT_EQ(add(fragment(5, SEQ, 10, 10, 0)), std::string(10, 'F'));
+}
+
+TEST_F(DatagramReceiverTest, SequentialFirstMessage)
+{
+	/* Nothing is stale until something has been delivered, whatever the sequence number. */
+	EXPECT_EQ(add(fragment(0, SEQ, 0xFFFFFFF0, 10, 0)), std::string(10, 'A'));
+	EXPECT_EQ(add(fragment(1, SEQ, 0xFFFFFFEF, 10, 0)), "STALE");
+}
+
+TEST_F(DatagramReceiverTest, SequentialWraparound)
+{
+	EXPECT_EQ(add(fragment(0, SEQ, 0xFFFFFFFE, 10, 0)), std::string(10, 'A'));
+	EXPECT_EQ(add(fragment(1, SEQ, 0xFFFFFFFF, 10, 0)), std::string(10, 'B'));
+	EXPECT_EQ(add(fragment(2, SEQ, 0x00000001, 10, 0)), std::string(10, 'C'));
+	
+	/* Messages from before the wrap are stale. */
+	EXPECT_EQ(add(fragment(3, SEQ, 0xFFFFFFFF, 10, 0)), "STALE");
+	EXPECT_EQ(add(fragment(4, SEQ, 0x00000000, 10, 0)), "STALE");
+	
+	EXPECT_EQ(add(fragment(5, SEQ, 0x00000002, 10, 0)), std::string(10, 'F'));
+}
+
+TEST_F(DatagramReceiverTest, SequentialStaleFragments)
+{
+	/* Fragments of a message older than one already delivered are dropped without
+	 * starting a reassembly.
+	*/
+	
+	EXPECT_EQ(add(fragment(1, SEQ, 2, 10, 0)), std::string(10, 'B'));
+	
+	EXPECT_EQ(add(fragment(0, SEQ, 1, FS * 2, 0)), "STALE");
+	EXPECT_EQ(dr.pending(), 0U);
+}
+
+TEST_F(DatagramReceiverTest, SequentialStaleAfterReassembly)
+{
+	/* A message overtaken by a later one while it was being reassembled is dropped once
+	 * complete.
+	*/
+	
+	EXPECT_EQ(add(fragment(0, SEQ, 1, FS * 2, 0)), "INCOMPLETE");
+	EXPECT_EQ(add(fragment(1, SEQ, 2, 10, 0)), std::string(10, 'B'));
+	EXPECT_EQ(add(fragment(0, SEQ, 1, FS * 2, 1)), "STALE");
+	
+	EXPECT_EQ(dr.pending(), 0U);
+}
+
+TEST_F(DatagramReceiverTest, SequentialReassemblyOvertakes)
+{
+	/* A fragmented message completed before an earlier one makes the earlier one stale. */
+	
+	EXPECT_EQ(add(fragment(0, SEQ, 1, FS * 2, 0)), "INCOMPLETE");
+	EXPECT_EQ(add(fragment(1, SEQ, 2, FS * 2, 0)), "INCOMPLETE");
+	EXPECT_EQ(add(fragment(1, SEQ, 2, FS * 2, 1)), std::string(FS * 2, 'B'));
+	EXPECT_EQ(add(fragment(0, SEQ, 1, FS * 2, 1)), "STALE");
+}
+
+TEST_F(DatagramReceiverTest, NonSequentialOutOfOrder)
+{
+	/* Everything in the non-sequential channel is delivered, in whatever order it arrives. */
+	
+	EXPECT_EQ(add(fragment(0, NONSEQ, 5, 10, 0)), std::string(10, 'A'));
+	EXPECT_EQ(add(fragment(1, NONSEQ, 3, 10, 0)), std::string(10, 'B'));
+	EXPECT_EQ(add(fragment(2, NONSEQ, 4, 10, 0)), std::string(10, 'C'));
+	EXPECT_EQ(add(fragment(3, NONSEQ, 1, FS * 2, 1)), "INCOMPLETE");
+	EXPECT_EQ(add(fragment(4, NONSEQ, 6, 10, 0)), std::string(10, 'E'));
+	EXPECT_EQ(add(fragment(3, NONSEQ, 1, FS * 2, 0)), std::string(FS * 2, 'D'));
+}
+
+TEST_F(DatagramReceiverTest, ChannelsIndependent)
+{
+	/* Non-sequential messages don't advance the sequential channel, or vice versa. */
+	
+	EXPECT_EQ(add(fragment(0, NONSEQ, 10, 10, 0)), std::string(10, 'A'));
+	EXPECT_EQ(add(fragment(1, SEQ,    2,  10, 0)), std::string(10, 'B'));
+	EXPECT_EQ(add(fragment(2, NONSEQ, 1,  10, 0)), std::string(10, 'C'));
+	EXPECT_EQ(add(fragment(3, SEQ,    1,  10, 0)), "STALE");
+	EXPECT_EQ(add(fragment(4, SEQ,    3,  10, 0)), std::string(10, 'E'));
+}
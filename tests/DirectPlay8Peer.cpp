@@ -24,9 +24,13 @@
 #include <mutex>
 #include <stdexcept>
 #include <stdint.h>
+#include <string>
+#include <vector>
 
 #include "../src/DirectPlay8Address.hpp"
 #include "../src/DirectPlay8Peer.hpp"
+#include "../src/Messages.hpp"
+#include "../src/packet.hpp"
 
 #pragma warning(disable: 4065) /* switch statement contains 'default' but no 'case' labels */
 
@@ -4032,22 +4036,29 @@ TEST(DirectPlay8Peer, AsyncSendToPeerToHost)
 	testing = false;
 }
 
-TEST(DirectPlay8Peer, AsyncSendToPeerToSelf)
+TEST(DirectPlay8Peer, AsyncSendToPeerToHostGuaranteed)
 {
 	std::atomic<bool> testing(false);
 	
 	std::atomic<int> host_seq(0), p1_seq(0);
 	DPNID host_player_id = -1, p1_player_id = -1;
-	DPNHANDLE send_handle;
 	
 	SessionHost host(APP_GUID_1, L"Session 1", PORT,
-		[&testing, &host_seq, &host_player_id]
+		[&testing, &host_seq, &host_player_id, &p1_player_id]
 		(DWORD dwMessageType, PVOID pMessage)
 		{
-			if(dwMessageType == DPN_MSGID_CREATE_PLAYER && host_player_id == -1)
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER)
 			{
 				DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
-				host_player_id = cp->dpnidPlayer;
+				
+				if(host_player_id == -1)
+				{
+					host_player_id = cp->dpnidPlayer;
+					cp->pvPlayerContext = (void*)(0x0001);
+				}
+				else{
+					cp->pvPlayerContext = (void*)(0x0002);
+				}
 			}
 			
 			if(!testing)
@@ -4059,6 +4070,27 @@ TEST(DirectPlay8Peer, AsyncSendToPeerToSelf)
 			
 			switch(seq)
 			{
+				case 1:
+				{
+					EXPECT_EQ(dwMessageType, DPN_MSGID_RECEIVE);
+					
+					if(dwMessageType == DPN_MSGID_RECEIVE)
+					{
+						DPNMSG_RECEIVE *r = (DPNMSG_RECEIVE*)(pMessage);
+						
+						EXPECT_EQ(r->dwSize,          sizeof(*r));
+						EXPECT_EQ(r->dpnidSender,     p1_player_id);
+						EXPECT_EQ(r->pvPlayerContext, (void*)(0x0002));
+						EXPECT_EQ(r->dwReceiveFlags,  DPNRECEIVE_GUARANTEED);
+						
+						EXPECT_EQ(
+							std::string((const char*)(r->pReceiveData), r->dwReceiveDataSize),
+							std::string("Hello, world"));
+					}
+					
+					break;
+				}
+				
 				default:
 					ADD_FAILURE() << "Unexpected message of type " << dwMessageType <<", sequence " << seq;
 					break;
@@ -4067,6 +4099,8 @@ TEST(DirectPlay8Peer, AsyncSendToPeerToSelf)
 			return DPN_OK;
 		});
 	
+	DPNHANDLE send_handle;
+	
 	std::function<HRESULT(DWORD,PVOID)> p1_cb =
 		[&testing, &p1_seq, &p1_player_id, &send_handle]
 		(DWORD dwMessageType, PVOID pMessage)
@@ -4087,9 +4121,8 @@ TEST(DirectPlay8Peer, AsyncSendToPeerToSelf)
 			switch(seq)
 			{
 				case 1:
-				case 2:
 				{
-					EXPECT_TRUE(dwMessageType == DPN_MSGID_SEND_COMPLETE || dwMessageType == DPN_MSGID_RECEIVE);
+					EXPECT_EQ(dwMessageType, DPN_MSGID_SEND_COMPLETE);
 					
 					if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
 					{
@@ -4103,19 +4136,6 @@ TEST(DirectPlay8Peer, AsyncSendToPeerToSelf)
 						EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
 						EXPECT_EQ(sc->dwNumBuffers,        0);
 					}
-					else if(dwMessageType == DPN_MSGID_RECEIVE)
-					{
-						DPNMSG_RECEIVE *r = (DPNMSG_RECEIVE*)(pMessage);
-						
-						EXPECT_EQ(r->dwSize,          sizeof(*r));
-						EXPECT_EQ(r->dpnidSender,     p1_player_id);
-						EXPECT_EQ(r->pvPlayerContext, (void*)(NULL));
-						EXPECT_EQ(r->dwReceiveFlags,  0);
-						
-						EXPECT_EQ(
-							std::string((const char*)(r->pReceiveData), r->dwReceiveDataSize),
-							std::string("Hello, world"));
-					}
 					
 					break;
 				}
@@ -4164,25 +4184,25 @@ TEST(DirectPlay8Peer, AsyncSendToPeerToSelf)
 	};
 	
 	ASSERT_EQ(p1->SendTo(
-		p1_player_id,
+		host_player_id,
 		bd,
 		1,
 		0,
 		(void*)(0xABCD),
 		&send_handle,
-		0
+		DPNSEND_GUARANTEED
 	), DPNSUCCESS_PENDING);
 	
 	/* Let the message get through any any resultant messages happen. */
 	Sleep(250);
 	
-	EXPECT_EQ(host_seq, 0);
-	EXPECT_EQ(p1_seq, 2);
+	EXPECT_EQ(host_seq, 1);
+	EXPECT_EQ(p1_seq, 1);
 	
 	testing = false;
 }
 
-TEST(DirectPlay8Peer, AsyncSendToPeerToAll)
+TEST(DirectPlay8Peer, AsyncSendToPeerToHostNonSequential)
 {
 	std::atomic<bool> testing(false);
 	
@@ -4267,9 +4287,8 @@ TEST(DirectPlay8Peer, AsyncSendToPeerToAll)
 			switch(seq)
 			{
 				case 1:
-				case 2:
 				{
-					EXPECT_TRUE(dwMessageType == DPN_MSGID_SEND_COMPLETE || dwMessageType == DPN_MSGID_RECEIVE);
+					EXPECT_EQ(dwMessageType, DPN_MSGID_SEND_COMPLETE);
 					
 					if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
 					{
@@ -4283,19 +4302,6 @@ TEST(DirectPlay8Peer, AsyncSendToPeerToAll)
 						EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
 						EXPECT_EQ(sc->dwNumBuffers,        0);
 					}
-					else if(dwMessageType == DPN_MSGID_RECEIVE)
-					{
-						DPNMSG_RECEIVE *r = (DPNMSG_RECEIVE*)(pMessage);
-						
-						EXPECT_EQ(r->dwSize,          sizeof(*r));
-						EXPECT_EQ(r->dpnidSender,     p1_player_id);
-						EXPECT_EQ(r->pvPlayerContext, (void*)(NULL));
-						EXPECT_EQ(r->dwReceiveFlags,  0);
-						
-						EXPECT_EQ(
-							std::string((const char*)(r->pReceiveData), r->dwReceiveDataSize),
-							std::string("Hello, world"));
-					}
 					
 					break;
 				}
@@ -4344,33 +4350,35 @@ TEST(DirectPlay8Peer, AsyncSendToPeerToAll)
 	};
 	
 	ASSERT_EQ(p1->SendTo(
-		DPNID_ALL_PLAYERS_GROUP,
+		host_player_id,
 		bd,
 		1,
 		0,
 		(void*)(0xABCD),
 		&send_handle,
-		0
+		DPNSEND_NONSEQUENTIAL
 	), DPNSUCCESS_PENDING);
 	
 	/* Let the message get through any any resultant messages happen. */
 	Sleep(250);
 	
 	EXPECT_EQ(host_seq, 1);
-	EXPECT_EQ(p1_seq, 2);
+	EXPECT_EQ(p1_seq, 1);
 	
 	testing = false;
 }
 
-TEST(DirectPlay8Peer, AsyncSendToPeerToAllButSelf)
+TEST(DirectPlay8Peer, DatagramFromWrongAddress)
 {
 	std::atomic<bool> testing(false);
 	
-	std::atomic<int> host_seq(0), p1_seq(0);
+	std::mutex received_lock;
+	std::vector<std::string> received;
+	
 	DPNID host_player_id = -1, p1_player_id = -1;
 	
 	SessionHost host(APP_GUID_1, L"Session 1", PORT,
-		[&testing, &host_seq, &host_player_id, &p1_player_id]
+		[&testing, &received_lock, &received, &host_player_id]
 		(DWORD dwMessageType, PVOID pMessage)
 		{
 			if(dwMessageType == DPN_MSGID_CREATE_PLAYER)
@@ -4380,55 +4388,21 @@ TEST(DirectPlay8Peer, AsyncSendToPeerToAllButSelf)
 				if(host_player_id == -1)
 				{
 					host_player_id = cp->dpnidPlayer;
-					cp->pvPlayerContext = (void*)(0x0001);
 				}
-				else{
-					cp->pvPlayerContext = (void*)(0x0002);
-				}
-			}
-			
-			if(!testing)
-			{
-				return DPN_OK;
 			}
-			
-			int seq = ++host_seq;
-			
-			switch(seq)
+			else if(testing && dwMessageType == DPN_MSGID_RECEIVE)
 			{
-				case 1:
-				{
-					EXPECT_EQ(dwMessageType, DPN_MSGID_RECEIVE);
-					
-					if(dwMessageType == DPN_MSGID_RECEIVE)
-					{
-						DPNMSG_RECEIVE *r = (DPNMSG_RECEIVE*)(pMessage);
-						
-						EXPECT_EQ(r->dwSize,          sizeof(*r));
-						EXPECT_EQ(r->dpnidSender,     p1_player_id);
-						EXPECT_EQ(r->pvPlayerContext, (void*)(0x0002));
-						EXPECT_EQ(r->dwReceiveFlags,  0);
-						
-						EXPECT_EQ(
-							std::string((const char*)(r->pReceiveData), r->dwReceiveDataSize),
-							std::string("Hello, world"));
-					}
-					
-					break;
-				}
+				DPNMSG_RECEIVE *r = (DPNMSG_RECEIVE*)(pMessage);
 				
-				default:
-					ADD_FAILURE() << "Unexpected message of type " << dwMessageType <<", sequence " << seq;
-					break;
+				std::unique_lock<std::mutex> rl(received_lock);
+				received.push_back(std::string((const char*)(r->pReceiveData), r->dwReceiveDataSize));
 			}
 			
 			return DPN_OK;
 		});
 	
-	DPNHANDLE send_handle;
-	
 	std::function<HRESULT(DWORD,PVOID)> p1_cb =
-		[&testing, &p1_seq, &p1_player_id, &send_handle]
+		[&p1_player_id]
 		(DWORD dwMessageType, PVOID pMessage)
 		{
 			if(dwMessageType == DPN_MSGID_CONNECT_COMPLETE)
@@ -4437,40 +4411,6 @@ TEST(DirectPlay8Peer, AsyncSendToPeerToAllButSelf)
 				p1_player_id = cc->dpnidLocal;
 			}
 			
-			if(!testing)
-			{
-				return DPN_OK;
-			}
-			
-			int seq = ++p1_seq;
-			
-			switch(seq)
-			{
-				case 1:
-				{
-					EXPECT_EQ(dwMessageType, DPN_MSGID_SEND_COMPLETE);
-					
-					if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
-					{
-						DPNMSG_SEND_COMPLETE *sc = (DPNMSG_SEND_COMPLETE*)(pMessage);
-						
-						EXPECT_EQ(sc->dwSize,              sizeof(*sc));
-						EXPECT_EQ(sc->hAsyncOp,            send_handle);
-						EXPECT_EQ(sc->pvUserContext,       (void*)(0xABCD));
-						EXPECT_EQ(sc->hResultCode,         DPN_OK);
-						EXPECT_EQ(sc->dwSendCompleteFlags, 0);
-						EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
-						EXPECT_EQ(sc->dwNumBuffers,        0);
-					}
-					
-					break;
-				}
-				
-				default:
-					ADD_FAILURE() << "Unexpected message of type " << dwMessageType <<", sequence " << seq;
-					break;
-			}
-			
 			return DPN_OK;
 		};
 	
@@ -4505,30 +4445,65 @@ TEST(DirectPlay8Peer, AsyncSendToPeerToAllButSelf)
 	
 	testing = true;
 	
+	/* Send a datagram claiming to be from p1 to the host from a different socket. */
+	
+	SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	ASSERT_NE(sock, INVALID_SOCKET);
+	
+	PacketSerialiser forged(DPLITE_MSGID_DATAGRAM);
+	forged.append_dword(p1_player_id);
+	forged.append_dword(1);
+	forged.append_dword(DATAGRAM_CHANNEL_NONSEQUENTIAL);
+	forged.append_dword(0);
+	forged.append_dword(0);
+	forged.append_dword(6);
+	forged.append_dword(0);
+	forged.append_dword(1);
+	forged.append_data("Forged", 6);
+	
+	std::pair<const void*, size_t> raw = forged.raw_packet();
+	
+	struct sockaddr_in host_addr;
+	memset(&host_addr, 0, sizeof(host_addr));
+	
+	host_addr.sin_family      = AF_INET;
+	host_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	host_addr.sin_port        = htons(PORT);
+	
+	EXPECT_EQ(sendto(sock, (const char*)(raw.first), raw.second, 0, (struct sockaddr*)(&host_addr), sizeof(host_addr)), (int)(raw.second));
+	
+	closesocket(sock);
+	
+	/* Send a real one, so we know the forged one would have arrived first. */
+	
+	Sleep(100);
+	
 	DPN_BUFFER_DESC bd[] = {
 		{ 12, (BYTE*)("Hello, world") },
 	};
 	
 	ASSERT_EQ(p1->SendTo(
-		DPNID_ALL_PLAYERS_GROUP,
+		host_player_id,
 		bd,
 		1,
 		0,
-		(void*)(0xABCD),
-		&send_handle,
-		DPNSEND_NOLOOPBACK
-	), DPNSUCCESS_PENDING);
+		NULL,
+		NULL,
+		DPNSEND_NONSEQUENTIAL | DPNSEND_SYNC
+	), S_OK);
 	
 	/* Let the message get through any any resultant messages happen. */
 	Sleep(250);
 	
-	EXPECT_EQ(host_seq, 1);
-	EXPECT_EQ(p1_seq, 1);
-	
 	testing = false;
+	
+	std::unique_lock<std::mutex> rl(received_lock);
+	
+	ASSERT_EQ(received.size(), 1U);
+	EXPECT_EQ(received[0], std::string("Hello, world"));
 }
 
-TEST(DirectPlay8Peer, AsyncSendToHostToPeer)
+TEST(DirectPlay8Peer, AsyncSendToPeerToSelf)
 {
 	std::atomic<bool> testing(false);
 	
@@ -4537,7 +4512,7 @@ TEST(DirectPlay8Peer, AsyncSendToHostToPeer)
 	DPNHANDLE send_handle;
 	
 	SessionHost host(APP_GUID_1, L"Session 1", PORT,
-		[&testing, &host_seq, &host_player_id, &send_handle]
+		[&testing, &host_seq, &host_player_id]
 		(DWORD dwMessageType, PVOID pMessage)
 		{
 			if(dwMessageType == DPN_MSGID_CREATE_PLAYER && host_player_id == -1)
@@ -4555,26 +4530,6 @@ TEST(DirectPlay8Peer, AsyncSendToHostToPeer)
 			
 			switch(seq)
 			{
-				case 1:
-				{
-					EXPECT_EQ(dwMessageType, DPN_MSGID_SEND_COMPLETE);
-					
-					if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
-					{
-						DPNMSG_SEND_COMPLETE *sc = (DPNMSG_SEND_COMPLETE*)(pMessage);
-						
-						EXPECT_EQ(sc->dwSize,              sizeof(*sc));
-						EXPECT_EQ(sc->hAsyncOp,            send_handle);
-						EXPECT_EQ(sc->pvUserContext,       (void*)(0xABCD));
-						EXPECT_EQ(sc->hResultCode,         DPN_OK);
-						EXPECT_EQ(sc->dwSendCompleteFlags, 0);
-						EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
-						EXPECT_EQ(sc->dwNumBuffers,        0);
-					}
-					
-					break;
-				}
-				
 				default:
 					ADD_FAILURE() << "Unexpected message of type " << dwMessageType <<", sequence " << seq;
 					break;
@@ -4584,7 +4539,7 @@ TEST(DirectPlay8Peer, AsyncSendToHostToPeer)
 		});
 	
 	std::function<HRESULT(DWORD,PVOID)> p1_cb =
-		[&testing, &p1_seq, &p1_player_id, &host_player_id]
+		[&testing, &p1_seq, &p1_player_id, &send_handle]
 		(DWORD dwMessageType, PVOID pMessage)
 		{
 			if(dwMessageType == DPN_MSGID_CONNECT_COMPLETE)
@@ -4603,15 +4558,28 @@ TEST(DirectPlay8Peer, AsyncSendToHostToPeer)
 			switch(seq)
 			{
 				case 1:
+				case 2:
 				{
-					EXPECT_EQ(dwMessageType, DPN_MSGID_RECEIVE);
+					EXPECT_TRUE(dwMessageType == DPN_MSGID_SEND_COMPLETE || dwMessageType == DPN_MSGID_RECEIVE);
 					
-					if(dwMessageType == DPN_MSGID_RECEIVE)
+					if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
+					{
+						DPNMSG_SEND_COMPLETE *sc = (DPNMSG_SEND_COMPLETE*)(pMessage);
+						
+						EXPECT_EQ(sc->dwSize,              sizeof(*sc));
+						EXPECT_EQ(sc->hAsyncOp,            send_handle);
+						EXPECT_EQ(sc->pvUserContext,       (void*)(0xABCD));
+						EXPECT_EQ(sc->hResultCode,         DPN_OK);
+						EXPECT_EQ(sc->dwSendCompleteFlags, 0);
+						EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
+						EXPECT_EQ(sc->dwNumBuffers,        0);
+					}
+					else if(dwMessageType == DPN_MSGID_RECEIVE)
 					{
 						DPNMSG_RECEIVE *r = (DPNMSG_RECEIVE*)(pMessage);
 						
 						EXPECT_EQ(r->dwSize,          sizeof(*r));
-						EXPECT_EQ(r->dpnidSender,     host_player_id);
+						EXPECT_EQ(r->dpnidSender,     p1_player_id);
 						EXPECT_EQ(r->pvPlayerContext, (void*)(NULL));
 						EXPECT_EQ(r->dwReceiveFlags,  0);
 						
@@ -4666,7 +4634,7 @@ TEST(DirectPlay8Peer, AsyncSendToHostToPeer)
 		{ 12, (BYTE*)("Hello, world") },
 	};
 	
-	ASSERT_EQ(host->SendTo(
+	ASSERT_EQ(p1->SendTo(
 		p1_player_id,
 		bd,
 		1,
@@ -4679,42 +4647,100 @@ TEST(DirectPlay8Peer, AsyncSendToHostToPeer)
 	/* Let the message get through any any resultant messages happen. */
 	Sleep(250);
 	
-	EXPECT_EQ(host_seq, 1);
-	EXPECT_EQ(p1_seq, 1);
+	EXPECT_EQ(host_seq, 0);
+	EXPECT_EQ(p1_seq, 2);
 	
 	testing = false;
 }
 
-TEST(DirectPlay8Peer, AsyncSendToHostToNone)
+TEST(DirectPlay8Peer, AsyncSendToPeerToAll)
 {
 	std::atomic<bool> testing(false);
 	
-	std::atomic<int> host_seq(0);
-	DPNID host_player_id = -1;
-	DPNHANDLE send_handle;
+	std::atomic<int> host_seq(0), p1_seq(0);
+	DPNID host_player_id = -1, p1_player_id = -1;
 	
 	SessionHost host(APP_GUID_1, L"Session 1", PORT,
-		[&testing, &host_seq, &host_player_id, &send_handle]
+		[&testing, &host_seq, &host_player_id, &p1_player_id]
 		(DWORD dwMessageType, PVOID pMessage)
 		{
-			if(dwMessageType == DPN_MSGID_CREATE_PLAYER && host_player_id == -1)
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER)
 			{
 				DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
-				host_player_id = cp->dpnidPlayer;
-			}
-			
-			if(!testing)
-			{
-				return DPN_OK;
-			}
-			
+				
+				if(host_player_id == -1)
+				{
+					host_player_id = cp->dpnidPlayer;
+					cp->pvPlayerContext = (void*)(0x0001);
+				}
+				else{
+					cp->pvPlayerContext = (void*)(0x0002);
+				}
+			}
+			
+			if(!testing)
+			{
+				return DPN_OK;
+			}
+			
 			int seq = ++host_seq;
 			
 			switch(seq)
 			{
 				case 1:
 				{
-					EXPECT_EQ(dwMessageType, DPN_MSGID_SEND_COMPLETE);
+					EXPECT_EQ(dwMessageType, DPN_MSGID_RECEIVE);
+					
+					if(dwMessageType == DPN_MSGID_RECEIVE)
+					{
+						DPNMSG_RECEIVE *r = (DPNMSG_RECEIVE*)(pMessage);
+						
+						EXPECT_EQ(r->dwSize,          sizeof(*r));
+						EXPECT_EQ(r->dpnidSender,     p1_player_id);
+						EXPECT_EQ(r->pvPlayerContext, (void*)(0x0002));
+						EXPECT_EQ(r->dwReceiveFlags,  0);
+						
+						EXPECT_EQ(
+							std::string((const char*)(r->pReceiveData), r->dwReceiveDataSize),
+							std::string("Hello, world"));
+					}
+					
+					break;
+				}
+				
+				default:
+					ADD_FAILURE() << "Unexpected message of type " << dwMessageType <<", sequence " << seq;
+					break;
+			}
+			
+			return DPN_OK;
+		});
+	
+	DPNHANDLE send_handle;
+	
+	std::function<HRESULT(DWORD,PVOID)> p1_cb =
+		[&testing, &p1_seq, &p1_player_id, &send_handle]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CONNECT_COMPLETE)
+			{
+				DPNMSG_CONNECT_COMPLETE *cc = (DPNMSG_CONNECT_COMPLETE*)(pMessage);
+				p1_player_id = cc->dpnidLocal;
+			}
+			
+			if(!testing)
+			{
+				return DPN_OK;
+			}
+			
+			int seq = ++p1_seq;
+			
+			switch(seq)
+			{
+				case 1:
+				case 2:
+				{
+					EXPECT_TRUE(dwMessageType == DPN_MSGID_SEND_COMPLETE || dwMessageType == DPN_MSGID_RECEIVE);
 					
 					if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
 					{
@@ -4728,6 +4754,19 @@ TEST(DirectPlay8Peer, AsyncSendToHostToNone)
 						EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
 						EXPECT_EQ(sc->dwNumBuffers,        0);
 					}
+					else if(dwMessageType == DPN_MSGID_RECEIVE)
+					{
+						DPNMSG_RECEIVE *r = (DPNMSG_RECEIVE*)(pMessage);
+						
+						EXPECT_EQ(r->dwSize,          sizeof(*r));
+						EXPECT_EQ(r->dpnidSender,     p1_player_id);
+						EXPECT_EQ(r->pvPlayerContext, (void*)(NULL));
+						EXPECT_EQ(r->dwReceiveFlags,  0);
+						
+						EXPECT_EQ(
+							std::string((const char*)(r->pReceiveData), r->dwReceiveDataSize),
+							std::string("Hello, world"));
+					}
 					
 					break;
 				}
@@ -4738,7 +4777,33 @@ TEST(DirectPlay8Peer, AsyncSendToHostToNone)
 			}
 			
 			return DPN_OK;
-		});
+		};
+	
+	IDP8PeerInstance p1;
+	
+	ASSERT_EQ(p1->Initialize(&p1_cb, &callback_shim, 0), S_OK);
+	
+	DPN_APPLICATION_DESC connect_to_app;
+	memset(&connect_to_app, 0, sizeof(connect_to_app));
+	
+	connect_to_app.dwSize = sizeof(connect_to_app);
+	connect_to_app.guidApplication = APP_GUID_1;
+	
+	IDP8AddressInstance connect_to_addr(L"127.0.0.1", PORT);
+	
+	ASSERT_EQ(p1->Connect(
+		&connect_to_app,  /* pdnAppDesc */
+		connect_to_addr,  /* pHostAddr */
+		NULL,             /* pDeviceInfo */
+		NULL,             /* pdnSecurity */
+		NULL,             /* pdnCredentials */
+		NULL,             /* pvUserConnectData */
+		0,                /* dwUserConnectDataSize */
+		NULL,             /* pvPlayerContext */
+		NULL,             /* pvAsyncContext */
+		NULL,             /* phAsyncHandle */
+		DPNCONNECT_SYNC   /* dwFlags */
+	), S_OK);
 	
 	/* Give everything a moment to settle. */
 	Sleep(250);
@@ -4749,33 +4814,1038 @@ TEST(DirectPlay8Peer, AsyncSendToHostToNone)
 		{ 12, (BYTE*)("Hello, world") },
 	};
 	
-	ASSERT_EQ(host->SendTo(
+	ASSERT_EQ(p1->SendTo(
 		DPNID_ALL_PLAYERS_GROUP,
 		bd,
 		1,
 		0,
 		(void*)(0xABCD),
 		&send_handle,
-		DPNSEND_NOLOOPBACK
+		0
+	), DPNSUCCESS_PENDING);
+	
+	/* Let the message get through any any resultant messages happen. */
+	Sleep(250);
+	
+	EXPECT_EQ(host_seq, 1);
+	EXPECT_EQ(p1_seq, 2);
+	
+	testing = false;
+}
+
+TEST(DirectPlay8Peer, AsyncSendToPeerToAllButSelf)
+{
+	std::atomic<bool> testing(false);
+	
+	std::atomic<int> host_seq(0), p1_seq(0);
+	DPNID host_player_id = -1, p1_player_id = -1;
+	
+	SessionHost host(APP_GUID_1, L"Session 1", PORT,
+		[&testing, &host_seq, &host_player_id, &p1_player_id]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER)
+			{
+				DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
+				
+				if(host_player_id == -1)
+				{
+					host_player_id = cp->dpnidPlayer;
+					cp->pvPlayerContext = (void*)(0x0001);
+				}
+				else{
+					cp->pvPlayerContext = (void*)(0x0002);
+				}
+			}
+			
+			if(!testing)
+			{
+				return DPN_OK;
+			}
+			
+			int seq = ++host_seq;
+			
+			switch(seq)
+			{
+				case 1:
+				{
+					EXPECT_EQ(dwMessageType, DPN_MSGID_RECEIVE);
+					
+					if(dwMessageType == DPN_MSGID_RECEIVE)
+					{
+						DPNMSG_RECEIVE *r = (DPNMSG_RECEIVE*)(pMessage);
+						
+						EXPECT_EQ(r->dwSize,          sizeof(*r));
+						EXPECT_EQ(r->dpnidSender,     p1_player_id);
+						EXPECT_EQ(r->pvPlayerContext, (void*)(0x0002));
+						EXPECT_EQ(r->dwReceiveFlags,  0);
+						
+						EXPECT_EQ(
+							std::string((const char*)(r->pReceiveData), r->dwReceiveDataSize),
+							std::string("Hello, world"));
+					}
+					
+					break;
+				}
+				
+				default:
+					ADD_FAILURE() << "Unexpected message of type " << dwMessageType <<", sequence " << seq;
+					break;
+			}
+			
+			return DPN_OK;
+		});
+	
+	DPNHANDLE send_handle;
+	
+	std::function<HRESULT(DWORD,PVOID)> p1_cb =
+		[&testing, &p1_seq, &p1_player_id, &send_handle]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CONNECT_COMPLETE)
+			{
+				DPNMSG_CONNECT_COMPLETE *cc = (DPNMSG_CONNECT_COMPLETE*)(pMessage);
+				p1_player_id = cc->dpnidLocal;
+			}
+			
+			if(!testing)
+			{
+				return DPN_OK;
+			}
+			
+			int seq = ++p1_seq;
+			
+			switch(seq)
+			{
+				case 1:
+				{
+					EXPECT_EQ(dwMessageType, DPN_MSGID_SEND_COMPLETE);
+					
+					if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
+					{
+						DPNMSG_SEND_COMPLETE *sc = (DPNMSG_SEND_COMPLETE*)(pMessage);
+						
+						EXPECT_EQ(sc->dwSize,              sizeof(*sc));
+						EXPECT_EQ(sc->hAsyncOp,            send_handle);
+						EXPECT_EQ(sc->pvUserContext,       (void*)(0xABCD));
+						EXPECT_EQ(sc->hResultCode,         DPN_OK);
+						EXPECT_EQ(sc->dwSendCompleteFlags, 0);
+						EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
+						EXPECT_EQ(sc->dwNumBuffers,        0);
+					}
+					
+					break;
+				}
+				
+				default:
+					ADD_FAILURE() << "Unexpected message of type " << dwMessageType <<", sequence " << seq;
+					break;
+			}
+			
+			return DPN_OK;
+		};
+	
+	IDP8PeerInstance p1;
+	
+	ASSERT_EQ(p1->Initialize(&p1_cb, &callback_shim, 0), S_OK);
+	
+	DPN_APPLICATION_DESC connect_to_app;
+	memset(&connect_to_app, 0, sizeof(connect_to_app));
+	
+	connect_to_app.dwSize = sizeof(connect_to_app);
+	connect_to_app.guidApplication = APP_GUID_1;
+	
+	IDP8AddressInstance connect_to_addr(L"127.0.0.1", PORT);
+	
+	ASSERT_EQ(p1->Connect(
+		&connect_to_app,  /* pdnAppDesc */
+		connect_to_addr,  /* pHostAddr */
+		NULL,             /* pDeviceInfo */
+		NULL,             /* pdnSecurity */
+		NULL,             /* pdnCredentials */
+		NULL,             /* pvUserConnectData */
+		0,                /* dwUserConnectDataSize */
+		NULL,             /* pvPlayerContext */
+		NULL,             /* pvAsyncContext */
+		NULL,             /* phAsyncHandle */
+		DPNCONNECT_SYNC   /* dwFlags */
+	), S_OK);
+	
+	/* Give everything a moment to settle. */
+	Sleep(250);
+	
+	testing = true;
+	
+	DPN_BUFFER_DESC bd[] = {
+		{ 12, (BYTE*)("Hello, world") },
+	};
+	
+	ASSERT_EQ(p1->SendTo(
+		DPNID_ALL_PLAYERS_GROUP,
+		bd,
+		1,
+		0,
+		(void*)(0xABCD),
+		&send_handle,
+		DPNSEND_NOLOOPBACK
+	), DPNSUCCESS_PENDING);
+	
+	/* Let the message get through any any resultant messages happen. */
+	Sleep(250);
+	
+	EXPECT_EQ(host_seq, 1);
+	EXPECT_EQ(p1_seq, 1);
+	
+	testing = false;
+}
+
+TEST(DirectPlay8Peer, AsyncSendToHostToPeer)
+{
+	std::atomic<bool> testing(false);
+	
+	std::atomic<int> host_seq(0), p1_seq(0);
+	DPNID host_player_id = -1, p1_player_id = -1;
+	DPNHANDLE send_handle;
+	
+	SessionHost host(APP_GUID_1, L"Session 1", PORT,
+		[&testing, &host_seq, &host_player_id, &send_handle]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER && host_player_id == -1)
+			{
+				DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
+				host_player_id = cp->dpnidPlayer;
+			}
+			
+			if(!testing)
+			{
+				return DPN_OK;
+			}
+			
+			int seq = ++host_seq;
+			
+			switch(seq)
+			{
+				case 1:
+				{
+					EXPECT_EQ(dwMessageType, DPN_MSGID_SEND_COMPLETE);
+					
+					if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
+					{
+						DPNMSG_SEND_COMPLETE *sc = (DPNMSG_SEND_COMPLETE*)(pMessage);
+						
+						EXPECT_EQ(sc->dwSize,              sizeof(*sc));
+						EXPECT_EQ(sc->hAsyncOp,            send_handle);
+						EXPECT_EQ(sc->pvUserContext,       (void*)(0xABCD));
+						EXPECT_EQ(sc->hResultCode,         DPN_OK);
+						EXPECT_EQ(sc->dwSendCompleteFlags, 0);
+						EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
+						EXPECT_EQ(sc->dwNumBuffers,        0);
+					}
+					
+					break;
+				}
+				
+				default:
+					ADD_FAILURE() << "Unexpected message of type " << dwMessageType <<", sequence " << seq;
+					break;
+			}
+			
+			return DPN_OK;
+		});
+	
+	std::function<HRESULT(DWORD,PVOID)> p1_cb =
+		[&testing, &p1_seq, &p1_player_id, &host_player_id]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CONNECT_COMPLETE)
+			{
+				DPNMSG_CONNECT_COMPLETE *cc = (DPNMSG_CONNECT_COMPLETE*)(pMessage);
+				p1_player_id = cc->dpnidLocal;
+			}
+			
+			if(!testing)
+			{
+				return DPN_OK;
+			}
+			
+			int seq = ++p1_seq;
+			
+			switch(seq)
+			{
+				case 1:
+				{
+					EXPECT_EQ(dwMessageType, DPN_MSGID_RECEIVE);
+					
+					if(dwMessageType == DPN_MSGID_RECEIVE)
+					{
+						DPNMSG_RECEIVE *r = (DPNMSG_RECEIVE*)(pMessage);
+						
+						EXPECT_EQ(r->dwSize,          sizeof(*r));
+						EXPECT_EQ(r->dpnidSender,     host_player_id);
+						EXPECT_EQ(r->pvPlayerContext, (void*)(NULL));
+						EXPECT_EQ(r->dwReceiveFlags,  0);
+						
+						EXPECT_EQ(
+							std::string((const char*)(r->pReceiveData), r->dwReceiveDataSize),
+							std::string("Hello, world"));
+					}
+					
+					break;
+				}
+				
+				default:
+					ADD_FAILURE() << "Unexpected message of type " << dwMessageType <<", sequence " << seq;
+					break;
+			}
+			
+			return DPN_OK;
+		};
+	
+	IDP8PeerInstance p1;
+	
+	ASSERT_EQ(p1->Initialize(&p1_cb, &callback_shim, 0), S_OK);
+	
+	DPN_APPLICATION_DESC connect_to_app;
+	memset(&connect_to_app, 0, sizeof(connect_to_app));
+	
+	connect_to_app.dwSize = sizeof(connect_to_app);
+	connect_to_app.guidApplication = APP_GUID_1;
+	
+	IDP8AddressInstance connect_to_addr(L"127.0.0.1", PORT);
+	
+	ASSERT_EQ(p1->Connect(
+		&connect_to_app,  /* pdnAppDesc */
+		connect_to_addr,  /* pHostAddr */
+		NULL,             /* pDeviceInfo */
+		NULL,             /* pdnSecurity */
+		NULL,             /* pdnCredentials */
+		NULL,             /* pvUserConnectData */
+		0,                /* dwUserConnectDataSize */
+		NULL,             /* pvPlayerContext */
+		NULL,             /* pvAsyncContext */
+		NULL,             /* phAsyncHandle */
+		DPNCONNECT_SYNC   /* dwFlags */
+	), S_OK);
+	
+	/* Give everything a moment to settle. */
+	Sleep(250);
+	
+	testing = true;
+	
+	DPN_BUFFER_DESC bd[] = {
+		{ 12, (BYTE*)("Hello, world") },
+	};
+	
+	ASSERT_EQ(host->SendTo(
+		p1_player_id,
+		bd,
+		1,
+		0,
+		(void*)(0xABCD),
+		&send_handle,
+		0
+	), DPNSUCCESS_PENDING);
+	
+	/* Let the message get through any any resultant messages happen. */
+	Sleep(250);
+	
+	EXPECT_EQ(host_seq, 1);
+	EXPECT_EQ(p1_seq, 1);
+	
+	testing = false;
+}
+
+TEST(DirectPlay8Peer, AsyncSendToHostToNone)
+{
+	std::atomic<bool> testing(false);
+	
+	std::atomic<int> host_seq(0);
+	DPNID host_player_id = -1;
+	DPNHANDLE send_handle;
+	
+	SessionHost host(APP_GUID_1, L"Session 1", PORT,
+		[&testing, &host_seq, &host_player_id, &send_handle]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER && host_player_id == -1)
+			{
+				DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
+				host_player_id = cp->dpnidPlayer;
+			}
+			
+			if(!testing)
+			{
+				return DPN_OK;
+			}
+			
+			int seq = ++host_seq;
+			
+			switch(seq)
+			{
+				case 1:
+				{
+					EXPECT_EQ(dwMessageType, DPN_MSGID_SEND_COMPLETE);
+					
+					if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
+					{
+						DPNMSG_SEND_COMPLETE *sc = (DPNMSG_SEND_COMPLETE*)(pMessage);
+						
+						EXPECT_EQ(sc->dwSize,              sizeof(*sc));
+						EXPECT_EQ(sc->hAsyncOp,            send_handle);
+						EXPECT_EQ(sc->pvUserContext,       (void*)(0xABCD));
+						EXPECT_EQ(sc->hResultCode,         DPN_OK);
+						EXPECT_EQ(sc->dwSendCompleteFlags, 0);
+						EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
+						EXPECT_EQ(sc->dwNumBuffers,        0);
+					}
+					
+					break;
+				}
+				
+				default:
+					ADD_FAILURE() << "Unexpected message of type " << dwMessageType <<", sequence " << seq;
+					break;
+			}
+			
+			return DPN_OK;
+		});
+	
+	/* Give everything a moment to settle. */
+	Sleep(250);
+	
+	testing = true;
+	
+	DPN_BUFFER_DESC bd[] = {
+		{ 12, (BYTE*)("Hello, world") },
+	};
+	
+	ASSERT_EQ(host->SendTo(
+		DPNID_ALL_PLAYERS_GROUP,
+		bd,
+		1,
+		0,
+		(void*)(0xABCD),
+		&send_handle,
+		DPNSEND_NOLOOPBACK
+	), DPNSUCCESS_PENDING);
+	
+	/* Let the message get through any any resultant messages happen. */
+	Sleep(250);
+	
+	EXPECT_EQ(host_seq, 1);
+	
+	testing = false;
+}
+
+TEST(DirectPlay8Peer, AsyncSendCancelByHandle)
+{
+	DPNID p1_player_id = -1;
+	
+	DPNHANDLE cancel_handle = 0;
+	bool got_cancel_msg = false;
+	
+	SessionHost host(APP_GUID_1, L"Session 1", PORT,
+		[&cancel_handle, &got_cancel_msg]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
+			{
+				DPNMSG_SEND_COMPLETE *sc = (DPNMSG_SEND_COMPLETE*)(pMessage);
+				
+				if(sc->hResultCode == DPNERR_USERCANCEL)
+				{
+					EXPECT_EQ(sc->dwSize,              sizeof(*sc));
+					EXPECT_EQ(sc->hAsyncOp,            cancel_handle);
+					EXPECT_EQ(sc->pvUserContext,       (void*)(0xBCDE));
+					EXPECT_EQ(sc->dwSendCompleteFlags, 0);
+					EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
+					EXPECT_EQ(sc->dwNumBuffers,        0);
+					
+					got_cancel_msg = true;
+				}
+				else if(sc->hResultCode != S_OK)
+				{
+					ADD_FAILURE() << "Unexpected hResultCode: " << sc->hResultCode;
+				}
+			}
+			
+			return DPN_OK;
+		});
+	
+	std::function<HRESULT(DWORD,PVOID)> p1_cb =
+		[&p1_player_id]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CONNECT_COMPLETE)
+			{
+				DPNMSG_CONNECT_COMPLETE *cc = (DPNMSG_CONNECT_COMPLETE*)(pMessage);
+				p1_player_id = cc->dpnidLocal;
+			}
+			
+			return DPN_OK;
+		};
+	
+	IDP8PeerInstance p1;
+	
+	ASSERT_EQ(p1->Initialize(&p1_cb, &callback_shim, 0), S_OK);
+	
+	DPN_APPLICATION_DESC connect_to_app;
+	memset(&connect_to_app, 0, sizeof(connect_to_app));
+	
+	connect_to_app.dwSize = sizeof(connect_to_app);
+	connect_to_app.guidApplication = APP_GUID_1;
+	
+	IDP8AddressInstance connect_to_addr(L"127.0.0.1", PORT);
+	
+	ASSERT_EQ(p1->Connect(
+		&connect_to_app,  /* pdnAppDesc */
+		connect_to_addr,  /* pHostAddr */
+		NULL,             /* pDeviceInfo */
+		NULL,             /* pdnSecurity */
+		NULL,             /* pdnCredentials */
+		NULL,             /* pvUserConnectData */
+		0,                /* dwUserConnectDataSize */
+		NULL,             /* pvPlayerContext */
+		NULL,             /* pvAsyncContext */
+		NULL,             /* phAsyncHandle */
+		DPNCONNECT_SYNC   /* dwFlags */
+	), S_OK);
+	
+	/* Give everything a moment to settle. */
+	Sleep(250);
+	
+	DPN_BUFFER_DESC bd[] = {
+		{ 12, (BYTE*)("Hello, world") },
+	};
+	
+	/* Queue a load of messages we don't care about... */
+	
+	for(int i = 0; i < 1000; ++i)
+	{
+		DPNHANDLE send_handle;
+		ASSERT_EQ(host->SendTo(
+			p1_player_id,
+			bd,
+			1,
+			0,
+			(void*)(0xABCD),
+			&send_handle,
+			0
+		), DPNSUCCESS_PENDING);
+	}
+	
+	/* ...hopefully stuffing up the send queue enough for us to be able to cancel THIS send
+	 * before it goes out.
+	*/
+	
+	ASSERT_EQ(host->SendTo(
+		p1_player_id,
+		bd,
+		1,
+		0,
+		(void*)(0xBCDE),
+		&cancel_handle,
+		0
+	), DPNSUCCESS_PENDING);
+	
+	ASSERT_EQ(host->CancelAsyncOperation(cancel_handle, 0), S_OK);
+	
+	/* Wait for the send buffer to clear out. */
+	Sleep(1000);
+	
+	EXPECT_TRUE(got_cancel_msg);
+}
+
+TEST(DirectPlay8Peer, AsyncSendCancelFragmentedByHandle)
+{
+	DPNID p1_player_id = -1;
+	
+	/* Big enough to be split over several datagrams. */
+	const std::string big_message((DatagramReceiver::FRAGMENT_SIZE * 3) + 10, 'X');
+	
+	DPNHANDLE cancel_handle = 0;
+	std::atomic<int> cancel_completions(0);
+	std::atomic<HRESULT> cancel_result(S_OK);
+	std::atomic<int> big_receives(0);
+	
+	SessionHost host(APP_GUID_1, L"Session 1", PORT,
+		[&cancel_handle, &cancel_completions, &cancel_result]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
+			{
+				DPNMSG_SEND_COMPLETE *sc = (DPNMSG_SEND_COMPLETE*)(pMessage);
+				
+				if(sc->hAsyncOp == cancel_handle)
+				{
+					EXPECT_EQ(sc->pvUserContext, (void*)(0xBCDE));
+					
+					cancel_result = sc->hResultCode;
+					++cancel_completions;
+				}
+				else if(sc->hResultCode != S_OK)
+				{
+					ADD_FAILURE() << "Unexpected hResultCode: " << sc->hResultCode;
+				}
+			}
+			
+			return DPN_OK;
+		});
+	
+	std::function<HRESULT(DWORD,PVOID)> p1_cb =
+		[&p1_player_id, &big_message, &big_receives]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CONNECT_COMPLETE)
+			{
+				DPNMSG_CONNECT_COMPLETE *cc = (DPNMSG_CONNECT_COMPLETE*)(pMessage);
+				p1_player_id = cc->dpnidLocal;
+			}
+			else if(dwMessageType == DPN_MSGID_RECEIVE)
+			{
+				DPNMSG_RECEIVE *r = (DPNMSG_RECEIVE*)(pMessage);
+				
+				if(r->dwReceiveDataSize == big_message.size())
+				{
+					++big_receives;
+				}
+			}
+			
+			return DPN_OK;
+		};
+	
+	IDP8PeerInstance p1;
+	
+	ASSERT_EQ(p1->Initialize(&p1_cb, &callback_shim, 0), S_OK);
+	
+	DPN_APPLICATION_DESC connect_to_app;
+	memset(&connect_to_app, 0, sizeof(connect_to_app));
+	
+	connect_to_app.dwSize = sizeof(connect_to_app);
+	connect_to_app.guidApplication = APP_GUID_1;
+	
+	IDP8AddressInstance connect_to_addr(L"127.0.0.1", PORT);
+	
+	ASSERT_EQ(p1->Connect(
+		&connect_to_app,  /* pdnAppDesc */
+		connect_to_addr,  /* pHostAddr */
+		NULL,             /* pDeviceInfo */
+		NULL,             /* pdnSecurity */
+		NULL,             /* pdnCredentials */
+		NULL,             /* pvUserConnectData */
+		0,                /* dwUserConnectDataSize */
+		NULL,             /* pvPlayerContext */
+		NULL,             /* pvAsyncContext */
+		NULL,             /* phAsyncHandle */
+		DPNCONNECT_SYNC   /* dwFlags */
+	), S_OK);
+	
+	/* Give everything a moment to settle. */
+	Sleep(250);
+	
+	DPN_BUFFER_DESC bd[] = {
+		{ 12, (BYTE*)("Hello, world") },
+	};
+	
+	/* Queue a load of messages we don't care about... */
+	
+	for(int i = 0; i < 1000; ++i)
+	{
+		DPNHANDLE send_handle;
+		ASSERT_EQ(host->SendTo(
+			p1_player_id,
+			bd,
+			1,
+			0,
+			(void*)(0xABCD),
+			&send_handle,
+			0
+		), DPNSUCCESS_PENDING);
+	}
+	
+	DPN_BUFFER_DESC big_bd[] = {
+		{ (DWORD)(big_message.size()), (BYTE*)(big_message.data()) },
+	};
+	
+	ASSERT_EQ(host->SendTo(
+		p1_player_id,
+		big_bd,
+		1,
+		0,
+		(void*)(0xBCDE),
+		&cancel_handle,
+		0
+	), DPNSUCCESS_PENDING);
+	
+	/* The send may have started going out already, but however far it got, every fragment
+	 * must have been cancelled or sent and the send must complete exactly once.
+	*/
+	HRESULT c_result = host->CancelAsyncOperation(cancel_handle, 0);
+	
+	/* Wait for the send buffer to clear out. */
+	Sleep(1000);
+	
+	EXPECT_EQ(cancel_completions, 1);
+	
+	if(c_result == S_OK)
+	{
+		EXPECT_EQ(cancel_result, DPNERR_USERCANCEL);
+		EXPECT_EQ(big_receives, 0);
+	}
+	else{
+		EXPECT_EQ(c_result, DPNERR_CANNOTCANCEL);
+		EXPECT_EQ(cancel_result, S_OK);
+	}
+}
+
+TEST(DirectPlay8Peer, AsyncSendCancelPlayerSends)
+{
+	DPNID p1_player_id = -1;
+	
+	DPNHANDLE cancel_handle = 0;
+	int got_cancel_msg = 0;
+	
+	SessionHost host(APP_GUID_1, L"Session 1", PORT,
+		[&cancel_handle, &got_cancel_msg]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
+			{
+				DPNMSG_SEND_COMPLETE *sc = (DPNMSG_SEND_COMPLETE*)(pMessage);
+				
+				if(sc->hResultCode == DPNERR_USERCANCEL)
+				{
+					EXPECT_EQ(sc->dwSize,              sizeof(*sc));
+					EXPECT_EQ(sc->pvUserContext,       (void*)(0xABCD));
+					EXPECT_EQ(sc->dwSendCompleteFlags, 0);
+					EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
+					EXPECT_EQ(sc->dwNumBuffers,        0);
+					
+					++got_cancel_msg;
+				}
+				else if(sc->hResultCode != S_OK)
+				{
+					ADD_FAILURE() << "Unexpected hResultCode: " << sc->hResultCode;
+				}
+			}
+			
+			return DPN_OK;
+		});
+	
+	std::function<HRESULT(DWORD,PVOID)> p1_cb =
+		[&p1_player_id]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CONNECT_COMPLETE)
+			{
+				DPNMSG_CONNECT_COMPLETE *cc = (DPNMSG_CONNECT_COMPLETE*)(pMessage);
+				p1_player_id = cc->dpnidLocal;
+			}
+			
+			return DPN_OK;
+		};
+	
+	IDP8PeerInstance p1;
+	
+	ASSERT_EQ(p1->Initialize(&p1_cb, &callback_shim, 0), S_OK);
+	
+	DPN_APPLICATION_DESC connect_to_app;
+	memset(&connect_to_app, 0, sizeof(connect_to_app));
+	
+	connect_to_app.dwSize = sizeof(connect_to_app);
+	connect_to_app.guidApplication = APP_GUID_1;
+	
+	IDP8AddressInstance connect_to_addr(L"127.0.0.1", PORT);
+	
+	ASSERT_EQ(p1->Connect(
+		&connect_to_app,  /* pdnAppDesc */
+		connect_to_addr,  /* pHostAddr */
+		NULL,             /* pDeviceInfo */
+		NULL,             /* pdnSecurity */
+		NULL,             /* pdnCredentials */
+		NULL,             /* pvUserConnectData */
+		0,                /* dwUserConnectDataSize */
+		NULL,             /* pvPlayerContext */
+		NULL,             /* pvAsyncContext */
+		NULL,             /* phAsyncHandle */
+		DPNCONNECT_SYNC   /* dwFlags */
+	), S_OK);
+	
+	/* Give everything a moment to settle. */
+	Sleep(250);
+	
+	DPN_BUFFER_DESC bd[] = {
+		{ 12, (BYTE*)("Hello, world") },
+	};
+	
+	/* Queue a load of messages... */
+	
+	for(int i = 0; i < 1000; ++i)
+	{
+		DPNHANDLE send_handle;
+		ASSERT_EQ(host->SendTo(
+			p1_player_id,
+			bd,
+			1,
+			0,
+			(void*)(0xABCD),
+			&send_handle,
+			0
+		), DPNSUCCESS_PENDING);
+	}
+	
+	/* ...and cancel however many of them are still pending here. */
+	
+	ASSERT_EQ(host->CancelAsyncOperation(p1_player_id, DPNCANCEL_PLAYER_SENDS), S_OK);
+	
+	/* Wait for the send buffer to clear out. */
+	Sleep(1000);
+	
+	EXPECT_TRUE(got_cancel_msg > 0);
+}
+
+TEST(DirectPlay8Peer, AsyncSendCancelPlayerSendsLow)
+{
+	DPNID p1_player_id = -1;
+	
+	DPNHANDLE cancel_handle = 0;
+	int got_cancel_msg = 0;
+	
+	SessionHost host(APP_GUID_1, L"Session 1", PORT,
+		[&cancel_handle, &got_cancel_msg]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
+			{
+				DPNMSG_SEND_COMPLETE *sc = (DPNMSG_SEND_COMPLETE*)(pMessage);
+				
+				if(sc->hResultCode == DPNERR_USERCANCEL)
+				{
+					EXPECT_EQ(sc->dwSize,              sizeof(*sc));
+					EXPECT_EQ(sc->hAsyncOp,            cancel_handle);
+					EXPECT_EQ(sc->pvUserContext,       (void*)(0xABCD));
+					EXPECT_EQ(sc->dwSendCompleteFlags, 0);
+					EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
+					EXPECT_EQ(sc->dwNumBuffers,        0);
+					
+					++got_cancel_msg;
+				}
+				else if(sc->hResultCode != S_OK)
+				{
+					ADD_FAILURE() << "Unexpected hResultCode: " << sc->hResultCode;
+				}
+			}
+			
+			return DPN_OK;
+		});
+	
+	std::function<HRESULT(DWORD,PVOID)> p1_cb =
+		[&p1_player_id]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CONNECT_COMPLETE)
+			{
+				DPNMSG_CONNECT_COMPLETE *cc = (DPNMSG_CONNECT_COMPLETE*)(pMessage);
+				p1_player_id = cc->dpnidLocal;
+			}
+			
+			return DPN_OK;
+		};
+	
+	IDP8PeerInstance p1;
+	
+	ASSERT_EQ(p1->Initialize(&p1_cb, &callback_shim, 0), S_OK);
+	
+	DPN_APPLICATION_DESC connect_to_app;
+	memset(&connect_to_app, 0, sizeof(connect_to_app));
+	
+	connect_to_app.dwSize = sizeof(connect_to_app);
+	connect_to_app.guidApplication = APP_GUID_1;
+	
+	IDP8AddressInstance connect_to_addr(L"127.0.0.1", PORT);
+	
+	ASSERT_EQ(p1->Connect(
+		&connect_to_app,  /* pdnAppDesc */
+		connect_to_addr,  /* pHostAddr */
+		NULL,             /* pDeviceInfo */
+		NULL,             /* pdnSecurity */
+		NULL,             /* pdnCredentials */
+		NULL,             /* pvUserConnectData */
+		0,                /* dwUserConnectDataSize */
+		NULL,             /* pvPlayerContext */
+		NULL,             /* pvAsyncContext */
+		NULL,             /* phAsyncHandle */
+		DPNCONNECT_SYNC   /* dwFlags */
+	), S_OK);
+	
+	/* Give everything a moment to settle. */
+	Sleep(250);
+	
+	DPN_BUFFER_DESC bd[] = {
+		{ 12, (BYTE*)("Hello, world") },
+	};
+	
+	/* Queue a load of messages... */
+	
+	for(int i = 0; i < 1000; ++i)
+	{
+		DPNHANDLE send_handle;
+		ASSERT_EQ(host->SendTo(
+			p1_player_id,
+			bd,
+			1,
+			0,
+			(void*)(0xABCD),
+			&send_handle,
+			DPNSEND_PRIORITY_HIGH
+		), DPNSUCCESS_PENDING);
+	}
+	
+	/* ...and hopefully cancel this one before it goes out. */
+	
+	ASSERT_EQ(host->SendTo(
+		p1_player_id,
+		bd,
+		1,
+		0,
+		(void*)(0xABCD),
+		&cancel_handle,
+		DPNSEND_PRIORITY_LOW
+	), DPNSUCCESS_PENDING);
+	
+	ASSERT_EQ(host->CancelAsyncOperation(p1_player_id, DPNCANCEL_PLAYER_SENDS_PRIORITY_LOW), S_OK);
+	
+	/* Wait for the send buffer to clear out. */
+	Sleep(1000);
+	
+	EXPECT_EQ(got_cancel_msg, 1);
+}
+
+TEST(DirectPlay8Peer, AsyncSendCancelPlayerSendsNormal)
+{
+	DPNID p1_player_id = -1;
+	
+	DPNHANDLE cancel_handle = 0;
+	int got_cancel_msg = 0;
+	
+	SessionHost host(APP_GUID_1, L"Session 1", PORT,
+		[&cancel_handle, &got_cancel_msg]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
+			{
+				DPNMSG_SEND_COMPLETE *sc = (DPNMSG_SEND_COMPLETE*)(pMessage);
+				
+				if(sc->hResultCode == DPNERR_USERCANCEL)
+				{
+					EXPECT_EQ(sc->dwSize,              sizeof(*sc));
+					EXPECT_EQ(sc->hAsyncOp,            cancel_handle);
+					EXPECT_EQ(sc->pvUserContext,       (void*)(0xABCD));
+					EXPECT_EQ(sc->dwSendCompleteFlags, 0);
+					EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
+					EXPECT_EQ(sc->dwNumBuffers,        0);
+					
+					++got_cancel_msg;
+				}
+				else if(sc->hResultCode != S_OK)
+				{
+					ADD_FAILURE() << "Unexpected hResultCode: " << sc->hResultCode;
+				}
+			}
+			
+			return DPN_OK;
+		});
+	
+	std::function<HRESULT(DWORD,PVOID)> p1_cb =
+		[&p1_player_id]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CONNECT_COMPLETE)
+			{
+				DPNMSG_CONNECT_COMPLETE *cc = (DPNMSG_CONNECT_COMPLETE*)(pMessage);
+				p1_player_id = cc->dpnidLocal;
+			}
+			
+			return DPN_OK;
+		};
+	
+	IDP8PeerInstance p1;
+	
+	ASSERT_EQ(p1->Initialize(&p1_cb, &callback_shim, 0), S_OK);
+	
+	DPN_APPLICATION_DESC connect_to_app;
+	memset(&connect_to_app, 0, sizeof(connect_to_app));
+	
+	connect_to_app.dwSize = sizeof(connect_to_app);
+	connect_to_app.guidApplication = APP_GUID_1;
+	
+	IDP8AddressInstance connect_to_addr(L"127.0.0.1", PORT);
+	
+	ASSERT_EQ(p1->Connect(
+		&connect_to_app,  /* pdnAppDesc */
+		connect_to_addr,  /* pHostAddr */
+		NULL,             /* pDeviceInfo */
+		NULL,             /* pdnSecurity */
+		NULL,             /* pdnCredentials */
+		NULL,             /* pvUserConnectData */
+		0,                /* dwUserConnectDataSize */
+		NULL,             /* pvPlayerContext */
+		NULL,             /* pvAsyncContext */
+		NULL,             /* phAsyncHandle */
+		DPNCONNECT_SYNC   /* dwFlags */
+	), S_OK);
+	
+	/* Give everything a moment to settle. */
+	Sleep(250);
+	
+	DPN_BUFFER_DESC bd[] = {
+		{ 12, (BYTE*)("Hello, world") },
+	};
+	
+	/* Queue a load of messages... */
+	
+	for(int i = 0; i < 1000; ++i)
+	{
+		DPNHANDLE send_handle;
+		ASSERT_EQ(host->SendTo(
+			p1_player_id,
+			bd,
+			1,
+			0,
+			(void*)(0xABCD),
+			&send_handle,
+			DPNSEND_PRIORITY_HIGH
+		), DPNSUCCESS_PENDING);
+	}
+	
+	/* ...and hopefully cancel this one before it goes out. */
+	
+	ASSERT_EQ(host->SendTo(
+		p1_player_id,
+		bd,
+		1,
+		0,
+		(void*)(0xABCD),
+		&cancel_handle,
+		0
 	), DPNSUCCESS_PENDING);
 	
-	/* Let the message get through any any resultant messages happen. */
-	Sleep(250);
+	ASSERT_EQ(host->CancelAsyncOperation(p1_player_id, DPNCANCEL_PLAYER_SENDS_PRIORITY_NORMAL), S_OK);
 	
-	EXPECT_EQ(host_seq, 1);
+	/* Wait for the send buffer to clear out. */
+	Sleep(1000);
 	
-	testing = false;
+	EXPECT_EQ(got_cancel_msg, 1);
 }
 
-TEST(DirectPlay8Peer, AsyncSendCancelByHandle)
+TEST(DirectPlay8Peer, AsyncSendCancelPlayerSendsHigh)
 {
 	DPNID p1_player_id = -1;
-	
-	DPNHANDLE cancel_handle = 0;
-	bool got_cancel_msg = false;
+	int got_cancel_msg = 0;
 	
 	SessionHost host(APP_GUID_1, L"Session 1", PORT,
-		[&cancel_handle, &got_cancel_msg]
+		[&got_cancel_msg]
 		(DWORD dwMessageType, PVOID pMessage)
 		{
 			if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
@@ -4785,13 +5855,12 @@ TEST(DirectPlay8Peer, AsyncSendCancelByHandle)
 				if(sc->hResultCode == DPNERR_USERCANCEL)
 				{
 					EXPECT_EQ(sc->dwSize,              sizeof(*sc));
-					EXPECT_EQ(sc->hAsyncOp,            cancel_handle);
-					EXPECT_EQ(sc->pvUserContext,       (void*)(0xBCDE));
+					EXPECT_EQ(sc->pvUserContext,       (void*)(0xABCD));
 					EXPECT_EQ(sc->dwSendCompleteFlags, 0);
 					EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
 					EXPECT_EQ(sc->dwNumBuffers,        0);
 					
-					got_cancel_msg = true;
+					++got_cancel_msg;
 				}
 				else if(sc->hResultCode != S_OK)
 				{
@@ -4848,7 +5917,7 @@ TEST(DirectPlay8Peer, AsyncSendCancelByHandle)
 		{ 12, (BYTE*)("Hello, world") },
 	};
 	
-	/* Queue a load of messages we don't care about... */
+	/* Queue a load of messages... */
 	
 	for(int i = 0; i < 1000; ++i)
 	{
@@ -4860,55 +5929,46 @@ TEST(DirectPlay8Peer, AsyncSendCancelByHandle)
 			0,
 			(void*)(0xABCD),
 			&send_handle,
-			0
+			DPNSEND_PRIORITY_HIGH
 		), DPNSUCCESS_PENDING);
 	}
 	
-	/* ...hopefully stuffing up the send queue enough for us to be able to cancel THIS send
-	 * before it goes out.
-	*/
-	
-	ASSERT_EQ(host->SendTo(
-		p1_player_id,
-		bd,
-		1,
-		0,
-		(void*)(0xBCDE),
-		&cancel_handle,
-		0
-	), DPNSUCCESS_PENDING);
+	/* ...and cancel however many haven't gone out yet. */
 	
-	ASSERT_EQ(host->CancelAsyncOperation(cancel_handle, 0), S_OK);
+	ASSERT_EQ(host->CancelAsyncOperation(p1_player_id, DPNCANCEL_PLAYER_SENDS_PRIORITY_HIGH), S_OK);
 	
 	/* Wait for the send buffer to clear out. */
 	Sleep(1000);
 	
-	EXPECT_TRUE(got_cancel_msg);
+	EXPECT_NE(got_cancel_msg, 0);
 }
 
-TEST(DirectPlay8Peer, AsyncSendCancelPlayerSends)
+TEST(DirectPlay8Peer, AsyncSendCancelPlayerSendsOtherHandle)
 {
-	DPNID p1_player_id = -1;
+	DPNID host_player_id = -1, p1_player_id = -1;
 	
 	DPNHANDLE cancel_handle = 0;
 	int got_cancel_msg = 0;
 	
 	SessionHost host(APP_GUID_1, L"Session 1", PORT,
-		[&cancel_handle, &got_cancel_msg]
+		[&host_player_id, &cancel_handle, &got_cancel_msg]
 		(DWORD dwMessageType, PVOID pMessage)
 		{
-			if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER)
+			{
+				DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
+				
+				if(host_player_id == -1)
+				{
+					host_player_id = cp->dpnidPlayer;
+				}
+			}
+			else if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
 			{
 				DPNMSG_SEND_COMPLETE *sc = (DPNMSG_SEND_COMPLETE*)(pMessage);
 				
 				if(sc->hResultCode == DPNERR_USERCANCEL)
 				{
-					EXPECT_EQ(sc->dwSize,              sizeof(*sc));
-					EXPECT_EQ(sc->pvUserContext,       (void*)(0xABCD));
-					EXPECT_EQ(sc->dwSendCompleteFlags, 0);
-					EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
-					EXPECT_EQ(sc->dwNumBuffers,        0);
-					
 					++got_cancel_msg;
 				}
 				else if(sc->hResultCode != S_OK)
@@ -4982,17 +6042,17 @@ TEST(DirectPlay8Peer, AsyncSendCancelPlayerSends)
 		), DPNSUCCESS_PENDING);
 	}
 	
-	/* ...and cancel however many of them are still pending here. */
+	/* ...and cancel none of them here. */
 	
-	ASSERT_EQ(host->CancelAsyncOperation(p1_player_id, DPNCANCEL_PLAYER_SENDS), S_OK);
+	ASSERT_EQ(host->CancelAsyncOperation(host_player_id, DPNCANCEL_PLAYER_SENDS), S_OK);
 	
 	/* Wait for the send buffer to clear out. */
 	Sleep(1000);
 	
-	EXPECT_TRUE(got_cancel_msg > 0);
+	EXPECT_EQ(got_cancel_msg, 0);
 }
 
-TEST(DirectPlay8Peer, AsyncSendCancelPlayerSendsLow)
+TEST(DirectPlay8Peer, AsyncSendCancelAllOperations)
 {
 	DPNID p1_player_id = -1;
 	
@@ -5010,7 +6070,6 @@ TEST(DirectPlay8Peer, AsyncSendCancelPlayerSendsLow)
 				if(sc->hResultCode == DPNERR_USERCANCEL)
 				{
 					EXPECT_EQ(sc->dwSize,              sizeof(*sc));
-					EXPECT_EQ(sc->hAsyncOp,            cancel_handle);
 					EXPECT_EQ(sc->pvUserContext,       (void*)(0xABCD));
 					EXPECT_EQ(sc->dwSendCompleteFlags, 0);
 					EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
@@ -5085,39 +6144,27 @@ TEST(DirectPlay8Peer, AsyncSendCancelPlayerSendsLow)
 			0,
 			(void*)(0xABCD),
 			&send_handle,
-			DPNSEND_PRIORITY_HIGH
+			0
 		), DPNSUCCESS_PENDING);
 	}
 	
-	/* ...and hopefully cancel this one before it goes out. */
-	
-	ASSERT_EQ(host->SendTo(
-		p1_player_id,
-		bd,
-		1,
-		0,
-		(void*)(0xABCD),
-		&cancel_handle,
-		DPNSEND_PRIORITY_LOW
-	), DPNSUCCESS_PENDING);
+	/* ...and cancel however many of them are still pending here. */
 	
-	ASSERT_EQ(host->CancelAsyncOperation(p1_player_id, DPNCANCEL_PLAYER_SENDS_PRIORITY_LOW), S_OK);
+	ASSERT_EQ(host->CancelAsyncOperation(0, DPNCANCEL_ALL_OPERATIONS), S_OK);
 	
 	/* Wait for the send buffer to clear out. */
 	Sleep(1000);
 	
-	EXPECT_EQ(got_cancel_msg, 1);
+	EXPECT_TRUE(got_cancel_msg > 0);
 }
 
-TEST(DirectPlay8Peer, AsyncSendCancelPlayerSendsNormal)
+TEST(DirectPlay8Peer, AsyncSendCancelByClose)
 {
 	DPNID p1_player_id = -1;
-	
-	DPNHANDLE cancel_handle = 0;
 	int got_cancel_msg = 0;
 	
 	SessionHost host(APP_GUID_1, L"Session 1", PORT,
-		[&cancel_handle, &got_cancel_msg]
+		[&got_cancel_msg]
 		(DWORD dwMessageType, PVOID pMessage)
 		{
 			if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
@@ -5127,7 +6174,6 @@ TEST(DirectPlay8Peer, AsyncSendCancelPlayerSendsNormal)
 				if(sc->hResultCode == DPNERR_USERCANCEL)
 				{
 					EXPECT_EQ(sc->dwSize,              sizeof(*sc));
-					EXPECT_EQ(sc->hAsyncOp,            cancel_handle);
 					EXPECT_EQ(sc->pvUserContext,       (void*)(0xABCD));
 					EXPECT_EQ(sc->dwSendCompleteFlags, 0);
 					EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
@@ -5202,55 +6248,43 @@ TEST(DirectPlay8Peer, AsyncSendCancelPlayerSendsNormal)
 			0,
 			(void*)(0xABCD),
 			&send_handle,
-			DPNSEND_PRIORITY_HIGH
+			0
 		), DPNSUCCESS_PENDING);
 	}
 	
-	/* ...and hopefully cancel this one before it goes out. */
-	
-	ASSERT_EQ(host->SendTo(
-		p1_player_id,
-		bd,
-		1,
-		0,
-		(void*)(0xABCD),
-		&cancel_handle,
-		0
-	), DPNSUCCESS_PENDING);
+	/* ...and cancel however many of them are still pending here. */
 	
-	ASSERT_EQ(host->CancelAsyncOperation(p1_player_id, DPNCANCEL_PLAYER_SENDS_PRIORITY_NORMAL), S_OK);
+	host->Close(DPNCLOSE_IMMEDIATE);
 	
 	/* Wait for the send buffer to clear out. */
 	Sleep(1000);
 	
-	EXPECT_EQ(got_cancel_msg, 1);
+	EXPECT_TRUE(got_cancel_msg > 0);
 }
 
-TEST(DirectPlay8Peer, AsyncSendCancelPlayerSendsHigh)
+TEST(DirectPlay8Peer, AsyncSendTimeout)
 {
 	DPNID p1_player_id = -1;
-	int got_cancel_msg = 0;
+	
+	std::atomic<int> got_ok(0), got_timeout(0);
 	
 	SessionHost host(APP_GUID_1, L"Session 1", PORT,
-		[&got_cancel_msg]
+		[&got_ok, &got_timeout]
 		(DWORD dwMessageType, PVOID pMessage)
 		{
 			if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
 			{
 				DPNMSG_SEND_COMPLETE *sc = (DPNMSG_SEND_COMPLETE*)(pMessage);
 				
-				if(sc->hResultCode == DPNERR_USERCANCEL)
+				if(sc->hResultCode == S_OK)
 				{
-					EXPECT_EQ(sc->dwSize,              sizeof(*sc));
-					EXPECT_EQ(sc->pvUserContext,       (void*)(0xABCD));
-					EXPECT_EQ(sc->dwSendCompleteFlags, 0);
-					EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
-					EXPECT_EQ(sc->dwNumBuffers,        0);
-					
-					++got_cancel_msg;
+					++got_ok;
 				}
-				else if(sc->hResultCode != S_OK)
+				else if(sc->hResultCode == DPNERR_TIMEDOUT)
 				{
+					++got_timeout;
+				}
+				else{
 					ADD_FAILURE() << "Unexpected hResultCode: " << sc->hResultCode;
 				}
 			}
@@ -5300,11 +6334,103 @@ TEST(DirectPlay8Peer, AsyncSendCancelPlayerSendsHigh)
 	/* Give everything a moment to settle. */
 	Sleep(250);
 	
+	std::vector<unsigned char> big(64 * 1024);
+	
 	DPN_BUFFER_DESC bd[] = {
-		{ 12, (BYTE*)("Hello, world") },
+		{ (DWORD)(big.size()), big.data() },
 	};
 	
-	/* Queue a load of messages... */
+	/* Queue far more than can be sent within the timeout... */
+	
+	for(int i = 0; i < 2000; ++i)
+	{
+		DPNHANDLE send_handle;
+		ASSERT_EQ(host->SendTo(
+			p1_player_id,
+			bd,
+			1,
+			20,
+			NULL,
+			&send_handle,
+			DPNSEND_GUARANTEED
+		), DPNSUCCESS_PENDING);
+	}
+	
+	/* ...and wait for everything to either be sent or expire. */
+	Sleep(3000);
+	
+	EXPECT_EQ((got_ok + got_timeout), 2000);
+	EXPECT_TRUE(got_ok > 0);
+	EXPECT_TRUE(got_timeout > 0);
+}
+
+TEST(DirectPlay8Peer, GetSendQueueInfo)
+{
+	DPNID p1_player_id = -1;
+	
+	SessionHost host(APP_GUID_1, L"Session 1", PORT,
+		[]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			return DPN_OK;
+		});
+	
+	std::function<HRESULT(DWORD,PVOID)> p1_cb =
+		[&p1_player_id]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CONNECT_COMPLETE)
+			{
+				DPNMSG_CONNECT_COMPLETE *cc = (DPNMSG_CONNECT_COMPLETE*)(pMessage);
+				p1_player_id = cc->dpnidLocal;
+			}
+			
+			return DPN_OK;
+		};
+	
+	IDP8PeerInstance p1;
+	
+	ASSERT_EQ(p1->Initialize(&p1_cb, &callback_shim, 0), S_OK);
+	
+	DWORD num_msgs, num_bytes;
+	
+	EXPECT_EQ(p1->GetSendQueueInfo(DPNID_ALL_PLAYERS_GROUP, &num_msgs, &num_bytes, 0), DPNERR_NOCONNECTION);
+	
+	DPN_APPLICATION_DESC connect_to_app;
+	memset(&connect_to_app, 0, sizeof(connect_to_app));
+	
+	connect_to_app.dwSize = sizeof(connect_to_app);
+	connect_to_app.guidApplication = APP_GUID_1;
+	
+	IDP8AddressInstance connect_to_addr(L"127.0.0.1", PORT);
+	
+	ASSERT_EQ(p1->Connect(
+		&connect_to_app,  /* pdnAppDesc */
+		connect_to_addr,  /* pHostAddr */
+		NULL,             /* pDeviceInfo */
+		NULL,             /* pdnSecurity */
+		NULL,             /* pdnCredentials */
+		NULL,             /* pvUserConnectData */
+		0,                /* dwUserConnectDataSize */
+		NULL,             /* pvPlayerContext */
+		NULL,             /* pvAsyncContext */
+		NULL,             /* phAsyncHandle */
+		DPNCONNECT_SYNC   /* dwFlags */
+	), S_OK);
+	
+	/* Give everything a moment to settle. */
+	Sleep(250);
+	
+	EXPECT_EQ(host->GetSendQueueInfo(p1_player_id, &num_msgs, &num_bytes, 0), S_OK);
+	EXPECT_EQ(num_msgs,  0U);
+	EXPECT_EQ(num_bytes, 0U);
+	
+	EXPECT_EQ(host->GetSendQueueInfo(0x1234, &num_msgs, &num_bytes, 0), DPNERR_INVALIDPLAYER);
+	EXPECT_EQ(host->GetSendQueueInfo(p1_player_id, &num_msgs, &num_bytes, 0x8000), DPNERR_INVALIDFLAGS);
+	
+	DPN_BUFFER_DESC bd[] = {
+		{ 12, (BYTE*)("Hello, world") },
+	};
 	
 	for(int i = 0; i < 1000; ++i)
 	{
@@ -5314,75 +6440,120 @@ TEST(DirectPlay8Peer, AsyncSendCancelPlayerSendsHigh)
 			bd,
 			1,
 			0,
-			(void*)(0xABCD),
+			NULL,
 			&send_handle,
-			DPNSEND_PRIORITY_HIGH
+			(DPNSEND_GUARANTEED | DPNSEND_PRIORITY_LOW)
 		), DPNSUCCESS_PENDING);
 	}
 	
-	/* ...and cancel however many haven't gone out yet. */
+	/* Only DPNSEND_PRIORITY_LOW messages have been queued. */
 	
-	ASSERT_EQ(host->CancelAsyncOperation(p1_player_id, DPNCANCEL_PLAYER_SENDS_PRIORITY_HIGH), S_OK);
+	EXPECT_EQ(host->GetSendQueueInfo(p1_player_id, &num_msgs, &num_bytes, DPNGETSENDQUEUEINFO_PRIORITY_NORMAL), S_OK);
+	EXPECT_EQ(num_msgs,  0U);
+	EXPECT_EQ(num_bytes, 0U);
 	
-	/* Wait for the send buffer to clear out. */
+	EXPECT_EQ(host->GetSendQueueInfo(DPNID_ALL_PLAYERS_GROUP, &num_msgs, NULL, DPNGETSENDQUEUEINFO_PRIORITY_LOW), S_OK);
+	EXPECT_LE(num_msgs, 1000U);
+	
+	/* Wait for the send queue to drain. */
 	Sleep(1000);
 	
-	EXPECT_NE(got_cancel_msg, 0);
+	EXPECT_EQ(host->GetSendQueueInfo(p1_player_id, &num_msgs, &num_bytes, 0), S_OK);
+	EXPECT_EQ(num_msgs,  0U);
+	EXPECT_EQ(num_bytes, 0U);
+	
+	EXPECT_EQ(host->GetSendQueueInfo(DPNID_ALL_PLAYERS_GROUP, &num_msgs, &num_bytes, 0), S_OK);
+	EXPECT_EQ(num_msgs,  0U);
+	EXPECT_EQ(num_bytes, 0U);
 }
 
-TEST(DirectPlay8Peer, AsyncSendCancelPlayerSendsOtherHandle)
+TEST(DirectPlay8Peer, SetCaps)
 {
-	DPNID host_player_id = -1, p1_player_id = -1;
+	std::function<HRESULT(DWORD,PVOID)> cb =
+		[]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			return DPN_OK;
+		};
 	
-	DPNHANDLE cancel_handle = 0;
-	int got_cancel_msg = 0;
+	IDP8PeerInstance peer;
+	
+	ASSERT_EQ(peer->Initialize(&cb, &callback_shim, 0), S_OK);
+	
+	DPN_CAPS caps;
+	memset(&caps, 0, sizeof(caps));
+	caps.dwSize = sizeof(caps);
+	
+	ASSERT_EQ(peer->GetCaps(&caps, 0), S_OK);
+	EXPECT_EQ(caps.dwTimeoutUntilKeepAlive, 25000U);
+	
+	caps.dwConnectTimeout        = 500;
+	caps.dwTimeoutUntilKeepAlive = 1234;
+	
+	ASSERT_EQ(peer->SetCaps(&caps, 0), S_OK);
+	
+	DPN_CAPS_EX caps_ex;
+	memset(&caps_ex, 0, sizeof(caps_ex));
+	caps_ex.dwSize = sizeof(caps_ex);
+	
+	ASSERT_EQ(peer->GetCaps((DPN_CAPS*)(&caps_ex), 0), S_OK);
+	EXPECT_EQ(caps_ex.dwConnectTimeout,        500U);
+	EXPECT_EQ(caps_ex.dwTimeoutUntilKeepAlive, 1234U);
+	EXPECT_EQ(caps_ex.dwNumSendRetries,        10U);
+	
+	/* Keepalive periods below the minimum are raised to it. */
+	
+	caps.dwTimeoutUntilKeepAlive = 1;
+	
+	ASSERT_EQ(peer->SetCaps(&caps, 0), S_OK);
+	ASSERT_EQ(peer->GetCaps(&caps, 0), S_OK);
+	EXPECT_EQ(caps.dwTimeoutUntilKeepAlive, 50U);
+	
+	caps.dwSize = sizeof(caps) - 1;
+	EXPECT_EQ(peer->SetCaps(&caps, 0), DPNERR_INVALIDPARAM);
+}
+
+TEST(DirectPlay8Peer, KeepAliveHealthyPeer)
+{
+	/* A connected peer must not be timed out while it is still responding, even with a
+	 * very short keepalive period.
+	*/
+	
+	std::atomic<int> host_destroyed(0);
 	
 	SessionHost host(APP_GUID_1, L"Session 1", PORT,
-		[&host_player_id, &cancel_handle, &got_cancel_msg]
-		(DWORD dwMessageType, PVOID pMessage)
-		{
-			if(dwMessageType == DPN_MSGID_CREATE_PLAYER)
-			{
-				DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
-				
-				if(host_player_id == -1)
-				{
-					host_player_id = cp->dpnidPlayer;
-				}
-			}
-			else if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
+		[&host_destroyed]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_DESTROY_PLAYER)
 			{
-				DPNMSG_SEND_COMPLETE *sc = (DPNMSG_SEND_COMPLETE*)(pMessage);
-				
-				if(sc->hResultCode == DPNERR_USERCANCEL)
-				{
-					++got_cancel_msg;
-				}
-				else if(sc->hResultCode != S_OK)
-				{
-					ADD_FAILURE() << "Unexpected hResultCode: " << sc->hResultCode;
-				}
+				++host_destroyed;
 			}
 			
 			return DPN_OK;
 		});
 	
+	DPN_CAPS caps;
+	memset(&caps, 0, sizeof(caps));
+	caps.dwSize = sizeof(caps);
+	
+	ASSERT_EQ(host->GetCaps(&caps, 0), S_OK);
+	
+	caps.dwTimeoutUntilKeepAlive = 200;
+	
+	ASSERT_EQ(host->SetCaps(&caps, 0), S_OK);
+	
 	std::function<HRESULT(DWORD,PVOID)> p1_cb =
-		[&p1_player_id]
+		[]
 		(DWORD dwMessageType, PVOID pMessage)
 		{
-			if(dwMessageType == DPN_MSGID_CONNECT_COMPLETE)
-			{
-				DPNMSG_CONNECT_COMPLETE *cc = (DPNMSG_CONNECT_COMPLETE*)(pMessage);
-				p1_player_id = cc->dpnidLocal;
-			}
-			
 			return DPN_OK;
 		};
 	
 	IDP8PeerInstance p1;
 	
 	ASSERT_EQ(p1->Initialize(&p1_cb, &callback_shim, 0), S_OK);
+	ASSERT_EQ(p1->SetCaps(&caps, 0), S_OK);
 	
 	DPN_APPLICATION_DESC connect_to_app;
 	memset(&connect_to_app, 0, sizeof(connect_to_app));
@@ -5406,73 +6577,134 @@ TEST(DirectPlay8Peer, AsyncSendCancelPlayerSendsOtherHandle)
 		DPNCONNECT_SYNC   /* dwFlags */
 	), S_OK);
 	
-	/* Give everything a moment to settle. */
-	Sleep(250);
-	
-	DPN_BUFFER_DESC bd[] = {
-		{ 12, (BYTE*)("Hello, world") },
-	};
-	
-	/* Queue a load of messages... */
-	
-	for(int i = 0; i < 1000; ++i)
-	{
-		DPNHANDLE send_handle;
-		ASSERT_EQ(host->SendTo(
-			p1_player_id,
-			bd,
-			1,
-			0,
-			(void*)(0xABCD),
-			&send_handle,
-			0
-		), DPNSUCCESS_PENDING);
-	}
-	
-	/* ...and cancel none of them here. */
+	Sleep(2000);
 	
-	ASSERT_EQ(host->CancelAsyncOperation(host_player_id, DPNCANCEL_PLAYER_SENDS), S_OK);
+	EXPECT_EQ(host_destroyed, 0);
 	
-	/* Wait for the send buffer to clear out. */
-	Sleep(1000);
+	DPNID players[4];
+	DWORD num_players = 4;
 	
-	EXPECT_EQ(got_cancel_msg, 0);
+	ASSERT_EQ(host->EnumPlayersAndGroups(players, &num_players, DPNENUM_PLAYERS), S_OK);
+	EXPECT_EQ(num_players, 2U);
 }
 
-TEST(DirectPlay8Peer, AsyncSendCancelAllOperations)
+TEST(DirectPlay8Peer, KeepAliveDeadPeer)
 {
-	DPNID p1_player_id = -1;
+	/* A peer which connects and then stops responding must be destroyed with
+	 * DPNDESTROYPLAYERREASON_CONNECTIONLOST after about two keepalive periods.
+	*/
 	
-	DPNHANDLE cancel_handle = 0;
-	int got_cancel_msg = 0;
+	std::atomic<DPNID> host_player_id(-1), p1_player_id(-1), destroyed_player_id(-1);
+	std::atomic<DWORD> created_at(0), destroyed_at(0), destroy_reason(0);
 	
 	SessionHost host(APP_GUID_1, L"Session 1", PORT,
-		[&cancel_handle, &got_cancel_msg]
+		[&]
 		(DWORD dwMessageType, PVOID pMessage)
 		{
-			if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER)
 			{
-				DPNMSG_SEND_COMPLETE *sc = (DPNMSG_SEND_COMPLETE*)(pMessage);
+				DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
 				
-				if(sc->hResultCode == DPNERR_USERCANCEL)
+				if(host_player_id == -1)
 				{
-					EXPECT_EQ(sc->dwSize,              sizeof(*sc));
-					EXPECT_EQ(sc->pvUserContext,       (void*)(0xABCD));
-					EXPECT_EQ(sc->dwSendCompleteFlags, 0);
-					EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
-					EXPECT_EQ(sc->dwNumBuffers,        0);
-					
-					++got_cancel_msg;
+					host_player_id = cp->dpnidPlayer;
 				}
-				else if(sc->hResultCode != S_OK)
+				else{
+					p1_player_id = cp->dpnidPlayer;
+					created_at   = GetTickCount();
+				}
+			}
+			else if(dwMessageType == DPN_MSGID_DESTROY_PLAYER)
+			{
+				DPNMSG_DESTROY_PLAYER *dp = (DPNMSG_DESTROY_PLAYER*)(pMessage);
+				
+				if(dp->dpnidPlayer != host_player_id)
 				{
-					ADD_FAILURE() << "Unexpected hResultCode: " << sc->hResultCode;
+					destroy_reason      = dp->dwReason;
+					destroyed_player_id = dp->dpnidPlayer;
+					destroyed_at        = GetTickCount();
 				}
 			}
 			
 			return DPN_OK;
 		});
 	
+	DPN_CAPS caps;
+	memset(&caps, 0, sizeof(caps));
+	caps.dwSize = sizeof(caps);
+	
+	ASSERT_EQ(host->GetCaps(&caps, 0), S_OK);
+	
+	caps.dwTimeoutUntilKeepAlive = 250;
+	
+	ASSERT_EQ(host->SetCaps(&caps, 0), S_OK);
+	
+	/* Join the session from a plain TCP socket which sends the connection request and
+	 * then never reads or sends anything else, like a peer which has hung.
+	*/
+	
+	SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	ASSERT_NE(sock, INVALID_SOCKET);
+	
+	struct sockaddr_in host_addr;
+	memset(&host_addr, 0, sizeof(host_addr));
+	
+	host_addr.sin_family      = AF_INET;
+	host_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	host_addr.sin_port        = htons(PORT);
+	
+	ASSERT_EQ(connect(sock, (struct sockaddr*)(&host_addr), sizeof(host_addr)), 0);
+	
+	PacketSerialiser connect_host(DPLITE_MSGID_CONNECT_HOST);
+	connect_host.append_null();
+	connect_host.append_guid(APP_GUID_1);
+	connect_host.append_null();
+	connect_host.append_null();
+	connect_host.append_wstring(L"Hung");
+	connect_host.append_data(NULL, 0);
+	
+	std::pair<const void*, size_t> raw = connect_host.raw_packet();
+	EXPECT_EQ(send(sock, (const char*)(raw.first), raw.second, 0), (int)(raw.second));
+	
+	for(int i = 0; i < 100 && destroyed_player_id == -1; ++i)
+	{
+		Sleep(20);
+	}
+	
+	ASSERT_NE(p1_player_id, -1);
+	
+	EXPECT_EQ(destroyed_player_id, p1_player_id);
+	EXPECT_EQ(destroy_reason, DPNDESTROYPLAYERREASON_CONNECTIONLOST);
+	
+	if(destroyed_player_id != -1)
+	{
+		/* Two periods, allowing a check interval either side. */
+		DWORD elapsed = destroyed_at - created_at;
+		
+		EXPECT_GE(elapsed, 400U);
+		EXPECT_LE(elapsed, 800U);
+	}
+	
+	DPNID players[4];
+	DWORD num_players = 4;
+	
+	ASSERT_EQ(host->EnumPlayersAndGroups(players, &num_players, DPNENUM_PLAYERS), S_OK);
+	EXPECT_EQ(num_players, 1U);
+	
+	closesocket(sock);
+}
+
+TEST(DirectPlay8Peer, GetConnectionInfo)
+{
+	DPNID p1_player_id = -1;
+	
+	SessionHost host(APP_GUID_1, L"Session 1", PORT,
+		[]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			return DPN_OK;
+		});
+	
 	std::function<HRESULT(DWORD,PVOID)> p1_cb =
 		[&p1_player_id]
 		(DWORD dwMessageType, PVOID pMessage)
@@ -5490,6 +6722,12 @@ TEST(DirectPlay8Peer, AsyncSendCancelAllOperations)
 	
 	ASSERT_EQ(p1->Initialize(&p1_cb, &callback_shim, 0), S_OK);
 	
+	DPN_CONNECTION_INFO info;
+	memset(&info, 0, sizeof(info));
+	info.dwSize = sizeof(info);
+	
+	EXPECT_EQ(p1->GetConnectionInfo(DPNID_ALL_PLAYERS_GROUP, &info, 0), DPNERR_NOCONNECTION);
+	
 	DPN_APPLICATION_DESC connect_to_app;
 	memset(&connect_to_app, 0, sizeof(connect_to_app));
 	
@@ -5515,70 +6753,110 @@ TEST(DirectPlay8Peer, AsyncSendCancelAllOperations)
 	/* Give everything a moment to settle. */
 	Sleep(250);
 	
+	EXPECT_EQ(host->GetConnectionInfo(0x1234, &info, 0), DPNERR_INVALIDPLAYER);
+	EXPECT_EQ(host->GetConnectionInfo(p1_player_id, &info, 0x8000), DPNERR_INVALIDFLAGS);
+	
+	info.dwSize = sizeof(info) - 1;
+	EXPECT_EQ(host->GetConnectionInfo(p1_player_id, &info, 0), DPNERR_INVALIDPARAM);
+	info.dwSize = sizeof(info);
+	
 	DPN_BUFFER_DESC bd[] = {
 		{ 12, (BYTE*)("Hello, world") },
 	};
 	
-	/* Queue a load of messages... */
-	
-	for(int i = 0; i < 1000; ++i)
+	for(int i = 0; i < 10; ++i)
 	{
-		DPNHANDLE send_handle;
 		ASSERT_EQ(host->SendTo(
 			p1_player_id,
 			bd,
 			1,
 			0,
-			(void*)(0xABCD),
-			&send_handle,
-			0
-		), DPNSUCCESS_PENDING);
+			NULL,
+			NULL,
+			(DPNSEND_GUARANTEED | DPNSEND_SYNC)
+		), S_OK);
 	}
 	
-	/* ...and cancel however many of them are still pending here. */
+	ASSERT_EQ(host->GetConnectionInfo(p1_player_id, &info, 0), S_OK);
 	
-	ASSERT_EQ(host->CancelAsyncOperation(0, DPNCANCEL_ALL_OPERATIONS), S_OK);
+	EXPECT_EQ(info.dwSize, sizeof(info));
+	EXPECT_EQ(info.dwMessagesTransmittedNormalPriority, 10U);
+	EXPECT_EQ(info.dwMessagesTimedOutNormalPriority,    0U);
+	EXPECT_EQ(info.dwMessagesTransmittedHighPriority,   0U);
+	EXPECT_EQ(info.dwMessagesTransmittedLowPriority,    0U);
+	EXPECT_GE(info.dwPacketsSentGuaranteed, 10U);
+	EXPECT_GE(info.dwBytesSentGuaranteed,   (DWORD)(10 * bd[0].dwBufferSize));
 	
-	/* Wait for the send buffer to clear out. */
-	Sleep(1000);
+	/* Wait for a few pings and throughput updates. */
+	Sleep(2500);
 	
-	EXPECT_TRUE(got_cancel_msg > 0);
+	ASSERT_EQ(host->GetConnectionInfo(p1_player_id, &info, 0), S_OK);
+	
+	EXPECT_LT(info.dwRoundTripLatencyMS, 1000U);
+	EXPECT_GT(info.dwPeakThroughputBPS, 0U);
+	EXPECT_GT(info.dwPacketsReceivedGuaranteed, 0U);
+	EXPECT_EQ(info.dwMessagesReceived, 0U);
+	
+	ASSERT_EQ(p1->GetConnectionInfo(p1_player_id, &info, 0), DPNERR_INVALIDPLAYER);
 }
 
-TEST(DirectPlay8Peer, AsyncSendCancelByClose)
+TEST(DirectPlay8Peer, SyncSendToPeerToHost)
 {
-	DPNID p1_player_id = -1;
-	int got_cancel_msg = 0;
+	std::atomic<bool> testing(false);
+	
+	std::atomic<int> host_seq(0), p1_seq(0);
+	DPNID host_player_id = -1, p1_player_id = -1;
 	
 	SessionHost host(APP_GUID_1, L"Session 1", PORT,
-		[&got_cancel_msg]
+		[&testing, &host_seq, &host_player_id, &p1_player_id]
 		(DWORD dwMessageType, PVOID pMessage)
 		{
-			if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER && host_player_id == -1)
 			{
-				DPNMSG_SEND_COMPLETE *sc = (DPNMSG_SEND_COMPLETE*)(pMessage);
-				
-				if(sc->hResultCode == DPNERR_USERCANCEL)
+				DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
+				host_player_id = cp->dpnidPlayer;
+			}
+			
+			if(!testing)
+			{
+				return DPN_OK;
+			}
+			
+			int seq = ++host_seq;
+			
+			switch(seq)
+			{
+				case 1:
 				{
-					EXPECT_EQ(sc->dwSize,              sizeof(*sc));
-					EXPECT_EQ(sc->pvUserContext,       (void*)(0xABCD));
-					EXPECT_EQ(sc->dwSendCompleteFlags, 0);
-					EXPECT_EQ(sc->pBuffers,            (DPN_BUFFER_DESC*)(NULL));
-					EXPECT_EQ(sc->dwNumBuffers,        0);
+					EXPECT_EQ(dwMessageType, DPN_MSGID_RECEIVE);
 					
-					++got_cancel_msg;
-				}
-				else if(sc->hResultCode != S_OK)
-				{
-					ADD_FAILURE() << "Unexpected hResultCode: " << sc->hResultCode;
+					if(dwMessageType == DPN_MSGID_RECEIVE)
+					{
+						DPNMSG_RECEIVE *r = (DPNMSG_RECEIVE*)(pMessage);
+						
+						EXPECT_EQ(r->dwSize,          sizeof(*r));
+						EXPECT_EQ(r->dpnidSender,     p1_player_id);
+						EXPECT_EQ(r->pvPlayerContext, (void*)(NULL));
+						EXPECT_EQ(r->dwReceiveFlags,  0);
+						
+						EXPECT_EQ(
+							std::string((const char*)(r->pReceiveData), r->dwReceiveDataSize),
+							std::string("Hello, world"));
+					}
+					
+					break;
 				}
+				
+				default:
+					ADD_FAILURE() << "Unexpected message of type " << dwMessageType <<", sequence " << seq;
+					break;
 			}
 			
 			return DPN_OK;
 		});
 	
 	std::function<HRESULT(DWORD,PVOID)> p1_cb =
-		[&p1_player_id]
+		[&testing, &p1_seq, &p1_player_id]
 		(DWORD dwMessageType, PVOID pMessage)
 		{
 			if(dwMessageType == DPN_MSGID_CONNECT_COMPLETE)
@@ -5587,6 +6865,15 @@ TEST(DirectPlay8Peer, AsyncSendCancelByClose)
 				p1_player_id = cc->dpnidLocal;
 			}
 			
+			if(!testing)
+			{
+				return DPN_OK;
+			}
+			
+			int seq = ++p1_seq;
+			
+			ADD_FAILURE() << "Unexpected message of type " << dwMessageType <<", sequence " << seq;
+			
 			return DPN_OK;
 		};
 	
@@ -5619,45 +6906,50 @@ TEST(DirectPlay8Peer, AsyncSendCancelByClose)
 	/* Give everything a moment to settle. */
 	Sleep(250);
 	
+	testing = true;
+	
 	DPN_BUFFER_DESC bd[] = {
 		{ 12, (BYTE*)("Hello, world") },
 	};
 	
-	/* Queue a load of messages... */
-	
-	for(int i = 0; i < 1000; ++i)
-	{
-		DPNHANDLE send_handle;
-		ASSERT_EQ(host->SendTo(
-			p1_player_id,
-			bd,
-			1,
-			0,
-			(void*)(0xABCD),
-			&send_handle,
-			0
-		), DPNSUCCESS_PENDING);
-	}
-	
-	/* ...and cancel however many of them are still pending here. */
+	ASSERT_EQ(p1->SendTo(
+		host_player_id,
+		bd,
+		1,
+		0,
+		NULL,
+		NULL,
+		DPNSEND_SYNC
+	), DPN_OK);
 	
-	host->Close(DPNCLOSE_IMMEDIATE);
+	/* Let the message get through any any resultant messages happen. */
+	Sleep(250);
 	
-	/* Wait for the send buffer to clear out. */
-	Sleep(1000);
+	EXPECT_EQ(host_seq, 1);
+	EXPECT_EQ(p1_seq, 0);
 	
-	EXPECT_TRUE(got_cancel_msg > 0);
+	testing = false;
 }
 
-TEST(DirectPlay8Peer, SyncSendToPeerToHost)
+TEST(DirectPlay8Peer, SyncSendToPeerToHostManyBuffers)
 {
+	/* More DPN_BUFFER_DESCs than can be passed to a single WSASendTo() call, the datagram
+	 * must still arrive whole.
+	*/
+	
+	std::string payload;
+	for(int i = 0; i < 200; ++i)
+	{
+		payload.push_back('A' + (i % 26));
+	}
+	
 	std::atomic<bool> testing(false);
 	
 	std::atomic<int> host_seq(0), p1_seq(0);
 	DPNID host_player_id = -1, p1_player_id = -1;
 	
 	SessionHost host(APP_GUID_1, L"Session 1", PORT,
-		[&testing, &host_seq, &host_player_id, &p1_player_id]
+		[&testing, &host_seq, &host_player_id, &p1_player_id, &payload]
 		(DWORD dwMessageType, PVOID pMessage)
 		{
 			if(dwMessageType == DPN_MSGID_CREATE_PLAYER && host_player_id == -1)
@@ -5690,7 +6982,7 @@ TEST(DirectPlay8Peer, SyncSendToPeerToHost)
 						
 						EXPECT_EQ(
 							std::string((const char*)(r->pReceiveData), r->dwReceiveDataSize),
-							std::string("Hello, world"));
+							payload);
 					}
 					
 					break;
@@ -5757,14 +7049,18 @@ TEST(DirectPlay8Peer, SyncSendToPeerToHost)
 	
 	testing = true;
 	
-	DPN_BUFFER_DESC bd[] = {
-		{ 12, (BYTE*)("Hello, world") },
-	};
+	std::vector<DPN_BUFFER_DESC> bd(payload.size());
+	
+	for(size_t i = 0; i < payload.size(); ++i)
+	{
+		bd[i].dwBufferSize = 1;
+		bd[i].pBufferData  = (BYTE*)(&(payload[i]));
+	}
 	
 	ASSERT_EQ(p1->SendTo(
 		host_player_id,
-		bd,
-		1,
+		bd.data(),
+		bd.size(),
 		0,
 		NULL,
 		NULL,
@@ -0,0 +1,520 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <atomic>
+#include <functional>
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <string.h>
+#include <wchar.h>
+#include <windows.h>
+
+#include "../src/DirectPlay8Address.hpp"
+#include "../src/DirectPlay8Peer.hpp"
+#include "../src/DirectPlay8ThreadPool.hpp"
+
+#define PORT 42895
+
+static const GUID APP_GUID_1 = { 0xa6133957, 0x6f42, 0x46ce, { 0xa9, 0x88, 0x22, 0xf7, 0x79, 0x47, 0x08, 0x16 } };
+
+#define ALL_PROCESSORS ((DWORD)(-1))
+
+static HRESULT CALLBACK callback_shim(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage)
+{
+	std::function<HRESULT(DWORD,PVOID)> *callback = (std::function<HRESULT(DWORD,PVOID)>*)(pvUserContext);
+	return (*callback)(dwMessageType, pMessage);
+}
+
+static HRESULT CALLBACK null_handler(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage)
+{
+	return DPN_OK;
+}
+
+/* Initialised DirectPlay8ThreadPool which puts the thread count back how it was when the
+ * test finishes, since it applies to the whole process.
+*/
+struct ThreadPoolInstance
+{
+	DirectPlay8ThreadPool *instance;
+	DWORD initial_threads;
+	
+	ThreadPoolInstance():
+		instance(new DirectPlay8ThreadPool(NULL)),
+		initial_threads(DirectPlay8ThreadPool::get_thread_count())
+	{
+		if(instance->Initialize(NULL, &null_handler, 0) != S_OK)
+		{
+			instance->Release();
+			throw std::runtime_error("DirectPlay8ThreadPool::Initialize failed");
+		}
+	}
+	
+	~ThreadPoolInstance()
+	{
+		instance->SetThreadCount(ALL_PROCESSORS, initial_threads, 0);
+		instance->Close(0);
+		instance->Release();
+	}
+	
+	DirectPlay8ThreadPool *operator->()
+	{
+		return instance;
+	}
+};
+
+TEST(DirectPlay8ThreadPool, Uninitialised)
+{
+	DirectPlay8ThreadPool *tp = new DirectPlay8ThreadPool(NULL);
+	
+	DWORD threads;
+	EXPECT_EQ(tp->GetThreadCount(ALL_PROCESSORS, &threads, 0), DPNERR_UNINITIALIZED);
+	EXPECT_EQ(tp->SetThreadCount(ALL_PROCESSORS, 0, 0), DPNERR_UNINITIALIZED);
+	EXPECT_EQ(tp->DoWork(0, 0), DPNERR_UNINITIALIZED);
+	EXPECT_EQ(tp->Close(0), DPNERR_UNINITIALIZED);
+	
+	EXPECT_EQ(tp->Initialize(NULL, &null_handler, 0), S_OK);
+	EXPECT_EQ(tp->Initialize(NULL, &null_handler, 0), DPNERR_ALREADYINITIALIZED);
+	EXPECT_EQ(tp->Close(0), S_OK);
+	
+	tp->Release();
+}
+
+TEST(DirectPlay8ThreadPool, ThreadCount)
+{
+	ThreadPoolInstance tp;
+	
+	ASSERT_EQ(tp->SetThreadCount(ALL_PROCESSORS, 4, 0), S_OK);
+	
+	DWORD threads = 0;
+	EXPECT_EQ(tp->GetThreadCount(ALL_PROCESSORS, &threads, 0), S_OK);
+	EXPECT_EQ(threads, 4U);
+	
+	/* DoWork() is only allowed when there are no threads. */
+	EXPECT_EQ(tp->DoWork(0, 0), DPNERR_NOTALLOWED);
+	
+	EXPECT_EQ(tp->SetThreadCount(ALL_PROCESSORS, 0, 0), S_OK);
+	EXPECT_EQ(tp->GetThreadCount(ALL_PROCESSORS, &threads, 0), S_OK);
+	EXPECT_EQ(threads, 0U);
+	
+	EXPECT_EQ(tp->DoWork(0, 0), S_OK);
+	
+	EXPECT_EQ(tp->SetThreadCount(ALL_PROCESSORS, 2, 0), S_OK);
+	EXPECT_EQ(tp->GetThreadCount(ALL_PROCESSORS, &threads, 0), S_OK);
+	EXPECT_EQ(threads, 2U);
+}
+
+TEST(DirectPlay8ThreadPool, DoWorkConnect)
+{
+	/* With no threads, connecting to a session should only make progress within DoWork()
+	 * and every callback should be raised from the thread calling it.
+	*/
+	
+	ThreadPoolInstance tp;
+	ASSERT_EQ(tp->SetThreadCount(ALL_PROCESSORS, 0, 0), S_OK);
+	
+	DWORD main_thread = GetCurrentThreadId();
+	
+	std::atomic<int> host_messages(0), p1_messages(0), wrong_thread(0);
+	std::atomic<bool> connected(false), doing_work(false);
+	
+	std::function<HRESULT(DWORD,PVOID)> host_cb =
+		[&](DWORD dwMessageType, PVOID pMessage)
+		{
+			++host_messages;
+			
+			if(GetCurrentThreadId() != main_thread || !doing_work)
+			{
+				++wrong_thread;
+			}
+			
+			return DPN_OK;
+		};
+		
+	std::function<HRESULT(DWORD,PVOID)> p1_cb =
+		[&](DWORD dwMessageType, PVOID pMessage)
+		{
+			++p1_messages;
+			
+			if(GetCurrentThreadId() != main_thread || !doing_work)
+			{
+				++wrong_thread;
+			}
+			
+			if(dwMessageType == DPN_MSGID_CONNECT_COMPLETE)
+			{
+				DPNMSG_CONNECT_COMPLETE *cc = (DPNMSG_CONNECT_COMPLETE*)(pMessage);
+				EXPECT_EQ(cc->hResultCode, S_OK);
+				
+				connected = true;
+			}
+			
+			return DPN_OK;
+		};
+		
+	DirectPlay8Peer *host = new DirectPlay8Peer(NULL);
+	DirectPlay8Peer *p1   = new DirectPlay8Peer(NULL);
+	
+	ASSERT_EQ(host->Initialize(&host_cb, &callback_shim, 0), S_OK);
+	
+	{
+		DPN_APPLICATION_DESC app_desc;
+		memset(&app_desc, 0, sizeof(app_desc));
+		
+		app_desc.dwSize = sizeof(app_desc);
+		app_desc.guidApplication = APP_GUID_1;
+		app_desc.pwszSessionName = (wchar_t*)(L"Session 1");
+		
+		DirectPlay8Address *address = new DirectPlay8Address(NULL);
+		address->SetSP(&CLSID_DP8SP_TCPIP);
+		
+		DWORD port = PORT;
+		address->AddComponent(DPNA_KEY_PORT, &port, sizeof(DWORD), DPNA_DATATYPE_DWORD);
+		
+		IDirectPlay8Address *addresses[] = { address };
+		
+		doing_work = true;  /* CREATE_PLAYER for the host is raised from within Host(). */
+		ASSERT_EQ(host->Host(&app_desc, addresses, 1, NULL, NULL, (void*)(0xB00), 0), S_OK);
+		doing_work = false;
+		
+		address->Release();
+	}
+	
+	ASSERT_EQ(p1->Initialize(&p1_cb, &callback_shim, 0), S_OK);
+	
+	{
+		DPN_APPLICATION_DESC connect_to_app;
+		memset(&connect_to_app, 0, sizeof(connect_to_app));
+		
+		connect_to_app.dwSize = sizeof(connect_to_app);
+		connect_to_app.guidApplication = APP_GUID_1;
+		
+		DirectPlay8Address *connect_to_addr = new DirectPlay8Address(NULL);
+		connect_to_addr->SetSP(&CLSID_DP8SP_TCPIP);
+		
+		const wchar_t *hostname = L"127.0.0.1";
+		connect_to_addr->AddComponent(DPNA_KEY_HOSTNAME, hostname, ((wcslen(hostname) + 1) * sizeof(wchar_t)), DPNA_DATATYPE_STRING);
+		
+		DWORD port = PORT;
+		connect_to_addr->AddComponent(DPNA_KEY_PORT, &port, sizeof(DWORD), DPNA_DATATYPE_DWORD);
+		
+		DPNHANDLE connect_handle;
+		
+		EXPECT_EQ(p1->Connect(&connect_to_app, connect_to_addr, NULL, NULL, NULL, NULL, 0,
+			NULL, NULL, &connect_handle, 0), DPNSUCCESS_PENDING);
+			
+		connect_to_addr->Release();
+	}
+	
+	/* Nothing should happen in the background. */
+	
+	int host_before = host_messages;
+	
+	Sleep(500);
+	
+	EXPECT_EQ(host_messages, host_before);
+	EXPECT_EQ(p1_messages, 0);
+	
+	for(int i = 0; i < 100 && !connected; ++i)
+	{
+		doing_work = true;
+		
+		HRESULT result = tp->DoWork(50, 0);
+		EXPECT_TRUE(result == S_OK || result == DPNSUCCESS_PENDING);
+		
+		doing_work = false;
+		
+		Sleep(10);
+	}
+	
+	EXPECT_TRUE(connected);
+	EXPECT_EQ(wrong_thread, 0);
+	
+	/* Let the threads back in before closing, so nothing is left waiting for DoWork(). */
+	ASSERT_EQ(tp->SetThreadCount(ALL_PROCESSORS, 4, 0), S_OK);
+	
+	p1->Close(0);
+	host->Close(0);
+	
+	p1->Release();
+	host->Release();
+}
+
+/* Has the host reply to a message from p1 with DPNSEND_SYNC sends from within its
+ * DPN_MSGID_RECEIVE handler, with the given number of worker threads.
+*/
+static void sync_send_from_receive_handler(DWORD threads)
+{
+	ThreadPoolInstance tp;
+	ASSERT_EQ(tp->SetThreadCount(ALL_PROCESSORS, threads, 0), S_OK);
+	
+	DirectPlay8Peer *host = new DirectPlay8Peer(NULL);
+	DirectPlay8Peer *p1   = new DirectPlay8Peer(NULL);
+	
+	std::atomic<DPNID> host_player_id(0), p1_player_id(0);
+	std::atomic<HRESULT> guaranteed_result(-1), datagram_result(-1);
+	std::atomic<bool> handler_returned(false);
+	std::atomic<int> p1_replies(0);
+	
+	std::function<HRESULT(DWORD,PVOID)> host_cb =
+		[&](DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER)
+			{
+				DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
+				
+				if(host_player_id == 0)
+				{
+					host_player_id = cp->dpnidPlayer;
+				}
+				else{
+					p1_player_id = cp->dpnidPlayer;
+				}
+			}
+			else if(dwMessageType == DPN_MSGID_RECEIVE)
+			{
+				DPN_BUFFER_DESC bd[] = {
+					{ 5, (BYTE*)("Reply") },
+				};
+				
+				guaranteed_result = host->SendTo(p1_player_id, bd, 1, 0, NULL, NULL, DPNSEND_SYNC | DPNSEND_GUARANTEED);
+				datagram_result   = host->SendTo(p1_player_id, bd, 1, 0, NULL, NULL, DPNSEND_SYNC);
+				
+				handler_returned = true;
+			}
+			
+			return DPN_OK;
+		};
+	
+	std::function<HRESULT(DWORD,PVOID)> p1_cb =
+		[&](DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_RECEIVE)
+			{
+				++p1_replies;
+			}
+			
+			return DPN_OK;
+		};
+	
+	ASSERT_EQ(host->Initialize(&host_cb, &callback_shim, 0), S_OK);
+	
+	{
+		DPN_APPLICATION_DESC app_desc;
+		memset(&app_desc, 0, sizeof(app_desc));
+		
+		app_desc.dwSize = sizeof(app_desc);
+		app_desc.guidApplication = APP_GUID_1;
+		app_desc.pwszSessionName = (wchar_t*)(L"Session 1");
+		
+		DirectPlay8Address *address = new DirectPlay8Address(NULL);
+		address->SetSP(&CLSID_DP8SP_TCPIP);
+		
+		DWORD port = PORT;
+		address->AddComponent(DPNA_KEY_PORT, &port, sizeof(DWORD), DPNA_DATATYPE_DWORD);
+		
+		IDirectPlay8Address *addresses[] = { address };
+		
+		ASSERT_EQ(host->Host(&app_desc, addresses, 1, NULL, NULL, (void*)(0xB00), 0), S_OK);
+		
+		address->Release();
+	}
+	
+	ASSERT_EQ(p1->Initialize(&p1_cb, &callback_shim, 0), S_OK);
+	
+	{
+		DPN_APPLICATION_DESC connect_to_app;
+		memset(&connect_to_app, 0, sizeof(connect_to_app));
+		
+		connect_to_app.dwSize = sizeof(connect_to_app);
+		connect_to_app.guidApplication = APP_GUID_1;
+		
+		DirectPlay8Address *connect_to_addr = new DirectPlay8Address(NULL);
+		connect_to_addr->SetSP(&CLSID_DP8SP_TCPIP);
+		
+		const wchar_t *hostname = L"127.0.0.1";
+		connect_to_addr->AddComponent(DPNA_KEY_HOSTNAME, hostname, ((wcslen(hostname) + 1) * sizeof(wchar_t)), DPNA_DATATYPE_STRING);
+		
+		DWORD port = PORT;
+		connect_to_addr->AddComponent(DPNA_KEY_PORT, &port, sizeof(DWORD), DPNA_DATATYPE_DWORD);
+		
+		EXPECT_EQ(p1->Connect(&connect_to_app, connect_to_addr, NULL, NULL, NULL, NULL, 0,
+			NULL, NULL, NULL, DPNCONNECT_SYNC), S_OK);
+		
+		connect_to_addr->Release();
+	}
+	
+	/* Give everything a moment to settle. */
+	Sleep(250);
+	
+	DPN_BUFFER_DESC bd[] = {
+		{ 12, (BYTE*)("Hello, world") },
+	};
+	
+	EXPECT_EQ(p1->SendTo(host_player_id, bd, 1, 0, NULL, NULL, DPNSEND_SYNC | DPNSEND_GUARANTEED), S_OK);
+	
+	for(int i = 0; i < 100 && (!handler_returned || p1_replies < 2); ++i)
+	{
+		Sleep(10);
+	}
+	
+	EXPECT_TRUE(handler_returned);
+	EXPECT_EQ(guaranteed_result, S_OK);
+	EXPECT_EQ(datagram_result, S_OK);
+	EXPECT_EQ(p1_replies, 2);
+	
+	p1->Close(0);
+	host->Close(0);
+	
+	p1->Release();
+	host->Release();
+}
+
+TEST(DirectPlay8ThreadPool, SyncSendFromReceiveHandlerOneThread)
+{
+	/* The only worker is busy running the handler, so the sends have to be made from
+	 * the calling thread.
+	*/
+	sync_send_from_receive_handler(1);
+}
+
+TEST(DirectPlay8ThreadPool, SyncSendFromReceiveHandler)
+{
+	sync_send_from_receive_handler(4);
+}
+
+TEST(DirectPlay8ThreadPool, SyncGroupCallFromHandlerOneThread)
+{
+	/* DPNMSG_CREATE_GROUP is raised by the only worker, a DPNADDPLAYERTOGROUP_SYNC call from
+	 * within its handler must not wait for that worker to raise DPNMSG_ADD_PLAYER_TO_GROUP.
+	*/
+	
+	ThreadPoolInstance tp;
+	ASSERT_EQ(tp->SetThreadCount(ALL_PROCESSORS, 1, 0), S_OK);
+	
+	DirectPlay8Peer *host = new DirectPlay8Peer(NULL);
+	
+	std::atomic<DPNID> host_player_id(0);
+	std::atomic<HRESULT> add_result(-1);
+	std::atomic<bool> got_add_player(false), handler_returned(false);
+	
+	std::function<HRESULT(DWORD,PVOID)> host_cb =
+		[&](DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER)
+			{
+				DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
+				host_player_id = cp->dpnidPlayer;
+			}
+			else if(dwMessageType == DPN_MSGID_CREATE_GROUP)
+			{
+				DPNMSG_CREATE_GROUP *cg = (DPNMSG_CREATE_GROUP*)(pMessage);
+				
+				add_result = host->AddPlayerToGroup(cg->dpnidGroup, host_player_id, NULL, NULL, DPNADDPLAYERTOGROUP_SYNC);
+				handler_returned = true;
+			}
+			else if(dwMessageType == DPN_MSGID_ADD_PLAYER_TO_GROUP)
+			{
+				got_add_player = true;
+			}
+			
+			return DPN_OK;
+		};
+	
+	ASSERT_EQ(host->Initialize(&host_cb, &callback_shim, 0), S_OK);
+	
+	{
+		DPN_APPLICATION_DESC app_desc;
+		memset(&app_desc, 0, sizeof(app_desc));
+		
+		app_desc.dwSize = sizeof(app_desc);
+		app_desc.guidApplication = APP_GUID_1;
+		app_desc.pwszSessionName = (wchar_t*)(L"Session 1");
+		
+		DirectPlay8Address *address = new DirectPlay8Address(NULL);
+		address->SetSP(&CLSID_DP8SP_TCPIP);
+		
+		DWORD port = PORT;
+		address->AddComponent(DPNA_KEY_PORT, &port, sizeof(DWORD), DPNA_DATATYPE_DWORD);
+		
+		IDirectPlay8Address *addresses[] = { address };
+		
+		ASSERT_EQ(host->Host(&app_desc, addresses, 1, NULL, NULL, (void*)(0xB00), 0), S_OK);
+		
+		address->Release();
+	}
+	
+	DPN_GROUP_INFO group_info;
+	memset(&group_info, 0, sizeof(group_info));
+	group_info.dwSize = sizeof(group_info);
+	
+	DPNHANDLE cg_handle;
+	EXPECT_EQ(host->CreateGroup(&group_info, NULL, NULL, &cg_handle, 0), DPNSUCCESS_PENDING);
+	
+	for(int i = 0; i < 100 && !handler_returned; ++i)
+	{
+		Sleep(10);
+	}
+	
+	EXPECT_TRUE(handler_returned);
+	EXPECT_EQ(add_result, S_OK);
+	EXPECT_TRUE(got_add_player);
+	
+	host->Close(0);
+	host->Release();
+}
+
+TEST(DirectPlay8ThreadPool, SPCaps)
+{
+	/* The legacy dwNumThreads member of DPN_SP_CAPS is the same thread count. */
+	
+	ThreadPoolInstance tp;
+	
+	DirectPlay8Peer *peer = new DirectPlay8Peer(NULL);
+	ASSERT_EQ(peer->Initialize(NULL, &null_handler, 0), S_OK);
+	
+	ASSERT_EQ(tp->SetThreadCount(ALL_PROCESSORS, 3, 0), S_OK);
+	
+	DPN_SP_CAPS caps;
+	memset(&caps, 0, sizeof(caps));
+	caps.dwSize = sizeof(caps);
+	
+	ASSERT_EQ(peer->GetSPCaps(&CLSID_DP8SP_TCPIP, &caps, 0), S_OK);
+	EXPECT_EQ(caps.dwNumThreads, 3U);
+	
+	caps.dwNumThreads = 6;
+	ASSERT_EQ(peer->SetSPCaps(&CLSID_DP8SP_TCPIP, &caps, 0), S_OK);
+	
+	DWORD threads = 0;
+	EXPECT_EQ(tp->GetThreadCount(ALL_PROCESSORS, &threads, 0), S_OK);
+	EXPECT_EQ(threads, 6U);
+	
+	/* Zero is ignored rather than switching to DoWork() mode. */
+	
+	caps.dwNumThreads = 0;
+	ASSERT_EQ(peer->SetSPCaps(&CLSID_DP8SP_TCPIP, &caps, 0), S_OK);
+	
+	memset(&caps, 0, sizeof(caps));
+	caps.dwSize = sizeof(caps);
+	
+	ASSERT_EQ(peer->GetSPCaps(&CLSID_DP8SP_TCPIP, &caps, 0), S_OK);
+	EXPECT_EQ(caps.dwNumThreads, 6U);
+	
+	peer->Close(0);
+	peer->Release();
+}
@@ -0,0 +1,413 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include "../src/EventObject.hpp"
+#else
+#include <sched.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+#include "../src/IOReactor.hpp"
+
+/* Something which can be registered with an IOReactor and made ready on demand. An auto reset
+ * event object on Windows, an eventfd elsewhere.
+*/
+class Trigger
+{
+	private:
+#ifdef _WIN32
+		EventObject event;
+#else
+		int fd;
+#endif
+		
+	public:
+#ifdef _WIN32
+		Trigger(): event(FALSE, FALSE) {}
+		
+		operator IOReactor::Handle() const { return event; }
+		
+		void set() { SetEvent(event); }
+		void reset() { ResetEvent(event); }
+#else
+		Trigger(): fd(eventfd(0, EFD_NONBLOCK)) {}
+		~Trigger() { close(fd); }
+		
+		operator IOReactor::Handle() const { return fd; }
+		
+		void set() { uint64_t one = 1; write(fd, &one, sizeof(one)); }
+		void reset() { uint64_t n; read(fd, &n, sizeof(n)); }
+#endif
+};
+
+static void sleep_ms(unsigned int ms)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+TEST(IOReactor, Basic)
+{
+	Trigger t1, t2, t3;
+	IOReactor reactor(1);
+	std::atomic<int> t1_counter(0), t2_counter(0), t3_counter(0);
+	
+	reactor.add_handle(t1, [&]() { t1.reset(); if(++t1_counter < 4) { t1.set(); } });
+	reactor.add_handle(t2, [&]() { t2.reset(); if(++t2_counter < 2) { t2.set(); } });
+	reactor.add_handle(t3, [&]() { t3.reset(); ++t3_counter; });
+	
+	t1.set();
+	t2.set();
+	
+	sleep_ms(100);
+	
+	EXPECT_EQ(t1_counter, 4);
+	EXPECT_EQ(t2_counter, 2);
+	EXPECT_EQ(t3_counter, 0);
+}
+
+TEST(IOReactor, FixedThreads)
+{
+	/* Far more handles than workers, each should still be serviced. */
+	
+	const int N_HANDLES = 200;
+	
+	std::vector< std::unique_ptr<Trigger> > triggers;
+	std::unique_ptr< std::atomic<int>[] > counters(new std::atomic<int>[N_HANDLES]);
+	
+	IOReactor reactor(4);
+	
+	for(int i = 0; i < N_HANDLES; ++i)
+	{
+		triggers.emplace_back(new Trigger());
+		counters[i] = 0;
+		
+		Trigger *t = triggers.back().get();
+		std::atomic<int> *c = &(counters[i]);
+		
+		reactor.add_handle(*t, [t, c]() { t->reset(); ++(*c); });
+	}
+	
+	EXPECT_EQ(reactor.get_threads(), 4U);
+	
+	for(int i = 0; i < N_HANDLES; i += 2)
+	{
+		triggers[i]->set();
+	}
+	
+	sleep_ms(200);
+	
+	for(int i = 0; i < N_HANDLES; ++i)
+	{
+		EXPECT_EQ(counters[i], ((i % 2) == 0 ? 1 : 0)) << "Handle " << i;
+	}
+}
+
+TEST(IOReactor, CallbackConcurrent)
+{
+	Trigger t;
+	IOReactor reactor(4);
+	
+	std::atomic<int> running(0), max_running(0), calls(0);
+	
+	reactor.add_handle(t, [&]()
+	{
+		t.reset();
+		
+		int r = ++running;
+		if(r > max_running)
+		{
+			max_running = r;
+		}
+		
+		sleep_ms(50);
+		
+		++calls;
+		--running;
+	});
+	
+	for(int i = 0; i < 4; ++i)
+	{
+		t.set();
+		sleep_ms(5);
+	}
+	
+	sleep_ms(200);
+	
+	EXPECT_EQ(calls, 4);
+	EXPECT_GT(max_running, 1);
+}
+
+TEST(IOReactor, WaitForOwnHandle)
+{
+	/* A callback which waits for its own handle to be signalled again doesn't stop that
+	 * being dispatched.
+	*/
+	
+	Trigger t;
+	IOReactor reactor(2);
+	
+	std::atomic<int> calls(0);
+	std::atomic<bool> second_call(false), first_returned(false);
+	
+	reactor.add_handle(t, [&]()
+	{
+		t.reset();
+		
+		if(++calls == 1)
+		{
+			t.set();
+			
+			for(int i = 0; i < 100 && !second_call; ++i)
+			{
+				sleep_ms(5);
+			}
+			
+			first_returned = true;
+		}
+		else{
+			second_call = true;
+		}
+	});
+	
+	t.set();
+	
+	sleep_ms(200);
+	
+	EXPECT_TRUE(second_call);
+	EXPECT_TRUE(first_returned);
+	EXPECT_EQ(calls, 2);
+}
+
+TEST(IOReactor, RemoveHandle)
+{
+	Trigger t1, t2;
+	IOReactor reactor(4);
+	std::atomic<int> t1_counter(0), t2_counter(0);
+	
+	reactor.add_handle(t1, [&]() { t1.reset(); ++t1_counter; });
+	reactor.add_handle(t2, [&]() { t2.reset(); ++t2_counter; });
+	
+	t1.set();
+	t2.set();
+	
+	sleep_ms(50);
+	
+	EXPECT_EQ(t1_counter, 1);
+	EXPECT_EQ(t2_counter, 1);
+	
+	reactor.remove_handle(t1);
+	
+	t1.set();
+	t2.set();
+	
+	sleep_ms(50);
+	
+	EXPECT_EQ(t1_counter, 1);
+	EXPECT_EQ(t2_counter, 2);
+	
+	/* Removing an unknown handle is a no-op. */
+	reactor.remove_handle(t1);
+	
+	/* The handle may be registered again after being removed. */
+	t1.reset();
+	reactor.add_handle(t1, [&]() { t1.reset(); t1_counter += 10; });
+	
+	t1.set();
+	
+	sleep_ms(50);
+	
+	EXPECT_EQ(t1_counter, 11);
+}
+
+TEST(IOReactor, RemoveFromCallback)
+{
+	Trigger t;
+	IOReactor reactor(2);
+	std::atomic<int> counter(0);
+	
+	reactor.add_handle(t, [&]() { ++counter; reactor.remove_handle(t); });
+	
+	/* Not reset by the callback, but mustn't be dispatched again once removed. */
+	t.set();
+	
+	sleep_ms(100);
+	
+	EXPECT_EQ(counter, 1);
+}
+
+TEST(IOReactor, AddRemoveWhileBusy)
+{
+	/* Keep one handle firing continuously while others come and go, it should never be
+	 * held up by the registration changes.
+	*/
+	
+	Trigger busy;
+	std::atomic<int> busy_counter(0);
+	
+	IOReactor reactor(4);
+	
+	reactor.add_handle(busy, [&]() { ++busy_counter; busy.set(); });
+	busy.set();
+	
+	const int N_CYCLES = 500;
+	
+	std::atomic<int> others_counter(0);
+	
+	for(int i = 0; i < N_CYCLES; ++i)
+	{
+		Trigger t;
+		reactor.add_handle(t, [&]() { t.reset(); ++others_counter; });
+		
+		t.set();
+		
+		while(others_counter <= i)
+		{
+			std::this_thread::yield();
+		}
+		
+		reactor.remove_handle(t);
+	}
+	
+	reactor.remove_handle(busy);
+	
+	EXPECT_EQ(others_counter, N_CYCLES);
+	EXPECT_GT(busy_counter, N_CYCLES / 10);
+}
+
+TEST(IOReactor, ZeroThreadsPoll)
+{
+	Trigger t1;
+	IOReactor reactor(0);
+	
+	EXPECT_EQ(reactor.get_threads(), 0U);
+	
+	std::atomic<int> counter(0);
+	bool was_in_callback = false;
+	
+	reactor.add_handle(t1, [&]() { t1.reset(); ++counter; was_in_callback = IOReactor::in_callback(); });
+	
+	t1.set();
+	sleep_ms(100);
+	
+	/* Nothing is dispatched without a worker or poll(). */
+	EXPECT_EQ(counter, 0);
+	
+	EXPECT_TRUE(reactor.poll(1000));
+	EXPECT_EQ(counter, 1);
+	EXPECT_TRUE(was_in_callback);
+	EXPECT_FALSE(IOReactor::in_callback());
+	
+	EXPECT_FALSE(reactor.poll(0));
+	EXPECT_EQ(counter, 1);
+}
+
+TEST(IOReactor, SetThreads)
+{
+	Trigger t1;
+	IOReactor reactor(0);
+	std::atomic<int> counter(0);
+	
+	reactor.add_handle(t1, [&]() { t1.reset(); ++counter; });
+	
+	t1.set();
+	sleep_ms(100);
+	
+	EXPECT_EQ(counter, 0);
+	
+	/* Starting workers picks up what was already ready. */
+	
+	reactor.set_threads(2);
+	EXPECT_EQ(reactor.get_threads(), 2U);
+	
+	sleep_ms(100);
+	EXPECT_EQ(counter, 1);
+	
+	reactor.set_threads(3);
+	EXPECT_EQ(reactor.get_threads(), 3U);
+	
+	t1.set();
+	sleep_ms(100);
+	EXPECT_EQ(counter, 2);
+	
+	reactor.set_threads(0);
+	EXPECT_EQ(reactor.get_threads(), 0U);
+	
+	t1.set();
+	sleep_ms(100);
+	EXPECT_EQ(counter, 2);
+	
+	EXPECT_TRUE(reactor.poll(0));
+	EXPECT_EQ(counter, 3);
+}
+
+TEST(IOReactor, Affinity)
+{
+	Trigger t1;
+	IOReactor reactor(2, 0x1);
+	
+	EXPECT_EQ(reactor.get_affinity(), 0x1U);
+	
+	std::atomic<int> counter(0), wrong_cpu(0);
+	
+	reactor.add_handle(t1, [&]()
+	{
+		t1.reset();
+		
+#ifdef _WIN32
+		if(GetCurrentProcessorNumber() != 0)
+#else
+		if(sched_getcpu() != 0)
+#endif
+		{
+			++wrong_cpu;
+		}
+		
+		if(++counter < 20)
+		{
+			t1.set();
+		}
+	});
+	
+	t1.set();
+	sleep_ms(200);
+	
+	EXPECT_EQ(counter, 20);
+	EXPECT_EQ(wrong_cpu, 0);
+	
+	/* New workers get the affinity too. */
+	
+	reactor.set_threads(3);
+	
+	counter = 0;
+	t1.set();
+	sleep_ms(200);
+	
+	EXPECT_EQ(counter, 20);
+	EXPECT_EQ(wrong_cpu, 0);
+}
@@ -0,0 +1,297 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include <windows.h>
+
+#include "../src/Log.hpp"
+
+#define LOG_FILE "dplite-log-test.log"
+
+static std::vector<std::string> read_lines(const char *path)
+{
+	std::vector<std::string> lines;
+	
+	FILE *fh = fopen(path, "r");
+	if(fh == NULL)
+	{
+		return lines;
+	}
+	
+	std::string line;
+	
+	int c;
+	while((c = fgetc(fh)) != EOF)
+	{
+		if(c == '\n')
+		{
+			lines.push_back(line);
+			line.clear();
+		}
+		else{
+			line.push_back(c);
+		}
+	}
+	
+	fclose(fh);
+	
+	return lines;
+}
+
+/* Strips the "[thread=X time=Y] " prefix from a line. */
+static std::string strip_prefix(const std::string &line)
+{
+	size_t p = line.find("] ");
+	return (p != std::string::npos && line[0] == '[' && line.compare(0, 8, "[thread=") == 0)
+		? line.substr(p + 2)
+		: line;
+}
+
+class LogTest: public ::testing::Test
+{
+	protected:
+		virtual void SetUp() override
+		{
+			log_fini();
+			remove(LOG_FILE);
+			
+			_putenv_s("DPLITE_LOG", LOG_FILE);
+			_putenv_s("DPLITE_TRACE", "1");
+			
+			log_init();
+		}
+		
+		virtual void TearDown() override
+		{
+			log_fini();
+			
+			_putenv_s("DPLITE_LOG", "");
+			_putenv_s("DPLITE_LOG_LEVEL", "");
+			_putenv_s("DPLITE_TRACE", "");
+			
+			remove(LOG_FILE);
+		}
+		
+		/* Restarts logging with different settings. */
+		void reinit(const char *level, const char *trace)
+		{
+			log_fini();
+			remove(LOG_FILE);
+			
+			_putenv_s("DPLITE_LOG_LEVEL", level);
+			_putenv_s("DPLITE_TRACE", trace);
+			
+			log_init();
+		}
+};
+
+TEST_F(LogTest, Basic)
+{
+	EXPECT_TRUE(log_trace_enabled());
+	
+	log_printf("Hello %s", "world");
+	log_printf("Number %d", 1234);
+	
+	log_fini();
+	
+	std::vector<std::string> lines = read_lines(LOG_FILE);
+	
+	ASSERT_EQ(lines.size(), 2U);
+	
+	EXPECT_EQ(lines[0].compare(0, 8, "[thread="), 0);
+	EXPECT_EQ(strip_prefix(lines[0]), "Hello world");
+	EXPECT_EQ(strip_prefix(lines[1]), "Number 1234");
+}
+
+TEST_F(LogTest, LongLine)
+{
+	std::string big(5000, 'x');
+	
+	log_printf("Before");
+	log_printf("Big %s", big.c_str());
+	log_printf("After");
+	
+	log_fini();
+	
+	std::vector<std::string> lines = read_lines(LOG_FILE);
+	
+	ASSERT_EQ(lines.size(), 3U);
+	
+	EXPECT_EQ(strip_prefix(lines[0]), "Before");
+	EXPECT_EQ(strip_prefix(lines[1]), "Big " + big);
+	EXPECT_EQ(strip_prefix(lines[2]), "After");
+}
+
+TEST_F(LogTest, Threads)
+{
+	/* Lines from each thread must come out in the order they were logged. Lines may be
+	 * dropped if a thread outruns the writer, but they must be accounted for.
+	*/
+	
+	const int N_THREADS = 4;
+	const int N_LINES   = 2000;
+	
+	std::vector<std::thread> threads;
+	
+	for(int t = 0; t < N_THREADS; ++t)
+	{
+		threads.push_back(std::thread([t]()
+		{
+			for(int i = 0; i < N_LINES; ++i)
+			{
+				log_printf("%d %d", t, i);
+			}
+		}));
+	}
+	
+	for(auto t = threads.begin(); t != threads.end(); ++t)
+	{
+		t->join();
+	}
+	
+	log_fini();
+	
+	std::vector<std::string> lines = read_lines(LOG_FILE);
+	
+	int last[N_THREADS];
+	for(int t = 0; t < N_THREADS; ++t)
+	{
+		last[t] = -1;
+	}
+	
+	unsigned logged = 0, dropped = 0;
+	
+	for(auto l = lines.begin(); l != lines.end(); ++l)
+	{
+		unsigned n;
+		if(sscanf(l->c_str(), "[%u log messages dropped]", &n) == 1)
+		{
+			dropped += n;
+			continue;
+		}
+		
+		int t, i;
+		ASSERT_EQ(sscanf(strip_prefix(*l).c_str(), "%d %d", &t, &i), 2) << *l;
+		ASSERT_TRUE(t >= 0 && t < N_THREADS);
+		
+		EXPECT_GT(i, last[t]);
+		last[t] = i;
+		
+		++logged;
+	}
+	
+	EXPECT_EQ((logged + dropped), (unsigned)(N_THREADS * N_LINES));
+}
+
+TEST_F(LogTest, Disabled)
+{
+	log_fini();
+	remove(LOG_FILE);
+	
+	_putenv_s("DPLITE_LOG", "");
+	_putenv_s("DPLITE_TRACE", "");
+	
+	EXPECT_FALSE(log_trace_enabled());
+	
+	log_printf("Nobody will see this");
+	
+	log_fini();
+	
+	FILE *fh = fopen(LOG_FILE, "r");
+	EXPECT_EQ(fh, (FILE*)(NULL));
+	
+	if(fh != NULL)
+	{
+		fclose(fh);
+	}
+}
+
+TEST_F(LogTest, Levels)
+{
+	reinit("warn", "0");
+	
+	EXPECT_TRUE(log_enabled(LOG_CAT_SOCKETS, LOG_LVL_ERROR));
+	EXPECT_TRUE(log_enabled(LOG_CAT_SOCKETS, LOG_LVL_WARN));
+	EXPECT_FALSE(log_enabled(LOG_CAT_SOCKETS, LOG_LVL_INFO));
+	EXPECT_FALSE(log_enabled(LOG_CAT_SOCKETS, LOG_LVL_TRACE));
+	EXPECT_FALSE(log_trace_enabled());
+	
+	LOG_ERROR(LOG_CAT_SOCKETS, "error %d", 1);
+	LOG_WARN(LOG_CAT_GROUPS,   "warn %d",  2);
+	LOG_INFO(LOG_CAT_DISPATCH, "info %d",  3);
+	LOG_TRACE(LOG_CAT_ENUM,    "trace %d", 4);
+	
+	log_fini();
+	
+	std::vector<std::string> lines = read_lines(LOG_FILE);
+	
+	ASSERT_EQ(lines.size(), 2U);
+	
+	EXPECT_EQ(strip_prefix(lines[0]), "error 1");
+	EXPECT_NE(lines[0].find(" sockets error] "), std::string::npos) << lines[0];
+	
+	EXPECT_EQ(strip_prefix(lines[1]), "warn 2");
+	EXPECT_NE(lines[1].find(" groups warn] "), std::string::npos) << lines[1];
+}
+
+TEST_F(LogTest, TraceCategories)
+{
+	reinit("", "sockets,enum");
+	
+	EXPECT_TRUE(log_enabled(LOG_CAT_SOCKETS, LOG_LVL_TRACE));
+	EXPECT_TRUE(log_enabled(LOG_CAT_ENUM, LOG_LVL_TRACE));
+	EXPECT_FALSE(log_enabled(LOG_CAT_SENDQUEUE, LOG_LVL_TRACE));
+	EXPECT_TRUE(log_enabled(LOG_CAT_SENDQUEUE, LOG_LVL_INFO));
+	EXPECT_TRUE(log_trace_enabled());
+	
+	LOG_TRACE(LOG_CAT_SOCKETS,   "sockets");
+	LOG_TRACE(LOG_CAT_SENDQUEUE, "sendqueue");
+	LOG_TRACE(LOG_CAT_ENUM,      "enum");
+	LOG_INFO(LOG_CAT_SENDQUEUE,  "info");
+	
+	log_fini();
+	
+	std::vector<std::string> lines = read_lines(LOG_FILE);
+	
+	ASSERT_EQ(lines.size(), 3U);
+	
+	EXPECT_EQ(strip_prefix(lines[0]), "sockets");
+	EXPECT_EQ(strip_prefix(lines[1]), "enum");
+	EXPECT_EQ(strip_prefix(lines[2]), "info");
+}
+
+TEST_F(LogTest, DisabledArgsNotEvaluated)
+{
+	reinit("error", "0");
+	
+	int evaluated = 0;
+	
+	LOG_INFO(LOG_CAT_GENERAL,  "%d", ++evaluated);
+	LOG_TRACE(LOG_CAT_GENERAL, "%d", ++evaluated);
+	
+	EXPECT_EQ(evaluated, 0);
+	
+	LOG_ERROR(LOG_CAT_GENERAL, "%d", ++evaluated);
+	
+	EXPECT_EQ(evaluated, 1);
+}
@@ -80,6 +80,31 @@ TEST(PacketSerialiser, DWORD)
 	ASSERT_EQ(got, expect);
 }
 
+TEST(PacketSerialiser, Reset)
+{
+	PacketSerialiser p(0xAA);
+	p.append_dword(0xFFEEDDCC);
+	p.append_null();
+	
+	p.reset(0xBB);
+	p.append_null();
+	
+	std::pair<const void*, size_t> raw = p.raw_packet();
+	
+	const unsigned char EXPECT[] = {
+		0xBB, 0x00, 0x00, 0x00,  /* type */
+		0x08, 0x00, 0x00, 0x00,  /* value_length */
+		
+		0x00, 0x00, 0x00, 0x00,  /* type */
+		0x00, 0x00, 0x00, 0x00,  /* value_length */
+	};
+	
+	std::vector<unsigned char> got((unsigned char*)(raw.first), (unsigned char*)(raw.first) + raw.second);
+	std::vector<unsigned char> expect(EXPECT, EXPECT + sizeof(EXPECT));
+	
+	ASSERT_EQ(got, expect);
+}
+
 TEST(PacketSerialiser, Data)
 {
 	PacketSerialiser p(0x1234);
@@ -109,6 +134,85 @@ TEST(PacketSerialiser, Data)
 	ASSERT_EQ(got, expect);
 }
 
+TEST(PacketSerialiser, DataMultiBuffer)
+{
+	PacketSerialiser p(0x1234);
+	
+	const unsigned char DATA1[] = { 0x01, 0x23, 0x45 };
+	const unsigned char DATA2[] = { 0x67, 0x89, 0xAB, 0xCD, 0xEF };
+	
+	std::vector< std::pair<const void*, size_t> > buffers;
+	buffers.push_back(std::make_pair((const void*)(DATA1), sizeof(DATA1)));
+	buffers.push_back(std::make_pair((const void*)(DATA2), sizeof(DATA2)));
+	
+	p.append_data(buffers);
+	
+	std::pair<const void*, size_t> raw = p.raw_packet();
+	
+	const unsigned char EXPECT[] = {
+		0x34, 0x12, 0x00, 0x00,  /* type */
+		0x10, 0x00, 0x00, 0x00,  /* value_length */
+		
+		0x02, 0x00, 0x00, 0x00,  /* type */
+		0x08, 0x00, 0x00, 0x00,  /* value_length */
+		0x01, 0x23, 0x45, 0x67,  /* value */
+		0x89, 0xAB, 0xCD, 0xEF,
+	};
+	
+	std::vector<unsigned char> got((unsigned char*)(raw.first), (unsigned char*)(raw.first) + raw.second);
+	std::vector<unsigned char> expect(EXPECT, EXPECT + sizeof(EXPECT));
+	
+	ASSERT_EQ(got, expect);
+}
+
+TEST(PacketSerialiser, DataRef)
+{
+	PacketSerialiser p(0x1234);
+	
+	const unsigned char DATA1[] = { 0x01, 0x23, 0x45 };
+	const unsigned char DATA2[] = { 0x67, 0x89, 0xAB, 0xCD, 0xEF };
+	
+	std::vector< std::pair<const void*, size_t> > buffers;
+	buffers.push_back(std::make_pair((const void*)(DATA1), sizeof(DATA1)));
+	buffers.push_back(std::make_pair((const void*)(DATA2), sizeof(DATA2)));
+	
+	p.append_data_ref(buffers);
+	p.append_dword(0xFFEEDDCC);
+	
+	std::vector< std::pair<const void*, size_t> > raw = p.raw_packet_v();
+	
+	/* Header, DATA1, DATA2, trailing DWORD */
+	ASSERT_EQ(raw.size(), 4U);
+	
+	EXPECT_EQ(raw[1].first, (const void*)(DATA1));
+	EXPECT_EQ(raw[2].first, (const void*)(DATA2));
+	
+	const unsigned char EXPECT[] = {
+		0x34, 0x12, 0x00, 0x00,  /* type */
+		0x1C, 0x00, 0x00, 0x00,  /* value_length */
+		
+		0x02, 0x00, 0x00, 0x00,  /* type */
+		0x08, 0x00, 0x00, 0x00,  /* value_length */
+		0x01, 0x23, 0x45, 0x67,  /* value */
+		0x89, 0xAB, 0xCD, 0xEF,
+		
+		0x01, 0x00, 0x00, 0x00,  /* type */
+		0x04, 0x00, 0x00, 0x00,  /* value_length */
+		0xCC, 0xDD, 0xEE, 0xFF,  /* value */
+	};
+	
+	std::vector<unsigned char> got;
+	for(auto r = raw.begin(); r != raw.end(); ++r)
+	{
+		got.insert(got.end(), (unsigned char*)(r->first), (unsigned char*)(r->first) + r->second);
+	}
+	
+	std::vector<unsigned char> expect(EXPECT, EXPECT + sizeof(EXPECT));
+	
+	ASSERT_EQ(got, expect);
+	EXPECT_EQ(p.raw_packet_size(), sizeof(EXPECT));
+}
+
 TEST(PacketSerialiser, WString)
 {
 	PacketSerialiser p(0x1234);
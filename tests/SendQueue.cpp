@@ -21,6 +21,7 @@
 #include <windows.h>
 
 #include "../src/EventObject.hpp"
+#include "../src/Messages.hpp"
 #include "../src/packet.hpp"
 #include "../src/SendQueue.hpp"
 
@@ -66,7 +67,7 @@ TEST_F(SendQueueTest, SendSingleLow)
 		EXPECT_EQ(sqop_ptype(sqop), 0);
 		
 		sq.pop_pending(sqop);
-		delete sqop;
+		sqop->release();
 	}
 	
 	EXPECT_EQ(sq.get_pending(), (SendQueue::SendOp*)(NULL));
@@ -104,7 +105,7 @@ TEST_F(SendQueueTest, SendMultiLow)
 		EXPECT_EQ(sqop_ptype(sqop), 1);
 		
 		sq.pop_pending(sqop);
-		delete sqop;
+		sqop->release();
 	}
 	
 	{
@@ -116,7 +117,7 @@ TEST_F(SendQueueTest, SendMultiLow)
 		EXPECT_EQ(sqop_ptype(sqop), 2);
 		
 		sq.pop_pending(sqop);
-		delete sqop;
+		sqop->release();
 	}
 	
 	{
@@ -128,7 +129,7 @@ TEST_F(SendQueueTest, SendMultiLow)
 		EXPECT_EQ(sqop_ptype(sqop), 0);
 		
 		sq.pop_pending(sqop);
-		delete sqop;
+		sqop->release();
 	}
 	
 	EXPECT_EQ(sq.get_pending(), (SendQueue::SendOp*)(NULL));
@@ -159,7 +160,7 @@ TEST_F(SendQueueTest, SendMultiMedium)
 		EXPECT_EQ(sqop_ptype(sqop), 1);
 		
 		sq.pop_pending(sqop);
-		delete sqop;
+		sqop->release();
 	}
 	
 	{
@@ -171,7 +172,7 @@ TEST_F(SendQueueTest, SendMultiMedium)
 		EXPECT_EQ(sqop_ptype(sqop), 2);
 		
 		sq.pop_pending(sqop);
-		delete sqop;
+		sqop->release();
 	}
 	
 	EXPECT_EQ(sq.get_pending(), (SendQueue::SendOp*)(NULL));
@@ -202,7 +203,7 @@ TEST_F(SendQueueTest, SendMultiHigh)
 		EXPECT_EQ(sqop_ptype(sqop), 1);
 		
 		sq.pop_pending(sqop);
-		delete sqop;
+		sqop->release();
 	}
 	
 	{
@@ -214,7 +215,7 @@ TEST_F(SendQueueTest, SendMultiHigh)
 		EXPECT_EQ(sqop_ptype(sqop), 2);
 		
 		sq.pop_pending(sqop);
-		delete sqop;
+		sqop->release();
 	}
 	
 	EXPECT_EQ(sq.get_pending(), (SendQueue::SendOp*)(NULL));
@@ -257,7 +258,7 @@ TEST_F(SendQueueTest, SendMultiPriorities)
 		EXPECT_EQ(sqop_ptype(sqop), 3);
 		
 		sq.pop_pending(sqop);
-		delete sqop;
+		sqop->release();
 	}
 	
 	{
@@ -269,7 +270,7 @@ TEST_F(SendQueueTest, SendMultiPriorities)
 		EXPECT_EQ(sqop_ptype(sqop), 6);
 		
 		sq.pop_pending(sqop);
-		delete sqop;
+		sqop->release();
 	}
 	
 	{
@@ -281,7 +282,7 @@ TEST_F(SendQueueTest, SendMultiPriorities)
 		EXPECT_EQ(sqop_ptype(sqop), 2);
 		
 		sq.pop_pending(sqop);
-		delete sqop;
+		sqop->release();
 	}
 	
 	{
@@ -293,7 +294,7 @@ TEST_F(SendQueueTest, SendMultiPriorities)
 		EXPECT_EQ(sqop_ptype(sqop), 5);
 		
 		sq.pop_pending(sqop);
-		delete sqop;
+		sqop->release();
 	}
 	
 	{
@@ -305,7 +306,7 @@ TEST_F(SendQueueTest, SendMultiPriorities)
 		EXPECT_EQ(sqop_ptype(sqop), 1);
 		
 		sq.pop_pending(sqop);
-		delete sqop;
+		sqop->release();
 	}
 	
 	{
@@ -317,7 +318,7 @@ TEST_F(SendQueueTest, SendMultiPriorities)
 		EXPECT_EQ(sqop_ptype(sqop), 4);
 		
 		sq.pop_pending(sqop);
-		delete sqop;
+		sqop->release();
 	}
 	
 	EXPECT_EQ(sq.get_pending(), (SendQueue::SendOp*)(NULL));
@@ -340,7 +341,7 @@ TEST_F(SendQueueTest, RemoveQueued)
 		
 		EXPECT_EQ(sqop_ptype(sqop), 3);
 		
-		delete sqop;
+		sqop->release();
 	}
 	
 	{
@@ -349,7 +350,7 @@ TEST_F(SendQueueTest, RemoveQueued)
 		
 		EXPECT_EQ(sqop_ptype(sqop), 2);
 		
-		delete sqop;
+		sqop->release();
 	}
 	
 	{
@@ -358,7 +359,7 @@ TEST_F(SendQueueTest, RemoveQueued)
 		
 		EXPECT_EQ(sqop_ptype(sqop), 1);
 		
-		delete sqop;
+		sqop->release();
 	}
 	
 	EXPECT_EQ(sq.remove_queued(), (SendQueue::SendOp*)(NULL));
@@ -384,7 +385,7 @@ TEST_F(SendQueueTest, RemoveQueuedPending)
 		EXPECT_EQ(sqop_ptype(sqop), 3);
 		
 		sq.pop_pending(sqop);
-		delete sqop;
+		sqop->release();
 	}
 	
 	{
@@ -393,7 +394,7 @@ TEST_F(SendQueueTest, RemoveQueuedPending)
 		
 		EXPECT_EQ(sqop_ptype(sqop), 2);
 		
-		delete sqop;
+		sqop->release();
 	}
 	
 	{
@@ -403,7 +404,7 @@ TEST_F(SendQueueTest, RemoveQueuedPending)
 		EXPECT_EQ(sqop_ptype(sqop), 1);
 		
 		sq.pop_pending(sqop);
-		delete sqop;
+		sqop->release();
 	}
 	
 	EXPECT_EQ(sq.remove_queued(), (SendQueue::SendOp*)(NULL));
@@ -442,7 +443,7 @@ TEST_F(SendQueueTest, RemoveQueuedByHandle)
 		
 		EXPECT_EQ(sqop_ptype(sqop), 1);
 		
-		delete sqop;
+		sqop->release();
 		
 		EXPECT_EQ(sq.remove_queued_by_handle(1), (SendQueue::SendOp*)(NULL));
 	}
@@ -453,7 +454,7 @@ TEST_F(SendQueueTest, RemoveQueuedByHandle)
 		
 		EXPECT_EQ(sqop_ptype(sqop), 2);
 		
-		delete sqop;
+		sqop->release();
 		
 		EXPECT_EQ(sq.remove_queued_by_handle(2), (SendQueue::SendOp*)(NULL));
 	}
@@ -464,7 +465,7 @@ TEST_F(SendQueueTest, RemoveQueuedByHandle)
 		
 		EXPECT_EQ(sqop_ptype(sqop), 3);
 		
-		delete sqop;
+		sqop->release();
 		
 		EXPECT_EQ(sq.remove_queued_by_handle(3), (SendQueue::SendOp*)(NULL));
 	}
@@ -489,7 +490,7 @@ TEST_F(SendQueueTest, RemoveQueuedByPriority)
 		
 		EXPECT_EQ(sqop_ptype(sqop), 1);
 		
-		delete sqop;
+		sqop->release();
 	}
 	
 	{
@@ -500,7 +501,7 @@ TEST_F(SendQueueTest, RemoveQueuedByPriority)
 		
 		EXPECT_EQ(sqop_ptype(sqop), 2);
 		
-		delete sqop;
+		sqop->release();
 	}
 	
 	{
@@ -511,7 +512,7 @@ TEST_F(SendQueueTest, RemoveQueuedByPriority)
 		
 		EXPECT_EQ(sqop_ptype(sqop), 3);
 		
-		delete sqop;
+		sqop->release();
 	}
 }
 
@@ -530,3 +531,633 @@ TEST_F(SendQueueTest, RemoveQueuedByPriorityNoHandle)
 	EXPECT_EQ(sq.remove_queued_by_priority(SendQueue::SEND_PRI_MEDIUM), (SendQueue::SendOp*)(NULL));
 	EXPECT_EQ(sq.remove_queued_by_priority(SendQueue::SEND_PRI_HIGH),   (SendQueue::SendOp*)(NULL));
 }
+
+TEST_F(SendQueueTest, PartialSendDataRef)
+{
+	const unsigned char DATA1[] = { 0x01, 0x23, 0x45 };
+	const unsigned char DATA2[] = { 0x67, 0x89, 0xAB, 0xCD, 0xEF };
+	
+	std::vector< std::pair<const void*, size_t> > buffers;
+	buffers.push_back(std::make_pair((const void*)(DATA1), sizeof(DATA1)));
+	buffers.push_back(std::make_pair((const void*)(DATA2), sizeof(DATA2)));
+	
+	PacketSerialiser p(1);
+	p.append_data_ref(buffers);
+	
+	sq.send(SendQueue::SEND_PRI_LOW, p, NULL,
+		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+	
+	SendQueue::SendOp *sqop = sq.get_pending();
+	ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	
+	EXPECT_EQ(sqop->get_data_size(), 24U);
+	EXPECT_EQ(sqop->get_pending_size(), 24U);
+	
+	WSABUF bufs[4];
+	
+	ASSERT_EQ(sqop->get_pending_data(bufs, 4), 3U);
+	EXPECT_EQ(bufs[0].len, 16U);
+	EXPECT_EQ(bufs[1].buf, (char*)(DATA1));
+	EXPECT_EQ(bufs[1].len, sizeof(DATA1));
+	EXPECT_EQ(bufs[2].buf, (char*)(DATA2));
+	EXPECT_EQ(bufs[2].len, sizeof(DATA2));
+	
+	/* Send part way into the second buffer. */
+	sqop->inc_sent_data(18);
+	
+	EXPECT_EQ(sqop->get_pending_size(), 6U);
+	
+	ASSERT_EQ(sqop->get_pending_data(bufs, 4), 2U);
+	EXPECT_EQ(bufs[0].buf, (char*)(DATA1 + 2));
+	EXPECT_EQ(bufs[0].len, 1U);
+	EXPECT_EQ(bufs[1].buf, (char*)(DATA2));
+	EXPECT_EQ(bufs[1].len, sizeof(DATA2));
+	
+	/* Only fill in as many buffers as we are given. */
+	ASSERT_EQ(sqop->get_pending_data(bufs, 1), 1U);
+	
+	sqop->inc_sent_data(6);
+	
+	EXPECT_EQ(sqop->get_pending_size(), 0U);
+	EXPECT_EQ(sqop->get_pending_data(bufs, 4), 0U);
+	
+	sq.pop_pending(sqop);
+	sqop->release();
+}
+
+TEST_F(SendQueueTest, SendShared)
+{
+	EventObject event2;
+	SendQueue sq2(event2);
+	
+	std::shared_ptr<PacketSerialiser> p = std::make_shared<PacketSerialiser>(1);
+	p->append_dword(0xFFEEDDCC);
+	
+	sq.send(SendQueue::SEND_PRI_LOW, p, NULL,
+		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+	
+	sq2.send(SendQueue::SEND_PRI_HIGH, p, NULL,
+		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+	
+	SendQueue::SendOp *sqop1 = sq.get_pending();
+	ASSERT_NE(sqop1, (SendQueue::SendOp*)(NULL));
+	
+	SendQueue::SendOp *sqop2 = sq2.get_pending();
+	ASSERT_NE(sqop2, (SendQueue::SendOp*)(NULL));
+	
+	/* Both ops should be sending from the same buffer... */
+	EXPECT_EQ(sqop1->get_data().first, sqop2->get_data().first);
+	
+	/* ...but track their progress independently. */
+	sqop1->inc_sent_data(4);
+	
+	EXPECT_EQ(sqop1->get_pending_size(), 16U);
+	EXPECT_EQ(sqop2->get_pending_size(), 20U);
+	
+	sq.pop_pending(sqop1);
+	sqop1->release();
+	
+	/* The packet must outlive the first op. */
+	EXPECT_EQ(sqop_ptype(sqop2), 1);
+	
+	sq2.pop_pending(sqop2);
+	sqop2->release();
+}
+
+TEST_F(SendQueueTest, GetNextPending)
+{
+	sq.send(SendQueue::SEND_PRI_LOW, PacketSerialiser(1), NULL, 1,
+		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+	
+	sq.send(SendQueue::SEND_PRI_HIGH, PacketSerialiser(2), NULL, 2,
+		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+	
+	sq.send(SendQueue::SEND_PRI_LOW, PacketSerialiser(3), NULL, 3,
+		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+	
+	SendQueue::SendOp *sqop1 = sq.get_pending();
+	ASSERT_NE(sqop1, (SendQueue::SendOp*)(NULL));
+	EXPECT_EQ(sqop_ptype(sqop1), 2);
+	
+	SendQueue::SendOp *sqop2 = sq.get_next_pending(sqop1);
+	ASSERT_NE(sqop2, (SendQueue::SendOp*)(NULL));
+	EXPECT_EQ(sqop_ptype(sqop2), 1);
+	
+	/* Asking again gives the same answer. */
+	EXPECT_EQ(sq.get_next_pending(sqop1), sqop2);
+	EXPECT_EQ(sq.get_pending(), sqop1);
+	
+	/* Taken SendOps are in progress and can't be removed. */
+	EXPECT_TRUE(sq.handle_is_pending(1));
+	EXPECT_TRUE(sq.handle_is_pending(2));
+	EXPECT_FALSE(sq.handle_is_pending(3));
+	
+	EXPECT_EQ(sq.remove_queued_by_handle(1), (SendQueue::SendOp*)(NULL));
+	
+	/* A message queued now at a higher priority doesn't overtake ones already taken. */
+	sq.send(SendQueue::SEND_PRI_HIGH, PacketSerialiser(4), NULL, 4,
+		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+	
+	SendQueue::SendOp *sqop3 = sq.get_next_pending(sqop2);
+	ASSERT_NE(sqop3, (SendQueue::SendOp*)(NULL));
+	EXPECT_EQ(sqop_ptype(sqop3), 4);
+	
+	sq.pop_pending(sqop1);
+	sqop1->release();
+	
+	EXPECT_EQ(sq.get_pending(), sqop2);
+	
+	sq.pop_pending(sqop2);
+	sqop2->release();
+	
+	sq.pop_pending(sqop3);
+	sqop3->release();
+	
+	SendQueue::SendOp *sqop4 = sq.get_pending();
+	ASSERT_NE(sqop4, (SendQueue::SendOp*)(NULL));
+	EXPECT_EQ(sqop_ptype(sqop4), 3);
+	
+	EXPECT_EQ(sq.get_next_pending(sqop4), (SendQueue::SendOp*)(NULL));
+	
+	sq.pop_pending(sqop4);
+	sqop4->release();
+	
+	EXPECT_EQ(sq.get_pending(), (SendQueue::SendOp*)(NULL));
+}
+
+TEST_F(SendQueueTest, QueuedCounts)
+{
+	PacketSerialiser p1(1);
+	PacketSerialiser p2(2);
+	p2.append_dword(0);
+	
+	const size_t p1_size = p1.raw_packet_size();
+	const size_t p2_size = p2.raw_packet_size();
+	
+	sq.send(SendQueue::SEND_PRI_LOW, p1, NULL, 1,
+		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+	
+	sq.send(SendQueue::SEND_PRI_LOW, p2, NULL, 2,
+		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+	
+	sq.send(SendQueue::SEND_PRI_HIGH, p2, NULL, 3,
+		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+	
+	EXPECT_EQ(sq.get_queued_msgs(SendQueue::SEND_PRI_LOW),     2U);
+	EXPECT_EQ(sq.get_queued_bytes(SendQueue::SEND_PRI_LOW),    p1_size + p2_size);
+	EXPECT_EQ(sq.get_queued_msgs(SendQueue::SEND_PRI_MEDIUM),  0U);
+	EXPECT_EQ(sq.get_queued_bytes(SendQueue::SEND_PRI_MEDIUM), 0U);
+	EXPECT_EQ(sq.get_queued_msgs(SendQueue::SEND_PRI_HIGH),    1U);
+	EXPECT_EQ(sq.get_queued_bytes(SendQueue::SEND_PRI_HIGH),   p2_size);
+	
+	/* Messages are counted until they have been sent... */
+	
+	SendQueue::SendOp *sqop = sq.get_pending();
+	ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	
+	EXPECT_EQ(sq.get_queued_msgs(SendQueue::SEND_PRI_HIGH), 1U);
+	
+	sq.pop_pending(sqop);
+	sqop->release();
+	
+	EXPECT_EQ(sq.get_queued_msgs(SendQueue::SEND_PRI_HIGH),  0U);
+	EXPECT_EQ(sq.get_queued_bytes(SendQueue::SEND_PRI_HIGH), 0U);
+	
+	/* ...or removed. */
+	
+	sqop = sq.remove_queued_by_handle(1);
+	ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	sqop->release();
+	
+	EXPECT_EQ(sq.get_queued_msgs(SendQueue::SEND_PRI_LOW),  1U);
+	EXPECT_EQ(sq.get_queued_bytes(SendQueue::SEND_PRI_LOW), p2_size);
+	
+	sqop = sq.remove_queued_by_priority(SendQueue::SEND_PRI_LOW);
+	ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	sqop->release();
+	
+	EXPECT_EQ(sq.get_queued_msgs(SendQueue::SEND_PRI_LOW),  0U);
+	EXPECT_EQ(sq.get_queued_bytes(SendQueue::SEND_PRI_LOW), 0U);
+}
+
+TEST_F(SendQueueTest, RemoveQueuedByHandleMany)
+{
+	/* Enough SendOps to grow the handle index a few times. */
+	
+	const DPNHANDLE N_OPS = 1000;
+	
+	for(DPNHANDLE h = 1; h <= N_OPS; ++h)
+	{
+		sq.send(SendQueue::SEND_PRI_LOW, PacketSerialiser(h), NULL, h,
+			[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+	}
+	
+	/* Take the first one so it is pending rather than queued. */
+	
+	SendQueue::SendOp *sqop1 = sq.get_pending();
+	ASSERT_NE(sqop1, (SendQueue::SendOp*)(NULL));
+	
+	EXPECT_EQ(sqop1->get_async_handle(), 1U);
+	EXPECT_TRUE(sq.handle_is_pending(1));
+	EXPECT_EQ(sq.remove_queued_by_handle(1), (SendQueue::SendOp*)(NULL));
+	
+	for(DPNHANDLE h = N_OPS; h > 1; h -= 2)
+	{
+		EXPECT_FALSE(sq.handle_is_pending(h));
+		
+		SendQueue::SendOp *sqop = sq.remove_queued_by_handle(h);
+		ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+		
+		EXPECT_EQ(sqop_ptype(sqop), h);
+		
+		sqop->release();
+		
+		EXPECT_EQ(sq.remove_queued_by_handle(h), (SendQueue::SendOp*)(NULL));
+	}
+	
+	EXPECT_EQ(sq.get_queued_msgs(SendQueue::SEND_PRI_LOW), (size_t)(N_OPS / 2));
+	
+	/* The rest are still sent in order. */
+	
+	sq.pop_pending(sqop1);
+	sqop1->release();
+	
+	EXPECT_FALSE(sq.handle_is_pending(1));
+	
+	for(DPNHANDLE h = 3; h < N_OPS; h += 2)
+	{
+		SendQueue::SendOp *sqop = sq.get_pending();
+		ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+		
+		EXPECT_EQ(sqop_ptype(sqop), h);
+		
+		sq.pop_pending(sqop);
+		sqop->release();
+	}
+	
+	EXPECT_EQ(sq.get_pending(), (SendQueue::SendOp*)(NULL));
+}
+
+TEST_F(SendQueueTest, ReuseSendOp)
+{
+	sq.send(SendQueue::SEND_PRI_LOW, PacketSerialiser(1), NULL, 1,
+		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+	
+	SendQueue::SendOp *sqop1 = sq.get_pending();
+	ASSERT_NE(sqop1, (SendQueue::SendOp*)(NULL));
+	
+	sq.pop_pending(sqop1);
+	sqop1->release();
+	
+	/* A released SendOp is reused for the next message. */
+	
+	sq.send(SendQueue::SEND_PRI_HIGH, PacketSerialiser(2), NULL, 2,
+		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+	
+	EXPECT_FALSE(sq.handle_is_pending(1));
+	EXPECT_EQ(sq.remove_queued_by_handle(1), (SendQueue::SendOp*)(NULL));
+	
+	SendQueue::SendOp *sqop2 = sq.get_pending();
+	ASSERT_NE(sqop2, (SendQueue::SendOp*)(NULL));
+	
+	EXPECT_EQ(sqop2, sqop1);
+	EXPECT_EQ(sqop_ptype(sqop2), 2U);
+	EXPECT_EQ(sqop2->get_async_handle(), 2U);
+	EXPECT_EQ(sqop2->get_pending_size(), sqop2->get_data_size());
+	
+	sq.pop_pending(sqop2);
+	sqop2->release();
+}
+
+TEST_F(SendQueueTest, ReleaseAfterDestroy)
+{
+	/* SendOps may be released after the queue they came from has been destroyed. */
+	
+	bool called = false;
+	
+	SendQueue::SendOp *sqop;
+	
+	{
+		SendQueue tsq(event);
+		
+		tsq.send(SendQueue::SEND_PRI_LOW, PacketSerialiser(1), NULL, 1,
+			[&called](std::unique_lock<std::mutex> &l, HRESULT result) { called = true; });
+		
+		tsq.send(SendQueue::SEND_PRI_LOW, PacketSerialiser(2), NULL, 2,
+			[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		
+		sqop = tsq.remove_queued_by_handle(1);
+		ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	}
+	
+	std::mutex m;
+	std::unique_lock<std::mutex> l(m);
+	
+	sqop->invoke_callback(l, DPNERR_USERCANCEL);
+	sqop->release();
+	
+	EXPECT_TRUE(called);
+}
+
+class SendQueueCoalesceTest: public SendQueueTest {
+	protected:
+		SendQueue csq;
+		
+		SendQueueCoalesceTest(): csq(event, true) {}
+		
+		void send_dword(SendQueue::SendPriority priority, uint32_t type, DWORD value, DPNHANDLE handle = 0, bool hold = false, std::vector<uint32_t> *completed = NULL)
+		{
+			std::shared_ptr<PacketSerialiser> p = std::make_shared<PacketSerialiser>(type);
+			p->append_dword(value);
+			
+			csq.send(priority, p, NULL, handle,
+				[completed, type](std::unique_lock<std::mutex> &l, HRESULT result)
+				{
+					if(completed != NULL)
+					{
+						completed->push_back(type);
+					}
+				}, hold);
+		}
+};
+
+TEST_F(SendQueueCoalesceTest, Batch)
+{
+	send_dword(SendQueue::SEND_PRI_LOW, 1, 0x11111111);
+	send_dword(SendQueue::SEND_PRI_LOW, 2, 0x22222222);
+	send_dword(SendQueue::SEND_PRI_LOW, 3, 0x33333333);
+	
+	SendQueue::SendOp *sqop = csq.get_pending();
+	ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	
+	EXPECT_EQ(csq.get_pending(), sqop);
+	
+	std::pair<const void*, size_t> data = sqop->get_data();
+	PacketDeserialiser pd(data.first, data.second);
+	
+	EXPECT_EQ(pd.packet_type(), DPLITE_MSGID_COALESCED);
+	ASSERT_EQ(pd.num_fields(), 3U);
+	
+	for(size_t i = 0; i < 3; ++i)
+	{
+		std::pair<const void*, size_t> inner_data = pd.get_data(i);
+		PacketDeserialiser inner(inner_data.first, inner_data.second);
+		
+		EXPECT_EQ(inner.packet_type(), (uint32_t)(i + 1));
+		EXPECT_EQ(inner.get_dword(0), (DWORD)(0x11111111 * (i + 1)));
+	}
+	
+	csq.pop_pending(sqop);
+	sqop->release();
+	
+	EXPECT_EQ(csq.get_pending(), (SendQueue::SendOp*)(NULL));
+}
+
+TEST_F(SendQueueCoalesceTest, Single)
+{
+	/* A lone packet should be sent as-is. */
+	
+	send_dword(SendQueue::SEND_PRI_LOW, 1, 0);
+	
+	SendQueue::SendOp *sqop = csq.get_pending();
+	ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	
+	EXPECT_EQ(sqop_ptype(sqop), 1U);
+	
+	csq.pop_pending(sqop);
+	sqop->release();
+}
+
+TEST_F(SendQueueCoalesceTest, Priorities)
+{
+	/* Packets of different priorities are never combined. */
+	
+	send_dword(SendQueue::SEND_PRI_LOW,  1, 0);
+	send_dword(SendQueue::SEND_PRI_HIGH, 2, 0);
+	send_dword(SendQueue::SEND_PRI_LOW,  3, 0);
+	
+	SendQueue::SendOp *sqop = csq.get_pending();
+	ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	EXPECT_EQ(sqop_ptype(sqop), 2U);
+	csq.pop_pending(sqop);
+	sqop->release();
+	
+	sqop = csq.get_pending();
+	ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	EXPECT_EQ(sqop_ptype(sqop), DPLITE_MSGID_COALESCED);
+	csq.pop_pending(sqop);
+	sqop->release();
+}
+
+TEST_F(SendQueueCoalesceTest, LargeNotCoalesced)
+{
+	std::vector<unsigned char> big(SendQueue::COALESCE_MAX_PACKET + 1, 0xAA);
+	
+	send_dword(SendQueue::SEND_PRI_LOW, 1, 0);
+	
+	PacketSerialiser p(2);
+	p.append_data(big.data(), big.size());
+	csq.send(SendQueue::SEND_PRI_LOW, p, NULL,
+		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+	
+	send_dword(SendQueue::SEND_PRI_LOW, 3, 0);
+	
+	for(uint32_t type = 1; type <= 3; ++type)
+	{
+		SendQueue::SendOp *sqop = csq.get_pending();
+		ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+		EXPECT_EQ(sqop_ptype(sqop), type);
+		csq.pop_pending(sqop);
+		sqop->release();
+	}
+	
+	EXPECT_EQ(csq.get_pending(), (SendQueue::SendOp*)(NULL));
+}
+
+TEST_F(SendQueueCoalesceTest, MaxSize)
+{
+	/* Enough packets to fill more than one batch. */
+	
+	PacketSerialiser p(1);
+	p.append_dword(0);
+	
+	const size_t packet_size = p.raw_packet_size();
+	const size_t n_packets   = (SendQueue::COALESCE_MAX_SIZE / packet_size) + 10;
+	
+	for(size_t i = 0; i < n_packets; ++i)
+	{
+		send_dword(SendQueue::SEND_PRI_LOW, 1, i);
+	}
+	
+	size_t n_batched = 0;
+	
+	SendQueue::SendOp *sqop = csq.get_pending();
+	ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	
+	{
+		std::pair<const void*, size_t> data = sqop->get_data();
+		PacketDeserialiser pd(data.first, data.second);
+		
+		EXPECT_EQ(pd.packet_type(), DPLITE_MSGID_COALESCED);
+		
+		n_batched += pd.num_fields();
+	}
+	
+	EXPECT_EQ(n_batched, SendQueue::COALESCE_MAX_SIZE / packet_size);
+	
+	csq.pop_pending(sqop);
+	sqop->release();
+	
+	/* The rest go in the next one. */
+	
+	while((sqop = csq.get_pending()) != NULL)
+	{
+		std::pair<const void*, size_t> data = sqop->get_data();
+		PacketDeserialiser pd(data.first, data.second);
+		
+		n_batched += (pd.packet_type() == DPLITE_MSGID_COALESCED ? pd.num_fields() : 1);
+		
+		csq.pop_pending(sqop);
+		sqop->release();
+	}
+	
+	EXPECT_EQ(n_batched, n_packets);
+}
+
+TEST_F(SendQueueCoalesceTest, Hold)
+{
+	send_dword(SendQueue::SEND_PRI_LOW, 1, 0, 0, true);
+	send_dword(SendQueue::SEND_PRI_LOW, 2, 0, 0, true);
+	
+	/* Held packets don't wake the sender... */
+	EXPECT_FALSE(event_signalled());
+	EXPECT_EQ(csq.get_pending(), (SendQueue::SendOp*)(NULL));
+	
+	/* ...until they are flushed. */
+	EXPECT_TRUE(csq.flush());
+	EXPECT_TRUE(event_signalled());
+	EXPECT_FALSE(csq.flush());
+	
+	SendQueue::SendOp *sqop = csq.get_pending();
+	ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	
+	std::pair<const void*, size_t> data = sqop->get_data();
+	PacketDeserialiser pd(data.first, data.second);
+	
+	EXPECT_EQ(pd.packet_type(), DPLITE_MSGID_COALESCED);
+	EXPECT_EQ(pd.num_fields(), 2U);
+	
+	csq.pop_pending(sqop);
+	sqop->release();
+}
+
+TEST_F(SendQueueCoalesceTest, HoldReleasedBySend)
+{
+	send_dword(SendQueue::SEND_PRI_LOW, 1, 0, 0, true);
+	
+	EXPECT_FALSE(event_signalled());
+	
+	/* A packet which isn't held releases any held ones before it. */
+	send_dword(SendQueue::SEND_PRI_LOW, 2, 0);
+	
+	EXPECT_TRUE(event_signalled());
+	
+	SendQueue::SendOp *sqop = csq.get_pending();
+	ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	
+	std::pair<const void*, size_t> data = sqop->get_data();
+	PacketDeserialiser pd(data.first, data.second);
+	
+	EXPECT_EQ(pd.packet_type(), DPLITE_MSGID_COALESCED);
+	EXPECT_EQ(pd.num_fields(), 2U);
+	
+	csq.pop_pending(sqop);
+	sqop->release();
+}
+
+TEST_F(SendQueueCoalesceTest, HoldReleasedBySize)
+{
+	PacketSerialiser p(1);
+	p.append_dword(0);
+	
+	for(size_t held_size = 0; held_size < SendQueue::COALESCE_MAX_SIZE; held_size += p.raw_packet_size())
+	{
+		EXPECT_FALSE(event_signalled());
+		send_dword(SendQueue::SEND_PRI_LOW, 1, 0, 0, true);
+	}
+	
+	EXPECT_TRUE(event_signalled());
+	EXPECT_NE(csq.get_pending(), (SendQueue::SendOp*)(NULL));
+}
+
+TEST_F(SendQueueCoalesceTest, Callbacks)
+{
+	std::vector<uint32_t> completed;
+	
+	send_dword(SendQueue::SEND_PRI_LOW, 1, 0, (DPNHANDLE)(0x100), false, &completed);
+	send_dword(SendQueue::SEND_PRI_LOW, 2, 0, (DPNHANDLE)(0x200), false, &completed);
+	send_dword(SendQueue::SEND_PRI_LOW, 3, 0, (DPNHANDLE)(0x300), false, &completed);
+	
+	SendQueue::SendOp *sqop = csq.get_pending();
+	ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	
+	/* Every message in the batch is in progress. */
+	EXPECT_TRUE(csq.handle_is_pending((DPNHANDLE)(0x100)));
+	EXPECT_TRUE(csq.handle_is_pending((DPNHANDLE)(0x200)));
+	EXPECT_TRUE(csq.handle_is_pending((DPNHANDLE)(0x300)));
+	EXPECT_FALSE(csq.handle_is_pending((DPNHANDLE)(0x400)));
+	
+	EXPECT_EQ(csq.get_queued_msgs(SendQueue::SEND_PRI_LOW), 3U);
+	
+	csq.pop_pending(sqop);
+	
+	EXPECT_FALSE(csq.handle_is_pending((DPNHANDLE)(0x100)));
+	
+	std::mutex m;
+	std::unique_lock<std::mutex> l(m);
+	
+	sqop->invoke_callback(l, S_OK);
+	sqop->release();
+	
+	std::vector<uint32_t> expect = { 1, 2, 3 };
+	EXPECT_EQ(completed, expect);
+	
+	/* Every message in the batch has been sent. */
+	EXPECT_EQ(csq.get_queued_msgs(SendQueue::SEND_PRI_LOW),  0U);
+	EXPECT_EQ(csq.get_queued_bytes(SendQueue::SEND_PRI_LOW), 0U);
+}
+
+TEST_F(SendQueueCoalesceTest, RemoveQueuedFromHeld)
+{
+	send_dword(SendQueue::SEND_PRI_LOW, 1, 0, (DPNHANDLE)(0x100), true);
+	send_dword(SendQueue::SEND_PRI_LOW, 2, 0, (DPNHANDLE)(0x200), true);
+	send_dword(SendQueue::SEND_PRI_LOW, 3, 0, (DPNHANDLE)(0x300), true);
+	
+	/* A held SendOp can be cancelled without disturbing the others. */
+	
+	SendQueue::SendOp *sqop = csq.remove_queued_by_handle((DPNHANDLE)(0x200));
+	ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	sqop->release();
+	
+	EXPECT_EQ(csq.get_pending(), (SendQueue::SendOp*)(NULL));
+	EXPECT_TRUE(csq.flush());
+	
+	sqop = csq.get_pending();
+	ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	
+	std::pair<const void*, size_t> data = sqop->get_data();
+	PacketDeserialiser pd(data.first, data.second);
+	
+	EXPECT_EQ(pd.packet_type(), DPLITE_MSGID_COALESCED);
+	EXPECT_EQ(pd.num_fields(), 2U);
+	
+	EXPECT_TRUE(csq.handle_is_pending((DPNHANDLE)(0x100)));
+	EXPECT_FALSE(csq.handle_is_pending((DPNHANDLE)(0x200)));
+	EXPECT_TRUE(csq.handle_is_pending((DPNHANDLE)(0x300)));
+	
+	csq.pop_pending(sqop);
+	sqop->release();
+	
+	EXPECT_EQ(csq.get_queued_msgs(SendQueue::SEND_PRI_LOW), 0U);
+	EXPECT_FALSE(csq.flush());
+}
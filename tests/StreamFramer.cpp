@@ -0,0 +1,271 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <algorithm>
+#include <gtest/gtest.h>
+#include <string.h>
+#include <vector>
+
+#include "../src/BufferPool.hpp"
+#include "../src/network.hpp"
+#include "../src/packet.hpp"
+#include "../src/StreamFramer.hpp"
+
+/* Builds a packet of the given type with a DATA field of data_size bytes. */
+static std::vector<unsigned char> make_packet(uint32_t type, size_t data_size)
+{
+	std::vector<unsigned char> data(data_size, (unsigned char)(type));
+	
+	PacketSerialiser p(type);
+	p.append_data(data.data(), data.size());
+	
+	std::pair<const void*, size_t> raw = p.raw_packet();
+	return std::vector<unsigned char>((const unsigned char*)(raw.first), (const unsigned char*)(raw.first) + raw.second);
+}
+
+/* Feeds up to size bytes into the framer, returns the number of bytes consumed. */
+static size_t feed(StreamFramer &sf, const unsigned char *data, size_t size)
+{
+	std::pair<unsigned char*, size_t> space = sf.write_space();
+	EXPECT_GT(space.second, 0U);
+	
+	size_t n = std::min(size, space.second);
+	
+	memcpy(space.first, data, n);
+	sf.commit(n);
+	
+	return n;
+}
+
+static uint32_t frame_type(const unsigned char *frame, size_t size)
+{
+	PacketDeserialiser pd(frame, size);
+	return pd.packet_type();
+}
+
+TEST(StreamFramer, Empty)
+{
+	BufferPool pool;
+	StreamFramer sf(pool);
+	
+	const unsigned char *frame;
+	size_t size;
+	
+	EXPECT_EQ(sf.next_frame(&frame, &size), StreamFramer::FRAME_PARTIAL);
+	EXPECT_EQ(sf.pending(), 0U);
+}
+
+TEST(StreamFramer, ManyFramesOneRead)
+{
+	BufferPool pool;
+	StreamFramer sf(pool);
+	
+	std::vector<unsigned char> stream;
+	for(uint32_t i = 1; i <= 100; ++i)
+	{
+		std::vector<unsigned char> p = make_packet(i, 10);
+		stream.insert(stream.end(), p.begin(), p.end());
+	}
+	
+	ASSERT_EQ(feed(sf, stream.data(), stream.size()), stream.size());
+	
+	const unsigned char *frame;
+	size_t size;
+	
+	const unsigned char *last_frame = NULL;
+	
+	for(uint32_t i = 1; i <= 100; ++i)
+	{
+		ASSERT_EQ(sf.next_frame(&frame, &size), StreamFramer::FRAME_READY);
+		EXPECT_EQ(size, 26U);
+		EXPECT_EQ(frame_type(frame, size), i);
+		
+		/* Frames should be returned in place, not shifted to the front. */
+		if(last_frame != NULL)
+		{
+			EXPECT_EQ(frame, last_frame + 26);
+		}
+		
+		last_frame = frame;
+		
+		sf.pop_frame();
+	}
+	
+	EXPECT_EQ(sf.next_frame(&frame, &size), StreamFramer::FRAME_PARTIAL);
+	EXPECT_EQ(sf.pending(), 0U);
+}
+
+TEST(StreamFramer, ByteAtATime)
+{
+	BufferPool pool;
+	StreamFramer sf(pool);
+	
+	std::vector<unsigned char> stream  = make_packet(1, 100);
+	std::vector<unsigned char> stream2 = make_packet(2, 5);
+	stream.insert(stream.end(), stream2.begin(), stream2.end());
+	
+	const unsigned char *frame;
+	size_t size;
+	
+	uint32_t next_type = 1;
+	
+	for(size_t i = 0; i < stream.size(); ++i)
+	{
+		feed(sf, stream.data() + i, 1);
+		
+		if(sf.next_frame(&frame, &size) == StreamFramer::FRAME_READY)
+		{
+			EXPECT_EQ(frame_type(frame, size), next_type);
+			++next_type;
+			
+			sf.pop_frame();
+		}
+	}
+	
+	EXPECT_EQ(next_type, 3U);
+}
+
+TEST(StreamFramer, PartialFrameAtEndOfBuffer)
+{
+	BufferPool pool;
+	StreamFramer sf(pool);
+	
+	/* Fill the buffer with one packet which exactly fits, minus 100 bytes,
+	 * followed by the start of another which doesn't.
+	*/
+	std::vector<unsigned char> stream = make_packet(1, BufferPool::MIN_SIZE - 16 - 100);
+	std::vector<unsigned char> p2     = make_packet(2, 1000);
+	stream.insert(stream.end(), p2.begin(), p2.end());
+	
+	size_t fed = feed(sf, stream.data(), stream.size());
+	ASSERT_EQ(fed, BufferPool::MIN_SIZE);
+	
+	const unsigned char *frame;
+	size_t size;
+	
+	ASSERT_EQ(sf.next_frame(&frame, &size), StreamFramer::FRAME_READY);
+	EXPECT_EQ(frame_type(frame, size), 1U);
+	sf.pop_frame();
+	
+	EXPECT_EQ(sf.next_frame(&frame, &size), StreamFramer::FRAME_PARTIAL);
+	EXPECT_EQ(sf.pending(), 100U);
+	
+	/* The partial packet should be moved to the front to make room for the rest. */
+	fed += feed(sf, stream.data() + fed, stream.size() - fed);
+	ASSERT_EQ(fed, stream.size());
+	
+	ASSERT_EQ(sf.next_frame(&frame, &size), StreamFramer::FRAME_READY);
+	EXPECT_EQ(frame_type(frame, size), 2U);
+	EXPECT_EQ(memcmp(frame, p2.data(), p2.size()), 0);
+	sf.pop_frame();
+}
+
+TEST(StreamFramer, GrowForLargeFrame)
+{
+	BufferPool pool;
+	StreamFramer sf(pool);
+	
+	std::vector<unsigned char> stream = make_packet(1, 100000);
+	
+	size_t fed = 0;
+	while(fed < stream.size())
+	{
+		const unsigned char *frame;
+		size_t size;
+		
+		EXPECT_EQ(sf.next_frame(&frame, &size), StreamFramer::FRAME_PARTIAL);
+		
+		fed += feed(sf, stream.data() + fed, stream.size() - fed);
+	}
+	
+	const unsigned char *frame;
+	size_t size;
+	
+	ASSERT_EQ(sf.next_frame(&frame, &size), StreamFramer::FRAME_READY);
+	ASSERT_EQ(size, stream.size());
+	EXPECT_EQ(memcmp(frame, stream.data(), stream.size()), 0);
+	sf.pop_frame();
+}
+
+TEST(StreamFramer, Oversize)
+{
+	BufferPool pool;
+	StreamFramer sf(pool);
+	
+	const unsigned char HEADER[] = {
+		0x01, 0x00, 0x00, 0x00,  /* type */
+		0xFF, 0xFF, 0xFF, 0xFF,  /* value_length */
+	};
+	
+	feed(sf, HEADER, sizeof(HEADER));
+	
+	const unsigned char *frame;
+	size_t size;
+	
+	EXPECT_EQ(sf.next_frame(&frame, &size), StreamFramer::FRAME_OVERSIZE);
+}
+
+TEST(StreamFramer, FrameBufferReferenced)
+{
+	BufferPool pool;
+	StreamFramer sf(pool);
+	
+	std::vector<unsigned char> p1 = make_packet(1, 10);
+	std::vector<unsigned char> p2 = make_packet(2, 10);
+	
+	feed(sf, p1.data(), p1.size());
+	feed(sf, p2.data(), 4);
+	
+	const unsigned char *frame;
+	size_t size;
+	
+	ASSERT_EQ(sf.next_frame(&frame, &size), StreamFramer::FRAME_READY);
+	
+	/* Hold onto the first packet, like a DPNMSG_RECEIVE would. */
+	BufferPool::Buffer *lease = sf.frame_buffer();
+	lease->ref();
+	
+	const unsigned char *leased_frame = frame;
+	
+	sf.pop_frame();
+	
+	/* Fill the rest of the buffer to force the partial second packet to be moved. */
+	std::vector<unsigned char> filler = make_packet(3, BufferPool::MIN_SIZE - p1.size() - p2.size() - 16);
+	
+	std::vector<unsigned char> stream(p2.begin() + 4, p2.end());
+	stream.insert(stream.end(), filler.begin(), filler.end());
+	stream.insert(stream.end(), p1.begin(), p1.end());
+	
+	size_t fed = 0;
+	
+	while(fed < stream.size())
+	{
+		fed += feed(sf, stream.data() + fed, stream.size() - fed);
+		
+		while(sf.next_frame(&frame, &size) == StreamFramer::FRAME_READY)
+		{
+			sf.pop_frame();
+		}
+	}
+	
+	/* Leased packet must not have been overwritten. */
+	EXPECT_EQ(memcmp(leased_frame, p1.data(), p1.size()), 0);
+	EXPECT_NE(frame, leased_frame);
+	
+	lease->unref();
+}
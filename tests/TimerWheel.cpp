@@ -0,0 +1,272 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <gtest/gtest.h>
+#include <mutex>
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "../src/TimerWheel.hpp"
+
+/* Runs any expired timers, returns how many there were. */
+static size_t run_expired(TimerWheel &tw, uint64_t now)
+{
+	std::mutex m;
+	std::unique_lock<std::mutex> l(m);
+	
+	std::vector<TimerWheel::Callback> expired = tw.advance(now);
+	
+	for(auto c = expired.begin(); c != expired.end(); ++c)
+	{
+		(*c)(l);
+	}
+	
+	return expired.size();
+}
+
+TEST(TimerWheel, Expire)
+{
+	TimerWheel tw(1000);
+	std::vector<int> fired;
+	
+	tw.schedule(1050, [&fired](std::unique_lock<std::mutex> &l) { fired.push_back(2); });
+	tw.schedule(1020, [&fired](std::unique_lock<std::mutex> &l) { fired.push_back(1); });
+	tw.schedule(1300, [&fired](std::unique_lock<std::mutex> &l) { fired.push_back(3); });
+	
+	EXPECT_EQ(tw.size(), 3U);
+	
+	/* Never early... */
+	EXPECT_EQ(run_expired(tw, 1019), 0U);
+	
+	EXPECT_EQ(run_expired(tw, 1020), 1U);
+	EXPECT_EQ(run_expired(tw, 1020), 0U);
+	
+	/* ...and in order when several expire at once. */
+	EXPECT_EQ(run_expired(tw, 2000), 2U);
+	
+	std::vector<int> expect = { 1, 2, 3 };
+	EXPECT_EQ(fired, expect);
+	
+	EXPECT_EQ(tw.size(), 0U);
+}
+
+TEST(TimerWheel, Past)
+{
+	TimerWheel tw(1000);
+	int fired = 0;
+	
+	tw.schedule(500, [&fired](std::unique_lock<std::mutex> &l) { ++fired; });
+	
+	EXPECT_EQ(run_expired(tw, 1000), 0U);
+	EXPECT_EQ(run_expired(tw, 1000 + TimerWheel::TICK_MS), 1U);
+	EXPECT_EQ(fired, 1);
+}
+
+TEST(TimerWheel, Cancel)
+{
+	TimerWheel tw(0);
+	int fired = 0;
+	
+	TimerWheel::TimerID t1 = tw.schedule(100,    [&fired](std::unique_lock<std::mutex> &l) { fired += 1; });
+	TimerWheel::TimerID t2 = tw.schedule(100000, [&fired](std::unique_lock<std::mutex> &l) { fired += 10; });
+	TimerWheel::TimerID t3 = tw.schedule(100,    [&fired](std::unique_lock<std::mutex> &l) { fired += 100; });
+	
+	EXPECT_NE(t1, t2);
+	EXPECT_NE(t1, t3);
+	
+	EXPECT_TRUE(tw.cancel(t1));
+	EXPECT_FALSE(tw.cancel(t1));
+	EXPECT_TRUE(tw.cancel(t2));
+	
+	EXPECT_EQ(run_expired(tw, 200000), 1U);
+	EXPECT_EQ(fired, 100);
+	
+	EXPECT_FALSE(tw.cancel(t3));
+}
+
+TEST(TimerWheel, Cascade)
+{
+	/* Timers in every level, each should fire at the first advance() at or after its
+	 * expiry time and no earlier.
+	*/
+	
+	const uint64_t start = 123456;
+	TimerWheel tw(start);
+	
+	std::vector<uint64_t> due = {
+		start + 15,
+		start + 700,
+		start + 45000,
+		start + 2000000,
+		start + 170000000,
+		start + 3000000000ULL,  /* Beyond the top level. */
+	};
+	
+	std::vector<uint64_t> fired_at(due.size(), 0);
+	uint64_t now = start;
+	
+	for(size_t i = 0; i < due.size(); ++i)
+	{
+		tw.schedule(due[i], [&fired_at, &now, i](std::unique_lock<std::mutex> &l) { fired_at[i] = now; });
+	}
+	
+	uint64_t next;
+	while(tw.next_expiry(&next))
+	{
+		ASSERT_GT(next, now);
+		
+		now = next;
+		run_expired(tw, now);
+	}
+	
+	for(size_t i = 0; i < due.size(); ++i)
+	{
+		EXPECT_GE(fired_at[i], due[i]) << "Timer " << i;
+		EXPECT_LT(fired_at[i], due[i] + TimerWheel::TICK_MS) << "Timer " << i;
+	}
+}
+
+TEST(TimerWheel, NextExpiry)
+{
+	TimerWheel tw(0);
+	uint64_t next;
+	
+	EXPECT_FALSE(tw.next_expiry(&next));
+	
+	tw.schedule(95, [](std::unique_lock<std::mutex> &l) {});
+	
+	ASSERT_TRUE(tw.next_expiry(&next));
+	EXPECT_EQ(next, 100U);
+	
+	TimerWheel::TimerID t = tw.schedule(40, [](std::unique_lock<std::mutex> &l) {});
+	
+	ASSERT_TRUE(tw.next_expiry(&next));
+	EXPECT_EQ(next, 40U);
+	
+	tw.cancel(t);
+	
+	ASSERT_TRUE(tw.next_expiry(&next));
+	EXPECT_EQ(next, 100U);
+	
+	/* A far off timer may need waking up for earlier to cascade it, but never later. */
+	
+	TimerWheel tw2(0);
+	tw2.schedule(1000000, [](std::unique_lock<std::mutex> &l) {});
+	
+	ASSERT_TRUE(tw2.next_expiry(&next));
+	EXPECT_LE(next, 1000000U);
+}
+
+TEST(TimerWheel, Reschedule)
+{
+	/* Timers scheduled from a callback go in relative to the new time. */
+	
+	TimerWheel tw(0);
+	
+	int fired = 0;
+	uint64_t now = 0;
+	
+	std::function<void(std::unique_lock<std::mutex>&)> tick;
+	tick = [&tw, &fired, &now, &tick](std::unique_lock<std::mutex> &l)
+	{
+		if(++fired < 1000)
+		{
+			tw.schedule(now + 50, tick);
+		}
+	};
+	
+	tw.schedule(50, tick);
+	
+	for(now = 0; now <= 100000; now += 10)
+	{
+		run_expired(tw, now);
+	}
+	
+	EXPECT_EQ(fired, 1000);
+	EXPECT_EQ(tw.size(), 0U);
+}
+
+TEST(TimerWheel, Random)
+{
+	/* Lots of timers and cancellations at random times, checked against what should have
+	 * happened at each advance().
+	*/
+	
+	srand(1234);
+	
+	TimerWheel tw(0);
+	
+	const int N_TIMERS = 5000;
+	
+	std::vector<uint64_t> due(N_TIMERS);
+	std::vector<TimerWheel::TimerID> ids(N_TIMERS);
+	std::vector<bool> cancelled(N_TIMERS, false);
+	std::vector<uint64_t> fired_at(N_TIMERS, 0);
+	
+	uint64_t now = 0, last = 0;
+	
+	for(int i = 0; i < N_TIMERS; ++i)
+	{
+		due[i] = (((uint64_t)(rand()) * rand()) % 50000000) + TimerWheel::TICK_MS;
+		ids[i] = tw.schedule(due[i], [&fired_at, &now, i](std::unique_lock<std::mutex> &l) { fired_at[i] = now; });
+	}
+	
+	for(int i = 0; i < N_TIMERS; i += 7)
+	{
+		EXPECT_TRUE(tw.cancel(ids[i]));
+		cancelled[i] = true;
+	}
+	
+	while(tw.size() > 0)
+	{
+		last = now;
+		now += rand() % 100000;
+		
+		run_expired(tw, now);
+		
+		for(int i = 0; i < N_TIMERS; ++i)
+		{
+			uint64_t due_tick_time = ((due[i] + TimerWheel::TICK_MS - 1) / TimerWheel::TICK_MS) * TimerWheel::TICK_MS;
+			
+			if(!cancelled[i] && fired_at[i] == 0 && due_tick_time <= now)
+			{
+				ADD_FAILURE() << "Timer " << i << " due at " << due[i] << " not fired at " << now;
+				return;
+			}
+			
+			if(fired_at[i] == now && due_tick_time <= last)
+			{
+				ADD_FAILURE() << "Timer " << i << " due at " << due[i] << " fired late at " << now;
+				return;
+			}
+		}
+	}
+	
+	for(int i = 0; i < N_TIMERS; ++i)
+	{
+		if(cancelled[i])
+		{
+			EXPECT_EQ(fired_at[i], 0U);
+		}
+		else{
+			EXPECT_GE(fired_at[i], due[i]);
+		}
+	}
+}
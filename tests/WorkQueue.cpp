@@ -0,0 +1,221 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <atomic>
+#include <gtest/gtest.h>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "../src/WorkQueue.hpp"
+
+TEST(WorkTask, Inline)
+{
+	int x = 0;
+	WorkTask t([&x]() { ++x; });
+	
+	EXPECT_TRUE((bool)(t));
+	EXPECT_TRUE(t.is_inline());
+	
+	t();
+	t();
+	
+	EXPECT_EQ(x, 2);
+}
+
+TEST(WorkTask, Heap)
+{
+	struct Big { char data[WorkTask::INLINE_SIZE * 2]; };
+	
+	Big big;
+	big.data[0] = 42;
+	
+	int x = 0;
+	WorkTask t([&x, big]() { x = big.data[0]; });
+	
+	EXPECT_FALSE(t.is_inline());
+	
+	t();
+	
+	EXPECT_EQ(x, 42);
+}
+
+TEST(WorkTask, MoveOnly)
+{
+	std::unique_ptr<int> p(new int(7));
+	int x = 0;
+	
+	WorkTask t1([&x, p = std::move(p)]() { x = *p; });
+	WorkTask t2(std::move(t1));
+	
+	EXPECT_FALSE((bool)(t1));
+	EXPECT_TRUE((bool)(t2));
+	
+	WorkTask t3;
+	t3 = std::move(t2);
+	
+	EXPECT_FALSE((bool)(t2));
+	
+	t3();
+	
+	EXPECT_EQ(x, 7);
+}
+
+TEST(WorkTask, Destroy)
+{
+	std::shared_ptr<int> p(new int(0));
+	
+	{
+		WorkTask t([p]() {});
+		EXPECT_EQ(p.use_count(), 2);
+		
+		WorkTask t2(std::move(t));
+		EXPECT_EQ(p.use_count(), 2);
+	}
+	
+	EXPECT_EQ(p.use_count(), 1);
+}
+
+TEST(WorkQueue, FIFO)
+{
+	WorkQueue q(16);
+	
+	EXPECT_TRUE(q.empty());
+	
+	std::vector<int> order;
+	
+	for(int i = 0; i < 10; ++i)
+	{
+		q.push([&order, i]() { order.push_back(i); });
+	}
+	
+	EXPECT_FALSE(q.empty());
+	
+	WorkTask t;
+	while(q.pop(t))
+	{
+		t();
+	}
+	
+	EXPECT_TRUE(q.empty());
+	
+	ASSERT_EQ(order.size(), 10U);
+	
+	for(int i = 0; i < 10; ++i)
+	{
+		EXPECT_EQ(order[i], i);
+	}
+}
+
+TEST(WorkQueue, Overflow)
+{
+	/* More tasks than the ring can hold should spill into the overflow list and still come
+	 * out in order.
+	*/
+	
+	WorkQueue q(8);
+	
+	std::vector<int> order;
+	
+	for(int i = 0; i < 100; ++i)
+	{
+		q.push([&order, i]() { order.push_back(i); });
+	}
+	
+	WorkTask t;
+	while(q.pop(t))
+	{
+		t();
+	}
+	
+	ASSERT_EQ(order.size(), 100U);
+	
+	for(int i = 0; i < 100; ++i)
+	{
+		EXPECT_EQ(order[i], i);
+	}
+	
+	/* And the ring is usable again afterwards. */
+	
+	q.push([&order]() { order.push_back(100); });
+	
+	ASSERT_TRUE(q.pop(t));
+	t();
+	
+	EXPECT_EQ(order.back(), 100);
+	EXPECT_FALSE(q.pop(t));
+}
+
+TEST(WorkQueue, Stress)
+{
+	/* 4 producers and 4 consumers, every task must be run exactly once. */
+	
+	const int N_THREADS = 4;
+	const int N_TASKS   = 100000;
+	
+	WorkQueue q(64);
+	
+	std::vector< std::atomic<int> > counters(N_THREADS * N_TASKS);
+	std::atomic<int> done(0);
+	
+	std::vector<std::thread> threads;
+	
+	for(int p = 0; p < N_THREADS; ++p)
+	{
+		threads.push_back(std::thread([&q, &counters, p]()
+		{
+			for(int i = 0; i < N_TASKS; ++i)
+			{
+				int n = (p * N_TASKS) + i;
+				q.push([&counters, n]() { ++counters[n]; });
+			}
+		}));
+	}
+	
+	for(int c = 0; c < N_THREADS; ++c)
+	{
+		threads.push_back(std::thread([&q, &done]()
+		{
+			WorkTask t;
+			
+			while(done < (N_THREADS * N_TASKS))
+			{
+				if(q.pop(t))
+				{
+					t();
+					++done;
+				}
+				else{
+					std::this_thread::yield();
+				}
+			}
+		}));
+	}
+	
+	for(auto t = threads.begin(); t != threads.end(); ++t)
+	{
+		t->join();
+	}
+	
+	EXPECT_TRUE(q.empty());
+	
+	for(int i = 0; i < (N_THREADS * N_TASKS); ++i)
+	{
+		EXPECT_EQ(counters[i], 1) << "Task " << i;
+	}
+}
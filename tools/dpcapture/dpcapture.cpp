@@ -0,0 +1,624 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* dpcapture - Decode and replay DirectPlay Lite capture files.
+ *
+ * Capture files are written by the library when the DPLITE_CAPTURE environment variable is
+ * set, see Capture.hpp for the format. Message and field names come from the comments in
+ * Messages.hpp (via mkschema.pl), so this only needs rebuilding when the protocol changes.
+ *
+ * Assumes a little-endian host, like the capture files.
+*/
+
+#include <chrono>
+#include <errno.h>
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "Capture.hpp"
+#include "Messages.hpp"
+#include "packet.hpp"
+
+enum SchemaFieldKind
+{
+	SF_END = 0,
+	SF_FIELD,       /* Field which appears once. */
+	SF_LOOP,        /* Following SF_LOOP_FIELDs repeat, count is the previous DWORD field. */
+	SF_LOOP_FIELD,
+	SF_REPEAT,      /* Previous field repeats until the end of the packet. */
+};
+
+struct SchemaField
+{
+	SchemaFieldKind kind;
+	const char *types;  /* e.g. "DATA | NULL" */
+	const char *label;
+};
+
+struct MessageSchema
+{
+	uint32_t id;
+	const char *name;
+	const SchemaField *fields;
+};
+
+#include "schema.inc"
+
+struct CaptureRecord
+{
+	const CaptureRecordHeader *header;
+	const unsigned char *data;
+};
+
+static const MessageSchema *find_schema(uint32_t id)
+{
+	for(size_t i = 0; i < (sizeof(MESSAGE_SCHEMA) / sizeof(*MESSAGE_SCHEMA)); ++i)
+	{
+		if(MESSAGE_SCHEMA[i].id == id)
+		{
+			return &(MESSAGE_SCHEMA[i]);
+		}
+	}
+	
+	return NULL;
+}
+
+static const char *field_type_name(uint32_t type)
+{
+	switch(type)
+	{
+		case FIELD_TYPE_NULL:    return "NULL";
+		case FIELD_TYPE_DWORD:   return "DWORD";
+		case FIELD_TYPE_DATA:    return "DATA";
+		case FIELD_TYPE_WSTRING: return "WSTRING";
+		case FIELD_TYPE_GUID:    return "GUID";
+		default:                 return "?";
+	}
+}
+
+/* Matches the fields of a packet up with the schema for its type. Returns the schema entry
+ * describing each field, NULL where the packet has more fields than the schema describes.
+*/
+static std::vector<const SchemaField*> match_schema(const MessageSchema *schema, const PacketDeserialiser &pd)
+{
+	std::vector<const SchemaField*> matched(pd.num_fields(), NULL);
+	
+	if(schema == NULL)
+	{
+		return matched;
+	}
+	
+	const SchemaField *sf = schema->fields;
+	size_t index = 0;
+	
+	DWORD last_dword = 0;
+	
+	auto note_dword = [&](size_t index)
+	{
+		if(pd.field_type(index) == FIELD_TYPE_DWORD && pd.get_raw(index).second == sizeof(DWORD))
+		{
+			last_dword = pd.get_dword(index);
+		}
+	};
+	
+	while(index < matched.size() && sf->kind != SF_END)
+	{
+		if(sf->kind == SF_FIELD)
+		{
+			note_dword(index);
+			matched[index++] = sf++;
+		}
+		else if(sf->kind == SF_LOOP)
+		{
+			const SchemaField *body = ++sf;
+			
+			while(sf->kind == SF_LOOP_FIELD)
+			{
+				++sf;
+			}
+			
+			DWORD count = last_dword;
+			
+			for(DWORD i = 0; i < count && index < matched.size(); ++i)
+			{
+				for(const SchemaField *lf = body; lf != sf && index < matched.size(); ++lf)
+				{
+					note_dword(index);
+					matched[index++] = lf;
+				}
+			}
+		}
+		else if(sf->kind == SF_REPEAT)
+		{
+			if(sf == schema->fields)
+			{
+				break;
+			}
+			
+			while(index < matched.size())
+			{
+				matched[index++] = sf - 1;
+			}
+		}
+		else{
+			/* Stray SF_LOOP_FIELD. */
+			++sf;
+		}
+	}
+	
+	return matched;
+}
+
+static bool schema_allows(const SchemaField *sf, uint32_t type)
+{
+	const char *name = field_type_name(type);
+	size_t name_len  = strlen(name);
+	
+	for(const char *t = sf->types; (t = strstr(t, name)) != NULL; t += name_len)
+	{
+		bool starts = (t == sf->types || t[-1] == ' ');
+		bool ends   = (t[name_len] == '\0' || t[name_len] == ' ');
+		
+		if(starts && ends)
+		{
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+/* Decodes a WSTRING field. These are written from a Windows (UTF-16LE) wchar_t string, so
+ * can't be read with get_wstring() where wchar_t is bigger.
+*/
+static std::string decode_wstring(const std::pair<const void*, size_t> &raw)
+{
+	const unsigned char *p = (const unsigned char*)(raw.first);
+	std::string s;
+	
+	for(size_t i = 0; (i + 1) < raw.second; i += 2)
+	{
+		unsigned c = p[i] | (p[i + 1] << 8);
+		
+		if(c >= 0x20 && c < 0x7F && c != '"' && c != '\\')
+		{
+			s.push_back((char)(c));
+		}
+		else{
+			char esc[8];
+			snprintf(esc, sizeof(esc), "\\u%04X", c);
+			s.append(esc);
+		}
+	}
+	
+	return s;
+}
+
+static void dump_packet(const void *data, size_t size, int depth)
+{
+	std::string indent(depth * 4, ' ');
+	
+	try {
+		PacketDeserialiser pd(data, size);
+		
+		const MessageSchema *schema = find_schema(pd.packet_type());
+		std::vector<const SchemaField*> labels = match_schema(schema, pd);
+		
+		if(schema != NULL)
+		{
+			printf("%s%s (%u fields)\n", indent.c_str(), schema->name, (unsigned)(pd.num_fields()));
+		}
+		else{
+			printf("%sUnknown message type %u (%u fields)\n", indent.c_str(), (unsigned)(pd.packet_type()), (unsigned)(pd.num_fields()));
+		}
+		
+		for(size_t i = 0; i < pd.num_fields(); ++i)
+		{
+			uint32_t type = pd.field_type(i);
+			std::pair<const void*, size_t> raw = pd.get_raw(i);
+			
+			printf("%s  [%u] %-7s ", indent.c_str(), (unsigned)(i), field_type_name(type));
+			
+			switch(type)
+			{
+				case FIELD_TYPE_NULL:
+					printf("%-38s", "");
+					break;
+					
+				case FIELD_TYPE_DWORD:
+				{
+					if(raw.second == sizeof(DWORD))
+					{
+						DWORD value = pd.get_dword(i);
+						printf("0x%08X %-27u", (unsigned)(value), (unsigned)(value));
+					}
+					else{
+						printf("%-38s", "(bad length)");
+					}
+					
+					break;
+				}
+				
+				case FIELD_TYPE_DATA:
+				{
+					const unsigned char *p = (const unsigned char*)(raw.first);
+					std::string hex;
+					
+					for(size_t j = 0; j < raw.second && j < 8; ++j)
+					{
+						char b[4];
+						snprintf(b, sizeof(b), "%02X", p[j]);
+						hex.append(b);
+					}
+					
+					if(raw.second > 8)
+					{
+						hex.append("...");
+					}
+					
+					printf("%-6u %-31s", (unsigned)(raw.second), hex.c_str());
+					break;
+				}
+				
+				case FIELD_TYPE_WSTRING:
+					printf("\"%s\"", decode_wstring(raw).c_str());
+					break;
+					
+				case FIELD_TYPE_GUID:
+				{
+					if(raw.second == sizeof(GUID))
+					{
+						GUID g = pd.get_guid(i);
+						printf("{%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X} ",
+							(unsigned)(g.Data1), (unsigned)(g.Data2), (unsigned)(g.Data3),
+							g.Data4[0], g.Data4[1], g.Data4[2], g.Data4[3],
+							g.Data4[4], g.Data4[5], g.Data4[6], g.Data4[7]);
+					}
+					else{
+						printf("%-38s", "(bad length)");
+					}
+					
+					break;
+				}
+				
+				default:
+					printf("%-38s", "(unknown type)");
+					break;
+			}
+			
+			if(labels[i] != NULL)
+			{
+				printf(" %s%s", labels[i]->label, (schema_allows(labels[i], type) ? "" : " (TYPE MISMATCH)"));
+			}
+			
+			printf("\n");
+			
+			if(pd.packet_type() == DPLITE_MSGID_COALESCED && type == FIELD_TYPE_DATA)
+			{
+				dump_packet(raw.first, raw.second, depth + 1);
+			}
+		}
+	}
+	catch(const PacketDeserialiser::Error &e)
+	{
+		printf("%s%s\n", indent.c_str(), e.what());
+	}
+}
+
+static bool load_capture(const char *path, std::vector<unsigned char> &buf, std::vector<CaptureRecord> &records)
+{
+	FILE *fh = fopen(path, "rb");
+	if(fh == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return false;
+	}
+	
+	unsigned char chunk[65536];
+	size_t n;
+	
+	while((n = fread(chunk, 1, sizeof(chunk), fh)) > 0)
+	{
+		buf.insert(buf.end(), chunk, chunk + n);
+	}
+	
+	bool read_error = ferror(fh);
+	fclose(fh);
+	
+	if(read_error)
+	{
+		fprintf(stderr, "%s: Read error\n", path);
+		return false;
+	}
+	
+	const CaptureFileHeader *fh_header = (const CaptureFileHeader*)(buf.data());
+	
+	if(buf.size() < sizeof(CaptureFileHeader) || memcmp(fh_header->magic, CAPTURE_MAGIC, sizeof(fh_header->magic)) != 0)
+	{
+		fprintf(stderr, "%s: Not a capture file\n", path);
+		return false;
+	}
+	
+	if(fh_header->version != CAPTURE_VERSION || fh_header->header_size < sizeof(CaptureFileHeader))
+	{
+		fprintf(stderr, "%s: Unsupported capture version %u\n", path, (unsigned)(fh_header->version));
+		return false;
+	}
+	
+	size_t at = fh_header->header_size;
+	
+	while((at + sizeof(CaptureRecordHeader)) <= buf.size())
+	{
+		const CaptureRecordHeader *rh = (const CaptureRecordHeader*)(buf.data() + at);
+		
+		if(rh->direction == 0)
+		{
+			/* Zero padding after the last record from a capture which wasn't closed. */
+			break;
+		}
+		
+		if((buf.size() - at - sizeof(CaptureRecordHeader)) < rh->length)
+		{
+			fprintf(stderr, "%s: Last record truncated\n", path);
+			break;
+		}
+		
+		CaptureRecord r = { rh, buf.data() + at + sizeof(CaptureRecordHeader) };
+		records.push_back(r);
+		
+		at += (sizeof(CaptureRecordHeader) + rh->length + 7) & ~(size_t)(7);
+	}
+	
+	return true;
+}
+
+static int cmd_dump(const std::vector<CaptureRecord> &records)
+{
+	for(auto r = records.begin(); r != records.end(); ++r)
+	{
+		const CaptureRecordHeader *rh = r->header;
+		const unsigned char *ip = (const unsigned char*)(&(rh->remote_ip));
+		
+		char peer[16] = "-";
+		if(rh->peer_id != CAPTURE_NO_PEER)
+		{
+			snprintf(peer, sizeof(peer), "%u", (unsigned)(rh->peer_id));
+		}
+		
+		printf("%llu.%06llu inst=%u peer=%s %u.%u.%u.%u:%u %s %s %u bytes\n",
+			(unsigned long long)(rh->time_us / 1000000), (unsigned long long)(rh->time_us % 1000000),
+			(unsigned)(rh->instance), peer,
+			ip[0], ip[1], ip[2], ip[3], (unsigned)(rh->remote_port),
+			(rh->transport == CAPTURE_TRANSPORT_UDP ? "UDP" : "TCP"),
+			(rh->direction == CAPTURE_DIR_IN ? "IN " : "OUT"),
+			(unsigned)(rh->length));
+		
+		dump_packet(r->data, rh->length, 1);
+	}
+	
+	return 0;
+}
+
+struct ReplayStats
+{
+	uint64_t count;
+	uint64_t bytes;
+	uint64_t ns;
+	uint64_t malformed;
+	uint64_t mismatched;
+	
+	ReplayStats(): count(0), bytes(0), ns(0), malformed(0), mismatched(0) {}
+};
+
+/* Decodes every field of a packet through the typed PacketDeserialiser accessors, the same
+ * work the message handlers in DirectPlay8Peer do before acting on a message.
+*/
+static uint64_t replay_packet(const void *data, size_t size, uint32_t *type, bool *mismatched)
+{
+	PacketDeserialiser pd(data, size);
+	*type = pd.packet_type();
+	
+	const MessageSchema *schema = find_schema(*type);
+	std::vector<const SchemaField*> matched = match_schema(schema, pd);
+	
+	uint64_t sink = 0;
+	
+	for(size_t i = 0; i < pd.num_fields(); ++i)
+	{
+		uint32_t ftype = pd.field_type(i);
+		
+		if(matched[i] != NULL && !schema_allows(matched[i], ftype))
+		{
+			*mismatched = true;
+		}
+		
+		switch(ftype)
+		{
+			case FIELD_TYPE_NULL:
+				sink += pd.is_null(i);
+				break;
+				
+			case FIELD_TYPE_DWORD:
+				sink += pd.get_dword(i);
+				break;
+				
+			case FIELD_TYPE_DATA:
+			{
+				std::pair<const void*, size_t> d = pd.get_data(i);
+				sink += d.second;
+				
+				if(*type == DPLITE_MSGID_COALESCED)
+				{
+					uint32_t inner_type;
+					sink += replay_packet(d.first, d.second, &inner_type, mismatched);
+				}
+				
+				break;
+			}
+			
+			case FIELD_TYPE_WSTRING:
+				sink += decode_wstring(pd.get_raw(i)).length();
+				break;
+				
+			case FIELD_TYPE_GUID:
+				sink += pd.get_guid(i).Data1;
+				break;
+				
+			default:
+				throw PacketDeserialiser::Error::Malformed();
+		}
+	}
+	
+	return sink;
+}
+
+static int cmd_replay(const std::vector<CaptureRecord> &records, unsigned passes)
+{
+	std::map<uint32_t, ReplayStats> stats;
+	ReplayStats unparsed;
+	
+	volatile uint64_t sink = 0;
+	
+	for(unsigned pass = 0; pass < passes; ++pass)
+	{
+		for(auto r = records.begin(); r != records.end(); ++r)
+		{
+			uint32_t type = 0;
+			bool mismatched = false;
+			bool malformed = false;
+			
+			auto start = std::chrono::steady_clock::now();
+			
+			try {
+				sink += replay_packet(r->data, r->header->length, &type, &mismatched);
+			}
+			catch(const PacketDeserialiser::Error &e)
+			{
+				malformed = true;
+			}
+			
+			auto end = std::chrono::steady_clock::now();
+			
+			ReplayStats &s = (malformed && type == 0) ? unparsed : stats[type];
+			
+			++(s.count);
+			s.bytes += r->header->length;
+			s.ns    += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+			
+			if(malformed)
+			{
+				++(s.malformed);
+			}
+			
+			if(mismatched)
+			{
+				++(s.mismatched);
+			}
+		}
+	}
+	
+	printf("%-32s %10s %12s %10s %10s %10s\n", "Message", "Count", "Bytes", "ns/msg", "Malformed", "Mismatch");
+	
+	auto print_row = [](const char *name, const ReplayStats &s)
+	{
+		printf("%-32s %10llu %12llu %10.1f %10llu %10llu\n", name,
+			(unsigned long long)(s.count), (unsigned long long)(s.bytes),
+			(s.count > 0 ? ((double)(s.ns) / s.count) : 0.0),
+			(unsigned long long)(s.malformed), (unsigned long long)(s.mismatched));
+	};
+	
+	ReplayStats total = unparsed;
+	
+	for(auto s = stats.begin(); s != stats.end(); ++s)
+	{
+		const MessageSchema *schema = find_schema(s->first);
+		
+		char name[32];
+		snprintf(name, sizeof(name), "%u", (unsigned)(s->first));
+		
+		print_row((schema != NULL ? schema->name : name), s->second);
+		
+		total.count      += s->second.count;
+		total.bytes      += s->second.bytes;
+		total.ns         += s->second.ns;
+		total.malformed  += s->second.malformed;
+		total.mismatched += s->second.mismatched;
+	}
+	
+	if(unparsed.count > 0)
+	{
+		print_row("(unparseable)", unparsed);
+	}
+	
+	printf("\n");
+	print_row("Total", total);
+	
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s dump <capture file>\n", argv0);
+	fprintf(stderr, "       %s replay [-n <passes>] <capture file>\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+	if(argc < 3)
+	{
+		usage(argv[0]);
+		return 42; /* EX_USAGE */
+	}
+	
+	std::string command = argv[1];
+	unsigned passes = 1;
+	int argi = 2;
+	
+	if(command == "replay" && (argi + 1) < argc && strcmp(argv[argi], "-n") == 0)
+	{
+		passes = strtoul(argv[argi + 1], NULL, 10);
+		argi += 2;
+	}
+	
+	if((command != "dump" && command != "replay") || (argi + 1) != argc || passes == 0)
+	{
+		usage(argv[0]);
+		return 42; /* EX_USAGE */
+	}
+	
+	std::vector<unsigned char> buf;
+	std::vector<CaptureRecord> records;
+	
+	if(!load_capture(argv[argi], buf, records))
+	{
+		return 1;
+	}
+	
+	if(command == "dump")
+	{
+		return cmd_dump(records);
+	}
+	else{
+		return cmd_replay(records, passes);
+	}
+}
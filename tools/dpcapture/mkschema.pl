@@ -0,0 +1,120 @@
+#!/usr/bin/perl
+# DirectPlay Lite - Capture schema generator
+# Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Generates the message schema table used by dpcapture from the comments describing each
+# message in Messages.hpp.
+#
+# Each message is described by a #define of its ID followed by a comment listing its fields
+# in order, one per line ("DWORD - Player ID"). Lines starting "For each" introduce a group
+# of indented fields which is repeated as many times as the DWORD field before it says, and
+# a line of "..." means the previous field repeats until the end of the message.
+
+use strict;
+use warnings;
+
+if((scalar @ARGV) != 1)
+{
+	print STDERR "Usage: $0 <Messages.hpp> > schema.inc\n";
+	exit(42); # EX_USAGE
+}
+
+my ($messages_hpp) = @ARGV;
+
+open(my $fh, "<", $messages_hpp) or die "$messages_hpp: $!\n";
+
+my @messages = ();
+my $message = undef;
+my $in_comment = 0;
+
+while(defined(my $line = <$fh>))
+{
+	$line =~ s/\r?\n$//;
+	
+	if($line =~ m/^#define\s+(DPLITE_MSGID_\w+)\s+(\d+)/)
+	{
+		$message = { name => $1, id => $2, fields => [] };
+		push(@messages, $message);
+		
+		$in_comment = 0;
+	}
+	elsif(defined($message) && !$in_comment && $line =~ m/^\/\*/)
+	{
+		$in_comment = 1;
+	}
+	elsif($in_comment && $line =~ m/^\s*\*\//)
+	{
+		$in_comment = 0;
+		$message = undef;
+	}
+	elsif($in_comment)
+	{
+		my $type = qr/(?:GUID|DWORD|DATA|WSTRING|NULL)/;
+		
+		if($line =~ m/^ \* ($type(?: \| $type)*\s+- .*)$/)
+		{
+			push(@{ $message->{fields} }, [ "SF_FIELD", $1 ]);
+		}
+		elsif($line =~ m/^ \*\s{2,}($type(?: \| $type)*\s+- .*)$/)
+		{
+			push(@{ $message->{fields} }, [ "SF_LOOP_FIELD", $1 ]);
+		}
+		elsif($line =~ m/^ \* (For each .*)$/)
+		{
+			push(@{ $message->{fields} }, [ "SF_LOOP", $1 ]);
+		}
+		elsif($line =~ m/^ \* \.\.\.$/)
+		{
+			push(@{ $message->{fields} }, [ "SF_REPEAT", "..." ]);
+		}
+	}
+}
+
+close($fh);
+
+print "/* Generated from Messages.hpp by mkschema.pl, do not edit. */\n\n";
+
+foreach my $m (@messages)
+{
+	print "static const SchemaField FIELDS_$m->{name}\[\] = {\n";
+	
+	foreach my $f (@{ $m->{fields} })
+	{
+		my ($kind, $text) = @$f;
+		my ($types, $label) = ($text =~ m/^(.*?)\s+- (.*)$/) ? ($1, $2) : ("", $text);
+		
+		foreach my $s(\$types, \$label)
+		{
+			$$s =~ s/\\/\\\\/g;
+			$$s =~ s/"/\\"/g;
+		}
+		
+		print "\t{ $kind, \"$types\", \"$label\" },\n";
+	}
+	
+	print "\t{ SF_END, NULL, NULL },\n";
+	print "};\n\n";
+}
+
+print "static const MessageSchema MESSAGE_SCHEMA[] = {\n";
+
+foreach my $m (@messages)
+{
+	print "\t{ $m->{id}, \"$m->{name}\", FIELDS_$m->{name} },\n";
+}
+
+print "};\n";